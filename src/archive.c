@@ -0,0 +1,1278 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file archive.c
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "archive.h"
+#include "baton.h"
+#include "tar.h"
+
+static char zero_block[TAR_BLOCK_SIZE];
+
+typedef enum {
+    /** Waiting to be read. */
+    ENTRY_PENDING,
+    /** Being read by a prefetch thread. */
+    ENTRY_READING,
+    /** Read into memory. */
+    ENTRY_READY,
+    /** Failed to read. */
+    ENTRY_FAILED,
+    /** Too large to prefetch, to be streamed when its turn comes. */
+    ENTRY_STREAM
+} entry_state;
+
+typedef struct archive_entry {
+    char *path;
+    int is_coll;
+    /** The size given by the listing. */
+    uint64_t size;
+    entry_state state;
+    char *content;
+    size_t length;
+} archive_entry_t;
+
+typedef struct archive_scheduler {
+    archive_in_t *archive_in;
+
+    archive_entry_t *entries;
+    size_t num_entries;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+
+    // The next entry to be claimed for prefetching
+    size_t next;
+    // The listed bytes of entries claimed and not yet written
+    size_t reserved;
+    // Set when the archive cannot continue
+    int cancelled;
+    baton_error_t cancel_error;
+} archive_scheduler_t;
+
+static int compare_entries(const void *a, const void *b) {
+    const archive_entry_t *ea = a;
+    const archive_entry_t *eb = b;
+
+    return strcmp(ea->path, eb->path);
+}
+
+static int add_entry(archive_entry_t **entries, size_t *num_entries,
+                     size_t *capacity, const char *coll_name,
+                     const char *data_name, uint64_t size,
+                     baton_error_t *error) {
+    if (*num_entries == *capacity) {
+        size_t new_capacity = *capacity == 0 ? 1024 : *capacity * 2;
+        archive_entry_t *tmp = realloc(*entries, new_capacity *
+                                       sizeof (archive_entry_t));
+        if (!tmp) {
+            set_baton_error(error, errno, "Failed to allocate memory: "
+                            "error %d %s", errno, strerror(errno));
+            return error->code;
+        }
+
+        *entries  = tmp;
+        *capacity = new_capacity;
+    }
+
+    size_t len = strlen(coll_name) + (data_name ? strlen(data_name) + 1 : 0);
+    char *path = calloc(len + 1, sizeof (char));
+    if (!path) {
+        set_baton_error(error, errno, "Failed to allocate memory: "
+                        "error %d %s", errno, strerror(errno));
+        return error->code;
+    }
+
+    if (data_name) {
+        snprintf(path, len + 1, "%s/%s", coll_name, data_name);
+    }
+    else {
+        snprintf(path, len + 1, "%s", coll_name);
+    }
+
+    archive_entry_t *entry = &(*entries)[(*num_entries)++];
+    memset(entry, 0, sizeof (archive_entry_t));
+    entry->path    = path;
+    entry->is_coll = data_name == NULL;
+    entry->size    = size;
+    entry->state   = ENTRY_PENDING;
+
+    return 0;
+}
+
+static void free_entries(archive_entry_t *entries, size_t num_entries) {
+    for (size_t i = 0; i < num_entries; i++) {
+        if (entries[i].path)    free(entries[i].path);
+        if (entries[i].content) free(entries[i].content);
+    }
+    free(entries);
+}
+
+// List a collection recursively, in one pass, returning its entries
+// sorted by path, so that each collection precedes its contents
+static archive_entry_t *list_entries(rcComm_t *conn, rodsPath_t *rods_path,
+                                     size_t *num_entries,
+                                     baton_error_t *error) {
+    archive_entry_t *entries = NULL;
+    size_t capacity = 0;
+    collHandle_t coll_handle;
+    collEnt_t coll_entry;
+
+    *num_entries = 0;
+
+    add_entry(&entries, num_entries, &capacity, rods_path->outPath, NULL, 0,
+              error);
+    if (error->code != 0) goto error;
+
+    int status = rclOpenCollection(conn, rods_path->outPath, RECUR_QUERY_FG,
+                                   &coll_handle);
+    if (status < 0) {
+        char *err_subname;
+        const char *err_name = rodsErrorName(status, &err_subname);
+        set_baton_error(error, status,
+                        "Failed to open collection: '%s' error %d %s",
+                        rods_path->outPath, status, err_name);
+        goto error;
+    }
+
+    while ((status = rclReadCollection(conn, &coll_handle, &coll_entry)) >= 0) {
+        switch (coll_entry.objType) {
+            case DATA_OBJ_T:
+                add_entry(&entries, num_entries, &capacity,
+                          coll_entry.collName, coll_entry.dataName,
+                          coll_entry.dataSize, error);
+                break;
+
+            case COLL_OBJ_T:
+                // The collection itself is already the first entry
+                if (str_equals(coll_entry.collName, rods_path->outPath,
+                               MAX_STR_LEN)) continue;
+
+                add_entry(&entries, num_entries, &capacity,
+                          coll_entry.collName, NULL, 0, error);
+                break;
+
+            default:
+                logmsg(WARN, "Skipping entry '%s' in '%s' as it is "
+                       "neither data object nor collection",
+                       coll_entry.dataName, rods_path->outPath);
+                break;
+        }
+
+        if (error->code != 0) break;
+    }
+
+    rclCloseCollection(&coll_handle);
+    if (error->code != 0) goto error;
+
+    qsort(entries, *num_entries, sizeof (archive_entry_t), compare_entries);
+
+    return entries;
+
+error:
+    if (conn->rError) {
+        logmsg(ERROR, error->message);
+        log_rods_errstack(ERROR, conn->rError);
+    }
+
+    if (entries) free_entries(entries, *num_entries);
+    *num_entries = 0;
+
+    return NULL;
+}
+
+static data_obj_file_t *open_entry(rcComm_t *conn, archive_entry_t *entry,
+                                   baton_error_t *error) {
+    rodsPath_t rods_path;
+    memset(&rods_path, 0, sizeof (rodsPath_t));
+    snprintf(rods_path.outPath, MAX_NAME_LEN, "%s", entry->path);
+
+    data_obj_file_t *data_obj = open_data_obj(conn, &rods_path, O_RDONLY, 0,
+                                              error);
+    if (data_obj) {
+        // The path must outlive this function
+        data_obj->path = entry->path;
+    }
+
+    return data_obj;
+}
+
+// Finish reading a data object, verifying its checksum and closing it
+static void close_entry(rcComm_t *conn, data_obj_file_t *data_obj,
+                        digest_t *digest, baton_error_t *error) {
+    if (error->code == 0) {
+        final_digest(digest, data_obj->checksum_last_read, error);
+    }
+    else {
+        free_digest(digest);
+    }
+
+    if (error->code == 0 && !validate_checksum_last_read(conn, data_obj)) {
+        logmsg(WARN, "Checksum mismatch for '%s' having checksum %s on "
+               "reading", data_obj->path, data_obj->checksum_last_read);
+    }
+
+    int status = close_data_obj(conn, data_obj);
+    if (error->code == 0 && status < 0) {
+        char *err_subname;
+        const char *err_name = rodsErrorName(status, &err_subname);
+        set_baton_error(error, status,
+                        "Failed to close data object: '%s' error %d %s",
+                        data_obj->path, status, err_name);
+    }
+
+    free_data_obj(data_obj);
+}
+
+// Read a data object into memory, failing if it has grown beyond its
+// listed size
+static int read_entry(rcComm_t *conn, archive_entry_t *entry,
+                      size_t buffer_size, baton_error_t *error) {
+    digest_t digest;
+    memset(&digest, 0, sizeof digest);
+
+    init_baton_error(error);
+
+    data_obj_file_t *data_obj = open_entry(conn, entry, error);
+    if (error->code != 0) goto finally;
+
+    init_digest(&digest, data_obj->scheme, error);
+    if (error->code != 0) {
+        close_data_obj(conn, data_obj);
+        free_data_obj(data_obj);
+        goto finally;
+    }
+
+    // One byte more than listed, to detect growth
+    size_t capacity = entry->size + 1;
+    entry->content = malloc(capacity);
+    if (!entry->content) {
+        set_baton_error(error, errno, "Failed to allocate memory: "
+                        "error %d %s", errno, strerror(errno));
+    }
+
+    size_t num_read = 0;
+    while (error->code == 0 && num_read < capacity) {
+        size_t len = capacity - num_read;
+        if (len > buffer_size) len = buffer_size;
+
+        size_t nr = read_chunk(conn, data_obj, entry->content + num_read,
+                               len, error);
+        if (nr == 0) break;
+
+        update_digest(&digest, entry->content + num_read, nr);
+        num_read += nr;
+    }
+
+    if (error->code == 0 && num_read > entry->size) {
+        set_baton_error(error, -1, "Data object '%s' grew beyond its "
+                        "listed size of %llu bytes while being archived",
+                        entry->path, (unsigned long long) entry->size);
+    }
+
+    entry->length = num_read;
+    close_entry(conn, data_obj, &digest, error);
+
+finally:
+    if (error->code != 0 && entry->content) {
+        free(entry->content);
+        entry->content = NULL;
+        entry->length  = 0;
+    }
+
+    return error->code;
+}
+
+static void cancel_archive(archive_scheduler_t *sched, baton_error_t *error) {
+    pthread_mutex_lock(&sched->mutex);
+    if (!sched->cancelled) {
+        sched->cancelled = 1;
+        sched->cancel_error = *error;
+    }
+    pthread_cond_broadcast(&sched->ready);
+    pthread_cond_broadcast(&sched->space);
+    pthread_mutex_unlock(&sched->mutex);
+}
+
+// Claim the next data object to prefetch, waiting for room in the
+// window. Returns NULL when there are no more. Call with the mutex
+// held.
+static archive_entry_t *claim_entry(archive_scheduler_t *sched) {
+    while (!sched->cancelled) {
+        while (sched->next < sched->num_entries &&
+               sched->entries[sched->next].is_coll) {
+            sched->next++;
+        }
+        if (sched->next == sched->num_entries) return NULL;
+
+        archive_entry_t *entry = &sched->entries[sched->next];
+        if (entry->size > sched->archive_in->window) {
+            entry->state = ENTRY_STREAM;
+            sched->next++;
+            pthread_cond_broadcast(&sched->ready);
+            continue;
+        }
+
+        // An entry is always claimed when the window is empty, so
+        // that the writer is never left waiting for it
+        if (sched->reserved > 0 &&
+            sched->reserved + entry->size > sched->archive_in->window) {
+            pthread_cond_wait(&sched->space, &sched->mutex);
+            continue;
+        }
+
+        entry->state = ENTRY_READING;
+        sched->reserved += entry->size;
+        sched->next++;
+
+        return entry;
+    }
+
+    return NULL;
+}
+
+static void *prefetch_worker(void *arg) {
+    archive_scheduler_t *sched = arg;
+    rodsEnv env;
+    baton_error_t error;
+
+    init_baton_error(&error);
+
+    rcComm_t *conn = rods_login(&env);
+
+    if (!conn) {
+        set_baton_error(&error, -1, "Failed to open a connection for "
+                        "a prefetch thread");
+        cancel_archive(sched, &error);
+        goto finally;
+    }
+
+    while (!exit_flag) {
+        pthread_mutex_lock(&sched->mutex);
+        archive_entry_t *entry = claim_entry(sched);
+        pthread_mutex_unlock(&sched->mutex);
+
+        if (!entry) break;
+
+        read_entry(conn, entry, sched->archive_in->buffer_size, &error);
+        if (error.code != 0) {
+            logmsg(ERROR, "Failed to archive '%s': %s", entry->path,
+                   error.message);
+        }
+
+        pthread_mutex_lock(&sched->mutex);
+        if (error.code != 0) {
+            entry->state = ENTRY_FAILED;
+            sched->reserved -= entry->size;
+            pthread_cond_broadcast(&sched->space);
+        }
+        else {
+            entry->state = ENTRY_READY;
+        }
+        pthread_cond_broadcast(&sched->ready);
+        pthread_mutex_unlock(&sched->mutex);
+    }
+
+finally:
+    if (conn) rcDisconnect(conn);
+
+    return NULL;
+}
+
+static int write_bytes(FILE *out, const void *data, size_t len,
+                       baton_error_t *error) {
+    if (len > 0 && fwrite(data, 1, len, out) != len) {
+        set_baton_error(error, errno, "Failed to write the archive: "
+                        "error %d %s", errno, strerror(errno));
+    }
+
+    return error->code;
+}
+
+static int write_padding(FILE *out, uint64_t len, baton_error_t *error) {
+    while (len > 0 && error->code == 0) {
+        size_t n = len < TAR_BLOCK_SIZE ? len : TAR_BLOCK_SIZE;
+        write_bytes(out, zero_block, n, error);
+        len -= n;
+    }
+
+    return error->code;
+}
+
+static int write_header(FILE *out, archive_entry_t *entry, size_t base,
+                        uint64_t size, time_t mtime, baton_error_t *error) {
+    char header[TAR_MAX_HEADER_SIZE];
+    char name[MAX_NAME_LEN + 2];
+
+    snprintf(name, sizeof name, "%s%s", entry->path + base,
+             entry->is_coll ? "/" : "");
+
+    size_t len = format_tar_header(header, name, entry->is_coll ?
+                                   TAR_TYPE_DIRECTORY : TAR_TYPE_FILE,
+                                   size, mtime, error);
+    if (error->code != 0) return error->code;
+
+    return write_bytes(out, header, len, error);
+}
+
+// Stream a data object to the archive, on the archive connection. If
+// it cannot be opened, it is left out. If it then fails or changes
+// size, its entry is cut or padded to its listed size. Either is
+// reported in entry_error, while failures to write the archive are
+// reported in error.
+static int stream_entry(rcComm_t *conn, archive_entry_t *entry, size_t base,
+                        time_t mtime, FILE *out, size_t buffer_size,
+                        baton_error_t *entry_error, baton_error_t *error) {
+    char *buffer = NULL;
+    digest_t digest;
+    memset(&digest, 0, sizeof digest);
+
+    init_baton_error(entry_error);
+
+    data_obj_file_t *data_obj = open_entry(conn, entry, entry_error);
+    if (entry_error->code != 0) goto finally;
+
+    buffer = lease_buffer(buffer_size, entry_error);
+    if (entry_error->code == 0) {
+        init_digest(&digest, data_obj->scheme, entry_error);
+    }
+    if (entry_error->code != 0) {
+        close_data_obj(conn, data_obj);
+        free_data_obj(data_obj);
+        goto finally;
+    }
+
+    write_header(out, entry, base, entry->size, mtime, error);
+
+    uint64_t num_written = 0;
+    size_t nr;
+    while (error->code == 0 && entry_error->code == 0 &&
+           (nr = read_chunk(conn, data_obj, buffer, buffer_size,
+                            entry_error)) > 0) {
+        update_digest(&digest, buffer, nr);
+
+        if (num_written + nr > entry->size) {
+            set_baton_error(entry_error, -1, "Data object '%s' grew beyond "
+                            "its listed size of %llu bytes while being "
+                            "archived", entry->path,
+                            (unsigned long long) entry->size);
+            nr = entry->size - num_written;
+        }
+
+        write_bytes(out, buffer, nr, error);
+        num_written += nr;
+    }
+
+    if (error->code == 0 && entry_error->code == 0 &&
+        num_written < entry->size) {
+        set_baton_error(entry_error, -1, "Data object '%s' shrank below "
+                        "its listed size of %llu bytes while being "
+                        "archived", entry->path,
+                        (unsigned long long) entry->size);
+    }
+
+    if (error->code == 0) {
+        write_padding(out, entry->size - num_written +
+                      tar_padding(entry->size), error);
+    }
+
+    close_entry(conn, data_obj, &digest, entry_error);
+
+finally:
+    release_buffer(buffer, buffer_size);
+
+    return error->code;
+}
+
+// Wait for a data object's prefetch to finish, returning its state
+static entry_state await_entry(archive_scheduler_t *sched,
+                               archive_entry_t *entry, baton_error_t *error) {
+    pthread_mutex_lock(&sched->mutex);
+    while (!sched->cancelled && (entry->state == ENTRY_PENDING ||
+                                 entry->state == ENTRY_READING)) {
+        pthread_cond_wait(&sched->ready, &sched->mutex);
+    }
+    if (sched->cancelled) *error = sched->cancel_error;
+    entry_state state = entry->state;
+    pthread_mutex_unlock(&sched->mutex);
+
+    return state;
+}
+
+static void release_entry(archive_scheduler_t *sched,
+                          archive_entry_t *entry) {
+    free(entry->content);
+    entry->content = NULL;
+
+    pthread_mutex_lock(&sched->mutex);
+    sched->reserved -= entry->size;
+    pthread_cond_broadcast(&sched->space);
+    pthread_mutex_unlock(&sched->mutex);
+}
+
+static int check_archive_in(archive_in_t *archive_in,
+                            baton_error_t *error) {
+    if (archive_in->num_threads > ARCHIVE_MAX_THREADS) {
+        set_baton_error(error, CAT_INVALID_ARGUMENT,
+                        "Invalid number of threads %zu; the maximum is %d",
+                        archive_in->num_threads, ARCHIVE_MAX_THREADS);
+    }
+    else if (archive_in->buffer_size == 0) {
+        set_baton_error(error, CAT_INVALID_ARGUMENT,
+                        "Invalid buffer_size argument %zu",
+                        archive_in->buffer_size);
+    }
+
+    return error->code;
+}
+
+int archive_collection(rcComm_t *conn, rodsPath_t *rods_path, FILE *out,
+                       archive_in_t *archive_in, archive_out_t *archive_out,
+                       baton_error_t *error) {
+    pthread_t *threads = NULL;
+    size_t num_started = 0;
+
+    archive_scheduler_t sched = { .archive_in = archive_in,
+                                  .mutex      = PTHREAD_MUTEX_INITIALIZER,
+                                  .ready      = PTHREAD_COND_INITIALIZER,
+                                  .space      = PTHREAD_COND_INITIALIZER };
+
+    init_baton_error(error);
+    memset(archive_out, 0, sizeof (archive_out_t));
+
+    check_archive_in(archive_in, error);
+    if (error->code != 0) goto finally;
+
+    if (rods_path->objType != COLL_OBJ_T) {
+        set_baton_error(error, USER_INPUT_PATH_ERR,
+                        "Cannot archive '%s' because it is not a "
+                        "collection", rods_path->outPath);
+        goto finally;
+    }
+
+    // Entry names start with the collection's own name
+    const char *last_slash = strrchr(rods_path->outPath, '/');
+    if (!last_slash || *(last_slash + 1) == '\0') {
+        set_baton_error(error, USER_INPUT_PATH_ERR,
+                        "Cannot archive '%s' because it has no name",
+                        rods_path->outPath);
+        goto finally;
+    }
+    size_t base = last_slash - rods_path->outPath + 1;
+
+    sched.entries = list_entries(conn, rods_path, &sched.num_entries, error);
+    if (error->code != 0) goto finally;
+
+    logmsg(NOTICE, "Archiving %zu entries in '%s'", sched.num_entries,
+           rods_path->outPath);
+
+    if (archive_in->num_threads > 0) {
+        threads = calloc(archive_in->num_threads, sizeof (pthread_t));
+        if (!threads) {
+            set_baton_error(error, errno,
+                            "Failed to allocate memory: error %d %s",
+                            errno, strerror(errno));
+            goto finally;
+        }
+
+        for (size_t i = 0; i < archive_in->num_threads; i++) {
+            int status = pthread_create(&threads[i], NULL, prefetch_worker,
+                                        &sched);
+            if (status != 0) {
+                set_baton_error(error, status,
+                                "Failed to start prefetch thread: "
+                                "error %d %s", status, strerror(status));
+                goto finally;
+            }
+            num_started++;
+        }
+
+        logmsg(DEBUG, "Prefetching with %zu threads into a %zu byte window",
+               num_started, archive_in->window);
+    }
+
+    // The archive has no times of its own, so every entry is given
+    // the time at which it was written
+    time_t mtime = time(NULL);
+
+    for (size_t i = 0; i < sched.num_entries; i++) {
+        archive_entry_t *entry = &sched.entries[i];
+
+        if (exit_flag) {
+            set_baton_error(error, -1, "Archive interrupted by signal %d",
+                            exit_flag);
+            goto finally;
+        }
+
+        if (entry->is_coll) {
+            write_header(out, entry, base, 0, mtime, error);
+            if (error->code != 0) goto finally;
+
+            archive_out->num_collections++;
+            continue;
+        }
+
+        entry_state state = num_started > 0 ?
+            await_entry(&sched, entry, error) : ENTRY_STREAM;
+        if (error->code != 0) goto finally;
+
+        baton_error_t entry_error;
+        init_baton_error(&entry_error);
+
+        switch (state) {
+            case ENTRY_READY:
+                write_header(out, entry, base, entry->length, mtime, error);
+                write_bytes(out, entry->content, entry->length, error);
+                write_padding(out, tar_padding(entry->length), error);
+
+                archive_out->num_concurrent++;
+                archive_out->num_bytes += entry->length;
+                release_entry(&sched, entry);
+                break;
+
+            case ENTRY_STREAM:
+                stream_entry(conn, entry, base, mtime, out,
+                             archive_in->buffer_size, &entry_error, error);
+                if (entry_error.code != 0) {
+                    logmsg(ERROR, "Failed to archive '%s': %s",
+                           entry->path, entry_error.message);
+                }
+                else {
+                    archive_out->num_bytes += entry->size;
+                }
+                break;
+
+            default:
+                // Already reported by the prefetch thread
+                set_baton_error(&entry_error, -1, "Failed to prefetch");
+                break;
+        }
+        if (error->code != 0) goto finally;
+
+        if (entry_error.code != 0) {
+            archive_out->num_errors++;
+        }
+        else {
+            archive_out->num_data_objects++;
+        }
+    }
+
+    write_padding(out, TAR_END_SIZE, error);
+    if (error->code == 0 && fflush(out) != 0) {
+        set_baton_error(error, errno, "Failed to write the archive: "
+                        "error %d %s", errno, strerror(errno));
+    }
+    if (error->code != 0) goto finally;
+
+    logmsg(NOTICE, "Archived %zu collections and %zu data objects, "
+           "%llu bytes, %zu prefetched", archive_out->num_collections,
+           archive_out->num_data_objects,
+           (unsigned long long) archive_out->num_bytes,
+           archive_out->num_concurrent);
+
+    if (archive_out->num_errors > 0) {
+        set_baton_error(error, -1, "Failed to archive %zu of %zu data "
+                        "objects in '%s'", archive_out->num_errors,
+                        archive_out->num_errors +
+                        archive_out->num_data_objects, rods_path->outPath);
+    }
+
+finally:
+    if (num_started > 0) {
+        baton_error_t cancel_error;
+        init_baton_error(&cancel_error);
+        set_baton_error(&cancel_error, -1, "Archive finished");
+        cancel_archive(&sched, &cancel_error);
+
+        for (size_t i = 0; i < num_started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    if (threads)       free(threads);
+    if (sched.entries) free_entries(sched.entries, sched.num_entries);
+
+    pthread_mutex_destroy(&sched.mutex);
+    pthread_cond_destroy(&sched.ready);
+    pthread_cond_destroy(&sched.space);
+
+    return error->code;
+}
+
+typedef struct extract_item {
+    char path[MAX_NAME_LEN];
+    char *content;
+    size_t size;
+    struct extract_item *next;
+} extract_item_t;
+
+typedef struct extract_pool {
+    archive_in_t *archive_in;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+
+    extract_item_t *head;
+    extract_item_t *tail;
+    // The bytes of data objects queued or being written
+    size_t queued;
+    // Set when no more data objects will be queued
+    int finished;
+    // Set when the archive cannot continue
+    int cancelled;
+    baton_error_t cancel_error;
+
+    size_t num_written;
+    size_t num_errors;
+    uint64_t num_bytes;
+} extract_pool_t;
+
+// Join an entry name to the collection being extracted into, rejecting
+// absolute names and those that would climb above it
+static int member_path(const char *root, const char *name, char *path,
+                       baton_error_t *error) {
+    if (name[0] == '/') {
+        set_baton_error(error, USER_INPUT_PATH_ERR,
+                        "Invalid archive entry name '%s': absolute", name);
+        return error->code;
+    }
+
+    // A root of "/" would otherwise give paths starting "//"
+    size_t len = str_equals(root, "/", 2) ? 0 :
+        (size_t) snprintf(path, MAX_NAME_LEN, "%s", root);
+
+    const char *start = name;
+    while (*start) {
+        const char *end = strchr(start, '/');
+        size_t clen = end ? (size_t) (end - start) : strlen(start);
+
+        if (clen == 2 && strncmp(start, "..", 2) == 0) {
+            set_baton_error(error, USER_INPUT_PATH_ERR,
+                            "Invalid archive entry name '%s': it leads "
+                            "outside '%s'", name, root);
+            return error->code;
+        }
+
+        if (clen > 0 && !(clen == 1 && start[0] == '.')) {
+            if (len + 1 + clen >= MAX_NAME_LEN) {
+                set_baton_error(error, USER_INPUT_PATH_ERR,
+                                "Invalid archive entry name '%s': too long",
+                                name);
+                return error->code;
+            }
+
+            path[len++] = '/';
+            memcpy(path + len, start, clen);
+            len += clen;
+            path[len] = '\0';
+        }
+
+        start += clen;
+        if (*start == '/') start++;
+    }
+
+    if (len == 0) snprintf(path, MAX_NAME_LEN, "/");
+
+    return error->code;
+}
+
+// Create a collection unless it was the last one created. Archives
+// usually list the contents of each collection together, so this
+// avoids most repeated calls.
+static int ensure_collection(rcComm_t *conn, const char *path,
+                             char *last_coll, baton_error_t *error) {
+    rodsPath_t rods_path;
+
+    init_baton_error(error);
+
+    if (str_equals(path, last_coll, MAX_NAME_LEN)) return 0;
+
+    memset(&rods_path, 0, sizeof (rodsPath_t));
+    snprintf(rods_path.outPath, MAX_NAME_LEN, "%s", path);
+
+    // A recursive create succeeds where the collection exists
+    create_collection(conn, &rods_path, RECURSIVE, error);
+    if (error->code == 0) {
+        snprintf(last_coll, MAX_NAME_LEN, "%s", path);
+    }
+
+    return error->code;
+}
+
+static data_obj_file_t *create_member(rcComm_t *conn, const char *path,
+                                      digest_t *digest,
+                                      baton_error_t *error) {
+    rodsPath_t rods_path;
+    memset(&rods_path, 0, sizeof (rodsPath_t));
+    snprintf(rods_path.outPath, MAX_NAME_LEN, "%s", path);
+
+    data_obj_file_t *data_obj = open_data_obj(conn, &rods_path, O_WRONLY, 0,
+                                              error);
+    if (error->code != 0) return NULL;
+
+    // The path must outlive this function
+    data_obj->path = path;
+
+    init_digest(digest, data_obj->scheme, error);
+    if (error->code != 0) {
+        close_data_obj(conn, data_obj);
+        free_data_obj(data_obj);
+        return NULL;
+    }
+
+    return data_obj;
+}
+
+// Finish writing a data object, verifying its checksum and closing it
+static void finish_member(rcComm_t *conn, data_obj_file_t *data_obj,
+                          digest_t *digest, baton_error_t *error) {
+    if (error->code == 0) {
+        final_digest(digest, data_obj->checksum_last_write, error);
+    }
+    else {
+        free_digest(digest);
+    }
+
+    int status = close_data_obj(conn, data_obj);
+    if (error->code == 0 && status < 0) {
+        char *err_subname;
+        const char *err_name = rodsErrorName(status, &err_subname);
+        set_baton_error(error, status,
+                        "Failed to close data object: '%s' error %d %s",
+                        data_obj->path, status, err_name);
+    }
+
+    if (error->code == 0) {
+        // The server reads back what was written to calculate its
+        // checksum
+        snprintf(data_obj->checksum_last_read, MAX_CHECKSUM_LEN, "%s",
+                 data_obj->checksum_last_write);
+
+        if (!validate_checksum_last_read(conn, data_obj)) {
+            logmsg(WARN, "Checksum mismatch for '%s' having checksum %s on "
+                   "writing", data_obj->path, data_obj->checksum_last_write);
+        }
+    }
+
+    free_data_obj(data_obj);
+}
+
+// Write a data object from memory
+static int write_member(rcComm_t *conn, extract_item_t *item,
+                        size_t buffer_size, baton_error_t *error) {
+    digest_t digest;
+    memset(&digest, 0, sizeof digest);
+
+    init_baton_error(error);
+
+    data_obj_file_t *data_obj = create_member(conn, item->path, &digest,
+                                              error);
+    if (error->code != 0) return error->code;
+
+    size_t num_written = 0;
+    while (error->code == 0 && num_written < item->size) {
+        size_t len = item->size - num_written;
+        if (len > buffer_size) len = buffer_size;
+
+        write_chunk(conn, item->content + num_written, data_obj, len, error);
+        if (error->code != 0) break;
+
+        update_digest(&digest, item->content + num_written, len);
+        num_written += len;
+    }
+
+    finish_member(conn, data_obj, &digest, error);
+
+    return error->code;
+}
+
+// Stream a data object from the archive, on the main connection. If it
+// cannot be written, its content is read on and discarded. Failures to
+// write it are reported in entry_error, while failures to read the
+// archive are reported in error.
+static int stream_member(rcComm_t *conn, const char *path, FILE *in,
+                         uint64_t size, char *buffer, size_t buffer_size,
+                         baton_error_t *entry_error, baton_error_t *error) {
+    digest_t digest;
+    memset(&digest, 0, sizeof digest);
+
+    init_baton_error(entry_error);
+
+    data_obj_file_t *data_obj = create_member(conn, path, &digest,
+                                              entry_error);
+
+    uint64_t num_read = 0;
+    while (num_read < size) {
+        size_t len = size - num_read < buffer_size ?
+            (size_t) (size - num_read) : buffer_size;
+
+        read_tar_content(in, buffer, len, error);
+        if (error->code != 0) break;
+        num_read += len;
+
+        if (entry_error->code == 0) {
+            write_chunk(conn, buffer, data_obj, len, entry_error);
+            if (entry_error->code == 0) update_digest(&digest, buffer, len);
+        }
+    }
+
+    if (error->code == 0) {
+        read_tar_content(in, buffer, tar_padding(size), error);
+    }
+
+    if (data_obj) {
+        // An incomplete data object is not verified
+        if (error->code != 0 && entry_error->code == 0) {
+            set_baton_error(entry_error, error->code, "%s", error->message);
+        }
+        finish_member(conn, data_obj, &digest, entry_error);
+    }
+
+    return error->code;
+}
+
+static void cancel_extract(extract_pool_t *pool, baton_error_t *error) {
+    pthread_mutex_lock(&pool->mutex);
+    if (!pool->cancelled) {
+        pool->cancelled = 1;
+        pool->cancel_error = *error;
+    }
+    pthread_cond_broadcast(&pool->ready);
+    pthread_cond_broadcast(&pool->space);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static void *extract_worker(void *arg) {
+    extract_pool_t *pool = arg;
+    rodsEnv env;
+    baton_error_t error;
+
+    init_baton_error(&error);
+
+    rcComm_t *conn = rods_login(&env);
+
+    if (!conn) {
+        set_baton_error(&error, -1, "Failed to open a connection for "
+                        "an extract thread");
+        cancel_extract(pool, &error);
+        goto finally;
+    }
+
+    while (1) {
+        pthread_mutex_lock(&pool->mutex);
+        while (!pool->head && !pool->finished && !pool->cancelled) {
+            pthread_cond_wait(&pool->ready, &pool->mutex);
+        }
+
+        extract_item_t *item = pool->cancelled ? NULL : pool->head;
+        if (item) {
+            pool->head = item->next;
+            if (!pool->head) pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (!item) break;
+
+        write_member(conn, item, pool->archive_in->buffer_size, &error);
+        if (error.code != 0) {
+            logmsg(ERROR, "Failed to extract '%s': %s", item->path,
+                   error.message);
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        if (error.code != 0) {
+            pool->num_errors++;
+        }
+        else {
+            pool->num_written++;
+            pool->num_bytes += item->size;
+        }
+        pool->queued -= item->size;
+        pthread_cond_broadcast(&pool->space);
+        pthread_mutex_unlock(&pool->mutex);
+
+        free(item->content);
+        free(item);
+    }
+
+finally:
+    if (conn) rcDisconnect(conn);
+
+    return NULL;
+}
+
+// Queue a data object for the worker threads, waiting for room in the
+// window. The pool takes ownership of the item.
+static int queue_member(extract_pool_t *pool, extract_item_t *item,
+                        baton_error_t *error) {
+    pthread_mutex_lock(&pool->mutex);
+    while (!pool->cancelled && pool->queued > 0 &&
+           pool->queued + item->size > pool->archive_in->window) {
+        pthread_cond_wait(&pool->space, &pool->mutex);
+    }
+
+    if (pool->cancelled) {
+        *error = pool->cancel_error;
+        free(item->content);
+        free(item);
+    }
+    else {
+        if (pool->tail) {
+            pool->tail->next = item;
+        }
+        else {
+            pool->head = item;
+        }
+        pool->tail = item;
+        pool->queued += item->size;
+        pthread_cond_signal(&pool->ready);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return error->code;
+}
+
+// Read a data object from the archive into a new item
+static extract_item_t *read_member(FILE *in, const char *path, size_t size,
+                                   baton_error_t *error) {
+    char padding[TAR_BLOCK_SIZE];
+
+    extract_item_t *item = calloc(1, sizeof (extract_item_t));
+    if (!item) goto error;
+
+    // One byte more, so that empty content is not a NULL allocation
+    item->content = malloc(size + 1);
+    if (!item->content) goto error;
+
+    snprintf(item->path, MAX_NAME_LEN, "%s", path);
+    item->size = size;
+
+    read_tar_content(in, item->content, size, error);
+    if (error->code == 0) {
+        read_tar_content(in, padding, tar_padding(size), error);
+    }
+    if (error->code != 0) {
+        free(item->content);
+        free(item);
+        return NULL;
+    }
+
+    return item;
+
+error:
+    set_baton_error(error, errno, "Failed to allocate memory: error %d %s",
+                    errno, strerror(errno));
+    if (item) free(item);
+
+    return NULL;
+}
+
+int extract_archive(rcComm_t *conn, rodsPath_t *rods_path, FILE *in,
+                    archive_in_t *archive_in, archive_out_t *archive_out,
+                    baton_error_t *error) {
+    pthread_t *threads = NULL;
+    size_t num_started = 0;
+    char *buffer       = NULL;
+    char last_coll[MAX_NAME_LEN] = { 0 };
+    char path[MAX_NAME_LEN];
+    const char *root   = rods_path->outPath;
+    tar_entry_t entry;
+
+    extract_pool_t pool = { .archive_in = archive_in,
+                            .mutex      = PTHREAD_MUTEX_INITIALIZER,
+                            .ready      = PTHREAD_COND_INITIALIZER,
+                            .space      = PTHREAD_COND_INITIALIZER };
+
+    init_baton_error(error);
+    memset(archive_out, 0, sizeof (archive_out_t));
+
+    check_archive_in(archive_in, error);
+    if (error->code != 0) goto finally;
+
+    if (rods_path->objType == DATA_OBJ_T) {
+        set_baton_error(error, USER_INPUT_PATH_ERR,
+                        "Cannot extract into '%s' because it is a data "
+                        "object", root);
+        goto finally;
+    }
+
+    ensure_collection(conn, root, last_coll, error);
+    if (error->code != 0) goto finally;
+
+    buffer = lease_buffer(archive_in->buffer_size, error);
+    if (error->code != 0) goto finally;
+
+    if (archive_in->num_threads > 0) {
+        threads = calloc(archive_in->num_threads, sizeof (pthread_t));
+        if (!threads) {
+            set_baton_error(error, errno,
+                            "Failed to allocate memory: error %d %s",
+                            errno, strerror(errno));
+            goto finally;
+        }
+
+        for (size_t i = 0; i < archive_in->num_threads; i++) {
+            int status = pthread_create(&threads[i], NULL, extract_worker,
+                                        &pool);
+            if (status != 0) {
+                set_baton_error(error, status,
+                                "Failed to start extract thread: "
+                                "error %d %s", status, strerror(status));
+                goto finally;
+            }
+            num_started++;
+        }
+
+        logmsg(DEBUG, "Extracting with %zu threads and a %zu byte window",
+               num_started, archive_in->window);
+    }
+
+    int status;
+    while ((status = read_tar_header(in, &entry, error)) == 0) {
+        if (exit_flag) {
+            set_baton_error(error, -1, "Extract interrupted by signal %d",
+                            exit_flag);
+            goto finally;
+        }
+
+        member_path(root, entry.name, path, error);
+        if (error->code != 0) goto finally;
+
+        if (entry.type == TAR_TYPE_DIRECTORY) {
+            if (!str_equals(path, root, MAX_NAME_LEN)) {
+                ensure_collection(conn, path, last_coll, error);
+                if (error->code != 0) goto finally;
+
+                archive_out->num_collections++;
+            }
+
+            skip_tar_content(in, entry.size, error);
+            if (error->code != 0) goto finally;
+            continue;
+        }
+
+        if (entry.type != TAR_TYPE_FILE ||
+            str_equals(path, root, MAX_NAME_LEN)) {
+            logmsg(WARN, "Skipping archive entry '%s' of type '%c'",
+                   entry.name, entry.type);
+
+            skip_tar_content(in, entry.size, error);
+            if (error->code != 0) goto finally;
+            continue;
+        }
+
+        char *last_slash = strrchr(path, '/');
+        *last_slash = '\0';
+        ensure_collection(conn, last_slash == path ? "/" : path, last_coll,
+                          error);
+        *last_slash = '/';
+        if (error->code != 0) goto finally;
+
+        if (num_started > 0 && entry.size <= archive_in->buffer_size) {
+            extract_item_t *item = read_member(in, path, entry.size, error);
+            if (error->code != 0) goto finally;
+
+            queue_member(&pool, item, error);
+            if (error->code != 0) goto finally;
+            continue;
+        }
+
+        baton_error_t entry_error;
+        stream_member(conn, path, in, entry.size, buffer,
+                      archive_in->buffer_size, &entry_error, error);
+        if (error->code != 0) goto finally;
+
+        if (entry_error.code != 0) {
+            logmsg(ERROR, "Failed to extract '%s': %s", path,
+                   entry_error.message);
+            archive_out->num_errors++;
+        }
+        else {
+            archive_out->num_data_objects++;
+            archive_out->num_bytes += entry.size;
+        }
+    }
+
+finally:
+    if (num_started > 0) {
+        if (error->code != 0) {
+            cancel_extract(&pool, error);
+        }
+        else {
+            pthread_mutex_lock(&pool.mutex);
+            pool.finished = 1;
+            pthread_cond_broadcast(&pool.ready);
+            pthread_mutex_unlock(&pool.mutex);
+        }
+
+        for (size_t i = 0; i < num_started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+
+        // A thread that failed to log in cancels the others
+        if (error->code == 0 && pool.cancelled) {
+            *error = pool.cancel_error;
+        }
+
+        archive_out->num_concurrent    = pool.num_written;
+        archive_out->num_data_objects += pool.num_written;
+        archive_out->num_errors       += pool.num_errors;
+        archive_out->num_bytes        += pool.num_bytes;
+    }
+
+    while (pool.head) {
+        extract_item_t *item = pool.head;
+        pool.head = item->next;
+        free(item->content);
+        free(item);
+    }
+
+    if (error->code == 0) {
+        logmsg(NOTICE, "Extracted %zu collections and %zu data objects, "
+               "%llu bytes, %zu concurrently, into '%s'",
+               archive_out->num_collections, archive_out->num_data_objects,
+               (unsigned long long) archive_out->num_bytes,
+               archive_out->num_concurrent, root);
+
+        if (archive_out->num_errors > 0) {
+            set_baton_error(error, -1, "Failed to extract %zu of %zu data "
+                            "objects into '%s'", archive_out->num_errors,
+                            archive_out->num_errors +
+                            archive_out->num_data_objects, root);
+        }
+    }
+
+    if (threads) free(threads);
+    release_buffer(buffer, archive_in->buffer_size);
+
+    pthread_mutex_destroy(&pool.mutex);
+    pthread_cond_destroy(&pool.ready);
+    pthread_cond_destroy(&pool.space);
+
+    return error->code;
+}
@@ -0,0 +1,135 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file archive.h
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#ifndef _BATON_ARCHIVE_H
+#define _BATON_ARCHIVE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <rodsClient.h>
+
+#include "config.h"
+#include "error.h"
+
+#define ARCHIVE_MAX_THREADS 64
+
+/** The default number of bytes of content held in memory for the
+    worker threads. */
+#define ARCHIVE_DEFAULT_WINDOW (256 * 1024 * 1024)
+
+/**
+ *  @struct archive_in
+ *  @brief Archive inputs.
+ */
+typedef struct archive_in {
+    /** The number of worker threads, each with its own connection.
+        When archiving, they read data objects ahead of the one being
+        written; when extracting, they write small data objects. 0
+        means doing everything in turn on the main connection. */
+    size_t num_threads;
+    /** The number of bytes of content that may be held in memory for
+        the worker threads. Data objects larger than this are streamed
+        in turn on the main connection. */
+    size_t window;
+    /** The transfer buffer size. When extracting, data objects no
+        larger than this are passed to the worker threads. */
+    size_t buffer_size;
+} archive_in_t;
+
+/**
+ *  @struct archive_out
+ *  @brief Archive counters.
+ */
+typedef struct archive_out {
+    /** The number of collections archived or created. */
+    size_t num_collections;
+    /** The number of data objects archived or written. */
+    size_t num_data_objects;
+    /** The number of data objects that could not be read or written
+        in full. */
+    size_t num_errors;
+    /** The number of data objects read or written by the worker
+        threads. */
+    size_t num_concurrent;
+    /** The number of content bytes archived or written. */
+    uint64_t num_bytes;
+} archive_out_t;
+
+/**
+ * Write a collection and everything in it to a stream as a POSIX tar
+ * archive. Entries are named relative to the collection's parent, so
+ * that the archive unpacks to a directory named after the collection.
+ *
+ * The collection is listed recursively in one pass. While each data
+ * object is written, those following it are read concurrently into
+ * memory by the prefetch threads, up to the window size.
+ *
+ * A data object that cannot be read is left out of the archive, or if
+ * it fails part way through, its entry is padded to its listed size
+ * with zeros, so that the archive remains readable. Such data objects
+ * are counted as errors, and the error report gives their number
+ * once the archive is complete.
+ *
+ * @param[in]  conn         An open iRODS connection.
+ * @param[in]  rods_path    An iRODS collection path.
+ * @param[in]  out          The stream to write.
+ * @param[in]  archive_in   Archive inputs.
+ * @param[out] archive_out  Archive counters.
+ * @param[out] error        An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int archive_collection(rcComm_t *conn, rodsPath_t *rods_path, FILE *out,
+                       archive_in_t *archive_in, archive_out_t *archive_out,
+                       baton_error_t *error);
+
+/**
+ * Read a tar archive from a stream and write its contents beneath a
+ * collection, which is created if necessary. Collections are created
+ * as their entries, or those of their contents, are read. Data objects
+ * are written as they are read, in chunks, their checksums being
+ * calculated as they are written and compared with those calculated
+ * by the server. Existing data objects are overwritten.
+ *
+ * Data objects no larger than the buffer size are written by the
+ * worker threads, each on its own connection, while the archive is
+ * read; larger ones are streamed in turn on the main connection.
+ *
+ * Entry names that are absolute, or that would climb above the
+ * collection, are rejected. Entries other than files and directories,
+ * such as links, are skipped with a warning. A data object that cannot
+ * be written is counted as an error and the archive is read on; the
+ * error report gives their number once the archive is complete.
+ *
+ * @param[in]  conn         An open iRODS connection.
+ * @param[in]  rods_path    The iRODS collection path to extract into.
+ * @param[in]  in           The stream to read.
+ * @param[in]  archive_in   Archive inputs.
+ * @param[out] archive_out  Archive counters.
+ * @param[out] error        An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int extract_archive(rcComm_t *conn, rodsPath_t *rods_path, FILE *in,
+                    archive_in_t *archive_in, archive_out_t *archive_out,
+                    baton_error_t *error);
+
+#endif // _BATON_ARCHIVE_H
@@ -0,0 +1,866 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "baton.h"
+#include "workload.h"
+
+#define BENCH_RUN_ATTR  "baton_bench_run"
+#define BENCH_AVU_ATTR  "baton_bench"
+#define BENCH_MAX_THREADS 256
+
+static int debug_flag   = 0;
+static int help_flag    = 0;
+static int keep_flag    = 0;
+static int silent_flag  = 0;
+static int verbose_flag = 0;
+static int version_flag = 0;
+
+static size_t default_buffer_size = 1024 * 64 * 16 * 2;
+
+typedef enum {
+    BENCH_LIST,
+    BENCH_METAQUERY,
+    BENCH_METAMOD,
+    BENCH_PUT,
+    BENCH_GET,
+    BENCH_NUM_OPS
+} bench_op;
+
+static const char *bench_op_names[BENCH_NUM_OPS] = {
+    JSON_LIST_OP, JSON_METAQUERY_OP, JSON_METAMOD_OP, JSON_PUT_OP, JSON_GET_OP
+};
+
+typedef struct bench_config {
+    /** The collection holding the objects of this run. */
+    char collection[PATH_MAX];
+    /** The local directory holding the files of this run. */
+    char local_dir[PATH_MAX];
+    /** The value of the BENCH_RUN_ATTR AVU on objects of this run. */
+    char run_id[64];
+    /** The relative frequency of each operation. */
+    unsigned long weights[BENCH_NUM_OPS];
+    unsigned long total_weight;
+    /** The number of operations per thread. */
+    size_t num_ops;
+    /** The number of data objects created by each thread before timing
+        starts, for get, list, metamod and metaquery operations. */
+    size_t num_objects;
+    /** The number of local files made by each thread for put
+        operations. */
+    size_t num_files;
+    /** The number of AVUs per metamod operation. */
+    size_t num_avus;
+    /** The range of local file sizes. */
+    size_t min_size;
+    size_t max_size;
+    unsigned long seed;
+    operation_args_t *args;
+
+    /** Start gate, opened once every thread is ready. */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    size_t num_ready;
+    int go;
+} bench_config_t;
+
+typedef struct bench_samples {
+    double *latency;
+    size_t num;
+    size_t capacity;
+    size_t errors;
+    size_t bytes;
+} bench_samples_t;
+
+typedef struct bench_worker {
+    bench_config_t *config;
+    size_t index;
+    uint64_t rng;
+    char collection[PATH_MAX];
+    size_t *file_sizes;
+    size_t num_puts;
+    bench_samples_t samples[BENCH_NUM_OPS];
+    int status;
+    pthread_t thread;
+} bench_worker_t;
+
+static bench_op choose_op(bench_worker_t *worker) {
+    bench_config_t *config = worker->config;
+
+    return (bench_op) choose_weighted(&worker->rng, config->weights,
+                                      BENCH_NUM_OPS, config->total_weight);
+}
+
+static int add_sample(bench_samples_t *samples, double latency) {
+    if (samples->num == samples->capacity) {
+        size_t capacity = samples->capacity ? samples->capacity * 2 : 64;
+        double *tmp = realloc(samples->latency, capacity * sizeof (double));
+        if (!tmp) return -1;
+
+        samples->latency  = tmp;
+        samples->capacity = capacity;
+    }
+
+    samples->latency[samples->num++] = latency;
+
+    return 0;
+}
+
+static void local_file_name(bench_worker_t *worker, size_t index,
+                            char *name, size_t len) {
+    snprintf(name, len, "w%zu.f%zu", worker->index, index);
+}
+
+static int make_local_files(bench_worker_t *worker, baton_error_t *error) {
+    bench_config_t *config = worker->config;
+    char *buffer = NULL;
+    FILE *stream = NULL;
+
+    init_baton_error(error);
+
+    worker->file_sizes = calloc(config->num_files, sizeof (size_t));
+    buffer = calloc(1, default_buffer_size);
+    if (!worker->file_sizes || !buffer) {
+        set_baton_error(error, errno, "Failed to allocate memory: "
+                        "error %d %s", errno, strerror(errno));
+        goto finally;
+    }
+
+    for (size_t i = 0; i < config->num_files; i++) {
+        char name[64];
+        char path[PATH_MAX];
+        local_file_name(worker, i, name, sizeof name);
+        snprintf(path, sizeof path, "%s/%s", config->local_dir, name);
+
+        size_t size = random_size(&worker->rng, config->min_size,
+                                  config->max_size);
+        worker->file_sizes[i] = size;
+
+        stream = fopen(path, "w");
+        if (!stream) {
+            set_baton_error(error, errno, "Failed to open '%s': error %d %s",
+                            path, errno, strerror(errno));
+            goto finally;
+        }
+
+        size_t remaining = size;
+        while (remaining > 0) {
+            size_t n = remaining < default_buffer_size ?
+                remaining : default_buffer_size;
+            for (size_t j = 0; j + 8 <= n; j += 8) {
+                uint64_t r = next_random(&worker->rng);
+                memcpy(buffer + j, &r, 8);
+            }
+            if (fwrite(buffer, 1, n, stream) != n) {
+                set_baton_error(error, errno, "Failed to write '%s': "
+                                "error %d %s", path, errno, strerror(errno));
+                goto finally;
+            }
+            remaining -= n;
+        }
+
+        if (fclose(stream) != 0) {
+            stream = NULL;
+            set_baton_error(error, errno, "Failed to close '%s': error %d %s",
+                            path, errno, strerror(errno));
+            goto finally;
+        }
+        stream = NULL;
+    }
+
+finally:
+    if (stream) fclose(stream);
+    if (buffer) free(buffer);
+
+    return error->code;
+}
+
+static void remove_local_files(bench_worker_t *worker) {
+    bench_config_t *config = worker->config;
+    char path[PATH_MAX];
+
+    if (!config) return;
+
+    if (worker->file_sizes) {
+        for (size_t i = 0; i < config->num_files; i++) {
+            char name[64];
+            local_file_name(worker, i, name, sizeof name);
+            snprintf(path, sizeof path, "%s/%s", config->local_dir, name);
+            unlink(path);
+        }
+    }
+
+    snprintf(path, sizeof path, "%s/w%zu.get", config->local_dir,
+             worker->index);
+    unlink(path);
+}
+
+// Make an envelope for an operation, recording the number of bytes it
+// will transfer
+static json_t *make_envelope(bench_worker_t *worker, bench_op op,
+                             size_t *bytes) {
+    bench_config_t *config = worker->config;
+    json_t *envelope = NULL;
+    char name[64];
+    char file[64];
+
+    *bytes = 0;
+
+    switch (op) {
+        case BENCH_LIST:
+            envelope = json_pack("{s:s, s:{s:b, s:b}, s:{s:s}}",
+                                 JSON_OP_KEY, JSON_LIST_OP,
+                                 JSON_OP_ARGS_KEY,
+                                 JSON_OP_CONTENTS, 1,
+                                 JSON_OP_AVU, 1,
+                                 JSON_TARGET_KEY,
+                                 JSON_COLLECTION_KEY, worker->collection);
+            break;
+
+        case BENCH_METAQUERY:
+            envelope = json_pack("{s:s, s:{s:b}, "
+                                 "s:{s:s, s:[{s:s, s:s}]}}",
+                                 JSON_OP_KEY, JSON_METAQUERY_OP,
+                                 JSON_OP_ARGS_KEY,
+                                 JSON_OP_OBJECT, 1,
+                                 JSON_TARGET_KEY,
+                                 JSON_COLLECTION_KEY, worker->collection,
+                                 JSON_AVUS_KEY,
+                                 JSON_ATTRIBUTE_KEY, BENCH_RUN_ATTR,
+                                 JSON_VALUE_KEY, config->run_id);
+            break;
+
+        case BENCH_METAMOD: {
+            json_t *avus = json_array();
+            for (size_t i = 0; avus && i < config->num_avus; i++) {
+                char attr[64];
+                char value[64];
+                snprintf(attr, sizeof attr, "%s.%zu", BENCH_AVU_ATTR, i);
+                snprintf(value, sizeof value, "%llu", (unsigned long long)
+                         next_random(&worker->rng));
+                json_array_append_new(avus, json_pack("{s:s, s:s}",
+                                                      JSON_ATTRIBUTE_KEY, attr,
+                                                      JSON_VALUE_KEY, value));
+            }
+
+            snprintf(name, sizeof name, "s%zu",
+                     random_below(&worker->rng, config->num_objects));
+            envelope = json_pack("{s:s, s:{s:s}, s:{s:s, s:s, s:o}}",
+                                 JSON_OP_KEY, JSON_METAMOD_OP,
+                                 JSON_OP_ARGS_KEY,
+                                 JSON_OP_OPERATION, JSON_ARG_META_ADD,
+                                 JSON_TARGET_KEY,
+                                 JSON_COLLECTION_KEY, worker->collection,
+                                 JSON_DATA_OBJECT_KEY, name,
+                                 JSON_AVUS_KEY, avus);
+            break;
+        }
+
+        case BENCH_PUT: {
+            size_t index = random_below(&worker->rng, config->num_files);
+            local_file_name(worker, index, file, sizeof file);
+            snprintf(name, sizeof name, "p%zu", worker->num_puts++);
+            *bytes = worker->file_sizes[index];
+
+            envelope = json_pack("{s:s, s:{s:s, s:s, s:s, s:s}}",
+                                 JSON_OP_KEY, JSON_PUT_OP,
+                                 JSON_TARGET_KEY,
+                                 JSON_COLLECTION_KEY, worker->collection,
+                                 JSON_DATA_OBJECT_KEY, name,
+                                 JSON_DIRECTORY_KEY, config->local_dir,
+                                 JSON_FILE_KEY, file);
+            break;
+        }
+
+        case BENCH_GET: {
+            size_t index = random_below(&worker->rng, config->num_objects);
+            snprintf(name, sizeof name, "s%zu", index);
+            snprintf(file, sizeof file, "w%zu.get", worker->index);
+            *bytes = worker->file_sizes[index % config->num_files];
+
+            envelope = json_pack("{s:s, s:{s:b}, s:{s:s, s:s, s:s, s:s}}",
+                                 JSON_OP_KEY, JSON_GET_OP,
+                                 JSON_OP_ARGS_KEY,
+                                 JSON_OP_SAVE, 1,
+                                 JSON_TARGET_KEY,
+                                 JSON_COLLECTION_KEY, worker->collection,
+                                 JSON_DATA_OBJECT_KEY, name,
+                                 JSON_DIRECTORY_KEY, config->local_dir,
+                                 JSON_FILE_KEY, file);
+            break;
+        }
+
+        default:
+            break;
+    }
+
+    return envelope;
+}
+
+static int run_envelope(rodsEnv *env, rcComm_t *conn, json_t *envelope,
+                        operation_args_t *args, baton_error_t *error) {
+    json_t *result = baton_json_dispatch_op(env, conn, envelope, args, error);
+    if (result) json_decref(result);
+
+    return error->code;
+}
+
+// Make the worker's collection and the data objects that the timed
+// operations read and modify
+static int setup_worker(bench_worker_t *worker, rodsEnv *env,
+                        rcComm_t *conn, baton_error_t *error) {
+    bench_config_t *config = worker->config;
+    json_t *envelope = NULL;
+
+    make_local_files(worker, error);
+    if (error->code != 0) goto finally;
+
+    envelope = json_pack("{s:s, s:{s:b}, s:{s:s}}",
+                         JSON_OP_KEY, JSON_MKCOLL_OP,
+                         JSON_OP_ARGS_KEY, JSON_OP_RECURSE, 1,
+                         JSON_TARGET_KEY,
+                         JSON_COLLECTION_KEY, worker->collection);
+    run_envelope(env, conn, envelope, config->args, error);
+    json_decref(envelope);
+    envelope = NULL;
+    if (error->code != 0) goto finally;
+
+    for (size_t i = 0; i < config->num_objects; i++) {
+        char name[64];
+        char file[64];
+        snprintf(name, sizeof name, "s%zu", i);
+        local_file_name(worker, i % config->num_files, file, sizeof file);
+
+        envelope = json_pack("{s:s, s:{s:s, s:s, s:s, s:s}}",
+                             JSON_OP_KEY, JSON_PUT_OP,
+                             JSON_TARGET_KEY,
+                             JSON_COLLECTION_KEY, worker->collection,
+                             JSON_DATA_OBJECT_KEY, name,
+                             JSON_DIRECTORY_KEY, config->local_dir,
+                             JSON_FILE_KEY, file);
+        run_envelope(env, conn, envelope, config->args, error);
+        json_decref(envelope);
+        envelope = NULL;
+        if (error->code != 0) goto finally;
+
+        envelope = json_pack("{s:s, s:{s:s}, s:{s:s, s:s, s:[{s:s, s:s}]}}",
+                             JSON_OP_KEY, JSON_METAMOD_OP,
+                             JSON_OP_ARGS_KEY,
+                             JSON_OP_OPERATION, JSON_ARG_META_ADD,
+                             JSON_TARGET_KEY,
+                             JSON_COLLECTION_KEY, worker->collection,
+                             JSON_DATA_OBJECT_KEY, name,
+                             JSON_AVUS_KEY,
+                             JSON_ATTRIBUTE_KEY, BENCH_RUN_ATTR,
+                             JSON_VALUE_KEY, config->run_id);
+        run_envelope(env, conn, envelope, config->args, error);
+        json_decref(envelope);
+        envelope = NULL;
+        if (error->code != 0) goto finally;
+    }
+
+finally:
+    return error->code;
+}
+
+static void wait_for_start(bench_config_t *config) {
+    pthread_mutex_lock(&config->mutex);
+    config->num_ready++;
+    pthread_cond_broadcast(&config->cond);
+    while (!config->go) {
+        pthread_cond_wait(&config->cond, &config->mutex);
+    }
+    pthread_mutex_unlock(&config->mutex);
+}
+
+static void *bench_worker(void *arg) {
+    bench_worker_t *worker = arg;
+    bench_config_t *config = worker->config;
+    rcComm_t *conn = NULL;
+    rodsEnv env;
+    baton_error_t error;
+
+    conn = rods_login(&env);
+
+    if (!conn) {
+        logmsg(ERROR, "Thread %zu failed to connect", worker->index);
+        worker->status = 1;
+        wait_for_start(config);
+        goto finally;
+    }
+
+    setup_worker(worker, &env, conn, &error);
+    if (error.code != 0) {
+        logmsg(ERROR, "Thread %zu failed to set up: %s", worker->index,
+               error.message);
+        worker->status = 1;
+    }
+
+    wait_for_start(config);
+    if (worker->status != 0) goto finally;
+
+    for (size_t i = 0; i < config->num_ops && !exit_flag; i++) {
+        bench_op op = choose_op(worker);
+        size_t bytes;
+        json_t *envelope = make_envelope(worker, op, &bytes);
+        if (!envelope) {
+            logmsg(ERROR, "Failed to make a '%s' operation",
+                   bench_op_names[op]);
+            worker->samples[op].errors++;
+            continue;
+        }
+
+        double start = monotonic_ms();
+        run_envelope(&env, conn, envelope, config->args, &error);
+        double latency = monotonic_ms() - start;
+        json_decref(envelope);
+
+        bench_samples_t *samples = &worker->samples[op];
+        if (error.code != 0) {
+            logmsg(WARN, "Operation '%s' failed: %s", bench_op_names[op],
+                   error.message);
+            samples->errors++;
+        }
+        else if (add_sample(samples, latency) != 0) {
+            logmsg(ERROR, "Failed to allocate memory for samples");
+            worker->status = 1;
+            goto finally;
+        }
+        else {
+            samples->bytes += bytes;
+        }
+    }
+
+finally:
+    if (conn) rcDisconnect(conn);
+
+    return NULL;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+static json_t *report_samples(bench_samples_t *samples, double elapsed_ms) {
+    double sum = 0;
+    for (size_t i = 0; i < samples->num; i++) sum += samples->latency[i];
+
+    if (samples->num > 0) {
+        qsort(samples->latency, samples->num, sizeof (double),
+              compare_double);
+    }
+
+    double seconds = elapsed_ms / 1000.0;
+    double *lat    = samples->latency;
+    size_t n       = samples->num;
+
+    return json_pack("{s:I, s:I, s:I, s:f, s:f, "
+                     "s:{s:f, s:f, s:f, s:f, s:f, s:f}}",
+                     "count",      (json_int_t) n,
+                     "errors",     (json_int_t) samples->errors,
+                     "bytes",      (json_int_t) samples->bytes,
+                     "throughput", seconds > 0 ? n / seconds : 0.0,
+                     "bandwidth",  seconds > 0 ? samples->bytes / seconds : 0.0,
+                     "latency_ms",
+                     "mean", n > 0 ? sum / n : 0.0,
+                     "min",  n > 0 ? lat[0] : 0.0,
+                     "p50",  percentile(lat, n, 50),
+                     "p90",  percentile(lat, n, 90),
+                     "p99",  percentile(lat, n, 99),
+                     "max",  n > 0 ? lat[n - 1] : 0.0);
+}
+
+static json_t *make_report(bench_config_t *config, bench_worker_t *workers,
+                           size_t num_threads, double elapsed_ms) {
+    json_t *operations = json_object();
+    bench_samples_t total;
+    memset(&total, 0, sizeof total);
+
+    for (int op = 0; op < BENCH_NUM_OPS; op++) {
+        bench_samples_t merged;
+        memset(&merged, 0, sizeof merged);
+
+        for (size_t i = 0; i < num_threads; i++) {
+            bench_samples_t *samples = &workers[i].samples[op];
+            for (size_t j = 0; j < samples->num; j++) {
+                add_sample(&merged, samples->latency[j]);
+                add_sample(&total, samples->latency[j]);
+            }
+            merged.errors += samples->errors;
+            merged.bytes  += samples->bytes;
+        }
+        total.errors += merged.errors;
+        total.bytes  += merged.bytes;
+
+        if (config->weights[op] > 0) {
+            json_object_set_new(operations, bench_op_names[op],
+                                report_samples(&merged, elapsed_ms));
+        }
+        free(merged.latency);
+    }
+
+    json_t *report = json_pack("{s:s, s:s, s:I, s:I, s:I, s:I, s:I, s:I, "
+                               "s:f, s:o, s:o}",
+                               "collection", config->collection,
+                               "run",        config->run_id,
+                               "seed",       (json_int_t) config->seed,
+                               "threads",    (json_int_t) num_threads,
+                               "operations_per_thread",
+                               (json_int_t) config->num_ops,
+                               "objects_per_thread",
+                               (json_int_t) config->num_objects,
+                               "min_size",   (json_int_t) config->min_size,
+                               "max_size",   (json_int_t) config->max_size,
+                               "elapsed_ms", elapsed_ms,
+                               "operations", operations,
+                               "total", report_samples(&total, elapsed_ms));
+    free(total.latency);
+
+    return report;
+}
+
+static int remove_run_collection(bench_config_t *config) {
+    rodsEnv env;
+    baton_error_t error;
+
+    rcComm_t *conn = rods_login(&env);
+    if (!conn) return 1;
+
+    json_t *envelope = json_pack("{s:s, s:{s:b}, s:{s:s}}",
+                                 JSON_OP_KEY, JSON_RMCOLL_OP,
+                                 JSON_OP_ARGS_KEY, JSON_OP_RECURSE, 1,
+                                 JSON_TARGET_KEY,
+                                 JSON_COLLECTION_KEY, config->collection);
+    run_envelope(&env, conn, envelope, config->args, &error);
+    json_decref(envelope);
+    rcDisconnect(conn);
+
+    if (error.code != 0) {
+        logmsg(ERROR, "Failed to remove '%s': %s", config->collection,
+               error.message);
+    }
+
+    return error.code != 0;
+}
+
+int main(int argc, char *argv[]) {
+    int exit_status = 0;
+    char *collection = NULL;
+    char *zone_name  = NULL;
+    char *mix        = "list=1,metaquery=1,metamod=1,put=1,get=1";
+    char *sizes      = NULL;
+    size_t num_threads = 1;
+    bench_worker_t *workers = NULL;
+
+    bench_config_t config;
+    memset(&config, 0, sizeof config);
+    config.num_ops     = 100;
+    config.num_objects = 10;
+    config.num_files   = 8;
+    config.num_avus    = 1;
+    config.min_size    = 1024;
+    config.max_size    = 1024 * 1024;
+    config.seed        = 1;
+
+    while (1) {
+        static struct option long_options[] = {
+            // Flag options
+            {"debug",      no_argument, &debug_flag,   1},
+            {"help",       no_argument, &help_flag,    1},
+            {"keep",       no_argument, &keep_flag,    1},
+            {"silent",     no_argument, &silent_flag,  1},
+            {"verbose",    no_argument, &verbose_flag, 1},
+            {"version",    no_argument, &version_flag, 1},
+            // Indexed options
+            {"avus",       required_argument, NULL, 'a'},
+            {"collection", required_argument, NULL, 'c'},
+            {"mix",        required_argument, NULL, 'm'},
+            {"objects",    required_argument, NULL, 'n'},
+            {"operations", required_argument, NULL, 'o'},
+            {"seed",       required_argument, NULL, 's'},
+            {"size",       required_argument, NULL, 'S'},
+            {"threads",    required_argument, NULL, 't'},
+            {"zone",       required_argument, NULL, 'z'},
+            {0, 0, 0, 0}
+        };
+
+        int option_index = 0;
+        int c = getopt_long_only(argc, argv, "a:c:m:n:o:s:t:z:S:",
+                                 long_options, &option_index);
+
+        /* Detect the end of the options. */
+        if (c == -1) break;
+
+        switch (c) {
+            case 'a':
+                config.num_avus = parse_count("avus", optarg);
+                break;
+
+            case 'c':
+                collection = optarg;
+                break;
+
+            case 'm':
+                mix = optarg;
+                break;
+
+            case 'n':
+                config.num_objects = parse_count("objects", optarg);
+                break;
+
+            case 'o':
+                config.num_ops = parse_count("operations", optarg);
+                break;
+
+            case 's':
+                config.seed = parse_count("seed", optarg);
+                break;
+
+            case 'S':
+                sizes = optarg;
+                break;
+
+            case 't':
+                num_threads = parse_count("threads", optarg);
+                break;
+
+            case 'z':
+                zone_name = optarg;
+                break;
+
+            case '?':
+                // getopt_long already printed an error message
+                break;
+
+            default:
+                // Ignore
+                break;
+        }
+    }
+
+    const char *help =
+        "Name\n"
+        "    baton-bench\n"
+        "\n"
+        "Synopsis\n"
+        "\n"
+        "    baton-bench --collection <path> [--avus <n>] [--keep]\n"
+        "                [--mix <op=weight,...>] [--objects <n>]\n"
+        "                [--operations <n>] [--seed <n>]\n"
+        "                [--size <min>[:<max>]] [--threads <n>]\n"
+        "                [--silent] [--verbose] [--version] [--zone]\n"
+        "\n"
+        "Description\n"
+        "    Runs a synthetic workload of baton operations against iRODS\n"
+        "    and prints the throughput and latency of each type of\n"
+        "    operation as JSON.\n"
+        "\n"
+        "    --avus          The number of AVUs added by each metamod\n"
+        "                    operation. Optional, defaults to 1.\n"
+        "    --collection    The collection in which to create the\n"
+        "                    collection for this run.\n"
+        "    --keep          Do not remove the collection and data objects\n"
+        "                    of this run at the end.\n"
+        "    --mix           The relative frequency of each operation, a\n"
+        "                    comma-separated list of op=weight where op is\n"
+        "                    one of list, metaquery, metamod, put or get.\n"
+        "                    Optional, defaults to an equal mix.\n"
+        "    --objects       The number of data objects each thread creates\n"
+        "                    before timing starts, for the get, list,\n"
+        "                    metamod and metaquery operations. Optional,\n"
+        "                    defaults to 10.\n"
+        "    --operations    The number of timed operations per thread.\n"
+        "                    Optional, defaults to 100.\n"
+        "    --seed          The random number seed. A given seed produces\n"
+        "                    the same workload. Optional, defaults to 1.\n"
+        "    --size          The range of file sizes in bytes, whose\n"
+        "                    powers of two are chosen uniformly. Optional,\n"
+        "                    defaults to 1024:1048576.\n"
+        "    --silent        Silence error messages.\n"
+        "    --threads       The number of concurrent threads, each with\n"
+        "                    its own connection. Optional, defaults to 1.\n"
+        "    --verbose       Print verbose messages to STDERR.\n"
+        "    --version       Print the version number and exit.\n"
+        "    --zone          The zone to operate within. Optional.\n";
+
+    if (help_flag) {
+        printf("%s\n",help);
+        exit(0);
+    }
+
+    if (version_flag) {
+        printf("%s\n", VERSION);
+        exit(0);
+    }
+
+    if (debug_flag)   set_log_threshold(DEBUG);
+    if (verbose_flag) set_log_threshold(NOTICE);
+    if (silent_flag)  set_log_threshold(FATAL);
+
+    if (!collection) {
+        fprintf(stderr, "A --collection argument is required\n");
+        exit(1);
+    }
+
+    if (parse_mix(mix, bench_op_names, BENCH_NUM_OPS, config.weights,
+                  &config.total_weight) != 0) {
+        fprintf(stderr, "Invalid --mix '%s'\n", mix);
+        exit(1);
+    }
+
+    if (sizes) {
+        char *sep = strchr(sizes, ':');
+        if (sep) *sep = '\0';
+        config.min_size = parse_count("size", sizes);
+        config.max_size = sep ? parse_count("size", sep + 1) :
+            config.min_size;
+    }
+
+    if (config.min_size == 0 || config.max_size < config.min_size) {
+        fprintf(stderr, "Invalid --size range %zu:%zu\n",
+                config.min_size, config.max_size);
+        exit(1);
+    }
+
+    if (num_threads == 0 || num_threads > BENCH_MAX_THREADS) {
+        fprintf(stderr, "Invalid --threads %zu; must be 1 to %d\n",
+                num_threads, BENCH_MAX_THREADS);
+        exit(1);
+    }
+
+    if (config.num_objects == 0) {
+        fprintf(stderr, "Invalid --objects 0\n");
+        exit(1);
+    }
+
+    declare_client_name(argv[0]);
+
+    snprintf(config.run_id, sizeof config.run_id, "%lu.%ld",
+             config.seed, (long) getpid());
+    snprintf(config.collection, sizeof config.collection,
+             "%s/baton-bench.%s", collection, config.run_id);
+
+    const char *tmpdir = getenv("TMPDIR");
+    snprintf(config.local_dir, sizeof config.local_dir,
+             "%s/baton-bench.XXXXXX", tmpdir ? tmpdir : "/tmp");
+    if (!mkdtemp(config.local_dir)) {
+        logmsg(ERROR, "Failed to create a local directory: error %d %s",
+               errno, strerror(errno));
+        exit(1);
+    }
+
+    operation_args_t args = { .flags            = 0,
+                              .buffer_size      = default_buffer_size,
+                              .zone_name        = zone_name,
+                              .max_connect_time = DEFAULT_MAX_CONNECT_TIME };
+    config.args = &args;
+
+    pthread_mutex_init(&config.mutex, NULL);
+    pthread_cond_init(&config.cond, NULL);
+
+    workers = calloc(num_threads, sizeof (bench_worker_t));
+    if (!workers) {
+        logmsg(ERROR, "Failed to allocate memory: error %d %s",
+               errno, strerror(errno));
+        exit_status = 1;
+        goto finally;
+    }
+
+    size_t num_started = 0;
+    for (size_t i = 0; i < num_threads; i++) {
+        bench_worker_t *worker = &workers[i];
+        worker->config = &config;
+        worker->index  = i;
+        worker->rng    = (uint64_t) config.seed * BENCH_MAX_THREADS + i + 1;
+        snprintf(worker->collection, sizeof worker->collection, "%s/w%zu",
+                 config.collection, i);
+
+        int status = pthread_create(&worker->thread, NULL, bench_worker,
+                                    worker);
+        if (status != 0) {
+            logmsg(ERROR, "Failed to start thread %zu: error %d %s",
+                   i, status, strerror(status));
+            exit_status = 1;
+            break;
+        }
+        num_started++;
+    }
+
+    // Start timing once every thread has set up
+    pthread_mutex_lock(&config.mutex);
+    while (config.num_ready < num_started) {
+        pthread_cond_wait(&config.cond, &config.mutex);
+    }
+
+    logmsg(NOTICE, "Starting %zu operations on each of %zu threads",
+           config.num_ops, num_started);
+    double start = monotonic_ms();
+    config.go = 1;
+    pthread_cond_broadcast(&config.cond);
+    pthread_mutex_unlock(&config.mutex);
+
+    for (size_t i = 0; i < num_started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].status != 0) exit_status = 1;
+    }
+    double elapsed_ms = monotonic_ms() - start;
+
+    if (exit_status == 0) {
+        json_t *report = make_report(&config, workers, num_started,
+                                     elapsed_ms);
+        print_json(report);
+        json_decref(report);
+    }
+
+    if (!keep_flag) {
+        if (remove_run_collection(&config) != 0) exit_status = 1;
+    }
+
+finally:
+    if (workers) {
+        for (size_t i = 0; i < num_threads; i++) {
+            remove_local_files(&workers[i]);
+            free(workers[i].file_sizes);
+            for (int op = 0; op < BENCH_NUM_OPS; op++) {
+                free(workers[i].samples[op].latency);
+            }
+        }
+        free(workers);
+    }
+    rmdir(config.local_dir);
+
+    pthread_mutex_destroy(&config.mutex);
+    pthread_cond_destroy(&config.cond);
+
+    exit(exit_status);
+}
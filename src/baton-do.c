@@ -27,9 +27,14 @@
 #include "config.h"
 #include "baton.h"
 
+static int balance_flag       = 0;
 static int debug_flag         = 0;
 static int help_flag          = 0;
+static int huge_pages_flag    = 0;
+static int memory_stats_flag  = 0;
 static int no_error_flag      = 0;
+static int plan_flag          = 0;
+static int resume_flag        = 0;
 static int silent_flag        = 0;
 static int single_server_flag = 0;
 static int unbuffered_flag    = 0;
@@ -47,13 +52,29 @@ int main(int argc, char *argv[]) {
     char *json_file = NULL;
     FILE *input     = NULL;
     unsigned long max_connect_time = DEFAULT_MAX_CONNECT_TIME;
+    char *cache_dir   = NULL;
+    size_t cache_size = 0;
+    unsigned long write_behind = 0;
+    unsigned long deadline_ms = 0;
+    char *checkpoint  = NULL;
+    char *trace_file  = NULL;
+    size_t buffer_pool_size = BUFFER_POOL_DEFAULT_LIMIT;
+    size_t output_buffer_size = OUTPUT_DEFAULT_BUFFER_SIZE;
+    size_t max_envelope_memory = 0;
+    unsigned long output_latency_ms = OUTPUT_DEFAULT_LATENCY_MS;
+    unsigned long value;
 
     while (1) {
         static struct option long_options[] = {
             // Flag options
+            {"balance",       no_argument, &balance_flag,       1},
             {"debug",         no_argument, &debug_flag,         1},
             {"help",          no_argument, &help_flag,          1},
+            {"huge-pages",    no_argument, &huge_pages_flag,    1},
+            {"memory-stats",  no_argument, &memory_stats_flag,  1},
             {"no-error",      no_argument, &no_error_flag,      1},
+            {"plan",          no_argument, &plan_flag,          1},
+            {"resume",        no_argument, &resume_flag,        1},
             {"silent",        no_argument, &silent_flag,        1},
             {"single-server", no_argument, &single_server_flag, 1},
             {"unbuffered",    no_argument, &unbuffered_flag,    1},
@@ -62,14 +83,24 @@ int main(int argc, char *argv[]) {
             {"version",       no_argument, &version_flag,       1},
             {"wlock",         no_argument, &wlock_flag,         1},
             // Indexed options
+            {"buffer-pool-size", required_argument, NULL, 'B'},
+            {"cache-dir",     required_argument, NULL, 'D'},
+            {"cache-size",    required_argument, NULL, 'S'},
+            {"checkpoint",    required_argument, NULL, 'C'},
             {"connect-time",  required_argument, NULL, 'c'},
+            {"deadline",      required_argument, NULL, 'd'},
             {"file",          required_argument, NULL, 'f'},
+            {"max-envelope-memory", required_argument, NULL, 'M'},
+            {"output-buffer", required_argument, NULL, 'O'},
+            {"output-latency", required_argument, NULL, 'L'},
+            {"trace",         required_argument, NULL, 'T'},
+            {"write-behind",  required_argument, NULL, 'w'},
             {"zone",          required_argument, NULL, 'z'},
             {0, 0, 0, 0}
         };
 
         int option_index = 0;
-        int c = getopt_long_only(argc, argv, "c:f:z:",
+        int c = getopt_long_only(argc, argv, "c:d:f:w:z:B:C:D:L:M:O:S:T:",
                                  long_options, &option_index);
 
         /* Detect the end of the options. */
@@ -77,24 +108,86 @@ int main(int argc, char *argv[]) {
 
         switch (c) {
             case 'c':
-                errno = 0;
-                char *endptr;
-                unsigned long val = strtoul(optarg, &endptr, 10);
-
-                if ((errno == ERANGE && val == ULONG_MAX) ||
-                    (errno != 0 && val == 0)              ||
-                    endptr == optarg) {
+                if (parse_unsigned(optarg, &max_connect_time) != 0) {
                     fprintf(stderr, "Invalid --connect-time '%s'\n", optarg);
                     exit(1);
                 }
+                break;
 
-                max_connect_time = val;
+            case 'd':
+                if (parse_unsigned(optarg, &deadline_ms) != 0) {
+                    fprintf(stderr, "Invalid --deadline '%s'\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'B':
+                if (parse_unsigned(optarg, &value) != 0) {
+                    fprintf(stderr, "Invalid --buffer-pool-size '%s'\n",
+                            optarg);
+                    exit(1);
+                }
+                buffer_pool_size = value;
+                break;
+
+            case 'C':
+                checkpoint = optarg;
+                break;
+
+            case 'D':
+                cache_dir = optarg;
+                break;
+
+            case 'L':
+                if (parse_unsigned(optarg, &output_latency_ms) != 0 ||
+                    output_latency_ms == 0) {
+                    fprintf(stderr, "Invalid --output-latency '%s'\n",
+                            optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'M':
+                if (parse_unsigned(optarg, &value) != 0) {
+                    fprintf(stderr, "Invalid --max-envelope-memory '%s'\n",
+                            optarg);
+                    exit(1);
+                }
+                max_envelope_memory = value;
+                break;
+
+            case 'O':
+                if (parse_unsigned(optarg, &value) != 0 || value == 0) {
+                    fprintf(stderr, "Invalid --output-buffer '%s'\n",
+                            optarg);
+                    exit(1);
+                }
+                output_buffer_size = value;
+                break;
+
+            case 'S':
+                if (parse_unsigned(optarg, &value) != 0) {
+                    fprintf(stderr, "Invalid --cache-size '%s'\n", optarg);
+                    exit(1);
+                }
+                cache_size = value;
+                break;
+
+            case 'T':
+                trace_file = optarg;
                 break;
 
             case 'f':
                 json_file = optarg;
                 break;
 
+            case 'w':
+                if (parse_unsigned(optarg, &write_behind) != 0) {
+                    fprintf(stderr, "Invalid --write-behind '%s'\n", optarg);
+                    exit(1);
+                }
+                break;
+
             case 'z':
                 zone_name = optarg;
                 break;
@@ -115,36 +208,111 @@ int main(int argc, char *argv[]) {
         "\n"
         "Synopsis\n"
         "\n"
-        "    baton-do [--file <JSON file>] [--connect-time <n>] [--silent]\n"
-        "             [--unbuffered] [--verbose] [--version] [--wlock]\n"
+        "    baton-do [--file <JSON file>] [--balance]\n"
+        "             [--buffer-pool-size <n>]\n"
+        "             [--cache-dir <dir>] [--cache-size <n>]\n"
+        "             [--checkpoint <file> [--resume]]\n"
+        "             [--connect-time <n>] [--deadline <ms>] [--huge-pages]\n"
+        "             [--max-envelope-memory <n>] [--memory-stats]\n"
+        "             [--output-buffer <n>] [--output-latency <ms>]\n"
+        "             [--plan] [--silent] [--trace <file>] [--unbuffered]\n"
+        "             [--verbose] [--version] [--wlock] [--write-behind <n>]\n"
         "             [--zone]\n"
         "\n"
         "Description\n"
         "    Performs remote operations as described in the JSON\n"
         "    input file.\n"
         "\n"
+        "    --balance       Place each put and write on the resource with\n"
+        "                    the most free space, less the bytes of\n"
+        "                    uploads in progress, rather than the default.\n"
+        "                    Resources are listed once every 5 minutes.\n"
+        "                    Ignored with --single-server. Optional.\n"
+        "    --buffer-pool-size\n"
+        "                    The size in bytes of the memory shared by the\n"
+        "                    transfer buffers of all operations. Buffers are\n"
+        "                    kept for reuse up to this size and transfers\n"
+        "                    wait for one another beyond it. Optional,\n"
+        "                    defaults to 512 MiB. 0 is unbounded.\n"
+        "    --cache-dir     A local directory in which to cache data\n"
+        "                    objects saved by 'get' operations, by\n"
+        "                    checksum. Saved files are read-only.\n"
+        "                    Optional.\n"
+        "    --cache-size    The size in bytes above which least recently\n"
+        "                    used cache entries are removed. Optional,\n"
+        "                    defaults to unbounded.\n"
+        "    --checkpoint    A file in which to record the position in the\n"
+        "                    input up to which all results have been\n"
+        "                    printed. Optional.\n"
         "    --connect-time  The duration in seconds after which a connection\n"
         "                    to iRODS will be refreshed (closed and reopened\n"
         "                    between JSON documents) to allow iRODS server\n"
         "                    resources to be released. Optional, defaults to\n"
         "                    10 minutes.\n"
+        "    --deadline      The time in milliseconds allowed for each\n"
+        "                    operation, after which it is abandoned with a\n"
+        "                    timeout error and the next one started. May be\n"
+        "                    overridden per operation by a 'deadline_ms'\n"
+        "                    argument. Optional, defaults to 0 (none).\n"
         "    --file          The JSON file describing the operations.\n"
         "                    Optional, defaults to STDIN.\n"
+        "    --huge-pages    Back transfer buffers of 2 MiB and larger with\n"
+        "                    transparent huge pages, where supported.\n"
+        "                    Optional.\n";
+
+    // Split to keep each string within the length C99 compilers must
+    // support
+    const char *help_options =
+        "    --max-envelope-memory\n"
+        "                    The number of bytes of JSON an operation may\n"
+        "                    allocate, beyond which it fails with an error\n"
+        "                    and the next one is started. Implies\n"
+        "                    --memory-stats. Optional, defaults to 0\n"
+        "                    (unbounded).\n"
+        "    --memory-stats  Count the JSON memory used by each operation\n"
+        "                    and print a JSON summary to STDERR on exit.\n"
+        "                    Optional.\n"
         "    --no-error      Do not return a non-zero exit code on iRODS\n"
         "                    errors. Errors will still be reported in-band\n"
         "                    as JSON responses.\n"
+        "    --output-buffer The number of bytes of results collected before\n"
+        "                    they are written together. Optional, defaults\n"
+        "                    to 1 MiB.\n"
+        "    --output-latency\n"
+        "                    The time in milliseconds a result may be held\n"
+        "                    before it is written. Results are also written\n"
+        "                    whenever no further input is waiting. Optional,\n"
+        "                    defaults to 20.\n"
+        "    --plan          Do not perform the operations. Instead, print\n"
+        "                    an estimate of the server calls, bytes\n"
+        "                    transferred and connections they would use,\n"
+        "                    and the optimisations that would apply.\n"
+        "                    The server is not contacted. Optional.\n"
+        "    --resume        Continue from the position recorded in the\n"
+        "                    --checkpoint file. Optional.\n"
         "    --silent        Silence error messages.\n"
         "    --single-server Only connect to a single iRODS server\n"
+        "    --trace         A file to which to write a timeline of the\n"
+        "                    operations, queries, transfers and other\n"
+        "                    server calls of each thread on exit, in the\n"
+        "                    Chrome trace-event format read by Perfetto.\n"
+        "                    Optional.\n"
         "    --unbuffered    Flush print operations for each JSON object.\n"
 
         "    --verbose       Print verbose messages to STDERR.\n"
         "    --version       Print the version number and exit.\n"
         "    --wlock         Enable server-side advisory write locking.\n"
         "                    Optional, defaults to false.\n"
+        "    --write-behind  Buffer up to this many metamod AVU operations\n"
+        "                    and apply them in bulk on a separate\n"
+        "                    connection. Results are printed once applied,\n"
+        "                    which is also done whenever no further input\n"
+        "                    is waiting. Optional, defaults to 0\n"
+        "                    (unbuffered).\n"
         "    --zone          The zone to operate within. Optional.\n";
 
     if (help_flag) {
-        printf("%s\n",help);
+        printf("%s%s\n", help, help_options);
         exit(0);
     }
 
@@ -162,6 +330,20 @@ int main(int argc, char *argv[]) {
     if (verbose_flag) set_log_threshold(NOTICE);
     if (silent_flag)  set_log_threshold(FATAL);
 
+    // Accounting must start before any JSON is allocated
+    if (memory_stats_flag || max_envelope_memory > 0) {
+        enable_memory_accounting();
+    }
+
+    set_buffer_pool_limit(buffer_pool_size);
+    set_buffer_pool_huge_pages(huge_pages_flag);
+    set_resource_placement(balance_flag);
+
+    if (resume_flag && !checkpoint) {
+        fprintf(stderr, "--resume requires a --checkpoint file\n");
+        exit(1);
+    }
+
     declare_client_name(argv[0]);
     input = maybe_stdin(json_file);
     if (!input) {
@@ -171,11 +353,42 @@ int main(int argc, char *argv[]) {
     operation_args_t args = { .flags            = flags,
                               .buffer_size      = default_buffer_size,
                               .zone_name        = zone_name,
-                              .max_connect_time = max_connect_time};
+                              .max_connect_time = max_connect_time,
+                              .cache_dir        = cache_dir,
+                              .cache_size       = cache_size,
+                              .write_behind     = write_behind,
+                              .deadline_ms      = deadline_ms,
+                              .checkpoint       = checkpoint,
+                              .resume           = resume_flag,
+                              .output_buffer_size = output_buffer_size,
+                              .output_latency_ms  = output_latency_ms,
+                              .max_envelope_memory = max_envelope_memory };
+
+    if (trace_file) {
+        baton_error_t error;
+        if (start_trace(trace_file, &error) != 0) {
+            logmsg(ERROR, "%s", error.message);
+            exit(1);
+        }
+    }
 
-    int status = do_operation(input, baton_json_dispatch_op, &args);
+    int status;
+    if (plan_flag) {
+        status = do_plan(input, &args);
+    }
+    else {
+        status = do_operation(input, baton_json_dispatch_op, &args);
+    }
     if (input != stdin) fclose(input);
 
+    if (trace_file) {
+        baton_error_t error;
+        if (stop_trace(&error) != 0) {
+            logmsg(ERROR, "%s", error.message);
+            status = 1;
+        }
+    }
+
     if (status != 0 && !no_error_flag) exit_status = 5;
 
     exit(exit_status);
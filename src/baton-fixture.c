@@ -0,0 +1,898 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "baton.h"
+#include "workload.h"
+
+#define FIXTURE_AVU_ATTR       "baton_fixture"
+#define FIXTURE_MAX_THREADS    256
+#define FIXTURE_MAX_DEPTH      32
+#define FIXTURE_DEFAULT_WINDOW 1000
+#define FIXTURE_PROGRESS       10000
+
+static int debug_flag   = 0;
+static int help_flag    = 0;
+static int silent_flag  = 0;
+static int verbose_flag = 0;
+static int version_flag = 0;
+
+static size_t default_buffer_size = 1024 * 64 * 16 * 2;
+
+typedef struct fixture_acl {
+    char *owner;
+    char *level;
+} fixture_acl_t;
+
+typedef struct fixture_config {
+    /** The collection at the root of the tree. */
+    char root[PATH_MAX];
+    /** The number of collections below the root. */
+    size_t num_collections;
+    /** The number of sub-collections of each collection. */
+    size_t fanout;
+    /** The number of data objects. */
+    size_t num_objects;
+    /** The range of the number of AVUs on each data object. */
+    size_t min_avus;
+    size_t max_avus;
+    /** The number of distinct values of each attribute. */
+    size_t cardinality;
+    /** The access controls to choose from and the number given to each
+        data object. */
+    fixture_acl_t *acls;
+    size_t num_acls;
+    size_t acl_fanout;
+    /** The resources holding replicas, the first holding the original. */
+    char **resources;
+    size_t num_resources;
+    size_t num_replicas;
+    /** The size of each data object in bytes. */
+    size_t size;
+    /** The number of AVU operations buffered before a bulk update. */
+    size_t window;
+    unsigned long seed;
+    size_t num_threads;
+
+    /** Holds back each level of collections until its parents exist. */
+    pthread_barrier_t barrier;
+} fixture_config_t;
+
+typedef struct fixture_counts {
+    size_t collections;
+    size_t objects;
+    size_t avus;
+    size_t acls;
+    size_t replicas;
+    size_t bytes;
+    size_t errors;
+} fixture_counts_t;
+
+typedef struct fixture_worker {
+    fixture_config_t *config;
+    size_t index;
+    char *buffer;
+    fixture_counts_t counts;
+    int status;
+    pthread_t thread;
+} fixture_worker_t;
+
+static size_t object_collection(fixture_config_t *config, size_t index) {
+    return config->num_collections == 0 ? 0 :
+        1 + index % config->num_collections;
+}
+
+static int make_collection(rcComm_t *conn, const char *path, int flags,
+                           baton_error_t *error) {
+    rodsPath_t rods_path;
+    memset(&rods_path, 0, sizeof rods_path);
+    snprintf(rods_path.outPath, MAX_NAME_LEN, "%s", path);
+
+    return create_collection(conn, &rods_path, flags, error);
+}
+
+static int make_object(rcComm_t *conn, const char *path, const char *resource,
+                       char *buffer, size_t size, baton_error_t *error) {
+    dataObjInp_t obj_create_in;
+    openedDataObjInp_t open_obj;
+    int descriptor;
+
+    init_baton_error(error);
+
+    memset(&obj_create_in, 0, sizeof obj_create_in);
+    snprintf(obj_create_in.objPath, MAX_NAME_LEN, "%s", path);
+    obj_create_in.createMode = 0750;
+    obj_create_in.openFlags  = O_WRONLY;
+    obj_create_in.dataSize   = size;
+    if (resource) {
+        addKeyVal(&obj_create_in.condInput, DEST_RESC_NAME_KW, resource);
+    }
+
+    descriptor = rcDataObjCreate(conn, &obj_create_in);
+    clearKeyVal(&obj_create_in.condInput);
+
+    if (descriptor < 0) {
+        char *err_subname;
+        const char *err_name = rodsErrorName(descriptor, &err_subname);
+        set_baton_error(error, descriptor, "Failed to create '%s': error %d %s",
+                        path, descriptor, err_name);
+        goto finally;
+    }
+
+    memset(&open_obj, 0, sizeof open_obj);
+    open_obj.l1descInx = descriptor;
+
+    size_t remaining = size;
+    while (remaining > 0) {
+        size_t n = remaining < default_buffer_size ?
+            remaining : default_buffer_size;
+
+        bytesBuf_t obj_write_in;
+        memset(&obj_write_in, 0, sizeof obj_write_in);
+        obj_write_in.buf = buffer;
+        obj_write_in.len = n;
+        open_obj.len     = n;
+
+        int status = rcDataObjWrite(conn, &open_obj, &obj_write_in);
+        if (status < 0) {
+            char *err_subname;
+            const char *err_name = rodsErrorName(status, &err_subname);
+            set_baton_error(error, status, "Failed to write to '%s': "
+                            "error %d %s", path, status, err_name);
+            break;
+        }
+        remaining -= n;
+    }
+
+    int status = rcDataObjClose(conn, &open_obj);
+    if (status < 0 && error->code == 0) {
+        char *err_subname;
+        const char *err_name = rodsErrorName(status, &err_subname);
+        set_baton_error(error, status, "Failed to close '%s': error %d %s",
+                        path, status, err_name);
+    }
+
+finally:
+    return error->code;
+}
+
+static int replicate_object(rcComm_t *conn, const char *path,
+                            const char *resource, baton_error_t *error) {
+    dataObjInp_t obj_repl_in;
+
+    init_baton_error(error);
+
+    memset(&obj_repl_in, 0, sizeof obj_repl_in);
+    snprintf(obj_repl_in.objPath, MAX_NAME_LEN, "%s", path);
+    addKeyVal(&obj_repl_in.condInput, DEST_RESC_NAME_KW, resource);
+
+    int status = rcDataObjRepl(conn, &obj_repl_in);
+    clearKeyVal(&obj_repl_in.condInput);
+
+    if (status < 0) {
+        char *err_subname;
+        const char *err_name = rodsErrorName(status, &err_subname);
+        set_baton_error(error, status, "Failed to replicate '%s' to '%s': "
+                        "error %d %s", path, resource, status, err_name);
+    }
+
+    return error->code;
+}
+
+// Make a metamod envelope adding the AVUs of a data object. Attribute
+// k is present on every data object with at least k + 1 AVUs and
+// lower-numbered values are the more common, so that metaqueries
+// select a realistic range of fractions of the tree.
+static json_t *make_avus_envelope(fixture_config_t *config, const char *coll,
+                                  const char *name, size_t num_avus,
+                                  uint64_t *rng) {
+    json_t *avus = json_array();
+    if (!avus) return NULL;
+
+    for (size_t i = 0; i < num_avus; i++) {
+        char attr[64];
+        char value[64];
+        size_t v = random_below(rng, random_below(rng, config->cardinality) + 1);
+        snprintf(attr, sizeof attr, "%s.a%zu", FIXTURE_AVU_ATTR, i);
+        snprintf(value, sizeof value, "v%zu", v);
+
+        json_array_append_new(avus, json_pack("{s:s, s:s}",
+                                              JSON_ATTRIBUTE_KEY, attr,
+                                              JSON_VALUE_KEY, value));
+    }
+
+    return json_pack("{s:s, s:{s:s}, s:{s:s, s:s, s:o}}",
+                     JSON_OP_KEY, JSON_METAMOD_OP,
+                     JSON_OP_ARGS_KEY,
+                     JSON_OP_OPERATION, JSON_ARG_META_ADD,
+                     JSON_TARGET_KEY,
+                     JSON_COLLECTION_KEY, coll,
+                     JSON_DATA_OBJECT_KEY, name,
+                     JSON_AVUS_KEY, avus);
+}
+
+// Count the AVUs of the items that have been flushed, rather than
+// those buffered, so that the report includes only the AVUs added
+static void count_done(fixture_worker_t *worker, json_t *done,
+                       size_t num_errors) {
+    if (num_errors > 0) {
+        logmsg(WARN, "Thread %zu failed to add AVUs to %zu data objects",
+               worker->index, num_errors);
+    }
+    worker->counts.errors += num_errors;
+
+    if (!done) return;
+
+    size_t i;
+    json_t *item;
+    json_array_foreach(done, i, item) {
+        if (json_object_get(item, JSON_ERROR_KEY)) continue;
+
+        baton_error_t error;
+        json_t *target = get_operation_target(item, &error);
+        if (error.code != 0) continue;
+
+        json_t *avus = get_avus(target, &error);
+        if (error.code != 0) continue;
+
+        worker->counts.avus += json_array_size(avus);
+    }
+
+    json_decref(done);
+}
+
+// Make this worker's share of each level of collections, waiting for
+// every worker to finish a level before starting the next
+static void make_collections(fixture_worker_t *worker, rcComm_t *conn) {
+    fixture_config_t *config = worker->config;
+    size_t first = 1;
+
+    while (first <= config->num_collections) {
+        size_t last = tree_level_last(first, config->num_collections,
+                                      config->fanout);
+
+        for (size_t i = first; conn && i <= last && !exit_flag; i++) {
+            if (i % config->num_threads != worker->index) continue;
+
+            char path[PATH_MAX];
+            baton_error_t error;
+            tree_path(config->root, i, config->fanout, path, sizeof path);
+            make_collection(conn, path, 0, &error);
+            if (error.code != 0) {
+                logmsg(ERROR, "Failed to create collection '%s': %s", path,
+                       error.message);
+                worker->counts.errors++;
+            }
+            else {
+                worker->counts.collections++;
+            }
+        }
+
+        pthread_barrier_wait(&config->barrier);
+        first = last + 1;
+    }
+}
+
+static int make_objects(fixture_worker_t *worker, rcComm_t *conn,
+                        baton_error_t *error) {
+    fixture_config_t *config = worker->config;
+    write_behind_t *wb = NULL;
+    const char *resource = config->num_resources > 0 ?
+        config->resources[0] : NULL;
+    size_t num_made = 0;
+
+    wb = start_write_behind(config->window, 0, error);
+    if (error->code != 0) goto finally;
+
+    for (size_t i = worker->index; i < config->num_objects && !exit_flag;
+         i += config->num_threads) {
+        uint64_t rng = seeded_random_state(config->seed, i);
+        char coll[PATH_MAX];
+        char name[64];
+        char path[PATH_MAX];
+        baton_error_t op_error;
+
+        tree_path(config->root, object_collection(config, i), config->fanout,
+                  coll, sizeof coll);
+        snprintf(name, sizeof name, "o%zu", i);
+        snprintf(path, sizeof path, "%s/%s", coll, name);
+
+        make_object(conn, path, resource, worker->buffer, config->size,
+                    &op_error);
+        if (op_error.code != 0) {
+            logmsg(WARN, "%s", op_error.message);
+            worker->counts.errors++;
+            continue;
+        }
+        worker->counts.objects++;
+        worker->counts.bytes += config->size;
+
+        for (size_t r = 1; r < config->num_replicas; r++) {
+            replicate_object(conn, path, config->resources[r], &op_error);
+            if (op_error.code != 0) {
+                logmsg(WARN, "%s", op_error.message);
+                worker->counts.errors++;
+            }
+            else {
+                worker->counts.replicas++;
+            }
+        }
+
+        if (config->num_acls > 0) {
+            rodsPath_t rods_path;
+            memset(&rods_path, 0, sizeof rods_path);
+            snprintf(rods_path.outPath, MAX_NAME_LEN, "%s", path);
+
+            size_t offset = random_below(&rng, config->num_acls);
+            for (size_t k = 0; k < config->acl_fanout; k++) {
+                fixture_acl_t *acl =
+                    &config->acls[(offset + k) % config->num_acls];
+                modify_permissions(conn, &rods_path, NO_RECURSE, acl->owner,
+                                   acl->level, &op_error);
+                if (op_error.code != 0) {
+                    logmsg(WARN, "%s", op_error.message);
+                    worker->counts.errors++;
+                }
+                else {
+                    worker->counts.acls++;
+                }
+            }
+        }
+
+        size_t num_avus = config->min_avus +
+            random_below(&rng, config->max_avus - config->min_avus + 1);
+        if (num_avus > 0) {
+            json_t *envelope = make_avus_envelope(config, coll, name,
+                                                  num_avus, &rng);
+            if (!envelope) {
+                set_baton_error(error, -1, "Failed to allocate memory");
+                goto finally;
+            }
+
+            write_behind_add(wb, envelope, &op_error);
+            json_decref(envelope);
+            if (op_error.code != 0) {
+                logmsg(WARN, "%s", op_error.message);
+                worker->counts.errors++;
+            }
+        }
+
+        if (++num_made % FIXTURE_PROGRESS == 0) {
+            size_t num_errors;
+            json_t *done = write_behind_done(wb, &num_errors);
+            count_done(worker, done, num_errors);
+
+            logmsg(NOTICE, "Thread %zu created %zu data objects",
+                   worker->index, num_made);
+        }
+    }
+
+finally:
+    if (wb) {
+        size_t num_errors;
+        json_t *done = write_behind_flush(wb, &num_errors);
+        count_done(worker, done, num_errors);
+        stop_write_behind(wb);
+    }
+
+    return error->code;
+}
+
+static void *fixture_worker(void *arg) {
+    fixture_worker_t *worker = arg;
+    rcComm_t *conn = NULL;
+    rodsEnv env;
+    baton_error_t error;
+
+    conn = rods_login(&env);
+
+    if (!conn) {
+        logmsg(ERROR, "Thread %zu failed to connect", worker->index);
+        worker->status = 1;
+    }
+
+    // Every worker takes part in each level, connected or not, so that
+    // none waits forever for the others
+    make_collections(worker, conn);
+    if (!conn) goto finally;
+
+    make_objects(worker, conn, &error);
+    if (error.code != 0) {
+        logmsg(ERROR, "Thread %zu failed: %s", worker->index, error.message);
+        worker->status = 1;
+    }
+
+finally:
+    if (conn) rcDisconnect(conn);
+
+    return NULL;
+}
+
+static json_t *make_report(fixture_config_t *config, fixture_worker_t *workers,
+                           size_t num_threads, double elapsed_ms) {
+    fixture_counts_t total;
+    memset(&total, 0, sizeof total);
+
+    for (size_t i = 0; i < num_threads; i++) {
+        fixture_counts_t *counts = &workers[i].counts;
+        total.collections += counts->collections;
+        total.objects     += counts->objects;
+        total.avus        += counts->avus;
+        total.acls        += counts->acls;
+        total.replicas    += counts->replicas;
+        total.bytes       += counts->bytes;
+        total.errors      += counts->errors;
+    }
+
+    double seconds = elapsed_ms / 1000.0;
+
+    return json_pack("{s:s, s:I, s:I, s:I, s:I, s:I, s:I, s:I, s:I, s:I, "
+                     "s:f, s:f}",
+                     "collection",  config->root,
+                     "seed",        (json_int_t) config->seed,
+                     "threads",     (json_int_t) num_threads,
+                     "collections", (json_int_t) total.collections,
+                     "objects",     (json_int_t) total.objects,
+                     "avus",        (json_int_t) total.avus,
+                     "acls",        (json_int_t) total.acls,
+                     "replicas",    (json_int_t) total.replicas,
+                     "bytes",       (json_int_t) total.bytes,
+                     "errors",      (json_int_t) total.errors,
+                     "elapsed_ms",  elapsed_ms,
+                     "throughput",  seconds > 0 ?
+                     total.objects / seconds : 0.0);
+}
+
+// Parse a comma-separated list of owner:level access controls, in
+// place
+static int parse_acls(char *str, fixture_config_t *config) {
+    size_t n = 1;
+    for (const char *c = str; *c; c++) {
+        if (*c == ',') n++;
+    }
+
+    config->acls = calloc(n, sizeof (fixture_acl_t));
+    if (!config->acls) return -1;
+
+    char *saveptr;
+    for (char *tok = strtok_r(str, ",", &saveptr); tok;
+         tok = strtok_r(NULL, ",", &saveptr)) {
+        char *sep = strrchr(tok, ':');
+        if (!sep || sep == tok || *(sep + 1) == '\0') return -1;
+
+        *sep = '\0';
+        config->acls[config->num_acls].owner = tok;
+        config->acls[config->num_acls].level = sep + 1;
+        config->num_acls++;
+    }
+
+    return config->num_acls > 0 ? 0 : -1;
+}
+
+// Parse a comma-separated list of resource names, in place
+static int parse_resources(char *str, fixture_config_t *config) {
+    size_t n = 1;
+    for (const char *c = str; *c; c++) {
+        if (*c == ',') n++;
+    }
+
+    config->resources = calloc(n, sizeof (char *));
+    if (!config->resources) return -1;
+
+    char *saveptr;
+    for (char *tok = strtok_r(str, ",", &saveptr); tok;
+         tok = strtok_r(NULL, ",", &saveptr)) {
+        config->resources[config->num_resources++] = tok;
+    }
+
+    return config->num_resources > 0 ? 0 : -1;
+}
+
+static int make_root_collection(fixture_config_t *config) {
+    rodsEnv env;
+    baton_error_t error;
+
+    rcComm_t *conn = rods_login(&env);
+    if (!conn) return 1;
+
+    make_collection(conn, config->root, RECURSIVE, &error);
+    rcDisconnect(conn);
+
+    if (error.code != 0) {
+        logmsg(ERROR, "Failed to create '%s': %s", config->root,
+               error.message);
+    }
+
+    return error.code != 0;
+}
+
+int main(int argc, char *argv[]) {
+    int exit_status = 0;
+    char *collection = NULL;
+    char *avus       = NULL;
+    char *acls       = NULL;
+    char *resources  = NULL;
+    fixture_worker_t *workers = NULL;
+    int barrier_init = 0;
+
+    fixture_config_t config;
+    memset(&config, 0, sizeof config);
+    config.num_collections = 10;
+    config.fanout          = 10;
+    config.num_objects     = 1000;
+    config.min_avus        = 1;
+    config.max_avus        = 3;
+    config.cardinality     = 100;
+    config.num_replicas    = 1;
+    config.window          = FIXTURE_DEFAULT_WINDOW;
+    config.seed            = 1;
+    config.num_threads     = 1;
+
+    while (1) {
+        static struct option long_options[] = {
+            // Flag options
+            {"debug",       no_argument, &debug_flag,   1},
+            {"help",        no_argument, &help_flag,    1},
+            {"silent",      no_argument, &silent_flag,  1},
+            {"verbose",     no_argument, &verbose_flag, 1},
+            {"version",     no_argument, &version_flag, 1},
+            // Indexed options
+            {"acl",         required_argument, NULL, 'A'},
+            {"acl-fanout",  required_argument, NULL, 'F'},
+            {"avus",        required_argument, NULL, 'a'},
+            {"cardinality", required_argument, NULL, 'V'},
+            {"collection",  required_argument, NULL, 'c'},
+            {"collections", required_argument, NULL, 'C'},
+            {"fanout",      required_argument, NULL, 'f'},
+            {"objects",     required_argument, NULL, 'n'},
+            {"replicas",    required_argument, NULL, 'R'},
+            {"resource",    required_argument, NULL, 'r'},
+            {"seed",        required_argument, NULL, 's'},
+            {"size",        required_argument, NULL, 'S'},
+            {"threads",     required_argument, NULL, 't'},
+            {"window",      required_argument, NULL, 'w'},
+            {0, 0, 0, 0}
+        };
+
+        int option_index = 0;
+        int c = getopt_long_only(argc, argv, "A:F:a:V:c:C:f:n:R:r:s:S:t:w:",
+                                 long_options, &option_index);
+
+        /* Detect the end of the options. */
+        if (c == -1) break;
+
+        switch (c) {
+            case 'A':
+                acls = optarg;
+                break;
+
+            case 'F':
+                config.acl_fanout = parse_count("acl-fanout", optarg);
+                break;
+
+            case 'a':
+                avus = optarg;
+                break;
+
+            case 'V':
+                config.cardinality = parse_count("cardinality", optarg);
+                break;
+
+            case 'c':
+                collection = optarg;
+                break;
+
+            case 'C':
+                config.num_collections = parse_count("collections", optarg);
+                break;
+
+            case 'f':
+                config.fanout = parse_count("fanout", optarg);
+                break;
+
+            case 'n':
+                config.num_objects = parse_count("objects", optarg);
+                break;
+
+            case 'R':
+                config.num_replicas = parse_count("replicas", optarg);
+                break;
+
+            case 'r':
+                resources = optarg;
+                break;
+
+            case 's':
+                config.seed = parse_count("seed", optarg);
+                break;
+
+            case 'S':
+                config.size = parse_count("size", optarg);
+                break;
+
+            case 't':
+                config.num_threads = parse_count("threads", optarg);
+                break;
+
+            case 'w':
+                config.window = parse_count("window", optarg);
+                break;
+
+            case '?':
+                // getopt_long already printed an error message
+                break;
+
+            default:
+                // Ignore
+                break;
+        }
+    }
+
+    const char *help =
+        "Name\n"
+        "    baton-fixture\n"
+        "\n"
+        "Synopsis\n"
+        "\n"
+        "    baton-fixture --collection <path> [--acl <owner:level,...>]\n"
+        "                  [--acl-fanout <n>] [--avus <min>[:<max>]]\n"
+        "                  [--cardinality <n>] [--collections <n>]\n"
+        "                  [--fanout <n>] [--objects <n>]\n"
+        "                  [--replicas <n>] [--resource <name,...>]\n"
+        "                  [--seed <n>] [--size <n>] [--threads <n>]\n"
+        "                  [--window <n>] [--silent] [--verbose]\n"
+        "                  [--version]\n"
+        "\n"
+        "Description\n"
+        "    Populates iRODS with a synthetic tree of collections and data\n"
+        "    objects, with metadata, access controls and replicas, for\n"
+        "    benchmarks and integration tests. Prints a summary of what\n"
+        "    was created as JSON.\n"
+        "\n"
+        "    --acl           Access controls to grant on data objects, a\n"
+        "                    comma-separated list of owner:level. Optional.\n"
+        "    --acl-fanout    The number of access controls from --acl to\n"
+        "                    grant on each data object. Optional, defaults\n"
+        "                    to all of them.\n"
+        "    --avus          The range of the number of AVUs on each data\n"
+        "                    object. Optional, defaults to 1:3.\n"
+        "    --cardinality   The number of distinct values of each\n"
+        "                    attribute. Optional, defaults to 100.\n"
+        "    --collection    The root collection of the tree.\n"
+        "    --collections   The number of collections below the root.\n"
+        "                    Optional, defaults to 10.\n"
+        "    --fanout        The number of sub-collections of each\n"
+        "                    collection. Optional, defaults to 10.\n"
+        "    --objects       The number of data objects, spread evenly over\n"
+        "                    the collections. Optional, defaults to 1000.\n"
+        "    --replicas      The number of replicas of each data object,\n"
+        "                    one on each of the first resources given by\n"
+        "                    --resource. Optional, defaults to 1.\n"
+        "    --resource      A comma-separated list of resources on which\n"
+        "                    to create data objects and their replicas.\n"
+        "                    Optional, defaults to the default resource.\n"
+        "    --seed          The random number seed. A given seed produces\n"
+        "                    the same tree. Optional, defaults to 1.\n"
+        "    --size          The size of each data object in bytes.\n"
+        "                    Optional, defaults to 0.\n"
+        "    --silent        Silence error messages.\n"
+        "    --threads       The number of concurrent threads, each with\n"
+        "                    its own connections. Optional, defaults to 1.\n"
+        "    --verbose       Print verbose messages to STDERR.\n"
+        "    --version       Print the version number and exit.\n"
+        "    --window        The number of AVU operations each thread\n"
+        "                    buffers before applying them in bulk.\n"
+        "                    Optional, defaults to 1000.\n";
+
+    if (help_flag) {
+        printf("%s\n",help);
+        exit(0);
+    }
+
+    if (version_flag) {
+        printf("%s\n", VERSION);
+        exit(0);
+    }
+
+    if (debug_flag)   set_log_threshold(DEBUG);
+    if (verbose_flag) set_log_threshold(NOTICE);
+    if (silent_flag)  set_log_threshold(FATAL);
+
+    if (!collection) {
+        fprintf(stderr, "A --collection argument is required\n");
+        exit(1);
+    }
+
+    if (!str_starts_with(collection, "/", 1)) {
+        fprintf(stderr, "Invalid --collection '%s'; it must be an absolute "
+                "path\n", collection);
+        exit(1);
+    }
+    snprintf(config.root, sizeof config.root, "%s", collection);
+
+    if (avus) {
+        char *sep = strchr(avus, ':');
+        if (sep) *sep = '\0';
+        config.min_avus = parse_count("avus", avus);
+        config.max_avus = sep ? parse_count("avus", sep + 1) :
+            config.min_avus;
+    }
+
+    if (config.max_avus < config.min_avus) {
+        fprintf(stderr, "Invalid --avus range %zu:%zu\n",
+                config.min_avus, config.max_avus);
+        exit(1);
+    }
+
+    if (config.cardinality == 0) {
+        fprintf(stderr, "Invalid --cardinality 0\n");
+        exit(1);
+    }
+
+    if (config.fanout == 0) {
+        fprintf(stderr, "Invalid --fanout 0\n");
+        exit(1);
+    }
+
+    size_t depth = 0;
+    for (size_t first = 1; first <= config.num_collections &&
+             depth <= FIXTURE_MAX_DEPTH; depth++) {
+        first = tree_level_last(first, config.num_collections,
+                                config.fanout) + 1;
+    }
+
+    if (depth > FIXTURE_MAX_DEPTH) {
+        fprintf(stderr, "Invalid --fanout %zu; %zu collections would be "
+                "nested more than %d deep\n", config.fanout,
+                config.num_collections, FIXTURE_MAX_DEPTH);
+        exit(1);
+    }
+
+    if (acls && parse_acls(acls, &config) != 0) {
+        fprintf(stderr, "Invalid --acl; expected a list of owner:level\n");
+        exit(1);
+    }
+
+    if (config.acl_fanout == 0 || config.acl_fanout > config.num_acls) {
+        config.acl_fanout = config.num_acls;
+    }
+
+    if (resources && parse_resources(resources, &config) != 0) {
+        fprintf(stderr, "Invalid --resource '%s'\n", resources);
+        exit(1);
+    }
+
+    if (config.num_replicas == 0 ||
+        (config.num_replicas > 1 &&
+         config.num_replicas > config.num_resources)) {
+        fprintf(stderr, "Invalid --replicas %zu; must be 1, or at most the "
+                "number of resources given by --resource\n",
+                config.num_replicas);
+        exit(1);
+    }
+
+    if (config.num_threads == 0 || config.num_threads > FIXTURE_MAX_THREADS) {
+        fprintf(stderr, "Invalid --threads %zu; must be 1 to %d\n",
+                config.num_threads, FIXTURE_MAX_THREADS);
+        exit(1);
+    }
+
+    if (config.window == 0) {
+        fprintf(stderr, "Invalid --window 0\n");
+        exit(1);
+    }
+
+    declare_client_name(argv[0]);
+
+    if (make_root_collection(&config) != 0) {
+        exit_status = 1;
+        goto finally;
+    }
+
+    workers = calloc(config.num_threads, sizeof (fixture_worker_t));
+    if (!workers) {
+        logmsg(ERROR, "Failed to allocate memory: error %d %s",
+               errno, strerror(errno));
+        exit_status = 1;
+        goto finally;
+    }
+
+    for (size_t i = 0; i < config.num_threads; i++) {
+        workers[i].config = &config;
+        workers[i].index  = i;
+
+        if (config.size > 0) {
+            size_t len = config.size < default_buffer_size ?
+                config.size : default_buffer_size;
+            workers[i].buffer = calloc(1, len);
+            if (!workers[i].buffer) {
+                logmsg(ERROR, "Failed to allocate memory: error %d %s",
+                       errno, strerror(errno));
+                exit_status = 1;
+                goto finally;
+            }
+
+            uint64_t rng = seeded_random_state(config.seed, i);
+            for (size_t j = 0; j + 8 <= len; j += 8) {
+                uint64_t r = next_random(&rng);
+                memcpy(workers[i].buffer + j, &r, 8);
+            }
+        }
+    }
+
+    // All threads must start, because they wait for each other at
+    // every level of collections
+    pthread_barrier_init(&config.barrier, NULL, config.num_threads);
+    barrier_init = 1;
+
+    logmsg(NOTICE, "Creating %zu collections and %zu data objects in '%s' "
+           "on %zu threads", config.num_collections, config.num_objects,
+           config.root, config.num_threads);
+    double start = monotonic_ms();
+
+    size_t num_started = 0;
+    for (size_t i = 0; i < config.num_threads; i++) {
+        int status = pthread_create(&workers[i].thread, NULL, fixture_worker,
+                                    &workers[i]);
+        if (status != 0) {
+            logmsg(FATAL, "Failed to start thread %zu: error %d %s",
+                   i, status, strerror(status));
+            exit(1);
+        }
+        num_started++;
+    }
+
+    for (size_t i = 0; i < num_started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].status != 0) exit_status = 1;
+    }
+    double elapsed_ms = monotonic_ms() - start;
+
+    json_t *report = make_report(&config, workers, num_started, elapsed_ms);
+    print_json(report);
+    if (json_integer_value(json_object_get(report, "errors")) > 0) {
+        exit_status = 1;
+    }
+    json_decref(report);
+
+finally:
+    if (workers) {
+        for (size_t i = 0; i < config.num_threads; i++) {
+            free(workers[i].buffer);
+        }
+        free(workers);
+    }
+    if (barrier_init) pthread_barrier_destroy(&config.barrier);
+    free(config.acls);
+    free(config.resources);
+
+    exit(exit_status);
+}
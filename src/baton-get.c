@@ -31,6 +31,7 @@ static int acl_flag        = 0;
 static int avu_flag        = 0;
 static int debug_flag      = 0;
 static int help_flag       = 0;
+static int parallel_flag   = 0;
 static int raw_flag        = 0;
 static int save_flag       = 0;
 static int silent_flag     = 0;
@@ -43,6 +44,7 @@ static int version_flag    = 0;
 
 static size_t default_buffer_size = 1024 * 64 * 16 * 2;
 static size_t max_buffer_size     = 1024 * 1024 * 1024;
+static size_t max_threads         = 64;
 
 int main(int argc, char *argv[]) {
     option_flags flags = 0;
@@ -51,6 +53,9 @@ int main(int argc, char *argv[]) {
     FILE *input     = NULL;
     size_t buffer_size = default_buffer_size;
     unsigned long max_connect_time = DEFAULT_MAX_CONNECT_TIME;
+    char *cache_dir   = NULL;
+    size_t cache_size = 0;
+    size_t num_threads = 0;
 
     while (1) {
         static struct option long_options[] = {
@@ -59,6 +64,7 @@ int main(int argc, char *argv[]) {
             {"avu",         no_argument, &avu_flag,        1},
             {"debug",       no_argument, &debug_flag,      1},
             {"help",        no_argument, &help_flag,       1},
+            {"parallel",    no_argument, &parallel_flag,   1},
             {"raw",         no_argument, &raw_flag,        1},
             {"save",        no_argument, &save_flag,       1},
             {"silent",      no_argument, &silent_flag,     1},
@@ -70,13 +76,16 @@ int main(int argc, char *argv[]) {
             {"version",     no_argument, &version_flag,    1},
             // Indexed options
             {"buffer-size",  required_argument, NULL, 'b'},
+            {"cache-dir",    required_argument, NULL, 'D'},
+            {"cache-size",   required_argument, NULL, 'S'},
             {"connect-time", required_argument, NULL, 'c'},
             {"file",         required_argument, NULL, 'f'},
+            {"threads",      required_argument, NULL, 't'},
             {0, 0, 0, 0}
         };
 
         int option_index = 0;
-        int c = getopt_long_only(argc, argv, "c:b:f:",
+        int c = getopt_long_only(argc, argv, "c:b:f:t:D:S:",
                                  long_options, &option_index);
 
         /* Detect the end of the options. */
@@ -103,10 +112,37 @@ int main(int argc, char *argv[]) {
                 if (errno != 0) buffer_size = default_buffer_size;
                 break;
 
+            case 'D':
+                cache_dir = optarg;
+                break;
+
+            case 'S':
+                cache_size = parse_size(optarg);
+                if (errno != 0) {
+                    fprintf(stderr, "Invalid --cache-size '%s'\n", optarg);
+                    exit(1);
+                }
+                break;
+
             case 'f':
                 json_file = optarg;
                 break;
 
+            case 't':
+                errno = 0;
+                char *t_endptr;
+                unsigned long t_val = strtoul(optarg, &t_endptr, 10);
+
+                if ((errno == ERANGE && t_val == ULONG_MAX) ||
+                    (errno != 0 && t_val == 0)              ||
+                    t_endptr == optarg || t_val > max_threads) {
+                    fprintf(stderr, "Invalid --threads '%s'\n", optarg);
+                    exit(1);
+                }
+
+                num_threads = t_val;
+                break;
+
             case '?':
                 // getopt_long already printed an error message
                 break;
@@ -118,6 +154,7 @@ int main(int argc, char *argv[]) {
     }
 
     if (acl_flag)        flags = flags | PRINT_ACL;
+    if (parallel_flag)   flags = flags | PARALLEL_TRANSFER;
     if (avu_flag)        flags = flags | PRINT_AVU;
     if (raw_flag)        flags = flags | PRINT_RAW;
     if (save_flag)       flags = flags | SAVE_FILES;
@@ -133,9 +170,10 @@ int main(int argc, char *argv[]) {
         "Synopsis\n"
         "\n"
         "    baton-get [--acl] [--avu] [--file <JSON file>]\n"
-        "              [--connect-time <n>] [--raw] [--save]\n"
-        "              [--silent] [--size] [--timestamp] [--unbuffered]\n"
-        "              [--unsafe] [--verbose] [--version]\n"
+        "              [--cache-dir <dir>] [--cache-size <n>]\n"
+        "              [--connect-time <n>] [--parallel [--threads <n>]]\n"
+        "              [--raw] [--save] [--silent] [--size] [--timestamp]\n"
+        "              [--unbuffered] [--unsafe] [--verbose] [--version]\n"
         "\n"
         "Description\n"
         "    Gets the contents of data objects described in a JSON\n"
@@ -144,6 +182,14 @@ int main(int argc, char *argv[]) {
         "  --acl          Print access control lists in output.\n"
         "  --avu          Print AVU lists in output.\n"
         "  --buffer-size  Set the transfer buffer size.\n"
+        "  --cache-dir    A local directory in which to cache saved data\n"
+        "                 objects by checksum. Repeated gets of the same\n"
+        "                 content are linked from the cache rather than\n"
+        "                 transferred. Saved files are read-only. Used\n"
+        "                 with --save. Optional.\n"
+        "  --cache-size   The size in bytes above which least recently used\n"
+        "                 cache entries are removed. Optional, defaults to\n"
+        "                 unbounded.\n"
         "  --connect-time The duration in seconds after which a connection\n"
         "                 to iRODS will be refreshed (closed and reopened\n"
         "                 between JSON documents) to allow iRODS server\n"
@@ -151,12 +197,18 @@ int main(int argc, char *argv[]) {
         "                 10 minutes.\n"
         "  --file         The JSON file describing the data objects.\n"
         "                 Optional, defaults to STDIN.\n"
+        "  --parallel     Save data objects using the server's parallel\n"
+        "                 transfer, which may use several streams to its\n"
+        "                 data transfer ports, verifying their checksums.\n"
+        "                 Used with --save. Optional.\n"
         "  --raw          Print data object content without any JSON\n"
         "                 wrapping.\n"
         "  --save         Save data object content to individual files,\n"
         "                 without any JSON wrapping i.e. implies --raw.\n"
         "  --silent       Silence error messages.\n"
         "  --size         Print data object sizes in output.\n"
+        "  --threads      The number of parallel transfer threads. Optional,\n"
+        "                 defaults to 0, for the server to choose.\n"
         "  --timestamp    Print timestamps in output.\n"
         "  --unbuffered   Flush print operations for each JSON object.\n"
         "  --unsafe       Permit unsafe relative iRODS paths.\n"
@@ -191,6 +243,17 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    if (cache_dir && !save_flag) {
+        logmsg(WARN, "Ignoring the --cache-dir option because --save "
+               "was not requested");
+        cache_dir = NULL;
+    }
+
+    if (parallel_flag && !save_flag) {
+        logmsg(WARN, "Ignoring the --parallel option because --save "
+               "was not requested");
+    }
+
     if (buffer_size > max_buffer_size) {
         logmsg(WARN, "Requested transfer buffer size %zu exceeds maximum of "
                "%zu. Setting buffer size to %zu",
@@ -215,7 +278,10 @@ int main(int argc, char *argv[]) {
 
     operation_args_t args = { .flags            = flags,
                               .buffer_size      = buffer_size,
-                              .max_connect_time = max_connect_time };
+                              .max_connect_time = max_connect_time,
+                              .cache_dir        = cache_dir,
+                              .cache_size       = cache_size,
+                              .num_threads      = num_threads };
 
     int status = do_operation(input, baton_json_get_op, &args);
     if (input != stdin) fclose(input);
@@ -39,6 +39,7 @@ int main(int argc, char *argv[]) {
     char *json_file = NULL;
     FILE     *input = NULL;
     unsigned long max_connect_time = DEFAULT_MAX_CONNECT_TIME;
+    unsigned long write_behind = 0;
 
     while (1) {
         static struct option long_options[] = {
@@ -54,11 +55,12 @@ int main(int argc, char *argv[]) {
             {"connect-time", required_argument, NULL, 'c'},
             {"file",         required_argument, NULL, 'f'},
             {"operation",    required_argument, NULL, 'o'},
+            {"write-behind", required_argument, NULL, 'w'},
             {0, 0, 0, 0}
         };
 
         int option_index = 0;
-        int c = getopt_long_only(argc, argv, "c:f:o:",
+        int c = getopt_long_only(argc, argv, "c:f:o:w:",
                                  long_options, &option_index);
 
         /* Detect the end of the options. */
@@ -98,6 +100,13 @@ int main(int argc, char *argv[]) {
                 }
                 break;
 
+            case 'w':
+                if (parse_unsigned(optarg, &write_behind) != 0) {
+                    fprintf(stderr, "Invalid --write-behind '%s'\n", optarg);
+                    exit(1);
+                }
+                break;
+
             case '?':
                 // getopt_long already printed an error message
                 break;
@@ -117,7 +126,7 @@ int main(int argc, char *argv[]) {
         "    baton-metamod [--connect-time <n>] [--file <JSON file>]\n"
         "                  --operation <operation>\n"
         "                  [--silent] [--unbuffered] [--unsafe]\n"
-        "                  [--verbose] [--version]\n"
+        "                  [--verbose] [--version] [--write-behind <n>]\n"
         "\n"
         "Description\n"
         "    Modifies metadata AVUs on collections and data objects\n"
@@ -136,7 +145,12 @@ int main(int argc, char *argv[]) {
         "    --unbuffered  Flush print operations for each JSON object.\n"
         "    --unsafe      Permit unsafe relative iRODS paths.\n"
         "    --verbose     Print verbose messages to STDERR.\n"
-        "    --version     Print the version number and exit.\n";
+        "    --version     Print the version number and exit.\n"
+        "  --write-behind  Buffer up to this many AVU operations and apply\n"
+        "                  them in bulk on a separate connection. Results\n"
+        "                  are printed once applied, which is also done\n"
+        "                  whenever no further input is waiting. Optional,\n"
+        "                  defaults to 0 (unbuffered).\n";
 
     if (help_flag) {
         printf("%s\n", help);
@@ -162,7 +176,8 @@ int main(int argc, char *argv[]) {
     }
 
     operation_args_t args = { .flags            = flags,
-                              .max_connect_time = max_connect_time };
+                              .max_connect_time = max_connect_time,
+                              .write_behind     = write_behind };
 
     int status = do_operation(input, baton_json_metamod_op, &args);
     if (input != stdin) fclose(input);
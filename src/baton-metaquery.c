@@ -51,6 +51,7 @@ int main(int argc, char *argv[]) {
     char *json_file = NULL;
     FILE *input     = NULL;
     unsigned long max_connect_time = DEFAULT_MAX_CONNECT_TIME;
+    unsigned long num_threads      = 0;
 
     while (1) {
         static struct option long_options[] = {
@@ -73,12 +74,13 @@ int main(int argc, char *argv[]) {
             // Indexed options
             {"connect-time", required_argument, NULL, 'c'},
             {"file",         required_argument, NULL, 'f'},
+            {"threads",      required_argument, NULL, 't'},
             {"zone",         required_argument, NULL, 'z'},
             {0, 0, 0, 0}
         };
 
         int option_index = 0;
-        int c = getopt_long_only(argc, argv, "c:f:z:",
+        int c = getopt_long_only(argc, argv, "c:f:t:z:",
                                  long_options, &option_index);
 
         /* Detect the end of the options. */
@@ -104,6 +106,19 @@ int main(int argc, char *argv[]) {
                 json_file = optarg;
                 break;
 
+            case 't':
+                errno = 0;
+                num_threads = strtoul(optarg, &endptr, 10);
+
+                if ((errno == ERANGE && num_threads == ULONG_MAX) ||
+                    (errno != 0 && num_threads == 0)              ||
+                    endptr == optarg                              ||
+                    num_threads > QUERY_SET_MAX_LEAVES) {
+                    fprintf(stderr, "Invalid --threads '%s'\n", optarg);
+                    exit(1);
+                }
+                break;
+
             case 'z':
                 zone_name = optarg;
                 break;
@@ -144,8 +159,9 @@ int main(int argc, char *argv[]) {
         "    baton-metaquery [--acl] [--avu] [--checksum] [--coll]\n"
         "                    [--connect-time <n>] [--file <JSON file>]\n"
         "                    [--obj ] [--replicate] [--silent] [--size]\n"
-        "                    [--timestamp] [--unbuffered] [--unsafe]\n"
-        "                    [--verbose] [--version] [--zone <name>]\n"
+        "                    [--threads <n>] [--timestamp] [--unbuffered]\n"
+        "                    [--unsafe] [--verbose] [--version]\n"
+        "                    [--zone <name>]\n"
         "\n"
         "Description\n"
         "    Finds items in iRODS by AVU, given a query constructed\n"
@@ -165,6 +181,10 @@ int main(int argc, char *argv[]) {
         "  --obj          Limit search to data object metadata only.\n"
         "  --replicate    Report data object replicates.\n"
         "  --silent       Silence error messages.\n"
+        "  --threads      The number of queries of a query set to run\n"
+        "                 concurrently, each on its own connection.\n"
+        "                 Optional, defaults to 0, running them all on\n"
+        "                 one connection.\n"
         "  --timestamp    Print timestamps in output.\n"
         "  --unbuffered   Flush print operations for each JSON object.\n"
         "  --unsafe       Permit unsafe relative iRODS paths.\n"
@@ -194,7 +214,8 @@ int main(int argc, char *argv[]) {
 
     operation_args_t args = { .flags            = flags,
                               .zone_name        = zone_name,
-                              .max_connect_time = max_connect_time };
+                              .max_connect_time = max_connect_time,
+                              .num_threads      = num_threads };
 
     int status = do_operation(input, baton_json_metaquery_op, &args);
     if (input != stdin) fclose(input);
@@ -27,6 +27,7 @@
 #include "config.h"
 #include "baton.h"
 
+static int balance_flag       = 0;
 static int checksum_flag      = 0;
 static int verify_flag        = 0;
 static int debug_flag         = 0;
@@ -54,6 +55,7 @@ int main(int argc, char *argv[]) {
     while (1) {
         static struct option long_options[] = {
             // Flag options
+            {"balance",       no_argument, &balance_flag,       1},
             {"checksum",      no_argument, &checksum_flag,      1},
             {"debug",         no_argument, &debug_flag,         1},
             {"help",          no_argument, &help_flag,          1},
@@ -126,7 +128,8 @@ int main(int argc, char *argv[]) {
         "\n"
         "Synopsis\n"
         "\n"
-        "    baton-put [--checksum|--verify] [--connect-time <n>]\n"
+        "    baton-put [--balance] [--checksum|--verify]\n"
+        "              [--connect-time <n>]\n"
         "              [--file <JSON file>]\n"
         "              [--silent] [--unbuffered] [--unsafe]\n"
         "              [--verbose] [--version] [--wlock]\n"
@@ -135,6 +138,10 @@ int main(int argc, char *argv[]) {
         "  Puts the contents of files into data objects described in a\n"
         "  JSON input file.\n"
         ""
+        "  --balance       Place each data object on the resource with the\n"
+        "                  most free space, less the bytes of uploads in\n"
+        "                  progress, rather than the default. Ignored\n"
+        "                  with --single-server.\n"
         "  --buffer-size   Set the transfer buffer size.\n"
         "  --checksum      Calculate and register a checksum on the server\n"
         "                  side.\n"
@@ -173,6 +180,8 @@ int main(int argc, char *argv[]) {
     if (verbose_flag) set_log_threshold(NOTICE);
     if (silent_flag)  set_log_threshold(FATAL);
 
+    set_resource_placement(balance_flag);
+
     declare_client_name(argv[0]);
     input = maybe_stdin(json_file);
     if (!input) {
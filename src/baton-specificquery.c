@@ -20,7 +20,9 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <getopt.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -33,13 +35,14 @@ static int unbuffered_flag = 0;
 static int verbose_flag    = 0;
 static int version_flag    = 0;
 
-int do_search_specific(FILE *input, char *zone_name);
+int do_search_specific(FILE *input, char *zone_name, size_t num_threads);
 
 int main(int argc, char *argv[]) {
     int exit_status = 0;
     char *zone_name = NULL;
     char *json_file = NULL;
     FILE *input     = NULL;
+    unsigned long num_threads = 0;
 
     while (1) {
         static struct option long_options[] = {
@@ -51,12 +54,13 @@ int main(int argc, char *argv[]) {
             {"version",    no_argument, &version_flag,    1},
             // Indexed options
             {"file",      required_argument, NULL, 'f'},
+            {"threads",   required_argument, NULL, 't'},
             {"zone",      required_argument, NULL, 'z'},
             {0, 0, 0, 0}
         };
 
         int option_index = 0;
-        int c = getopt_long_only(argc, argv, "f:z:", long_options,
+        int c = getopt_long_only(argc, argv, "f:t:z:", long_options,
                                  &option_index);
 
         /* Detect the end of the options. */
@@ -67,6 +71,20 @@ int main(int argc, char *argv[]) {
                 json_file = optarg;
                 break;
 
+            case 't':
+                errno = 0;
+                char *endptr;
+                num_threads = strtoul(optarg, &endptr, 10);
+
+                if ((errno == ERANGE && num_threads == ULONG_MAX) ||
+                    (errno != 0 && num_threads == 0)              ||
+                    endptr == optarg                              ||
+                    num_threads > SPECIFIC_MAX_THREADS) {
+                    fprintf(stderr, "Invalid --threads '%s'\n", optarg);
+                    exit(1);
+                }
+                break;
+
             case 'z':
                 zone_name = optarg;
                 break;
@@ -89,7 +107,7 @@ int main(int argc, char *argv[]) {
         puts("Synopsis");
         puts("");
         puts("    baton-specificquery");
-        puts("                    [--file <JSON file>]");
+        puts("                    [--file <JSON file>] [--threads <n>]");
         puts("                    [--unbuffered] [--verbose] [--version]");
         puts("                    [--zone <name>]");
         puts("");
@@ -99,6 +117,9 @@ int main(int argc, char *argv[]) {
         puts("");
         puts("    --file        The JSON file describing the query. Optional,");
         puts("                  defaults to STDIN.");
+        puts("    --threads     The number of argument tuples of a batched");
+        puts("                  query to run concurrently, each on its own");
+        puts("                  connection. Optional, defaults to 0.");
         puts("    --unbuffered  Flush print operations for each JSON object.");
         puts("    --verbose     Print verbose messages to STDERR.");
         puts("    --version     Print the version number and exit.");
@@ -122,13 +143,13 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    int status = do_search_specific(input, zone_name);
+    int status = do_search_specific(input, zone_name, num_threads);
     if (status != 0) exit_status = 5;
 
     exit(exit_status);
 }
 
-int do_search_specific(FILE *input, char *zone_name) {
+int do_search_specific(FILE *input, char *zone_name, size_t num_threads) {
     int item_count  = 0;
     int error_count = 0;
 
@@ -161,7 +182,8 @@ int do_search_specific(FILE *input, char *zone_name) {
         json_t *results = NULL;
 
         baton_error_t search_error;
-        results = search_specific(conn, target, zone_name, &search_error);
+        results = search_specific_concurrent(conn, target, zone_name,
+                                             num_threads, &search_error);
         if (search_error.code != 0) {
             error_count++;
             add_error_value(target, &search_error);
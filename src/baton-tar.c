@@ -0,0 +1,251 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "baton.h"
+
+static int debug_flag   = 0;
+static int extract_flag = 0;
+static int help_flag    = 0;
+static int silent_flag  = 0;
+static int verbose_flag = 0;
+static int version_flag = 0;
+
+static size_t default_buffer_size = 1024 * 64 * 16 * 2;
+static size_t max_buffer_size     = 1024 * 1024 * 1024;
+
+static int do_archive(char *collection, archive_in_t *archive_in,
+                      int extract) {
+    rodsEnv env;
+    rodsPath_t rods_path;
+    archive_out_t archive_out;
+    baton_error_t error;
+
+    memset(&rods_path, 0, sizeof (rodsPath_t));
+
+    rcComm_t *conn = rods_login(&env);
+    if (!conn) return 1;
+
+    resolve_rods_path(conn, &env, &rods_path, collection, 0, &error);
+    if (error.code == 0 && extract) {
+        extract_archive(conn, &rods_path, stdin, archive_in, &archive_out,
+                        &error);
+    }
+    else if (error.code == 0) {
+        archive_collection(conn, &rods_path, stdout, archive_in,
+                           &archive_out, &error);
+    }
+
+    if (error.code != 0) {
+        logmsg(ERROR, "Failed to %s '%s': %s",
+               extract ? "extract into" : "archive", collection,
+               error.message);
+    }
+
+    if (rods_path.rodsObjStat) free(rods_path.rodsObjStat);
+    rcDisconnect(conn);
+
+    return error.code != 0;
+}
+
+int main(int argc, char *argv[]) {
+    char *collection = NULL;
+    unsigned long value;
+
+    archive_in_t archive_in = { .num_threads = 4,
+                                .window      = ARCHIVE_DEFAULT_WINDOW,
+                                .buffer_size = default_buffer_size };
+
+    while (1) {
+        static struct option long_options[] = {
+            // Flag options
+            {"debug",       no_argument, &debug_flag,   1},
+            {"extract",     no_argument, &extract_flag, 1},
+            {"help",        no_argument, &help_flag,    1},
+            {"silent",      no_argument, &silent_flag,  1},
+            {"verbose",     no_argument, &verbose_flag, 1},
+            {"version",     no_argument, &version_flag, 1},
+            // Indexed options
+            {"buffer-size", required_argument, NULL, 'b'},
+            {"collection",  required_argument, NULL, 'c'},
+            {"threads",     required_argument, NULL, 't'},
+            {"window",      required_argument, NULL, 'w'},
+            {0, 0, 0, 0}
+        };
+
+        int option_index = 0;
+        int c = getopt_long_only(argc, argv, "b:c:t:w:",
+                                 long_options, &option_index);
+
+        /* Detect the end of the options. */
+        if (c == -1) break;
+
+        switch (c) {
+            case 'b':
+                if (parse_unsigned(optarg, &value) != 0 || value == 0) {
+                    fprintf(stderr, "Invalid --buffer-size '%s'\n", optarg);
+                    exit(1);
+                }
+                archive_in.buffer_size = value;
+                break;
+
+            case 'c':
+                collection = optarg;
+                break;
+
+            case 't':
+                if (parse_unsigned(optarg, &value) != 0) {
+                    fprintf(stderr, "Invalid --threads '%s'\n", optarg);
+                    exit(1);
+                }
+                archive_in.num_threads = value;
+                break;
+
+            case 'w':
+                if (parse_unsigned(optarg, &value) != 0 || value == 0) {
+                    fprintf(stderr, "Invalid --window '%s'\n", optarg);
+                    exit(1);
+                }
+                archive_in.window = value;
+                break;
+
+            case '?':
+                // getopt_long already printed an error message
+                break;
+
+            default:
+                // Ignore
+                break;
+        }
+    }
+
+    const char *help =
+        "Name\n"
+        "    baton-tar\n"
+        "\n"
+        "Synopsis\n"
+        "\n"
+        "    baton-tar --collection <path> [--buffer-size <n>] [--extract]\n"
+        "              [--threads <n>] [--window <n>] [--silent]\n"
+        "              [--verbose] [--version]\n"
+        "\n"
+        "Description\n"
+        "    Writes a collection and everything in it to STDOUT as a POSIX\n"
+        "    tar archive, which unpacks to a directory named after the\n"
+        "    collection. While each data object is written, those after it\n"
+        "    are read ahead concurrently.\n"
+        "\n"
+        "    With --extract, reads a tar archive from STDIN instead and\n"
+        "    writes its contents into the collection, creating collections\n"
+        "    as required. Small data objects are written concurrently.\n"
+        "\n"
+        "    --buffer-size   Set the transfer buffer size.\n"
+        "    --collection    The collection to archive, or to extract\n"
+        "                    into.\n"
+        "    --extract       Extract an archive from STDIN.\n"
+        "    --silent        Silence error messages.\n"
+        "    --threads       The number of threads reading ahead, or\n"
+        "                    writing small data objects, each with its own\n"
+        "                    connection. 0 reads or writes each data object\n"
+        "                    in turn. Optional, defaults to 4.\n"
+        "    --verbose       Print verbose messages to STDERR.\n"
+        "    --version       Print the version number and exit.\n"
+        "    --window        The number of bytes that may be held in memory\n"
+        "                    for the threads. Larger data objects are\n"
+        "                    streamed in turn. Optional, defaults to\n"
+        "                    256 MiB.\n";
+
+    if (help_flag) {
+        printf("%s\n",help);
+        exit(0);
+    }
+
+    if (version_flag) {
+        printf("%s\n", VERSION);
+        exit(0);
+    }
+
+    if (debug_flag)   set_log_threshold(DEBUG);
+    if (verbose_flag) set_log_threshold(NOTICE);
+    if (silent_flag)  set_log_threshold(FATAL);
+
+    if (!collection) {
+        fprintf(stderr, "A --collection argument is required\n");
+        exit(1);
+    }
+
+    if (!str_starts_with(collection, "/", 1)) {
+        fprintf(stderr, "Invalid --collection '%s'; it must be an absolute "
+                "path\n", collection);
+        exit(1);
+    }
+
+    if (archive_in.num_threads > ARCHIVE_MAX_THREADS) {
+        fprintf(stderr, "Invalid --threads %zu; must be 0 to %d\n",
+                archive_in.num_threads, ARCHIVE_MAX_THREADS);
+        exit(1);
+    }
+
+    if (archive_in.buffer_size > max_buffer_size) {
+        logmsg(WARN, "Requested transfer buffer size %zu exceeds maximum of "
+               "%zu. Setting buffer size to %zu",
+               archive_in.buffer_size, max_buffer_size, max_buffer_size);
+        archive_in.buffer_size = max_buffer_size;
+    }
+
+    if (archive_in.buffer_size % 1024 != 0) {
+        size_t tmp = ((archive_in.buffer_size / 1024) + 1) * 1024;
+        if (tmp > max_buffer_size) {
+            tmp = max_buffer_size;
+        }
+
+        if (tmp > archive_in.buffer_size) {
+            logmsg(NOTICE, "Rounding transfer buffer size upwards from "
+                   "%zu to %zu", archive_in.buffer_size, tmp);
+            archive_in.buffer_size = tmp;
+        }
+    }
+
+    logmsg(DEBUG, "Using a transfer buffer size of %zu bytes",
+           archive_in.buffer_size);
+
+    if (extract_flag && isatty(fileno(stdin))) {
+        fprintf(stderr, "Refusing to read an archive from a terminal\n");
+        exit(1);
+    }
+
+    if (!extract_flag && isatty(fileno(stdout))) {
+        fprintf(stderr, "Refusing to write an archive to a terminal\n");
+        exit(1);
+    }
+
+    declare_client_name(argv[0]);
+
+    int exit_status = do_archive(collection, &archive_in, extract_flag);
+
+    exit(exit_status);
+}
@@ -23,6 +23,7 @@
 #include <errno.h>
 #include <libgen.h>
 #include <math.h>
+#include <pthread.h>
 #include <regex.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -202,18 +203,32 @@ error:
     return NULL;
 }
 
+// Serialises logins, which read the process-wide iRODS environment
+// and client API table
+static pthread_mutex_t login_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 rcComm_t *rods_login(rodsEnv *env) {
     rcComm_t *conn = NULL;
     int status;
 
+    pthread_mutex_lock(&login_mutex);
+
     status = getRodsEnv(env);
     if (status < 0) {
         logmsg(ERROR, "Failed to load your iRODS environment");
         goto error;
     }
 
+    // Checksum on the client as the environment says the zone does
+    init_default_digest_scheme(parse_digest_scheme(env->rodsDefaultHashScheme));
+
+    trace_span_t span;
+    trace_begin(&span, TRACE_CAT_LOGIN, "login", "%s:%d",
+                env->rodsHost, env->rodsPort);
+
     conn = rods_connect(env);
     if (!conn) {
+        trace_end(&span);
         logmsg(ERROR, "Failed to connect to %s:%d zone '%s' as '%s'",
                env->rodsHost, env->rodsPort, env->rodsZone, env->rodsUserName);
         goto error;
@@ -229,16 +244,20 @@ rcComm_t *rods_login(rodsEnv *env) {
 #else
     status = clientLogin(conn);
 #endif
+    trace_end(&span);
 
     if (status < 0) {
         logmsg(ERROR, "Failed to log in to iRODS");
         goto error;
     }
 
+    pthread_mutex_unlock(&login_mutex);
+
     return conn;
 
 error:
     if (conn) rcDisconnect(conn);
+    pthread_mutex_unlock(&login_mutex);
 
     return NULL;
 }
@@ -288,7 +307,10 @@ int resolve_rods_path(rcComm_t *conn, rodsEnv *env, rodsPath_t *rods_path,
         goto error;
     }
 
+    trace_span_t span;
+    trace_begin(&span, TRACE_CAT_STAT, "rcObjStat", "%s", rods_path->outPath);
     status = getRodsObjType(conn, rods_path);
+    trace_end(&span);
     if (status < 0) {
         char *err_subname;
         const char *err_name = rodsErrorName(status, &err_subname);
@@ -323,7 +345,10 @@ int set_rods_path(rcComm_t *conn, rodsPath_t *rods_path, char *path,
         goto error;
     }
 
+    trace_span_t span;
+    trace_begin(&span, TRACE_CAT_STAT, "rcObjStat", "%s", rods_path->outPath);
     status = getRodsObjType(conn, rods_path);
+    trace_end(&span);
     if (status < 0) {
         char *err_subname;
         const char *err_name = rodsErrorName(status, &err_subname);
@@ -457,8 +482,32 @@ finally:
     return error->code;
 }
 
+static json_t *search_items(rcComm_t *conn, json_t *query, char *zone_name,
+                            query_format_in_t *format,
+                            prepare_avu_search_cb prepare_avu,
+                            prepare_acl_search_cb prepare_acl,
+                            prepare_tps_search_cb prepare_cre,
+                            prepare_tps_search_cb prepare_mod,
+                            size_t num_threads, baton_error_t *error) {
+    if (is_query_set(query)) {
+        return do_search_set(conn, zone_name, query, format, prepare_avu,
+                             prepare_acl, prepare_cre, prepare_mod,
+                             num_threads, error);
+    }
+
+    return do_search(conn, zone_name, query, format, prepare_avu,
+                     prepare_acl, prepare_cre, prepare_mod, error);
+}
+
 json_t *search_metadata(rcComm_t *conn, json_t *query, char *zone_name,
                         option_flags flags, baton_error_t *error) {
+    return search_metadata_concurrent(conn, query, zone_name, flags, 0,
+                                      error);
+}
+
+json_t *search_metadata_concurrent(rcComm_t *conn, json_t *query,
+                                   char *zone_name, option_flags flags,
+                                   size_t num_threads, baton_error_t *error) {
     json_t *results      = NULL;
     json_t *collections  = NULL;
     json_t *data_objects = NULL;
@@ -493,7 +542,7 @@ json_t *search_metadata(rcComm_t *conn, json_t *query, char *zone_name,
         if (error->code != 0) goto error;
     }
 
-    query = map_access_args(query, error);
+    query = map_query_set_access_args(query, error);
     if (error->code != 0) goto error;
 
     results = json_array();
@@ -504,10 +553,12 @@ json_t *search_metadata(rcComm_t *conn, json_t *query, char *zone_name,
 
     if (flags & SEARCH_COLLECTIONS) {
         logmsg(DEBUG, "Searching for collections ...");
-        collections = do_search(conn, zone_name, query, col_format,
-                                prepare_col_avu_search, prepare_col_acl_search,
-                                prepare_col_cre_search, prepare_col_mod_search,
-                                error);
+        collections = search_items(conn, query, zone_name, col_format,
+                                   prepare_col_avu_search,
+                                   prepare_col_acl_search,
+                                   prepare_col_cre_search,
+                                   prepare_col_mod_search,
+                                   num_threads, error);
         if (error->code != 0) goto error;
 
         status = json_array_extend(results, collections);
@@ -521,10 +572,12 @@ json_t *search_metadata(rcComm_t *conn, json_t *query, char *zone_name,
 
     if (flags & SEARCH_OBJECTS) {
         logmsg(DEBUG, "Searching for data objects ...");
-        data_objects = do_search(conn, zone_name, query, obj_format,
-                                 prepare_obj_avu_search, prepare_obj_acl_search,
-                                 prepare_obj_cre_search, prepare_obj_mod_search,
-                                 error);
+        data_objects = search_items(conn, query, zone_name, obj_format,
+                                    prepare_obj_avu_search,
+                                    prepare_obj_acl_search,
+                                    prepare_obj_cre_search,
+                                    prepare_obj_mod_search,
+                                    num_threads, error);
         if (error->code != 0) goto error;
 
         status = json_array_extend(results, data_objects);
@@ -537,19 +590,23 @@ json_t *search_metadata(rcComm_t *conn, json_t *query, char *zone_name,
     }
 
     if (flags & PRINT_ACL) {
-        results = add_acl_json_array(conn, results, error);
+        results = add_acl_json_array_batched(conn, results,
+                                             error);
         if (error->code != 0) goto error;
     }
     if (flags & PRINT_AVU) {
-        results = add_avus_json_array(conn, results, error);
+        results = add_avus_json_array_batched(conn, results,
+                                              error);
         if (error->code != 0) goto error;
     }
     if (flags & PRINT_CHECKSUM) {
-        results = add_checksum_json_array(conn, results, error);
+        results = add_checksum_json_array_batched(conn, results,
+                                                  error);
         if (error->code != 0) goto error;
     }
     if (flags & PRINT_TIMESTAMP) {
-        results = add_tps_json_array(conn, results, error);
+        results = add_tps_json_array_batched(conn, results,
+                                             error);
         if (error->code != 0) goto error;
     }
     if (flags & PRINT_REPLICATE) {
@@ -571,6 +628,12 @@ error:
 
 json_t *search_specific(rcComm_t *conn, json_t *query, char *zone_name,
                         baton_error_t *error) {
+    return search_specific_concurrent(conn, query, zone_name, 0, error);
+}
+
+json_t *search_specific_concurrent(rcComm_t *conn, json_t *query,
+                                   char *zone_name, size_t num_threads,
+                                   baton_error_t *error) {
     json_t *results = NULL;
 
     init_baton_error(error);
@@ -581,8 +644,10 @@ json_t *search_specific(rcComm_t *conn, json_t *query, char *zone_name,
     }
 
     logmsg(TRACE, "Running specific query ...");
-    results = do_specific(conn, zone_name, query, prepare_specific_query,
-                          prepare_specific_labels, error);
+    results = do_specific_concurrent(conn, zone_name, query,
+                                     prepare_specific_query,
+                                     prepare_specific_labels, num_threads,
+                                     error);
 
     if (error->code != 0) goto error;
 
@@ -759,7 +824,11 @@ int modify_metadata(rcComm_t *conn, rodsPath_t *rods_path,
     modAVUMetadataInp_t anon_args;
     map_mod_args(&anon_args, &named_args);
 
+    trace_span_t span;
+    trace_begin(&span, TRACE_CAT_METADATA, "rcModAVUMetadata", "%s %s",
+                metadata_op_name(operation), rods_path->outPath);
     int status = rcModAVUMetadata(conn, &anon_args);
+    trace_end(&span);
     if (status < 0) {
         char *err_subname;
         const char *err_name = rodsErrorName(status, &err_subname);
@@ -806,7 +875,7 @@ int maybe_modify_json_metadata(rcComm_t *conn, rodsPath_t *rods_path,
                                  error);
         }
 
-        free(str);
+        free_json_str(str);
 
         if (error->code != 0) goto finally;
     }
@@ -26,11 +26,29 @@
 #include <rodsClient.h>
 
 #include "config.h"
+#include "archive.h"
+#include "buffer_pool.h"
+#include "cache.h"
+#include "checkpoint.h"
+#include "copy.h"
+#include "deadline.h"
+#include "digest.h"
+#include "envelope.h"
+#include "fetch.h"
 #include "json_query.h"
 #include "list.h"
 #include "log.h"
+#include "memory.h"
+#include "output.h"
+#include "placement.h"
+#include "plan.h"
+#include "query_set.h"
 #include "read.h"
+#include "tar.h"
+#include "trace.h"
+#include "tree_digest.h"
 #include "write.h"
+#include "write_behind.h"
 
 #define MAX_VERSION_STR_LEN 512
 
@@ -85,7 +103,8 @@ int is_irods_available();
 int declare_client_name(const char *name);
 
 /**
- * Log into iRODS using an pre-defined environment.
+ * Log into iRODS using an pre-defined environment. May be called from
+ * any thread; logins are made one at a time.
  *
  * @param[in] env A populated iRODS environment.
  *
@@ -179,6 +198,28 @@ int resolve_collection(json_t *object, rcComm_t *conn, rodsEnv *env,
 json_t *search_metadata(rcComm_t *conn, json_t *query, char *zone_name,
                         option_flags flags, baton_error_t *error);
 
+/**
+ * Search metadata to find matching data objects and collections, as
+ * search_metadata. The AVU queries of a query set may run
+ * concurrently, each on its own connection.
+ *
+ * @param[in]  conn         An open iRODS connection.
+ * @param[in]  query        A JSON query specification, or a query set
+ *                          combining several with "any", "all" and "not".
+ * @param[in]  zone_name    An iRODS zone name. Optional, NULL means the current
+ *                          zone.
+ * @param[in]  flags        Search behaviour options.
+ * @param[in]  num_threads  The number of AVU queries of a query set to run
+ *                          on their own connections. 0 runs them all on
+ *                          conn.
+ * @param[out] error        An error report struct.
+ *
+ * @return A newly constructed JSON array of JSON result objects.
+ */
+json_t *search_metadata_concurrent(rcComm_t *conn, json_t *query,
+                                   char *zone_name, option_flags flags,
+                                   size_t num_threads, baton_error_t *error);
+
 /**
  * Perform a specific query (SQL must have been installed on iRODS server by an
  * administrator using `iadmin asq`).
@@ -196,6 +237,28 @@ json_t *search_metadata(rcComm_t *conn, json_t *query, char *zone_name,
 json_t *search_specific(rcComm_t *conn, json_t *query, char *zone_name,
                         baton_error_t *error);
 
+/**
+ * Perform a specific query, as search_specific. If the query's args
+ * are an array of argument tuples, the query runs once for each,
+ * concurrently.
+ *
+ * @param[in]  conn         An open iRODS connection.
+ * @param[in]  query        A JSON query specification which includes the
+ *                          SQL query and optionally input arguments, or
+ *                          an array of argument tuples.
+ * @param[in]  zone_name    An iRODS zone name. Optional, NULL means the current
+ *                          zone.
+ * @param[in]  num_threads  The number of argument tuples to run at once,
+ *                          each thread with its own connection. 0 runs
+ *                          them in turn on conn.
+ * @param[out] error        An error report struct.
+ *
+ * @return A newly constructed JSON array of JSON result objects.
+ */
+json_t *search_specific_concurrent(rcComm_t *conn, json_t *query,
+                                   char *zone_name, size_t num_threads,
+                                   baton_error_t *error);
+
 /**
  * Modify the access control list of a resolved iRODS path.
  *
@@ -0,0 +1,239 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file buffer_pool.c
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "config.h"
+#include "buffer_pool.h"
+#include "log.h"
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+// Buffers are mapped directly, rather than by malloc, so that they
+// are page-aligned and so that releasing one to the pool never
+// returns its pages to the kernel.
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t released;
+    size_t limit;
+    int huge_pages;
+    void *idle[BUFFER_POOL_NUM_CLASSES][BUFFER_POOL_MAX_IDLE];
+    size_t num_idle[BUFFER_POOL_NUM_CLASSES];
+    size_t num_leased;
+    size_t leased_bytes;
+    size_t idle_bytes;
+    size_t leases;
+    size_t allocations;
+    size_t waits;
+} pool = { .mutex    = PTHREAD_MUTEX_INITIALIZER,
+           .released = PTHREAD_COND_INITIALIZER,
+           .limit    = BUFFER_POOL_DEFAULT_LIMIT };
+
+static int size_class(size_t size) {
+    int cls = 0;
+    while (cls < BUFFER_POOL_NUM_CLASSES &&
+           ((size_t) 1 << (BUFFER_POOL_MIN_SHIFT + cls)) < size) {
+        cls++;
+    }
+
+    return cls < BUFFER_POOL_NUM_CLASSES ? cls : -1;
+}
+
+static size_t class_size(int cls) {
+    return (size_t) 1 << (BUFFER_POOL_MIN_SHIFT + cls);
+}
+
+static int over_limit(size_t size) {
+    return pool.limit > 0 &&
+        pool.leased_bytes + pool.idle_bytes + size > pool.limit;
+}
+
+// Unmap one idle buffer, taking the largest first. Returns 0 if
+// there are none. Call with the pool mutex held.
+static int evict_idle(void) {
+    for (int cls = BUFFER_POOL_NUM_CLASSES - 1; cls >= 0; cls--) {
+        if (pool.num_idle[cls] > 0) {
+            void *buffer = pool.idle[cls][--pool.num_idle[cls]];
+            munmap(buffer, class_size(cls));
+            pool.idle_bytes -= class_size(cls);
+
+            logmsg(DEBUG, "Evicted an idle %zu byte transfer buffer",
+                   class_size(cls));
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void *lease_buffer(size_t size, baton_error_t *error) {
+    void *buffer = NULL;
+
+    init_baton_error(error);
+
+    int cls = size_class(size);
+    if (size == 0 || cls < 0) {
+        set_baton_error(error, -1, "Invalid transfer buffer size %zu", size);
+        return NULL;
+    }
+
+    size_t csize = class_size(cls);
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.leases++;
+
+    if (pool.num_idle[cls] > 0) {
+        buffer = pool.idle[cls][--pool.num_idle[cls]];
+        pool.idle_bytes   -= csize;
+        pool.leased_bytes += csize;
+        pool.num_leased++;
+        pthread_mutex_unlock(&pool.mutex);
+
+        return buffer;
+    }
+
+    int waited = 0;
+    while (over_limit(csize)) {
+        if (evict_idle()) continue;
+        // A lease larger than the limit is granted when it is the
+        // only one, so that a transfer is never refused outright
+        if (pool.num_leased == 0) break;
+
+        if (!waited) pool.waits++;
+        waited = 1;
+        pthread_cond_wait(&pool.released, &pool.mutex);
+
+        // Another lease of this class may have been released to
+        // the pool while waiting
+        if (pool.num_idle[cls] > 0) {
+            buffer = pool.idle[cls][--pool.num_idle[cls]];
+            pool.idle_bytes -= csize;
+            break;
+        }
+    }
+
+    // Reserve the bytes before mapping, outside the mutex
+    pool.leased_bytes += csize;
+    pool.num_leased++;
+    if (!buffer) pool.allocations++;
+    int huge_pages = pool.huge_pages;
+    pthread_mutex_unlock(&pool.mutex);
+
+    if (buffer) return buffer;
+
+    buffer = mmap(NULL, csize, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+        int errsv = errno;
+        set_baton_error(error, -1, "Failed to map a %zu byte transfer "
+                        "buffer: error %d %s", csize, errsv, strerror(errsv));
+
+        pthread_mutex_lock(&pool.mutex);
+        pool.leased_bytes -= csize;
+        pool.num_leased--;
+        pthread_cond_broadcast(&pool.released);
+        pthread_mutex_unlock(&pool.mutex);
+
+        return NULL;
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (huge_pages && csize >= BUFFER_POOL_HUGE_PAGE_SIZE) {
+        if (madvise(buffer, csize, MADV_HUGEPAGE) != 0) {
+            logmsg(DEBUG, "Failed to advise huge pages for a %zu byte "
+                   "transfer buffer: error %d %s",
+                   csize, errno, strerror(errno));
+        }
+    }
+#else
+    (void) huge_pages;
+#endif
+
+    logmsg(DEBUG, "Mapped a %zu byte transfer buffer", csize);
+
+    return buffer;
+}
+
+void release_buffer(void *buffer, size_t size) {
+    if (!buffer) return;
+
+    int cls = size_class(size);
+    if (cls < 0) return;
+
+    size_t csize = class_size(cls);
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.leased_bytes -= csize;
+    pool.num_leased--;
+
+    if (pool.num_idle[cls] < BUFFER_POOL_MAX_IDLE && !over_limit(csize)) {
+        pool.idle[cls][pool.num_idle[cls]++] = buffer;
+        pool.idle_bytes += csize;
+    }
+    else {
+        munmap(buffer, csize);
+    }
+
+    pthread_cond_broadcast(&pool.released);
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+void set_buffer_pool_limit(size_t limit) {
+    pthread_mutex_lock(&pool.mutex);
+    pool.limit = limit;
+    while (over_limit(0) && evict_idle());
+
+    pthread_cond_broadcast(&pool.released);
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+void set_buffer_pool_huge_pages(int huge_pages) {
+    pthread_mutex_lock(&pool.mutex);
+    pool.huge_pages = huge_pages;
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+void get_buffer_pool_stats(buffer_pool_stats_t *stats) {
+    pthread_mutex_lock(&pool.mutex);
+    stats->leases       = pool.leases;
+    stats->allocations  = pool.allocations;
+    stats->waits        = pool.waits;
+    stats->leased_bytes = pool.leased_bytes;
+    stats->idle_bytes   = pool.idle_bytes;
+    stats->limit        = pool.limit;
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+void drain_buffer_pool(void) {
+    pthread_mutex_lock(&pool.mutex);
+    while (evict_idle());
+
+    pool.leases      = 0;
+    pool.allocations = 0;
+    pool.waits       = 0;
+
+    pthread_cond_broadcast(&pool.released);
+    pthread_mutex_unlock(&pool.mutex);
+}
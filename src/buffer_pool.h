@@ -0,0 +1,124 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file buffer_pool.h
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#ifndef _BATON_BUFFER_POOL_H
+#define _BATON_BUFFER_POOL_H
+
+#include <stddef.h>
+
+#include "config.h"
+#include "error.h"
+
+/** The log2 of the smallest buffer size class, one 4 KiB page. */
+#define BUFFER_POOL_MIN_SHIFT   12
+
+/** The number of buffer size classes, each double the last. */
+#define BUFFER_POOL_NUM_CLASSES 32
+
+/** The number of idle buffers kept for reuse in each size class. */
+#define BUFFER_POOL_MAX_IDLE    64
+
+/** The default limit on the memory held by the pool, in bytes. */
+#define BUFFER_POOL_DEFAULT_LIMIT (512 * 1024 * 1024UL)
+
+/** The size from which buffers may be backed by huge pages. */
+#define BUFFER_POOL_HUGE_PAGE_SIZE (2 * 1024 * 1024UL)
+
+/**
+ *  @struct buffer_pool_stats
+ *  @brief Counters describing the use of the transfer buffer pool.
+ */
+typedef struct buffer_pool_stats {
+    /** The number of buffers leased. */
+    size_t leases;
+    /** The number of leases that mapped fresh memory. */
+    size_t allocations;
+    /** The number of leases that waited for another to be released. */
+    size_t waits;
+    /** The number of bytes currently leased. */
+    size_t leased_bytes;
+    /** The number of bytes held idle for reuse. */
+    size_t idle_bytes;
+    /** The limit on leased and idle bytes. 0 means unbounded. */
+    size_t limit;
+} buffer_pool_stats_t;
+
+/**
+ * Lease a page-aligned transfer buffer of at least the given size
+ * from the process-wide pool. Buffer sizes are rounded up to a power
+ * of two and released buffers are kept for reuse by later leases of
+ * the same size class, so that repeated transfers do not map fresh
+ * memory or take fresh page faults.
+ *
+ * When leasing would take the pool over its limit, idle buffers are
+ * unmapped and, if that is not enough, the caller waits until other
+ * leases are released. A lease is always granted when no others are
+ * outstanding, so a thread must hold at most one lease at a time.
+ *
+ * The buffer content is not initialised.
+ *
+ * @param[in]  size       The minimum buffer size, in bytes.
+ * @param[out] error      An error report struct.
+ *
+ * @return A buffer, to be returned with release_buffer, or NULL on
+ * error.
+ */
+void *lease_buffer(size_t size, baton_error_t *error);
+
+/**
+ * Return a leased buffer to the pool.
+ *
+ * @param[in]  buffer     A buffer from lease_buffer. May be NULL.
+ * @param[in]  size       The size with which the buffer was leased.
+ */
+void release_buffer(void *buffer, size_t size);
+
+/**
+ * Set the limit on the memory held by the pool in leased and idle
+ * buffers, shared by all concurrent transfers. Idle buffers are
+ * unmapped to bring the pool within the new limit.
+ *
+ * @param[in]  limit      The limit in bytes. 0 means unbounded.
+ */
+void set_buffer_pool_limit(size_t limit);
+
+/**
+ * Set whether buffers of BUFFER_POOL_HUGE_PAGE_SIZE and larger are
+ * advised to be backed by transparent huge pages, where the platform
+ * supports it. This applies to buffers mapped subsequently.
+ *
+ * @param[in]  huge_pages  1 to use huge pages, 0 otherwise.
+ */
+void set_buffer_pool_huge_pages(int huge_pages);
+
+/**
+ * Copy the current counters of the pool.
+ *
+ * @param[out] stats      A struct to receive the counters.
+ */
+void get_buffer_pool_stats(buffer_pool_stats_t *stats);
+
+/**
+ * Unmap all idle buffers in the pool and reset its counters. Leased
+ * buffers are unaffected.
+ */
+void drain_buffer_pool(void);
+
+#endif // _BATON_BUFFER_POOL_H
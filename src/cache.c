@@ -0,0 +1,642 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file cache.c
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#include "config.h"
+#include "cache.h"
+
+#define CACHE_COPY_BUFFER_SIZE (1024 * 64)
+
+// Temporary files older than this are assumed to have been abandoned
+// by a process that exited during a transfer
+#define CACHE_TMP_MAX_AGE (60 * 60 * 24)
+
+typedef struct cache_entry {
+    char name[MAX_CACHE_KEY_LEN];
+    time_t atime;
+    size_t size;
+} cache_entry_t;
+
+static int compare_entry_atime(const void *a, const void *b) {
+    const cache_entry_t *ea = a;
+    const cache_entry_t *eb = b;
+
+    if (ea->atime < eb->atime) return -1;
+    if (ea->atime > eb->atime) return 1;
+
+    return strncmp(ea->name, eb->name, MAX_CACHE_KEY_LEN);
+}
+
+static int cache_path(const local_cache_t *cache, const char *name,
+                      char *path, size_t path_len, baton_error_t *error) {
+    int len = snprintf(path, path_len, "%s/%s", cache->dir, name);
+    if (len < 0 || (size_t) len >= path_len) {
+        set_baton_error(error, USER_PATH_EXCEEDS_MAX,
+                        "Cache path for '%s' in '%s' exceeds the maximum "
+                        "length of %zu", name, cache->dir, path_len);
+    }
+
+    return error->code;
+}
+
+// Returns a file descriptor holding the lock, or -1 on error. Closing
+// the descriptor releases the lock.
+static int lock_cache(const local_cache_t *cache, int operation,
+                      baton_error_t *error) {
+    char path[PATH_MAX];
+    int fd = -1;
+
+    if (mkdir(cache->dir, 0777) != 0 && errno != EEXIST) {
+        set_baton_error(error, errno,
+                        "Failed to create cache directory '%s': error %d %s",
+                        cache->dir, errno, strerror(errno));
+        goto error;
+    }
+
+    cache_path(cache, CACHE_LOCK_FILE, path, sizeof path, error);
+    if (error->code != 0) goto error;
+
+    fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+        set_baton_error(error, errno,
+                        "Failed to open cache lock '%s': error %d %s",
+                        path, errno, strerror(errno));
+        goto error;
+    }
+
+    int status;
+    do {
+        status = flock(fd, operation);
+    } while (status != 0 && errno == EINTR);
+
+    if (status != 0) {
+        set_baton_error(error, errno,
+                        "Failed to lock cache '%s': error %d %s",
+                        cache->dir, errno, strerror(errno));
+        goto error;
+    }
+
+    return fd;
+
+error:
+    if (fd >= 0) close(fd);
+
+    return -1;
+}
+
+// Copy a file, sharing its extents when the filesystem supports it
+static int clone_file(const char *from, const char *to,
+                      baton_error_t *error) {
+    char *buffer = NULL;
+    int in  = -1;
+    int out = -1;
+
+    in = open(from, O_RDONLY);
+    if (in < 0) {
+        set_baton_error(error, errno,
+                        "Failed to open '%s' for reading: error %d %s",
+                        from, errno, strerror(errno));
+        goto error;
+    }
+
+    out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out < 0) {
+        set_baton_error(error, errno,
+                        "Failed to open '%s' for writing: error %d %s",
+                        to, errno, strerror(errno));
+        goto error;
+    }
+
+#ifdef FICLONE
+    if (ioctl(out, FICLONE, in) == 0) {
+        logmsg(DEBUG, "Reflinked '%s' to '%s'", from, to);
+        goto finally;
+    }
+#endif
+
+    buffer = malloc(CACHE_COPY_BUFFER_SIZE);
+    if (!buffer) {
+        set_baton_error(error, errno, "Failed to allocate memory: error %d %s",
+                        errno, strerror(errno));
+        goto error;
+    }
+
+    ssize_t nr;
+    while ((nr = read(in, buffer, CACHE_COPY_BUFFER_SIZE)) != 0) {
+        if (nr < 0) {
+            if (errno == EINTR) continue;
+            set_baton_error(error, errno,
+                            "Failed to read from '%s': error %d %s",
+                            from, errno, strerror(errno));
+            goto error;
+        }
+
+        ssize_t offset = 0;
+        while (offset < nr) {
+            ssize_t nw = write(out, buffer + offset, nr - offset);
+            if (nw < 0) {
+                if (errno == EINTR) continue;
+                set_baton_error(error, errno,
+                                "Failed to write to '%s': error %d %s",
+                                to, errno, strerror(errno));
+                goto error;
+            }
+            offset += nw;
+        }
+    }
+
+    logmsg(DEBUG, "Copied '%s' to '%s'", from, to);
+
+finally:
+    if (buffer) free(buffer);
+    close(in);
+    if (close(out) != 0) {
+        set_baton_error(error, errno, "Failed to close '%s': error %d %s",
+                        to, errno, strerror(errno));
+        unlink(to);
+    }
+
+    return error->code;
+
+error:
+    if (buffer)  free(buffer);
+    if (in >= 0) close(in);
+    if (out >= 0) {
+        close(out);
+        unlink(to);
+    }
+
+    return error->code;
+}
+
+static int link_or_clone_file(const char *from, const char *to,
+                              baton_error_t *error) {
+    if (unlink(to) != 0 && errno != ENOENT) {
+        set_baton_error(error, errno,
+                        "Failed to replace '%s': error %d %s",
+                        to, errno, strerror(errno));
+        goto finally;
+    }
+
+    if (link(from, to) == 0) {
+        logmsg(DEBUG, "Hard-linked '%s' to '%s'", from, to);
+        goto finally;
+    }
+
+    if (errno != EXDEV && errno != EPERM && errno != EMLINK) {
+        set_baton_error(error, errno,
+                        "Failed to link '%s' to '%s': error %d %s",
+                        from, to, errno, strerror(errno));
+        goto finally;
+    }
+
+    clone_file(from, to, error);
+
+finally:
+    return error->code;
+}
+
+// Move a complete temporary file into the cache and optionally place
+// it at a destination while holding the lock, so that it cannot be
+// evicted in between
+static int commit_entry(const local_cache_t *cache, const char *tmp_path,
+                        const char *key, const char *local_path,
+                        baton_error_t *error) {
+    char path[PATH_MAX];
+    int lock_fd = -1;
+
+    cache_path(cache, key, path, sizeof path, error);
+    if (error->code != 0) goto finally;
+
+    if (chmod(tmp_path, 0444) != 0) {
+        set_baton_error(error, errno,
+                        "Failed to make '%s' read-only: error %d %s",
+                        tmp_path, errno, strerror(errno));
+        goto finally;
+    }
+
+    lock_fd = lock_cache(cache, LOCK_EX, error);
+    if (error->code != 0) goto finally;
+
+    if (rename(tmp_path, path) != 0) {
+        set_baton_error(error, errno,
+                        "Failed to add '%s' to the cache: error %d %s",
+                        path, errno, strerror(errno));
+        goto finally;
+    }
+
+    logmsg(DEBUG, "Added '%s' to the cache", path);
+
+    if (local_path) {
+        link_or_clone_file(path, local_path, error);
+        if (error->code != 0) goto finally;
+    }
+
+    close(lock_fd);
+    lock_fd = -1;
+
+    cache_evict(cache, error);
+
+finally:
+    if (lock_fd >= 0) close(lock_fd);
+
+    return error->code;
+}
+
+static int make_tmp_file(const local_cache_t *cache, char *tmp_path,
+                         size_t path_len, baton_error_t *error) {
+    int fd = -1;
+
+    cache_path(cache, CACHE_TMP_PREFIX "XXXXXX", tmp_path, path_len, error);
+    if (error->code != 0) goto finally;
+
+    fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        set_baton_error(error, errno,
+                        "Failed to create a temporary file in '%s': "
+                        "error %d %s", cache->dir, errno, strerror(errno));
+        tmp_path[0] = '\0';
+    }
+
+finally:
+    return fd;
+}
+
+int cache_key(const char *checksum, char *key, size_t key_len,
+              baton_error_t *error) {
+    init_baton_error(error);
+
+    size_t len = strnlen(checksum, key_len);
+    if (len == 0) {
+        set_baton_error(error, CAT_INVALID_ARGUMENT,
+                        "Cannot make a cache key from an empty checksum");
+        goto finally;
+    }
+    if (len >= key_len) {
+        set_baton_error(error, CAT_INVALID_ARGUMENT,
+                        "Cannot make a cache key from a checksum longer "
+                        "than %zu characters", key_len - 1);
+        goto finally;
+    }
+    if (!isalnum((unsigned char) checksum[0])) {
+        set_baton_error(error, CAT_INVALID_ARGUMENT,
+                        "Cannot make a cache key from checksum '%s'",
+                        checksum);
+        goto finally;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        char c = checksum[i];
+
+        if (isalnum((unsigned char) c) || c == ':' || c == '=' ||
+            c == '-' || c == '_') {
+            key[i] = c;
+        }
+        else if (c == '/') {
+            key[i] = '_';
+        }
+        else if (c == '+') {
+            key[i] = '-';
+        }
+        else {
+            set_baton_error(error, CAT_INVALID_ARGUMENT,
+                            "Cannot make a cache key from checksum '%s'",
+                            checksum);
+            goto finally;
+        }
+    }
+    key[len] = '\0';
+
+finally:
+    return error->code;
+}
+
+int cache_fetch(const local_cache_t *cache, const char *checksum,
+                const char *local_path, baton_error_t *error) {
+    char key[MAX_CACHE_KEY_LEN];
+    char path[PATH_MAX];
+    int lock_fd = -1;
+    int hit     = 0;
+
+    init_baton_error(error);
+
+    cache_key(checksum, key, sizeof key, error);
+    if (error->code != 0) goto finally;
+
+    cache_path(cache, key, path, sizeof path, error);
+    if (error->code != 0) goto finally;
+
+    lock_fd = lock_cache(cache, LOCK_SH, error);
+    if (error->code != 0) goto finally;
+
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        if (errno != ENOENT) {
+            set_baton_error(error, errno,
+                            "Failed to stat cache entry '%s': error %d %s",
+                            path, errno, strerror(errno));
+        }
+        goto finally;
+    }
+
+    link_or_clone_file(path, local_path, error);
+    if (error->code != 0) goto finally;
+
+    // Only the access time is updated to mark the entry as recently
+    // used, leaving the modification time of the content unchanged
+    struct timespec times[2] = { { .tv_sec = 0, .tv_nsec = UTIME_NOW  },
+                                 { .tv_sec = 0, .tv_nsec = UTIME_OMIT } };
+    if (utimensat(AT_FDCWD, path, times, 0) != 0) {
+        logmsg(DEBUG, "Failed to update the access time of '%s': "
+               "error %d %s", path, errno, strerror(errno));
+    }
+
+    hit = 1;
+
+finally:
+    if (lock_fd >= 0) close(lock_fd);
+
+    return hit;
+}
+
+int cache_add(const local_cache_t *cache, const char *checksum,
+              const char *local_path, baton_error_t *error) {
+    char key[MAX_CACHE_KEY_LEN];
+    char tmp_path[PATH_MAX] = "";
+
+    init_baton_error(error);
+
+    cache_key(checksum, key, sizeof key, error);
+    if (error->code != 0) goto finally;
+
+    int lock_fd = lock_cache(cache, LOCK_SH, error); // Creates the directory
+    if (error->code != 0) goto finally;
+    close(lock_fd);
+
+    int fd = make_tmp_file(cache, tmp_path, sizeof tmp_path, error);
+    if (error->code != 0) goto finally;
+    close(fd);
+
+    // The file is copied rather than linked because the cache entry
+    // is made read-only, which would also affect the caller's file
+    clone_file(local_path, tmp_path, error);
+    if (error->code != 0) goto finally;
+
+    commit_entry(cache, tmp_path, key, NULL, error);
+    if (error->code != 0) goto finally;
+
+    tmp_path[0] = '\0';
+
+finally:
+    if (tmp_path[0] != '\0') unlink(tmp_path);
+
+    return error->code;
+}
+
+size_t cache_evict(const local_cache_t *cache, baton_error_t *error) {
+    cache_entry_t *entries = NULL;
+    DIR *dir               = NULL;
+    size_t num_entries     = 0;
+    size_t capacity        = 0;
+    size_t total_size      = 0;
+    size_t num_removed     = 0;
+    int lock_fd            = -1;
+
+    init_baton_error(error);
+
+    lock_fd = lock_cache(cache, LOCK_EX, error);
+    if (error->code != 0) goto finally;
+
+    dir = opendir(cache->dir);
+    if (!dir) {
+        set_baton_error(error, errno,
+                        "Failed to open cache directory '%s': error %d %s",
+                        cache->dir, errno, strerror(errno));
+        goto finally;
+    }
+
+    time_t now = time(NULL);
+    struct dirent *dent;
+    while ((dent = readdir(dir))) {
+        const char *name = dent->d_name;
+        struct stat st;
+
+        if (name[0] == '.') {
+            if (str_starts_with(name, CACHE_TMP_PREFIX, MAX_CACHE_KEY_LEN) &&
+                fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                now - st.st_mtime > CACHE_TMP_MAX_AGE) {
+                logmsg(NOTICE, "Removing abandoned cache file '%s/%s'",
+                       cache->dir, name);
+                unlinkat(dirfd(dir), name, 0);
+            }
+            continue;
+        }
+
+        if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+            !S_ISREG(st.st_mode)) continue;
+        if (strnlen(name, MAX_CACHE_KEY_LEN) >= MAX_CACHE_KEY_LEN) continue;
+
+        if (num_entries == capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 64;
+            cache_entry_t *tmp = realloc(entries, new_capacity *
+                                         sizeof (cache_entry_t));
+            if (!tmp) {
+                set_baton_error(error, errno,
+                                "Failed to allocate memory: error %d %s",
+                                errno, strerror(errno));
+                goto finally;
+            }
+            entries  = tmp;
+            capacity = new_capacity;
+        }
+
+        cache_entry_t *entry = &entries[num_entries++];
+        snprintf(entry->name, MAX_CACHE_KEY_LEN, "%s", name);
+        entry->atime = st.st_atime;
+        entry->size  = st.st_size;
+        total_size += entry->size;
+    }
+
+    logmsg(DEBUG, "Cache '%s' has %zu entries totalling %zu bytes",
+           cache->dir, num_entries, total_size);
+
+    if (cache->max_size == 0 || total_size <= cache->max_size) goto finally;
+
+    qsort(entries, num_entries, sizeof (cache_entry_t), compare_entry_atime);
+
+    for (size_t i = 0; i < num_entries && total_size > cache->max_size; i++) {
+        if (unlinkat(dirfd(dir), entries[i].name, 0) != 0) {
+            logmsg(WARN, "Failed to evict '%s/%s': error %d %s",
+                   cache->dir, entries[i].name, errno, strerror(errno));
+            continue;
+        }
+
+        logmsg(DEBUG, "Evicted '%s/%s' of %zu bytes",
+               cache->dir, entries[i].name, entries[i].size);
+        total_size -= entries[i].size;
+        num_removed++;
+    }
+
+    logmsg(NOTICE, "Evicted %zu entries from cache '%s'",
+           num_removed, cache->dir);
+
+finally:
+    if (dir)          closedir(dir);
+    if (entries)      free(entries);
+    if (lock_fd >= 0) close(lock_fd);
+
+    return num_removed;
+}
+
+int get_data_obj_file_cached(rcComm_t *conn, rodsPath_t *rods_path,
+                             const char *local_path, size_t buffer_size,
+                             const local_cache_t *cache,
+                             baton_error_t *error) {
+    char key[MAX_CACHE_KEY_LEN];
+    char tmp_path[PATH_MAX]   = "";
+    data_obj_file_t *obj_file = NULL;
+    json_t *jchecksum         = NULL;
+    FILE *stream              = NULL;
+    int fd                    = -1;
+
+    init_baton_error(error);
+
+    if (buffer_size == 0) {
+        set_baton_error(error, -1, "Invalid buffer_size argument %zu",
+                        buffer_size);
+        goto finally;
+    }
+
+    if (rods_path->objType != DATA_OBJ_T) {
+        set_baton_error(error, USER_INPUT_PATH_ERR,
+                        "Cannot write the contents of '%s' because "
+                        "it is not a data object", rods_path->outPath);
+        goto finally;
+    }
+
+    jchecksum = list_checksum(conn, rods_path, error);
+    if (error->code != 0) goto finally;
+
+    if (!json_is_string(jchecksum)) {
+        logmsg(NOTICE, "'%s' has no checksum in the catalogue; "
+               "bypassing the cache", rods_path->outPath);
+        get_data_obj_file(conn, rods_path, local_path, buffer_size, error);
+        goto finally;
+    }
+
+    const char *checksum = json_string_value(jchecksum);
+
+    cache_key(checksum, key, sizeof key, error);
+    if (error->code != 0) goto finally;
+
+    if (cache_fetch(cache, checksum, local_path, error)) {
+        logmsg(NOTICE, "Cache hit for '%s' having checksum '%s'",
+               rods_path->outPath, checksum);
+        goto finally;
+    }
+    if (error->code != 0) goto finally;
+
+    logmsg(NOTICE, "Cache miss for '%s' having checksum '%s'",
+           rods_path->outPath, checksum);
+
+    fd = make_tmp_file(cache, tmp_path, sizeof tmp_path, error);
+    if (error->code != 0) goto finally;
+
+    stream = fdopen(fd, "w");
+    if (!stream) {
+        set_baton_error(error, errno,
+                        "Failed to open '%s' for writing: error %d %s",
+                        tmp_path, errno, strerror(errno));
+        goto finally;
+    }
+    fd = -1;
+
+    obj_file = open_data_obj(conn, rods_path, O_RDONLY, 0, error);
+    if (error->code != 0) goto finally;
+
+    // Hash with the scheme of the key, so that the content can be
+    // checked against it
+    digest_scheme scheme = checksum_scheme(checksum);
+    if (scheme != DIGEST_UNKNOWN) obj_file->scheme = scheme;
+
+    read_data_obj(conn, obj_file, stream, buffer_size, error);
+    int status = close_data_obj(conn, obj_file);
+
+    if (error->code != 0) goto finally;
+    if (status < 0) {
+        char *err_subname;
+        const char *err_name = rodsErrorName(status, &err_subname);
+        set_baton_error(error, status,
+                        "Failed to close data object: '%s' error %d %s",
+                        rods_path->outPath, status, err_name);
+        goto finally;
+    }
+
+    status = fclose(stream);
+    stream = NULL;
+    if (status != 0) {
+        set_baton_error(error, errno,
+                        "Failed to close '%s': error %d %s",
+                        tmp_path, errno, strerror(errno));
+        goto finally;
+    }
+
+    // Never admit content to the cache that does not match its key
+    if (scheme != DIGEST_UNKNOWN &&
+        !checksum_equals(obj_file->checksum_last_read, checksum)) {
+        set_baton_error(error, USER_CHKSUM_MISMATCH,
+                        "Checksum mismatch for '%s': read %s but the "
+                        "catalogue has %s", rods_path->outPath,
+                        obj_file->checksum_last_read, checksum);
+        goto finally;
+    }
+
+    commit_entry(cache, tmp_path, key, local_path, error);
+    if (error->code != 0) goto finally;
+
+    tmp_path[0] = '\0';
+
+finally:
+    if (stream)            fclose(stream);
+    if (fd >= 0)           close(fd);
+    if (tmp_path[0] != '\0') unlink(tmp_path);
+    if (obj_file)          free_data_obj(obj_file);
+    if (jchecksum)         json_decref(jchecksum);
+
+    return error->code;
+}
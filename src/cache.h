@@ -0,0 +1,134 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file cache.h
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#ifndef _BATON_CACHE_H
+#define _BATON_CACHE_H
+
+#include <rodsClient.h>
+
+#include "config.h"
+#include "error.h"
+#include "read.h"
+
+#define MAX_CACHE_KEY_LEN 256
+
+#define CACHE_LOCK_FILE  ".lock"
+#define CACHE_TMP_PREFIX ".tmp."
+
+/**
+ *  @struct local_cache
+ *  @brief A local directory of data object content, keyed by checksum.
+ *
+ *  Each entry is a read-only file named for the catalogue checksum of
+ *  the data object whose content it holds. Entries are hard-linked
+ *  (or reflinked, or copied when neither is possible) to their
+ *  destinations, so destination files sharing an entry are also
+ *  read-only.
+ *
+ *  The cache is safe for concurrent use by several processes. Entries
+ *  are added by renaming complete files into the cache directory and
+ *  an advisory flock(2) lock on CACHE_LOCK_FILE serialises additions
+ *  and evictions.
+ */
+typedef struct local_cache {
+    /** The cache directory. */
+    const char *dir;
+    /** The size above which least recently used entries are evicted,
+        in bytes. 0 means unbounded. */
+    size_t max_size;
+} local_cache_t;
+
+/**
+ * Derive a cache entry name from a catalogue checksum. The characters
+ * of base64 encoded checksums that are not safe in file names are
+ * mapped to safe ones.
+ *
+ * @param[in]  checksum  A checksum string.
+ * @param[out] key       A buffer to receive the entry name.
+ * @param[in]  key_len   The length of the buffer.
+ * @param[out] error     An error report struct.
+ *
+ * @return 0 on success, iRODS error code on failure.
+ */
+int cache_key(const char *checksum, char *key, size_t key_len,
+              baton_error_t *error);
+
+/**
+ * Place the cached content for a checksum at a local path, if the
+ * cache has it. A hit marks the entry as most recently used.
+ *
+ * @param[in]  cache       A local cache.
+ * @param[in]  checksum    The checksum of the content.
+ * @param[in]  local_path  The destination file path.
+ * @param[out] error       An error report struct.
+ *
+ * @return 1 on a hit, 0 on a miss or error.
+ */
+int cache_fetch(const local_cache_t *cache, const char *checksum,
+                const char *local_path, baton_error_t *error);
+
+/**
+ * Add a local file to the cache under a checksum, then evict entries
+ * to bring the cache within its size bound. The caller is
+ * responsible for the checksum being correct for the file.
+ *
+ * @param[in]  cache       A local cache.
+ * @param[in]  checksum    The checksum of the file.
+ * @param[in]  local_path  The file path.
+ * @param[out] error       An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int cache_add(const local_cache_t *cache, const char *checksum,
+              const char *local_path, baton_error_t *error);
+
+/**
+ * Remove least recently used entries until the cache is within its
+ * size bound. Abandoned temporary files are also removed.
+ *
+ * @param[in]  cache       A local cache.
+ * @param[out] error       An error report struct.
+ *
+ * @return The number of entries removed.
+ */
+size_t cache_evict(const local_cache_t *cache, baton_error_t *error);
+
+/**
+ * Get a data object to a local file through a local cache. On a miss
+ * the data object is read into the cache, its MD5 compared with the
+ * catalogue checksum (when that is an MD5), and the new entry placed
+ * at the local path. Data objects without a catalogue checksum bypass
+ * the cache.
+ *
+ * @param[in]  conn        An open iRODS connection.
+ * @param[in]  rods_path   An iRODS data object path.
+ * @param[in]  local_path  The destination file path.
+ * @param[in]  buffer_size The number of bytes to copy at one time.
+ * @param[in]  cache       A local cache.
+ * @param[out] error       An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int get_data_obj_file_cached(rcComm_t *conn, rodsPath_t *rods_path,
+                             const char *local_path, size_t buffer_size,
+                             const local_cache_t *cache,
+                             baton_error_t *error);
+
+#endif // _BATON_CACHE_H
@@ -0,0 +1,210 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file checkpoint.c
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <jansson.h>
+
+#include "config.h"
+#include "checkpoint.h"
+#include "log.h"
+
+int write_checkpoint(checkpoint_t *checkpoint, baton_error_t *error) {
+    char tmp_path[PATH_MAX];
+    FILE *stream = NULL;
+    json_t *json = NULL;
+    int fd       = -1;
+
+    init_baton_error(error);
+
+    int n = snprintf(tmp_path, sizeof tmp_path, "%s.XXXXXX",
+                     checkpoint->path);
+    if (n < 0 || (size_t) n >= sizeof tmp_path) {
+        set_baton_error(error, -1, "Checkpoint file name '%s' is too long",
+                        checkpoint->path);
+        tmp_path[0] = '\0';
+        goto finally;
+    }
+
+    json = json_pack("{s:I, s:I}",
+                     JSON_CHECKPOINT_OFFSET_KEY,
+                     (json_int_t) checkpoint->offset,
+                     JSON_CHECKPOINT_SEQUENCE_KEY,
+                     (json_int_t) checkpoint->sequence);
+    if (!json) {
+        set_baton_error(error, -1, "Failed to pack checkpoint");
+        tmp_path[0] = '\0';
+        goto finally;
+    }
+
+    // Write beside the checkpoint and rename over it, so that a reader
+    // sees either the old checkpoint or the new one
+    fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        set_baton_error(error, errno,
+                        "Failed to create a temporary file for checkpoint "
+                        "'%s': error %d %s", checkpoint->path,
+                        errno, strerror(errno));
+        tmp_path[0] = '\0';
+        goto finally;
+    }
+
+    stream = fdopen(fd, "w");
+    if (!stream) {
+        set_baton_error(error, errno,
+                        "Failed to open '%s' for writing: error %d %s",
+                        tmp_path, errno, strerror(errno));
+        goto finally;
+    }
+    fd = -1;
+
+    int status = json_dumpf(json, stream, JSON_COMPACT);
+    if (status == 0) status = fputc('\n', stream) == EOF ? -1 : 0;
+    if (status == 0) status = fflush(stream);
+    if (status == 0) status = fsync(fileno(stream));
+    if (status != 0) {
+        set_baton_error(error, errno,
+                        "Failed to write checkpoint '%s': error %d %s",
+                        tmp_path, errno, strerror(errno));
+        goto finally;
+    }
+
+    status = fclose(stream);
+    stream = NULL;
+    if (status != 0) {
+        set_baton_error(error, errno, "Failed to close '%s': error %d %s",
+                        tmp_path, errno, strerror(errno));
+        goto finally;
+    }
+
+    if (rename(tmp_path, checkpoint->path) != 0) {
+        set_baton_error(error, errno,
+                        "Failed to replace checkpoint '%s': error %d %s",
+                        checkpoint->path, errno, strerror(errno));
+        goto finally;
+    }
+    tmp_path[0] = '\0';
+
+    checkpoint->written    = checkpoint->sequence;
+    checkpoint->last_write = time(NULL);
+
+    logmsg(DEBUG, "Checkpoint at item %zu, offset %ld",
+           checkpoint->sequence, checkpoint->offset);
+
+finally:
+    if (stream)      fclose(stream);
+    if (fd >= 0)     close(fd);
+    if (tmp_path[0]) unlink(tmp_path);
+    if (json)        json_decref(json);
+
+    return error->code;
+}
+
+int checkpoint_due(checkpoint_t *checkpoint, int force) {
+    if (!checkpoint->path) return 0;
+    if (checkpoint->sequence == checkpoint->written) return 0;
+
+    return force ||
+        difftime(time(NULL), checkpoint->last_write) >= CHECKPOINT_INTERVAL;
+}
+
+int read_checkpoint(checkpoint_t *checkpoint, baton_error_t *error) {
+    json_t *json = NULL;
+
+    init_baton_error(error);
+
+    checkpoint->offset   = 0;
+    checkpoint->sequence = 0;
+
+    if (access(checkpoint->path, F_OK) != 0) {
+        logmsg(NOTICE, "No checkpoint '%s'; starting from the beginning",
+               checkpoint->path);
+        goto finally;
+    }
+
+    json_error_t load_error;
+    json = json_load_file(checkpoint->path, 0, &load_error);
+    if (!json) {
+        set_baton_error(error, -1, "Failed to read checkpoint '%s': %s",
+                        checkpoint->path, load_error.text);
+        goto finally;
+    }
+
+    json_t *offset   = json_object_get(json, JSON_CHECKPOINT_OFFSET_KEY);
+    json_t *sequence = json_object_get(json, JSON_CHECKPOINT_SEQUENCE_KEY);
+    if (!json_is_integer(offset) || !json_is_integer(sequence) ||
+        json_integer_value(sequence) < 0) {
+        set_baton_error(error, -1, "Invalid checkpoint '%s'",
+                        checkpoint->path);
+        goto finally;
+    }
+
+    checkpoint->offset   = (long) json_integer_value(offset);
+    checkpoint->sequence = (size_t) json_integer_value(sequence);
+    checkpoint->written  = checkpoint->sequence;
+
+finally:
+    if (json) json_decref(json);
+
+    return error->code;
+}
+
+int resume_from_checkpoint(FILE *input, checkpoint_t *checkpoint,
+                           baton_error_t *error) {
+    read_checkpoint(checkpoint, error);
+    if (error->code != 0) goto finally;
+
+    if (checkpoint->sequence == 0) goto finally;
+
+    if (checkpoint->offset >= 0 &&
+        fseek(input, checkpoint->offset, SEEK_SET) == 0) {
+        logmsg(NOTICE, "Resuming after item %zu at offset %ld",
+               checkpoint->sequence, checkpoint->offset);
+        goto finally;
+    }
+
+    // The input is a pipe, or was not seekable when the checkpoint was
+    // written, so count items instead
+    logmsg(NOTICE, "Resuming after item %zu by skipping items",
+           checkpoint->sequence);
+
+    for (size_t i = 0; i < checkpoint->sequence; i++) {
+        size_t jflags = JSON_DISABLE_EOF_CHECK | JSON_REJECT_DUPLICATES;
+        json_error_t load_error;
+        json_t *item = json_loadf(input, jflags, &load_error);
+
+        if (!item && feof(input)) {
+            set_baton_error(error, -1, "Input ended after %zu of the %zu "
+                            "items recorded in checkpoint '%s'", i,
+                            checkpoint->sequence, checkpoint->path);
+            goto finally;
+        }
+        if (item) json_decref(item);
+    }
+
+    checkpoint->offset = ftell(input);
+
+finally:
+    return error->code;
+}
@@ -0,0 +1,103 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file checkpoint.h
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#ifndef _BATON_CHECKPOINT_H
+#define _BATON_CHECKPOINT_H
+
+#include <stdio.h>
+#include <time.h>
+
+#include "config.h"
+#include "error.h"
+
+#define JSON_CHECKPOINT_OFFSET_KEY   "offset"
+#define JSON_CHECKPOINT_SEQUENCE_KEY "sequence"
+
+/** The minimum interval in seconds between checkpoint writes. */
+#define CHECKPOINT_INTERVAL 5
+
+/**
+ *  @struct checkpoint
+ *  @brief The position in an input stream up to which all items have
+ *  been processed and their results printed.
+ */
+typedef struct checkpoint {
+    /** The checkpoint file, or NULL if checkpoints are not recorded. */
+    const char *path;
+    /** The byte offset in the input after the last item, or -1 if the
+        input is not seekable. */
+    long offset;
+    /** The number of items, counted from the start of the input. */
+    size_t sequence;
+    /** The sequence number last written to the file. */
+    size_t written;
+    /** The time of the last write. */
+    time_t last_write;
+} checkpoint_t;
+
+/**
+ * Write a checkpoint to its file, replacing the previous one
+ * atomically.
+ *
+ * @param[in]  checkpoint A checkpoint.
+ * @param[out] error      An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int write_checkpoint(checkpoint_t *checkpoint, baton_error_t *error);
+
+/**
+ * Return true if a checkpoint has a file and has advanced since it was
+ * last written, and either at least CHECKPOINT_INTERVAL seconds have
+ * passed since the last write, or force is true.
+ *
+ * @param[in]  checkpoint A checkpoint.
+ * @param[in]  force      Ignore the time since the last write.
+ *
+ * @return 1 if the checkpoint should be written, 0 otherwise.
+ */
+int checkpoint_due(checkpoint_t *checkpoint, int force);
+
+/**
+ * Read a checkpoint from its file. A missing file is not an error;
+ * the checkpoint is then the start of the input.
+ *
+ * @param[in,out] checkpoint A checkpoint with a path.
+ * @param[out]    error      An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int read_checkpoint(checkpoint_t *checkpoint, baton_error_t *error);
+
+/**
+ * Move an input stream to the position recorded in a checkpoint file,
+ * by seeking where the input allows it, otherwise by reading and
+ * discarding the items already processed.
+ *
+ * @param[in]     input      A file handle at the start of the input.
+ * @param[in,out] checkpoint A checkpoint with a path.
+ * @param[out]    error      An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int resume_from_checkpoint(FILE *input, checkpoint_t *checkpoint,
+                           baton_error_t *error);
+
+#endif // _BATON_CHECKPOINT_H
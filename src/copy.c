@@ -0,0 +1,740 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file copy.c
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "baton.h"
+#include "copy.h"
+
+typedef struct copy_entry {
+    char *path;
+    int is_coll;
+    /** The size given by the listing. */
+    uint64_t size;
+} copy_entry_t;
+
+typedef struct copy_scheduler {
+    const char *root;
+    const char *dest;
+    copy_in_t *copy_in;
+    option_flags flags;
+
+    copy_entry_t *entries;
+    size_t num_entries;
+
+    pthread_mutex_t mutex;
+    // The next data object to be claimed
+    size_t next;
+    // Set when the copy cannot continue
+    int cancelled;
+    baton_error_t cancel_error;
+
+    size_t num_copied;
+    size_t num_errors;
+    uint64_t num_bytes;
+} copy_scheduler_t;
+
+// Collections first, each before its contents, then data objects,
+// largest first
+static int compare_copy_order(const void *a, const void *b) {
+    const copy_entry_t *ea = a;
+    const copy_entry_t *eb = b;
+
+    if (ea->is_coll != eb->is_coll) return eb->is_coll - ea->is_coll;
+    if (ea->is_coll)                return strcmp(ea->path, eb->path);
+    if (ea->size != eb->size)       return ea->size < eb->size ? 1 : -1;
+
+    return strcmp(ea->path, eb->path);
+}
+
+static int add_copy_entry(copy_entry_t **entries, size_t *num_entries,
+                          size_t *capacity, const char *coll_name,
+                          const char *data_name, uint64_t size,
+                          baton_error_t *error) {
+    if (*num_entries == *capacity) {
+        size_t new_capacity = *capacity == 0 ? 1024 : *capacity * 2;
+        copy_entry_t *tmp = realloc(*entries, new_capacity *
+                                    sizeof (copy_entry_t));
+        if (!tmp) {
+            set_baton_error(error, errno, "Failed to allocate memory: "
+                            "error %d %s", errno, strerror(errno));
+            return error->code;
+        }
+
+        *entries  = tmp;
+        *capacity = new_capacity;
+    }
+
+    size_t len = strlen(coll_name) + (data_name ? strlen(data_name) + 1 : 0);
+    char *path = calloc(len + 1, sizeof (char));
+    if (!path) {
+        set_baton_error(error, errno, "Failed to allocate memory: "
+                        "error %d %s", errno, strerror(errno));
+        return error->code;
+    }
+
+    if (data_name) {
+        snprintf(path, len + 1, "%s/%s", coll_name, data_name);
+    }
+    else {
+        snprintf(path, len + 1, "%s", coll_name);
+    }
+
+    copy_entry_t *entry = &(*entries)[(*num_entries)++];
+    entry->path    = path;
+    entry->is_coll = data_name == NULL;
+    entry->size    = size;
+
+    return 0;
+}
+
+static void free_copy_entries(copy_entry_t *entries, size_t num_entries) {
+    for (size_t i = 0; i < num_entries; i++) {
+        free(entries[i].path);
+    }
+    free(entries);
+}
+
+// List a collection recursively, in one pass, returning its entries in
+// copy order
+static copy_entry_t *list_copy_entries(rcComm_t *conn, const char *root,
+                                       size_t *num_entries,
+                                       baton_error_t *error) {
+    copy_entry_t *entries = NULL;
+    size_t capacity = 0;
+    collHandle_t coll_handle;
+    collEnt_t coll_entry;
+
+    *num_entries = 0;
+
+    add_copy_entry(&entries, num_entries, &capacity, root, NULL, 0, error);
+    if (error->code != 0) goto error;
+
+    int status = rclOpenCollection(conn, (char *) root, RECUR_QUERY_FG,
+                                   &coll_handle);
+    if (status < 0) {
+        char *err_subname;
+        const char *err_name = rodsErrorName(status, &err_subname);
+        set_baton_error(error, status,
+                        "Failed to open collection: '%s' error %d %s",
+                        root, status, err_name);
+        goto error;
+    }
+
+    while ((status = rclReadCollection(conn, &coll_handle, &coll_entry)) >= 0) {
+        switch (coll_entry.objType) {
+            case DATA_OBJ_T:
+                add_copy_entry(&entries, num_entries, &capacity,
+                               coll_entry.collName, coll_entry.dataName,
+                               coll_entry.dataSize, error);
+                break;
+
+            case COLL_OBJ_T:
+                // The collection itself is already the first entry
+                if (str_equals(coll_entry.collName, root,
+                               MAX_NAME_LEN)) continue;
+
+                add_copy_entry(&entries, num_entries, &capacity,
+                               coll_entry.collName, NULL, 0, error);
+                break;
+
+            default:
+                logmsg(WARN, "Skipping entry '%s' in '%s' as it is "
+                       "neither data object nor collection",
+                       coll_entry.dataName, root);
+                break;
+        }
+
+        if (error->code != 0) break;
+    }
+
+    rclCloseCollection(&coll_handle);
+    if (error->code != 0) goto error;
+
+    qsort(entries, *num_entries, sizeof (copy_entry_t), compare_copy_order);
+
+    return entries;
+
+error:
+    if (conn->rError) {
+        logmsg(ERROR, error->message);
+        log_rods_errstack(ERROR, conn->rError);
+    }
+
+    if (entries) free_copy_entries(entries, *num_entries);
+    *num_entries = 0;
+
+    return NULL;
+}
+
+// Return the path of the copy of path, beneath dest
+static int copy_dest_path(const char *root, const char *dest,
+                          const char *path, char *dest_path,
+                          baton_error_t *error) {
+    size_t len = snprintf(dest_path, MAX_NAME_LEN, "%s%s", dest,
+                          path + strlen(root));
+    if (len >= MAX_NAME_LEN) {
+        set_baton_error(error, USER_PATH_EXCEEDS_MAX,
+                        "iRODS destination path for '%s' is too long "
+                        "(exceeds %d)", path, MAX_NAME_LEN);
+    }
+
+    return error->code;
+}
+
+// Add the AVUs of a source to its copy. Within a collection copy, they
+// are buffered and added by write-behind on its own connection, while
+// the copies continue; a failure is reported when the buffer is flushed.
+static int copy_metadata(rcComm_t *conn, rodsPath_t *src_path,
+                         rodsPath_t *dest_path, write_behind_t *wb,
+                         baton_error_t *error) {
+    json_t *avus    = NULL;
+    json_t *current = NULL;
+    json_t *target  = NULL;
+
+    avus = list_metadata(conn, src_path, NULL, error);
+    if (error->code != 0) goto finally;
+
+    current = list_metadata(conn, dest_path, NULL, error);
+    if (error->code != 0) goto finally;
+
+    // Only AVUs the copy lacks are added, so that an overwritten data
+    // object keeps its AVUs without error
+    if (!wb) {
+        maybe_modify_json_metadata(conn, dest_path, META_ADD, avus, current,
+                                   error);
+        goto finally;
+    }
+
+    json_t *lacking = json_array();
+    if (!lacking) {
+        set_baton_error(error, -1, "Failed to allocate a new JSON array");
+        goto finally;
+    }
+
+    size_t index;
+    json_t *avu;
+    json_array_foreach(avus, index, avu) {
+        if (!contains_avu(current, avu)) json_array_append(lacking, avu);
+    }
+
+    if (json_array_size(lacking) == 0) {
+        json_decref(lacking);
+        goto finally;
+    }
+
+    if (dest_path->objType == DATA_OBJ_T) {
+        target = data_object_path_to_json(dest_path->outPath, error);
+    }
+    else {
+        target = collection_path_to_json(dest_path->outPath, error);
+    }
+    if (error->code != 0) {
+        json_decref(lacking);
+        goto finally;
+    }
+
+    json_object_set_new(target, JSON_AVUS_KEY, lacking);
+    write_behind_add(wb, target, error);
+
+finally:
+    if (avus)    json_decref(avus);
+    if (current) json_decref(current);
+    if (target)  json_decref(target);
+
+    return error->code;
+}
+
+static int copy_permissions(rcComm_t *conn, rodsPath_t *src_path,
+                            rodsPath_t *dest_path, baton_error_t *error) {
+    json_t *perms = list_permissions(conn, src_path, error);
+    if (error->code != 0) goto finally;
+
+    size_t index;
+    json_t *perm;
+    json_array_foreach(perms, index, perm) {
+        modify_json_permissions(conn, dest_path, NO_RECURSE, perm, error);
+        if (error->code != 0) goto finally;
+    }
+
+finally:
+    if (perms) json_decref(perms);
+
+    return error->code;
+}
+
+// Add the AVUs and access of a source to its copy, as requested
+static int copy_annotations(rcComm_t *conn, const char *src,
+                            const char *dest, option_flags flags,
+                            write_behind_t *wb, baton_error_t *error) {
+    rodsPath_t src_path;
+    rodsPath_t dest_path;
+    char src_buf[MAX_NAME_LEN];
+    char dest_buf[MAX_NAME_LEN];
+
+    init_baton_error(error);
+
+    if (!(flags & (PRINT_AVU | PRINT_ACL))) return 0;
+
+    memset(&src_path,  0, sizeof (rodsPath_t));
+    memset(&dest_path, 0, sizeof (rodsPath_t));
+    snprintf(src_buf,  MAX_NAME_LEN, "%s", src);
+    snprintf(dest_buf, MAX_NAME_LEN, "%s", dest);
+
+    set_rods_path(conn, &src_path, src_buf, error);
+    if (error->code != 0) goto finally;
+
+    set_rods_path(conn, &dest_path, dest_buf, error);
+    if (error->code != 0) goto finally;
+
+    if (flags & PRINT_AVU) {
+        copy_metadata(conn, &src_path, &dest_path, wb, error);
+        if (error->code != 0) goto finally;
+    }
+
+    if (flags & PRINT_ACL) {
+        copy_permissions(conn, &src_path, &dest_path, error);
+    }
+
+finally:
+    if (src_path.rodsObjStat)  free(src_path.rodsObjStat);
+    if (dest_path.rodsObjStat) free(dest_path.rodsObjStat);
+
+    return error->code;
+}
+
+// Compare the catalogue checksums of a data object and its copy
+static int verify_copy(rcComm_t *conn, const char *src, const char *dest,
+                       baton_error_t *error) {
+    rodsPath_t src_path;
+    rodsPath_t dest_path;
+    json_t *src_checksum  = NULL;
+    json_t *dest_checksum = NULL;
+
+    memset(&src_path,  0, sizeof (rodsPath_t));
+    memset(&dest_path, 0, sizeof (rodsPath_t));
+    snprintf(src_path.outPath,  MAX_NAME_LEN, "%s", src);
+    snprintf(dest_path.outPath, MAX_NAME_LEN, "%s", dest);
+    src_path.objType  = dest_path.objType  = DATA_OBJ_T;
+    src_path.objState = dest_path.objState = EXIST_ST;
+
+    src_checksum = list_checksum(conn, &src_path, error);
+    if (error->code != 0) goto finally;
+
+    dest_checksum = list_checksum(conn, &dest_path, error);
+    if (error->code != 0) goto finally;
+
+    const char *expected = json_string_value(src_checksum);
+    const char *observed = json_string_value(dest_checksum);
+
+    if (!expected || expected[0] == '\0') {
+        logmsg(WARN, "'%s' has no checksum, so its copy '%s' was "
+               "checksummed but not verified", src, dest);
+        goto finally;
+    }
+
+    if (!observed || !checksum_equals(expected, observed)) {
+        set_baton_error(error, USER_CHKSUM_MISMATCH,
+                        "Checksum mismatch for '%s' copied to '%s'; "
+                        "expected %s but found %s", src, dest, expected,
+                        observed ? observed : "none");
+    }
+
+finally:
+    if (src_checksum)  json_decref(src_checksum);
+    if (dest_checksum) json_decref(dest_checksum);
+
+    return error->code;
+}
+
+static int copy_data_obj(rcComm_t *conn, const char *src, const char *dest,
+                         uint64_t size, const char *resource,
+                         option_flags flags, write_behind_t *wb,
+                         baton_error_t *error) {
+    dataObjCopyInp_t obj_copy_in;
+
+    init_baton_error(error);
+
+    memset(&obj_copy_in, 0, sizeof (dataObjCopyInp_t));
+    obj_copy_in.srcDataObjInp.oprType  = COPY_SRC;
+    obj_copy_in.destDataObjInp.oprType = COPY_DEST;
+    // The size allows the server to choose a destination resource
+    obj_copy_in.destDataObjInp.dataSize = (rodsLong_t) size;
+
+    snprintf(obj_copy_in.srcDataObjInp.objPath,  MAX_NAME_LEN, "%s", src);
+    snprintf(obj_copy_in.destDataObjInp.objPath, MAX_NAME_LEN, "%s", dest);
+
+    keyValPair_t *cond = &obj_copy_in.destDataObjInp.condInput;
+    if (resource)                 addKeyVal(cond, DEST_RESC_NAME_KW, resource);
+    if (flags & FORCE)            addKeyVal(cond, FORCE_FLAG_KW, "");
+    if (flags & VERIFY_CHECKSUM)  addKeyVal(cond, VERIFY_CHKSUM_KW, "");
+
+    logmsg(DEBUG, "Copying '%s' to '%s'", src, dest);
+
+    int status = rcDataObjCopy(conn, &obj_copy_in);
+    clearKeyVal(cond);
+
+    if (status < 0) {
+        char *err_subname;
+        const char *err_name = rodsErrorName(status, &err_subname);
+        set_baton_error(error, status,
+                        "Failed to copy '%s' to '%s': error %d %s",
+                        src, dest, status, err_name);
+        goto finally;
+    }
+
+    if (flags & VERIFY_CHECKSUM) {
+        verify_copy(conn, src, dest, error);
+        if (error->code != 0) goto finally;
+    }
+
+    copy_annotations(conn, src, dest, flags, wb, error);
+
+finally:
+    return error->code;
+}
+
+static int copy_coll(rcComm_t *conn, const char *src, const char *dest,
+                     option_flags flags, write_behind_t *wb,
+                     baton_error_t *error) {
+    rodsPath_t rods_path;
+    memset(&rods_path, 0, sizeof (rodsPath_t));
+    snprintf(rods_path.outPath, MAX_NAME_LEN, "%s", dest);
+
+    // A recursive create succeeds where the collection exists
+    create_collection(conn, &rods_path, RECURSIVE, error);
+    if (error->code != 0) return error->code;
+
+    return copy_annotations(conn, src, dest, flags, wb, error);
+}
+
+static void cancel_copy(copy_scheduler_t *sched, baton_error_t *error) {
+    pthread_mutex_lock(&sched->mutex);
+    if (!sched->cancelled) {
+        sched->cancelled = 1;
+        sched->cancel_error = *error;
+    }
+    pthread_mutex_unlock(&sched->mutex);
+}
+
+// Flush the AVUs buffered for the copies and stop the write-behind
+// buffer. A copy whose AVUs could not be added is counted as an error.
+static void finish_copy_metadata(copy_scheduler_t *sched,
+                                 write_behind_t *wb) {
+    size_t num_errors;
+    json_t *done = write_behind_flush(wb, &num_errors);
+    stop_write_behind(wb);
+
+    if (!done) return;
+
+    size_t index;
+    json_t *item;
+    json_array_foreach(done, index, item) {
+        json_t *item_error = json_object_get(item, JSON_ERROR_KEY);
+        if (!item_error) continue;
+
+        baton_error_t path_error;
+        char *path = json_to_path(item, &path_error);
+        json_t *message = json_object_get(item_error, JSON_ERROR_MSG_KEY);
+        logmsg(ERROR, "Failed to add AVUs to the copy '%s': %s",
+               path ? path : "", json_string_value(message));
+        if (path) free(path);
+
+        pthread_mutex_lock(&sched->mutex);
+        if (represents_data_object(item)) sched->num_copied--;
+        sched->num_errors++;
+        pthread_mutex_unlock(&sched->mutex);
+    }
+
+    json_decref(done);
+}
+
+// Copy data objects until none remain to be claimed
+static void copy_entries(rcComm_t *conn, copy_scheduler_t *sched,
+                         write_behind_t *wb) {
+    char dest_path[MAX_NAME_LEN];
+    baton_error_t error;
+
+    while (1) {
+        pthread_mutex_lock(&sched->mutex);
+        copy_entry_t *entry = NULL;
+        if (!sched->cancelled && sched->next < sched->num_entries) {
+            entry = &sched->entries[sched->next++];
+        }
+        pthread_mutex_unlock(&sched->mutex);
+
+        if (!entry) break;
+
+        init_baton_error(&error);
+        copy_dest_path(sched->root, sched->dest, entry->path, dest_path,
+                       &error);
+        if (error.code == 0) {
+            copy_data_obj(conn, entry->path, dest_path, entry->size,
+                          sched->copy_in->resource, sched->flags, wb,
+                          &error);
+        }
+
+        if (error.code != 0) {
+            logmsg(ERROR, "Failed to copy '%s': %s", entry->path,
+                   error.message);
+        }
+
+        pthread_mutex_lock(&sched->mutex);
+        if (error.code != 0) {
+            sched->num_errors++;
+        }
+        else {
+            sched->num_copied++;
+            sched->num_bytes += entry->size;
+        }
+        pthread_mutex_unlock(&sched->mutex);
+    }
+}
+
+static void *copy_worker(void *arg) {
+    copy_scheduler_t *sched = arg;
+    write_behind_t *wb = NULL;
+    rodsEnv env;
+    baton_error_t error;
+
+    init_baton_error(&error);
+
+    rcComm_t *conn = rods_login(&env);
+
+    if (!conn) {
+        set_baton_error(&error, -1, "Failed to open a connection for "
+                        "a copy thread");
+        cancel_copy(sched, &error);
+        goto finally;
+    }
+
+    if (sched->flags & PRINT_AVU) {
+        wb = start_write_behind(COPY_AVU_WINDOW, ADD_AVU, &error);
+        if (error.code != 0) {
+            cancel_copy(sched, &error);
+            goto finally;
+        }
+    }
+
+    copy_entries(conn, sched, wb);
+
+finally:
+    if (wb)   finish_copy_metadata(sched, wb);
+    if (conn) rcDisconnect(conn);
+
+    return NULL;
+}
+
+static int copy_collection(rcComm_t *conn, rodsPath_t *rods_path,
+                           const char *dest, copy_in_t *copy_in,
+                           option_flags flags, copy_out_t *copy_out,
+                           baton_error_t *error) {
+    pthread_t *threads = NULL;
+    size_t num_started = 0;
+    write_behind_t *wb = NULL;
+    char dest_path[MAX_NAME_LEN];
+
+    copy_scheduler_t sched;
+    memset(&sched, 0, sizeof (copy_scheduler_t));
+    sched.root    = rods_path->outPath;
+    sched.dest    = dest;
+    sched.copy_in = copy_in;
+    sched.flags   = flags;
+    pthread_mutex_init(&sched.mutex, NULL);
+
+    sched.entries = list_copy_entries(conn, rods_path->outPath,
+                                      &sched.num_entries, error);
+    if (error->code != 0) goto finally;
+
+    // The AVUs of the collections, and of the data objects copied on
+    // the main connection, are added by its own write-behind buffer
+    if (flags & PRINT_AVU) {
+        wb = start_write_behind(COPY_AVU_WINDOW, ADD_AVU, error);
+        if (error->code != 0) goto finally;
+    }
+
+    // Collections are created in turn, each after its parent, as they
+    // must exist before anything is copied into them
+    size_t num_colls = 0;
+    while (num_colls < sched.num_entries && sched.entries[num_colls].is_coll) {
+        copy_entry_t *entry = &sched.entries[num_colls];
+
+        copy_dest_path(sched.root, dest, entry->path, dest_path, error);
+        if (error->code != 0) goto finally;
+
+        copy_coll(conn, entry->path, dest_path, flags, wb, error);
+        if (error->code != 0) goto finally;
+
+        num_colls++;
+    }
+    copy_out->num_collections = num_colls;
+    sched.next = num_colls;
+
+    logmsg(DEBUG, "Copying %zu data objects from '%s' to '%s' with "
+           "%zu threads", sched.num_entries - num_colls, sched.root, dest,
+           copy_in->num_threads);
+
+    if (copy_in->num_threads == 0) {
+        copy_entries(conn, &sched, wb);
+    }
+    else {
+        threads = calloc(copy_in->num_threads, sizeof (pthread_t));
+        if (!threads) {
+            set_baton_error(error, errno, "Failed to allocate memory: "
+                            "error %d %s", errno, strerror(errno));
+            goto finally;
+        }
+
+        for (size_t i = 0; i < copy_in->num_threads; i++) {
+            int status = pthread_create(&threads[i], NULL, copy_worker,
+                                        &sched);
+            if (status != 0) {
+                set_baton_error(error, status, "Failed to start a copy "
+                                "thread: error %d %s", status,
+                                strerror(status));
+                cancel_copy(&sched, error);
+                break;
+            }
+            num_started++;
+        }
+
+        for (size_t i = 0; i < num_started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        num_started = 0;
+        if (error->code != 0) goto finally;
+    }
+
+    if (wb) {
+        finish_copy_metadata(&sched, wb);
+        wb = NULL;
+    }
+
+    if (sched.cancelled) {
+        *error = sched.cancel_error;
+        goto finally;
+    }
+
+    copy_out->num_data_objects = sched.num_copied;
+    copy_out->num_errors       = sched.num_errors;
+    copy_out->num_bytes        = sched.num_bytes;
+
+    logmsg(NOTICE, "Copied %zu collections and %zu data objects "
+           "(%" PRIu64 " bytes) from '%s' to '%s'", copy_out->num_collections,
+           copy_out->num_data_objects, copy_out->num_bytes, sched.root,
+           dest);
+
+    if (copy_out->num_errors > 0) {
+        set_baton_error(error, -1, "Failed to copy %zu of %zu data "
+                        "objects in '%s'", copy_out->num_errors,
+                        copy_out->num_errors + copy_out->num_data_objects,
+                        sched.root);
+    }
+
+finally:
+    if (wb)            finish_copy_metadata(&sched, wb);
+    if (threads)       free(threads);
+    if (sched.entries) free_copy_entries(sched.entries, sched.num_entries);
+
+    pthread_mutex_destroy(&sched.mutex);
+
+    return error->code;
+}
+
+int copy_path(rcComm_t *conn, rodsPath_t *rods_path, const char *dest,
+              copy_in_t *copy_in, option_flags flags, copy_out_t *copy_out,
+              baton_error_t *error) {
+    init_baton_error(error);
+
+    memset(copy_out, 0, sizeof (copy_out_t));
+
+    check_str_arg("path", dest, MAX_NAME_LEN, error);
+    if (error->code != 0) goto finally;
+
+    if (copy_in->num_threads > COPY_MAX_THREADS) {
+        set_baton_error(error, CAT_INVALID_ARGUMENT,
+                        "Invalid number of copy threads %zu; must be 0 "
+                        "to %d", copy_in->num_threads, COPY_MAX_THREADS);
+        goto finally;
+    }
+
+    if (rods_path->objState == NOT_EXIST_ST) {
+        set_baton_error(error, USER_FILE_DOES_NOT_EXIST,
+                        "Path '%s' does not exist "
+                        "(or lacks access permission)", rods_path->outPath);
+        goto finally;
+    }
+
+    switch (rods_path->objType) {
+        case DATA_OBJ_T:
+            logmsg(TRACE, "Identified '%s' as a data object",
+                   rods_path->outPath);
+            copy_data_obj(conn, rods_path->outPath, dest,
+                          (uint64_t) rods_path->size, copy_in->resource,
+                          flags, NULL, error);
+            if (error->code != 0) goto finally;
+
+            copy_out->num_data_objects = 1;
+            copy_out->num_bytes        = (uint64_t) rods_path->size;
+            break;
+
+        case COLL_OBJ_T:
+            logmsg(TRACE, "Identified '%s' as a collection",
+                   rods_path->outPath);
+            if (!(flags & RECURSIVE)) {
+                set_baton_error(error, USER_INPUT_OPTION_ERR,
+                                "Failed to copy '%s' as it is a collection "
+                                "and the copy is not recursive",
+                                rods_path->outPath);
+                goto finally;
+            }
+
+            // A collection copied into itself would be listed part way
+            // through being copied
+            size_t len = strlen(rods_path->outPath);
+            if (str_equals(dest, rods_path->outPath, MAX_NAME_LEN) ||
+                (strncmp(dest, rods_path->outPath, len) == 0 &&
+                 dest[len] == '/')) {
+                set_baton_error(error, USER_INPUT_PATH_ERR,
+                                "Failed to copy '%s' into itself, to '%s'",
+                                rods_path->outPath, dest);
+                goto finally;
+            }
+
+            copy_collection(conn, rods_path, dest, copy_in, flags, copy_out,
+                            error);
+            break;
+
+        default:
+            set_baton_error(error, USER_INPUT_PATH_ERR,
+                            "Failed to copy '%s' as it is "
+                            "neither data object nor collection",
+                            rods_path->outPath);
+            break;
+    }
+
+finally:
+    return error->code;
+}
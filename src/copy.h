@@ -0,0 +1,106 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file copy.h
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#ifndef _BATON_COPY_H
+#define _BATON_COPY_H
+
+#include <stdint.h>
+
+#include <rodsClient.h>
+
+#include "config.h"
+#include "error.h"
+#include "operations.h"
+
+#define COPY_MAX_THREADS 64
+
+/** The number of AVU operations buffered by each copy thread before
+    they are added to the copies. */
+#define COPY_AVU_WINDOW 1024
+
+/**
+ *  @struct copy_in
+ *  @brief Copy inputs.
+ */
+typedef struct copy_in {
+    /** The resource on which to create the copies, or NULL for the
+        server's default. */
+    const char *resource;
+    /** The number of worker threads copying data objects, each with
+        its own connection. 0 means copying each in turn on the main
+        connection. */
+    size_t num_threads;
+} copy_in_t;
+
+/**
+ *  @struct copy_out
+ *  @brief Copy counters.
+ */
+typedef struct copy_out {
+    /** The number of collections created. */
+    size_t num_collections;
+    /** The number of data objects copied. */
+    size_t num_data_objects;
+    /** The number of data objects that could not be copied, or to
+        whose copies AVUs could not be added, and of collections to
+        whose copies AVUs could not be added. */
+    size_t num_errors;
+    /** The number of bytes copied, as listed. */
+    uint64_t num_bytes;
+} copy_out_t;
+
+/**
+ * Copy a data object, or with RECURSIVE, a collection and everything
+ * in it, to a new path. Data are copied between servers, never
+ * through the client.
+ *
+ * The collections of a copied collection are created in turn on the
+ * main connection. Its data objects are then copied by the worker
+ * threads, largest first, so that the longest copies start early.
+ * A data object that cannot be copied is counted as an error and the
+ * others are copied regardless; the error report gives their number
+ * once the copy is complete.
+ *
+ * Options:
+ *   FORCE            Overwrite existing data objects.
+ *   VERIFY_CHECKSUM  Have the server verify each copy against the
+ *                    checksum of its source and compare the catalogue
+ *                    checksums of the two.
+ *   PRINT_AVU        Add the AVUs of each source to its copy. Within
+ *                    a collection, they are added by a write-behind
+ *                    buffer for each thread, on its own connection,
+ *                    while the copies continue.
+ *   PRINT_ACL        Grant the access of each source on its copy.
+ *
+ * @param[in]  conn         An open iRODS connection.
+ * @param[in]  rods_path    A resolved iRODS path to copy.
+ * @param[in]  dest         The path of the copy.
+ * @param[in]  copy_in      Copy inputs.
+ * @param[in]  flags        Function behaviour options.
+ * @param[out] copy_out     Copy counters.
+ * @param[out] error        An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int copy_path(rcComm_t *conn, rodsPath_t *rods_path, const char *dest,
+              copy_in_t *copy_in, option_flags flags, copy_out_t *copy_out,
+              baton_error_t *error);
+
+#endif // _BATON_COPY_H
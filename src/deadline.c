@@ -0,0 +1,71 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file deadline.c
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#include <time.h>
+
+#include "config.h"
+#include "deadline.h"
+
+// Each thread works on one envelope at a time, so each has its own
+// deadline. Worker threads, such as those of write-behind and fetch,
+// have none.
+static __thread int has_deadline = 0;
+static __thread struct timespec deadline;
+
+void set_deadline(unsigned long ms) {
+    if (ms == 0) {
+        clear_deadline();
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    deadline.tv_sec  += ms / 1000;
+    deadline.tv_nsec += (long) (ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    has_deadline = 1;
+}
+
+void clear_deadline(void) {
+    has_deadline = 0;
+}
+
+int deadline_expired(void) {
+    if (!has_deadline) return 0;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec > deadline.tv_sec ||
+        (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec);
+}
+
+int check_deadline(const char *what, baton_error_t *error) {
+    if (deadline_expired()) {
+        set_baton_error(error, DEADLINE_EXPIRED,
+                        "Deadline expired during %s", what);
+    }
+
+    return error->code;
+}
@@ -0,0 +1,67 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file deadline.h
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#ifndef _BATON_DEADLINE_H
+#define _BATON_DEADLINE_H
+
+#include <errno.h>
+
+#include "config.h"
+#include "error.h"
+
+/** The error code of an operation abandoned at its deadline. */
+#define DEADLINE_EXPIRED ETIMEDOUT
+
+/**
+ * Set a deadline for the work of the calling thread, replacing any
+ * existing deadline. Query paging and data object transfers check it
+ * between server calls and stop with a DEADLINE_EXPIRED error once
+ * it has passed. A call already in progress is not interrupted.
+ *
+ * @param[in]  ms         The deadline, in milliseconds from now. 0
+ *                        clears the deadline.
+ */
+void set_deadline(unsigned long ms);
+
+/**
+ * Clear any deadline for the calling thread.
+ */
+void clear_deadline(void);
+
+/**
+ * Return true if the calling thread has a deadline that has passed.
+ *
+ * @return 1 if the deadline has passed, 0 otherwise.
+ */
+int deadline_expired(void);
+
+/**
+ * Set a DEADLINE_EXPIRED error if the calling thread has a deadline
+ * that has passed.
+ *
+ * @param[in]  what       A description of the work abandoned, for the
+ *                        error message.
+ * @param[out] error      An error report struct.
+ *
+ * @return 0 if there is time remaining, error code otherwise.
+ */
+int check_deadline(const char *what, baton_error_t *error);
+
+#endif // _BATON_DEADLINE_H
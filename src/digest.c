@@ -0,0 +1,208 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file digest.c
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "config.h"
+#include "digest.h"
+#include "utilities.h"
+
+#define MD5_HEX_LEN       32
+#define SHA256_BASE64_LEN 44
+
+static pthread_mutex_t scheme_mutex = PTHREAD_MUTEX_INITIALIZER;
+static digest_scheme default_scheme = DIGEST_MD5;
+static int default_scheme_set       = 0;
+
+digest_scheme parse_digest_scheme(const char *name) {
+    if (!name) return DIGEST_UNKNOWN;
+
+    if (str_equals_ignore_case(name, DIGEST_MD5_NAME, MAX_STR_LEN)) {
+        return DIGEST_MD5;
+    }
+    if (str_equals_ignore_case(name, DIGEST_SHA256_NAME, MAX_STR_LEN)) {
+        return DIGEST_SHA256;
+    }
+
+    return DIGEST_UNKNOWN;
+}
+
+const char *digest_scheme_name(digest_scheme scheme) {
+    switch (scheme) {
+        case DIGEST_MD5:    return DIGEST_MD5_NAME;
+        case DIGEST_SHA256: return DIGEST_SHA256_NAME;
+        default:            return "unknown";
+    }
+}
+
+digest_scheme checksum_scheme(const char *checksum) {
+    if (!checksum) return DIGEST_UNKNOWN;
+
+    size_t prefix_len = strlen(DIGEST_SHA256_PREFIX);
+    if (strncmp(checksum, DIGEST_SHA256_PREFIX, prefix_len) == 0) {
+        const char *b64 = checksum + prefix_len;
+        if (strnlen(b64, SHA256_BASE64_LEN + 1) != SHA256_BASE64_LEN) {
+            return DIGEST_UNKNOWN;
+        }
+        for (size_t i = 0; i < SHA256_BASE64_LEN; i++) {
+            unsigned char c = b64[i];
+            if (!(isalnum(c) || c == '+' || c == '/' || c == '=')) {
+                return DIGEST_UNKNOWN;
+            }
+        }
+
+        return DIGEST_SHA256;
+    }
+
+    if (strnlen(checksum, MD5_HEX_LEN + 1) != MD5_HEX_LEN) {
+        return DIGEST_UNKNOWN;
+    }
+    for (size_t i = 0; i < MD5_HEX_LEN; i++) {
+        if (!isxdigit((unsigned char) checksum[i])) return DIGEST_UNKNOWN;
+    }
+
+    return DIGEST_MD5;
+}
+
+int checksum_equals(const char *a, const char *b) {
+    digest_scheme scheme = checksum_scheme(a);
+    if (scheme == DIGEST_UNKNOWN || scheme != checksum_scheme(b)) return 0;
+
+    if (scheme == DIGEST_MD5) {
+        return str_equals_ignore_case(a, b, MAX_CHECKSUM_LEN);
+    }
+
+    return str_equals(a, b, MAX_CHECKSUM_LEN);
+}
+
+digest_scheme get_default_digest_scheme(void) {
+    pthread_mutex_lock(&scheme_mutex);
+    digest_scheme scheme = default_scheme;
+    pthread_mutex_unlock(&scheme_mutex);
+
+    return scheme;
+}
+
+void init_default_digest_scheme(digest_scheme scheme) {
+    if (scheme == DIGEST_UNKNOWN) return;
+
+    pthread_mutex_lock(&scheme_mutex);
+    if (!default_scheme_set) {
+        default_scheme     = scheme;
+        default_scheme_set = 1;
+    }
+    pthread_mutex_unlock(&scheme_mutex);
+}
+
+void set_default_digest_scheme(digest_scheme scheme) {
+    if (scheme == DIGEST_UNKNOWN) return;
+
+    pthread_mutex_lock(&scheme_mutex);
+    default_scheme     = scheme;
+    default_scheme_set = 1;
+    pthread_mutex_unlock(&scheme_mutex);
+}
+
+int init_digest(digest_t *digest, digest_scheme scheme, baton_error_t *error) {
+    const EVP_MD *md = NULL;
+
+    init_baton_error(error);
+
+    digest->scheme  = scheme;
+    digest->context = NULL;
+
+    switch (scheme) {
+        case DIGEST_MD5:
+            md = EVP_md5();
+            break;
+
+        case DIGEST_SHA256:
+            md = EVP_sha256();
+            break;
+
+        default:
+            set_baton_error(error, -1, "Invalid hash scheme %d", scheme);
+            goto finally;
+    }
+
+    digest->context = EVP_MD_CTX_create();
+    if (!digest->context) {
+        set_baton_error(error, -1, "Failed to allocate memory for a digest");
+        goto finally;
+    }
+
+    if (!EVP_DigestInit_ex(digest->context, md, NULL)) {
+        set_baton_error(error, -1, "Failed to start a %s digest",
+                        digest_scheme_name(scheme));
+        free_digest(digest);
+    }
+
+finally:
+    return error->code;
+}
+
+void update_digest(digest_t *digest, const void *data, size_t len) {
+    if (digest->context && len > 0) {
+        EVP_DigestUpdate(digest->context, data, len);
+    }
+}
+
+int final_digest(digest_t *digest, char *checksum, baton_error_t *error) {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0;
+
+    init_baton_error(error);
+
+    checksum[0] = '\0';
+
+    if (!digest->context ||
+        !EVP_DigestFinal_ex(digest->context, md, &md_len)) {
+        set_baton_error(error, -1, "Failed to finish a %s digest",
+                        digest_scheme_name(digest->scheme));
+        goto finally;
+    }
+
+    if (digest->scheme == DIGEST_SHA256) {
+        // iRODS formats SHA-256 as base64 rather than hexadecimal
+        size_t prefix_len = strlen(DIGEST_SHA256_PREFIX);
+        memcpy(checksum, DIGEST_SHA256_PREFIX, prefix_len);
+        EVP_EncodeBlock((unsigned char *) checksum + prefix_len, md, md_len);
+    }
+    else {
+        for (unsigned int i = 0; i < md_len; i++) {
+            snprintf(checksum + i * 2, 3, "%02x", md[i]);
+        }
+    }
+
+finally:
+    free_digest(digest);
+
+    return error->code;
+}
+
+void free_digest(digest_t *digest) {
+    if (digest->context) {
+        EVP_MD_CTX_destroy(digest->context);
+        digest->context = NULL;
+    }
+}
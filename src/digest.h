@@ -0,0 +1,172 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file digest.h
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#ifndef _BATON_DIGEST_H
+#define _BATON_DIGEST_H
+
+#include <stddef.h>
+
+#include <openssl/evp.h>
+
+#include "config.h"
+#include "error.h"
+
+/** The prefix iRODS gives SHA-256 checksums. */
+#define DIGEST_SHA256_PREFIX "sha2:"
+
+/** The names of the hash schemes, as in an iRODS environment. */
+#define DIGEST_MD5_NAME      "MD5"
+#define DIGEST_SHA256_NAME   "SHA256"
+
+/** The length of a buffer able to hold a checksum in any scheme,
+    including the terminating NUL: "sha2:" and 44 base64
+    characters. */
+#define MAX_CHECKSUM_LEN 50
+
+/**
+ *  @enum digest_scheme
+ *  @brief The hash schemes of iRODS checksums.
+ */
+typedef enum {
+    DIGEST_UNKNOWN,
+    /** MD5, formatted as 32 hexadecimal digits. */
+    DIGEST_MD5,
+    /** SHA-256, formatted as "sha2:" and the base64 encoded digest. */
+    DIGEST_SHA256
+} digest_scheme;
+
+/**
+ *  @struct digest
+ *  @brief A digest being calculated.
+ */
+typedef struct digest {
+    digest_scheme scheme;
+    EVP_MD_CTX *context;
+} digest_t;
+
+/**
+ * Return the scheme of a hash scheme name, as given in an iRODS
+ * environment ("MD5", "SHA256"). Case is ignored.
+ *
+ * @param[in]  name       A hash scheme name.
+ *
+ * @return The scheme, or DIGEST_UNKNOWN.
+ */
+digest_scheme parse_digest_scheme(const char *name);
+
+/**
+ * Return the name of a hash scheme.
+ *
+ * @param[in]  scheme     A hash scheme.
+ *
+ * @return A name, as given in an iRODS environment.
+ */
+const char *digest_scheme_name(digest_scheme scheme);
+
+/**
+ * Return the scheme of an iRODS checksum, as judged by its format.
+ *
+ * @param[in]  checksum   A checksum string.
+ *
+ * @return The scheme, or DIGEST_UNKNOWN.
+ */
+digest_scheme checksum_scheme(const char *checksum);
+
+/**
+ * Compare two iRODS checksums. MD5 checksums are compared ignoring
+ * case, base64 encoded ones exactly.
+ *
+ * @param[in]  a          A checksum string.
+ * @param[in]  b          A checksum string.
+ *
+ * @return 1 if the checksums are of the same scheme and equal, 0
+ * otherwise.
+ */
+int checksum_equals(const char *a, const char *b);
+
+/**
+ * Return the hash scheme with which data are checksummed on the
+ * client. This is MD5 until set otherwise, from the iRODS environment
+ * or from the scheme of checksums found in the catalogue.
+ *
+ * @return A hash scheme.
+ */
+digest_scheme get_default_digest_scheme(void);
+
+/**
+ * Set the hash scheme with which data are checksummed on the client,
+ * for all threads, unless it has been set already. This allows the
+ * iRODS environment to give the scheme on each login without
+ * overriding a scheme learned from the catalogue.
+ *
+ * @param[in]  scheme     A hash scheme. DIGEST_UNKNOWN is ignored.
+ */
+void init_default_digest_scheme(digest_scheme scheme);
+
+/**
+ * Set the hash scheme with which data are checksummed on the client,
+ * for all threads.
+ *
+ * @param[in]  scheme     A hash scheme. DIGEST_UNKNOWN is ignored.
+ */
+void set_default_digest_scheme(digest_scheme scheme);
+
+/**
+ * Start calculating a digest. The hash implementation is chosen by
+ * OpenSSL at run time and uses the CPU's SHA extensions, where
+ * present.
+ *
+ * @param[out] digest     A digest.
+ * @param[in]  scheme     A hash scheme.
+ * @param[out] error      An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int init_digest(digest_t *digest, digest_scheme scheme, baton_error_t *error);
+
+/**
+ * Add data to a digest.
+ *
+ * @param[in]  digest     A digest.
+ * @param[in]  data       The data.
+ * @param[in]  len        The length of the data.
+ */
+void update_digest(digest_t *digest, const void *data, size_t len);
+
+/**
+ * Finish a digest and format it as an iRODS checksum. The digest is
+ * freed.
+ *
+ * @param[in]  digest     A digest.
+ * @param[out] checksum   A buffer of at least MAX_CHECKSUM_LEN.
+ * @param[out] error      An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int final_digest(digest_t *digest, char *checksum, baton_error_t *error);
+
+/**
+ * Free an unfinished digest.
+ *
+ * @param[in]  digest     A digest.
+ */
+void free_digest(digest_t *digest);
+
+#endif // _BATON_DIGEST_H
@@ -0,0 +1,284 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file envelope.c
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#include <string.h>
+
+#include <rodsClient.h>
+
+#include "config.h"
+#include "envelope.h"
+#include "json.h"
+#include "log.h"
+#include "utilities.h"
+
+// Operation names and argument keys are found by a hash that is
+// perfect for each of the tables below, so that a key is matched by a
+// single string comparison. When adding a key, choose the multipliers
+// in key_slot so that no two keys in a table share a slot.
+#define KEY_TABLE_SIZE 32
+
+typedef enum {
+    ARG_FLAG,
+    ARG_OPERATION,
+    ARG_OPERATION_SHORT,
+    ARG_PATH,
+    ARG_LAYOUT,
+    ARG_RESOURCE,
+    ARG_THREADS,
+    ARG_DEADLINE
+} arg_kind;
+
+typedef struct arg_key {
+    const char *key;
+    arg_kind kind;
+    /** The options set by a true value, for ARG_FLAG keys. */
+    int flags;
+} arg_key_t;
+
+typedef struct op_key {
+    const char *key;
+    operation_type type;
+} op_key_t;
+
+static const arg_key_t arg_keys[KEY_TABLE_SIZE] = {
+    [0]  = { JSON_OP_KEY,           ARG_OPERATION,       0                  },
+    [1]  = { JSON_OP_SINGLE_SERVER, ARG_FLAG,            SINGLE_SERVER      },
+    [2]  = { JSON_OP_AVU,           ARG_FLAG,            PRINT_AVU          },
+    [5]  = { JSON_OP_PATH,          ARG_PATH,            0                  },
+    [7]  = { JSON_OP_RESOURCE,      ARG_RESOURCE,        0                  },
+    [10] = { JSON_OP_TIMESTAMP,     ARG_FLAG,            PRINT_TIMESTAMP    },
+    [12] = { JSON_OP_SAVE,          ARG_FLAG,            SAVE_FILES         },
+    [13] = { JSON_OP_SHORT_KEY,     ARG_OPERATION_SHORT, 0                  },
+    [15] = { JSON_OP_THREADS,       ARG_THREADS,         0                  },
+    [16] = { JSON_OP_DEADLINE,      ARG_DEADLINE,        0                  },
+    [17] = { JSON_OP_VERIFY,        ARG_FLAG,            VERIFY_CHECKSUM |
+                                                         PRINT_CHECKSUM     },
+    [18] = { JSON_OP_RECURSE,       ARG_FLAG,            RECURSIVE          },
+    [19] = { JSON_OP_OBJECT,        ARG_FLAG,            SEARCH_OBJECTS     },
+    [20] = { JSON_OP_SIZE,          ARG_FLAG,            PRINT_SIZE         },
+    [22] = { JSON_OP_FORCE,         ARG_FLAG,            FORCE              },
+    [23] = { JSON_OP_CHECKSUM,      ARG_FLAG,            CALCULATE_CHECKSUM |
+                                                         PRINT_CHECKSUM     },
+    [24] = { JSON_OP_COLLECTION,    ARG_FLAG,            SEARCH_COLLECTIONS },
+    [25] = { JSON_OP_PARALLEL,      ARG_FLAG,            PARALLEL_TRANSFER  },
+    [26] = { JSON_OP_RAW,           ARG_FLAG,            PRINT_RAW          },
+    [27] = { JSON_OP_LAYOUT,        ARG_LAYOUT,          0                  },
+    [28] = { JSON_OP_REPLICATE,     ARG_FLAG,            PRINT_REPLICATE    },
+    [30] = { JSON_OP_CONTENTS,      ARG_FLAG,            PRINT_CONTENTS     },
+    [31] = { JSON_OP_ACL,           ARG_FLAG,            PRINT_ACL          }
+};
+
+static const op_key_t op_keys[KEY_TABLE_SIZE] = {
+    [0]  = { JSON_RMCOLL_OP,    OPERATION_RMCOLL    },
+    [4]  = { JSON_PUT_OP,       OPERATION_PUT       },
+    [8]  = { JSON_CHMOD_OP,     OPERATION_CHMOD     },
+    [10] = { JSON_COPY_OP,      OPERATION_COPY      },
+    [11] = { JSON_METAQUERY_OP, OPERATION_METAQUERY },
+    [12] = { JSON_MOVE_OP,      OPERATION_MOVE      },
+    [13] = { JSON_MKCOLL_OP,    OPERATION_MKCOLL    },
+    [15] = { JSON_GET_OP,       OPERATION_GET       },
+    [17] = { JSON_METAMOD_OP,   OPERATION_METAMOD   },
+    [23] = { JSON_CHECKSUM_OP,  OPERATION_CHECKSUM  },
+    [25] = { JSON_LIST_OP,      OPERATION_LIST      },
+    [27] = { JSON_DIGEST_OP,    OPERATION_DIGEST    },
+    [28] = { JSON_FETCH_OP,     OPERATION_FETCH     },
+    [29] = { JSON_RM_OP,        OPERATION_RM        }
+};
+
+// Return the table slot of a key, from its length and its first,
+// second and last characters
+static unsigned int key_slot(const char *key) {
+    size_t len = strnlen(key, MAX_STR_LEN);
+    if (len == 0) return KEY_TABLE_SIZE;
+
+    const unsigned char *k = (const unsigned char *) key;
+
+    return (unsigned int) (len * 21 + k[0] * 29 + k[len - 1] * 16 + k[1]) %
+        KEY_TABLE_SIZE;
+}
+
+static const arg_key_t *lookup_arg(const char *key) {
+    unsigned int slot = key_slot(key);
+    if (slot >= KEY_TABLE_SIZE || !arg_keys[slot].key) return NULL;
+
+    return str_equals(key, arg_keys[slot].key, MAX_STR_LEN) ?
+        &arg_keys[slot] : NULL;
+}
+
+operation_type lookup_operation(const char *name) {
+    if (!name) return OPERATION_UNKNOWN;
+
+    unsigned int slot = key_slot(name);
+    if (slot >= KEY_TABLE_SIZE || !op_keys[slot].key) return OPERATION_UNKNOWN;
+
+    return str_equals(name, op_keys[slot].key, MAX_STR_LEN) ?
+        op_keys[slot].type : OPERATION_UNKNOWN;
+}
+
+static const char *decode_string_arg(json_t *value, const char *name,
+                                     const char *key, baton_error_t *error) {
+    if (!json_is_string(value)) {
+        set_baton_error(error, CAT_INVALID_ARGUMENT,
+                        "Invalid %s %s: not a JSON string", name, key);
+        return NULL;
+    }
+
+    return json_string_value(value);
+}
+
+static json_int_t decode_count_arg(json_t *value, const char *key,
+                                   baton_error_t *error) {
+    if (!json_is_integer(value) || json_integer_value(value) < 0) {
+        set_baton_error(error, CAT_INVALID_ARGUMENT,
+                        "Invalid '%s' attribute: not a non-negative "
+                        "JSON integer", key);
+        return 0;
+    }
+
+    return json_integer_value(value);
+}
+
+int decode_operation_args(json_t *operation_args, option_flags flags,
+                          operation_desc_t *desc, baton_error_t *error) {
+    json_t *op_arg       = NULL;
+    json_t *op_short_arg = NULL;
+
+    init_baton_error(error);
+
+    desc->args         = operation_args;
+    desc->flags        = flags;
+    desc->path         = NULL;
+    desc->layout       = NULL;
+    desc->resource     = NULL;
+    desc->has_threads  = 0;
+    desc->num_threads  = 0;
+    desc->has_deadline = 0;
+    desc->deadline_ms  = 0;
+
+    if (!operation_args) goto finally;
+
+    if (!json_is_object(operation_args)) {
+        set_baton_error(error, CAT_INVALID_ARGUMENT,
+                        "Invalid '%s' attribute: not a JSON object",
+                        JSON_OP_ARGS_KEY);
+        goto finally;
+    }
+
+    const char *key;
+    json_t *value;
+    json_object_foreach(operation_args, key, value) {
+        const arg_key_t *arg = lookup_arg(key);
+        if (!arg) continue;
+
+        switch (arg->kind) {
+            case ARG_FLAG:
+                if (json_is_true(value)) desc->flags |= arg->flags;
+                break;
+
+            case ARG_OPERATION:
+                op_arg = value;
+                break;
+
+            case ARG_OPERATION_SHORT:
+                op_short_arg = value;
+                break;
+
+            case ARG_PATH:
+                desc->path = decode_string_arg(value, "operation path",
+                                               key, error);
+                break;
+
+            case ARG_LAYOUT:
+                desc->layout = decode_string_arg(value, "operation layout",
+                                                 key, error);
+                break;
+
+            case ARG_RESOURCE:
+                desc->resource = decode_string_arg(value,
+                                                   "operation resource",
+                                                   key, error);
+                break;
+
+            case ARG_THREADS:
+                desc->num_threads = decode_count_arg(value, key, error);
+                desc->has_threads = 1;
+                break;
+
+            case ARG_DEADLINE:
+                desc->deadline_ms = decode_count_arg(value, key, error);
+                desc->has_deadline = 1;
+                break;
+        }
+
+        if (error->code != 0) goto finally;
+    }
+
+    // As elsewhere, the long key takes precedence over the short and
+    // a value that is not a string is ignored
+    json_t *op_value = op_arg ? op_arg : op_short_arg;
+    if (json_is_string(op_value)) {
+        const char *op = json_string_value(op_value);
+
+        logmsg(DEBUG, "Detected operation argument '%s'", op);
+        if (str_equals(op, JSON_ARG_META_ADD, MAX_STR_LEN)) {
+            desc->flags |= ADD_AVU;
+        }
+        else if (str_equals(op, JSON_ARG_META_REM, MAX_STR_LEN)) {
+            desc->flags |= REMOVE_AVU;
+        }
+        else {
+            set_baton_error(error, -1,
+                            "Invalid baton operation argument '%s'", op);
+            goto finally;
+        }
+    }
+
+finally:
+    return error->code;
+}
+
+int decode_envelope(json_t *envelope, option_flags flags,
+                    operation_desc_t *desc, baton_error_t *error) {
+    init_baton_error(error);
+
+    memset(desc, 0, sizeof (operation_desc_t));
+    desc->flags = flags;
+
+    desc->name = get_operation(envelope, error);
+    if (error->code != 0) goto finally;
+
+    if (!desc->name) {
+        set_baton_error(error, -1, "No baton operation given");
+        goto finally;
+    }
+
+    desc->type = lookup_operation(desc->name);
+
+    desc->target = get_operation_target(envelope, error);
+    if (error->code != 0) goto finally;
+
+    json_t *args = json_object_get(envelope, JSON_OP_ARGS_KEY);
+    if (!args) args = json_object_get(envelope, JSON_OP_ARGS_SHORT_KEY);
+
+    decode_operation_args(args, flags, desc, error);
+
+finally:
+    return error->code;
+}
@@ -0,0 +1,128 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file envelope.h
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#ifndef _BATON_ENVELOPE_H
+#define _BATON_ENVELOPE_H
+
+#include <stddef.h>
+
+#include <jansson.h>
+
+#include "config.h"
+#include "error.h"
+#include "operations.h"
+
+/**
+ *  @enum operation_type
+ *  @brief The operations an envelope may request.
+ */
+typedef enum {
+    /** An operation name that is not recognised. */
+    OPERATION_UNKNOWN,
+    OPERATION_CHMOD,
+    OPERATION_CHECKSUM,
+    OPERATION_COPY,
+    OPERATION_DIGEST,
+    OPERATION_FETCH,
+    OPERATION_GET,
+    OPERATION_LIST,
+    OPERATION_METAMOD,
+    OPERATION_METAQUERY,
+    OPERATION_PUT,
+    OPERATION_MOVE,
+    OPERATION_RM,
+    OPERATION_MKCOLL,
+    OPERATION_RMCOLL
+} operation_type;
+
+/**
+ *  @struct operation_desc
+ *  @brief An envelope decoded for dispatch.
+ *
+ *  Strings and JSON values are borrowed from the envelope, which must
+ *  outlive the descriptor.
+ */
+typedef struct operation_desc {
+    /** The operation requested. */
+    operation_type type;
+    /** The operation name, as given. */
+    const char *name;
+    /** The operation target. */
+    json_t *target;
+    /** The operation arguments, or NULL if none were given. */
+    json_t *args;
+    /** The options given by the arguments, combined with the
+        defaults. */
+    option_flags flags;
+    /** The path argument, or NULL. */
+    const char *path;
+    /** The layout argument, or NULL. */
+    const char *layout;
+    /** The resource argument, or NULL. */
+    const char *resource;
+    /** True if a threads argument was given. */
+    int has_threads;
+    /** The threads argument. */
+    size_t num_threads;
+    /** True if a deadline argument was given. */
+    int has_deadline;
+    /** The deadline argument, in milliseconds. */
+    unsigned long deadline_ms;
+} operation_desc_t;
+
+/**
+ * Return the type of an operation, given its name.
+ *
+ * @param[in]  name       An operation name.
+ *
+ * @return The operation type, OPERATION_UNKNOWN if the name is not
+ * recognised.
+ */
+operation_type lookup_operation(const char *name);
+
+/**
+ * Decode the arguments of an envelope in a single pass over their
+ * keys. Keys that are not recognised are ignored.
+ *
+ * @param[in]  operation_args  The JSON arguments of an envelope. May be
+ *                             NULL.
+ * @param[in]  flags           The options already set.
+ * @param[out] desc            A descriptor to receive the arguments.
+ * @param[out] error           An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int decode_operation_args(json_t *operation_args, option_flags flags,
+                          operation_desc_t *desc, baton_error_t *error);
+
+/**
+ * Decode an envelope's operation, target and arguments.
+ *
+ * @param[in]  envelope   A JSON envelope.
+ * @param[in]  flags      The options already set.
+ * @param[out] desc       A descriptor to receive the envelope.
+ * @param[out] error      An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int decode_envelope(json_t *envelope, option_flags flags,
+                    operation_desc_t *desc, baton_error_t *error);
+
+#endif // _BATON_ENVELOPE_H
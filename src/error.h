@@ -21,6 +21,8 @@
 #ifndef _BATON_ERROR_H
 #define _BATON_ERROR_H
 
+#include <stddef.h>
+
 #define MAX_ERROR_MESSAGE_LEN 1024
 
 typedef struct baton_error {
@@ -0,0 +1,515 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file fetch.c
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "config.h"
+#include "baton.h"
+#include "fetch.h"
+
+typedef struct fetch_scheduler {
+    fetch_in_t *fetch_in;
+    // The query connection, used for gets when there are no threads
+    rcComm_t *conn;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+
+    // A ring buffer of data objects waiting to be fetched
+    json_t **queue;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    // Set when the query has finished
+    int closed;
+    // Set when the fetch cannot continue
+    int cancelled;
+    baton_error_t cancel_error;
+
+    // Completed results and the number that were errors
+    json_t *results;
+    size_t num_errors;
+    // The local paths taken, mapped to the data objects fetched to them
+    json_t *claimed;
+} fetch_scheduler_t;
+
+static int has_fetch_error(json_t *result) {
+    return json_object_get(result, JSON_ERROR_KEY) != NULL;
+}
+
+static void cancel_fetch(fetch_scheduler_t *sched, baton_error_t *error) {
+    pthread_mutex_lock(&sched->mutex);
+    if (!sched->cancelled) {
+        sched->cancelled = 1;
+        sched->cancel_error = *error;
+    }
+    pthread_cond_broadcast(&sched->not_empty);
+    pthread_cond_broadcast(&sched->not_full);
+    pthread_mutex_unlock(&sched->mutex);
+}
+
+static void add_fetch_result(fetch_scheduler_t *sched, json_t *result,
+                             int failed) {
+    pthread_mutex_lock(&sched->mutex);
+    json_array_append_new(sched->results, result);
+    if (failed) sched->num_errors++;
+    pthread_mutex_unlock(&sched->mutex);
+}
+
+// Take a local path for a data object, failing if another data object
+// of the same fetch has taken it, so that neither overwrites the other
+static int claim_local_path(fetch_scheduler_t *sched, const char *local_path,
+                            const char *path, baton_error_t *error) {
+    init_baton_error(error);
+
+    pthread_mutex_lock(&sched->mutex);
+    json_t *owner = json_object_get(sched->claimed, local_path);
+    if (owner) {
+        set_baton_error(error, CAT_INVALID_ARGUMENT,
+                        "Local path '%s' is already the destination of "
+                        "'%s'; use a layout that includes %s",
+                        local_path, json_string_value(owner),
+                        FETCH_LAYOUT_COLLECTION);
+    }
+    else {
+        json_object_set_new(sched->claimed, local_path, json_string(path));
+    }
+    pthread_mutex_unlock(&sched->mutex);
+
+    return error->code;
+}
+
+// Get a single data object, returning a new JSON result describing
+// where it went, or why it failed
+static json_t *fetch_data_obj(rcComm_t *conn, fetch_scheduler_t *sched,
+                              json_t *obj) {
+    fetch_in_t *fetch_in = sched->fetch_in;
+    char *path           = NULL;
+    char *local_path     = NULL;
+    baton_error_t error;
+    rodsPath_t rods_path;
+    memset(&rods_path, 0, sizeof (rodsPath_t));
+
+    json_t *result = json_deep_copy(obj);
+    if (!result) {
+        logmsg(ERROR, "Failed to allocate memory for result");
+        goto finally;
+    }
+
+    init_baton_error(&error);
+
+    path = json_to_path(obj, &error);
+    if (error.code != 0) goto finally;
+
+    local_path = make_layout_path(fetch_in->directory, fetch_in->layout, obj,
+                                  &error);
+    if (error.code != 0) goto finally;
+
+    claim_local_path(sched, local_path, path, &error);
+    if (error.code != 0) goto finally;
+
+    make_parent_dirs(local_path, &error);
+    if (error.code != 0) goto finally;
+
+    init_baton_error(&error);
+    set_rods_path(conn, &rods_path, path, &error);
+    if (error.code != 0) goto finally;
+
+    if (fetch_in->cache) {
+        get_data_obj_file_cached(conn, &rods_path, local_path,
+                                 fetch_in->buffer_size, fetch_in->cache,
+                                 &error);
+    }
+    else {
+        get_data_obj_file(conn, &rods_path, local_path,
+                          fetch_in->buffer_size, &error);
+    }
+    if (error.code != 0) goto finally;
+
+    json_object_set_new(result, JSON_FILE_KEY, json_string(local_path));
+
+finally:
+    if (result && error.code != 0) {
+        logmsg(ERROR, "Failed to fetch '%s': %s", path ? path : "",
+               error.message);
+        add_error_value(result, &error);
+    }
+
+    if (rods_path.rodsObjStat) free(rods_path.rodsObjStat);
+    if (local_path) free(local_path);
+    if (path)       free(path);
+
+    return result;
+}
+
+static void *fetch_worker(void *arg) {
+    fetch_scheduler_t *sched = arg;
+    rodsEnv env;
+    baton_error_t error;
+
+    init_baton_error(&error);
+
+    rcComm_t *conn = rods_login(&env);
+
+    if (!conn) {
+        set_baton_error(&error, -1, "Failed to open a connection for "
+                        "a fetch thread");
+        cancel_fetch(sched, &error);
+        goto finally;
+    }
+
+    while (1) {
+        pthread_mutex_lock(&sched->mutex);
+        while (sched->count == 0 && !sched->closed && !sched->cancelled) {
+            pthread_cond_wait(&sched->not_empty, &sched->mutex);
+        }
+
+        if (sched->cancelled || sched->count == 0) {
+            pthread_mutex_unlock(&sched->mutex);
+            break;
+        }
+
+        json_t *obj = sched->queue[sched->head];
+        sched->head = (sched->head + 1) % sched->capacity;
+        sched->count--;
+        pthread_cond_signal(&sched->not_full);
+        pthread_mutex_unlock(&sched->mutex);
+
+        json_t *result = fetch_data_obj(conn, sched, obj);
+        json_decref(obj);
+
+        if (result) {
+            add_fetch_result(sched, result, has_fetch_error(result));
+        }
+
+        if (exit_flag) {
+            set_baton_error(&error, -1, "Fetch interrupted by signal %d",
+                            exit_flag);
+            cancel_fetch(sched, &error);
+            break;
+        }
+    }
+
+finally:
+    if (conn) rcDisconnect(conn);
+
+    return NULL;
+}
+
+// Query page callback for getting between pages on the query connection
+static int fetch_page_inline(json_t *page, void *data, baton_error_t *error) {
+    fetch_scheduler_t *sched = data;
+
+    size_t index;
+    json_t *obj;
+    json_array_foreach(page, index, obj) {
+        if (exit_flag) {
+            set_baton_error(error, -1, "Fetch interrupted by signal %d",
+                            exit_flag);
+            break;
+        }
+
+        json_t *result = fetch_data_obj(sched->conn, sched, obj);
+        if (result) {
+            add_fetch_result(sched, result, has_fetch_error(result));
+        }
+    }
+
+    return error->code;
+}
+
+// Query page callback for queueing gets for the download threads
+static int fetch_page_queued(json_t *page, void *data, baton_error_t *error) {
+    fetch_scheduler_t *sched = data;
+
+    size_t index;
+    json_t *obj;
+    json_array_foreach(page, index, obj) {
+        if (exit_flag) {
+            set_baton_error(error, -1, "Fetch interrupted by signal %d",
+                            exit_flag);
+            break;
+        }
+
+        pthread_mutex_lock(&sched->mutex);
+        while (sched->count == sched->capacity && !sched->cancelled) {
+            pthread_cond_wait(&sched->not_full, &sched->mutex);
+        }
+
+        if (sched->cancelled) {
+            *error = sched->cancel_error;
+            pthread_mutex_unlock(&sched->mutex);
+            break;
+        }
+
+        size_t tail = (sched->head + sched->count) % sched->capacity;
+        sched->queue[tail] = json_incref(obj);
+        sched->count++;
+        pthread_cond_signal(&sched->not_empty);
+        pthread_mutex_unlock(&sched->mutex);
+    }
+
+    return error->code;
+}
+
+char *make_layout_path(const char *directory, const char *layout,
+                       json_t *obj, baton_error_t *error) {
+    char *path = NULL;
+    size_t coll_len = strlen(FETCH_LAYOUT_COLLECTION);
+    size_t obj_len  = strlen(FETCH_LAYOUT_DATA_OBJECT);
+
+    init_baton_error(error);
+
+    const char *collection = get_collection_value(obj, error);
+    if (error->code != 0) goto error;
+    const char *data_object = get_data_object_value(obj, error);
+    if (error->code != 0) goto error;
+
+    if (!collection || !data_object) {
+        set_baton_error(error, CAT_INVALID_ARGUMENT,
+                        "Cannot make a local path for a result that is "
+                        "not a data object");
+        goto error;
+    }
+
+    while (*collection == '/') collection++;
+
+    size_t dir_len  = strnlen(directory, MAX_STR_LEN);
+    size_t path_len = dir_len + 1 + 1; // +1 for '/', +1 for NUL
+    for (const char *c = layout; *c != '\0';) {
+        if (strncmp(c, FETCH_LAYOUT_COLLECTION, coll_len) == 0) {
+            path_len += strlen(collection);
+            c += coll_len;
+        }
+        else if (strncmp(c, FETCH_LAYOUT_DATA_OBJECT, obj_len) == 0) {
+            path_len += strlen(data_object);
+            c += obj_len;
+        }
+        else if (*c == '{' || *c == '}') {
+            set_baton_error(error, CAT_INVALID_ARGUMENT,
+                            "Invalid layout '%s': the only placeholders "
+                            "permitted are %s and %s", layout,
+                            FETCH_LAYOUT_COLLECTION,
+                            FETCH_LAYOUT_DATA_OBJECT);
+            goto error;
+        }
+        else {
+            path_len++;
+            c++;
+        }
+    }
+
+    path = calloc(path_len, sizeof (char));
+    if (!path) {
+        set_baton_error(error, errno, "Failed to allocate memory: error %d %s",
+                        errno, strerror(errno));
+        goto error;
+    }
+
+    char *p = path;
+    p += snprintf(p, path_len, "%s/", directory);
+    for (const char *c = layout; *c != '\0';) {
+        if (strncmp(c, FETCH_LAYOUT_COLLECTION, coll_len) == 0) {
+            p = stpcpy(p, collection);
+            c += coll_len;
+        }
+        else if (strncmp(c, FETCH_LAYOUT_DATA_OBJECT, obj_len) == 0) {
+            p = stpcpy(p, data_object);
+            c += obj_len;
+        }
+        else {
+            *p++ = *c++;
+        }
+    }
+    *p = '\0';
+
+    return path;
+
+error:
+    if (path) free(path);
+
+    return NULL;
+}
+
+int make_parent_dirs(const char *path, baton_error_t *error) {
+    init_baton_error(error);
+
+    char *tmp = copy_str(path, MAX_STR_LEN);
+    if (!tmp) {
+        set_baton_error(error, errno, "Failed to copy string '%s'", path);
+        goto finally;
+    }
+
+    // Skip the leading '/' of an absolute path
+    for (char *c = tmp + 1; *c != '\0'; c++) {
+        if (*c != '/') continue;
+
+        *c = '\0';
+        if (mkdir(tmp, 0777) != 0 && errno != EEXIST) {
+            set_baton_error(error, errno,
+                            "Failed to create directory '%s': error %d %s",
+                            tmp, errno, strerror(errno));
+            goto finally;
+        }
+        *c = '/';
+    }
+
+finally:
+    if (tmp) free(tmp);
+
+    return error->code;
+}
+
+json_t *fetch_metadata_results(rcComm_t *conn, json_t *query,
+                               char *zone_name, fetch_in_t *fetch_in,
+                               baton_error_t *error) {
+    pthread_t *threads = NULL;
+    size_t num_started = 0;
+    json_t *results    = NULL;
+
+    query_format_in_t *obj_format = &(query_format_in_t)
+        { .num_columns = 2,
+          .columns     = { COL_COLL_NAME, COL_DATA_NAME },
+          .labels      = { JSON_COLLECTION_KEY, JSON_DATA_OBJECT_KEY },
+          .good_repl   = 0 };
+
+    fetch_scheduler_t sched = { .fetch_in  = fetch_in,
+                                .conn      = conn,
+                                .mutex     = PTHREAD_MUTEX_INITIALIZER,
+                                .not_empty = PTHREAD_COND_INITIALIZER,
+                                .not_full  = PTHREAD_COND_INITIALIZER };
+
+    init_baton_error(error);
+
+    if (fetch_in->num_threads > FETCH_MAX_THREADS) {
+        set_baton_error(error, CAT_INVALID_ARGUMENT,
+                        "Invalid number of fetch threads %zu; the maximum "
+                        "is %d", fetch_in->num_threads, FETCH_MAX_THREADS);
+        goto error;
+    }
+
+    if (zone_name) {
+        check_str_arg("zone_name", zone_name, NAME_LEN, error);
+        if (error->code != 0) goto error;
+    }
+
+    query = map_access_args(query, error);
+    if (error->code != 0) goto error;
+
+    sched.results = json_array();
+    sched.claimed = json_object();
+    if (!sched.results || !sched.claimed) {
+        set_baton_error(error, -1, "Failed to allocate a new JSON object");
+        goto error;
+    }
+
+    query_page_cb page_cb = fetch_page_inline;
+
+    if (fetch_in->num_threads > 0) {
+        sched.capacity = fetch_in->num_threads * FETCH_QUEUE_PER_THREAD;
+        sched.queue    = calloc(sched.capacity, sizeof (json_t *));
+        threads        = calloc(fetch_in->num_threads, sizeof (pthread_t));
+        if (!sched.queue || !threads) {
+            set_baton_error(error, errno,
+                            "Failed to allocate memory: error %d %s",
+                            errno, strerror(errno));
+            goto error;
+        }
+
+        for (size_t i = 0; i < fetch_in->num_threads; i++) {
+            int status = pthread_create(&threads[i], NULL, fetch_worker,
+                                        &sched);
+            if (status != 0) {
+                set_baton_error(error, status,
+                                "Failed to start fetch thread: error %d %s",
+                                status, strerror(status));
+                goto error;
+            }
+            num_started++;
+        }
+
+        page_cb = fetch_page_queued;
+        logmsg(DEBUG, "Fetching with %zu threads", num_started);
+    }
+
+    do_search_pages(conn, zone_name, query, obj_format,
+                    prepare_obj_avu_search, prepare_obj_acl_search,
+                    prepare_obj_cre_search, prepare_obj_mod_search,
+                    page_cb, &sched, error);
+    if (error->code != 0) goto error;
+
+    if (num_started > 0) {
+        pthread_mutex_lock(&sched.mutex);
+        sched.closed = 1;
+        pthread_cond_broadcast(&sched.not_empty);
+        pthread_mutex_unlock(&sched.mutex);
+
+        for (size_t i = 0; i < num_started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        num_started = 0;
+
+        // A thread may have stopped the fetch after the query finished
+        if (sched.cancelled) {
+            *error = sched.cancel_error;
+            goto error;
+        }
+    }
+
+    if (sched.num_errors > 0) {
+        logmsg(WARN, "Failed to fetch %zu of %zu data objects",
+               sched.num_errors, json_array_size(sched.results));
+    }
+
+    results = sched.results;
+    sched.results = NULL;
+
+error:
+    if (num_started > 0) {
+        baton_error_t cancel_error;
+        init_baton_error(&cancel_error);
+        set_baton_error(&cancel_error, error->code, "%s", error->message);
+        cancel_fetch(&sched, &cancel_error);
+
+        for (size_t i = 0; i < num_started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    for (size_t i = 0; i < sched.count; i++) {
+        json_decref(sched.queue[(sched.head + i) % sched.capacity]);
+    }
+
+    if (sched.queue)   free(sched.queue);
+    if (threads)       free(threads);
+    if (sched.results) json_decref(sched.results);
+    if (sched.claimed) json_decref(sched.claimed);
+
+    pthread_mutex_destroy(&sched.mutex);
+    pthread_cond_destroy(&sched.not_empty);
+    pthread_cond_destroy(&sched.not_full);
+
+    return results;
+}
@@ -0,0 +1,113 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file fetch.h
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#ifndef _BATON_FETCH_H
+#define _BATON_FETCH_H
+
+#include <rodsClient.h>
+
+#include "config.h"
+#include "cache.h"
+#include "error.h"
+#include "operations.h"
+
+#define FETCH_LAYOUT_COLLECTION  "{collection}"
+#define FETCH_LAYOUT_DATA_OBJECT "{data_object}"
+
+/** The default layout, which mirrors the collections of the data
+    objects, so that those of the same name do not collide. */
+#define FETCH_DEFAULT_LAYOUT FETCH_LAYOUT_COLLECTION "/" \
+                             FETCH_LAYOUT_DATA_OBJECT
+
+#define FETCH_MAX_THREADS 64
+
+/** The number of queued gets permitted per download thread. */
+#define FETCH_QUEUE_PER_THREAD 4
+
+/**
+ *  @struct fetch_in
+ *  @brief Query-then-fetch inputs.
+ */
+typedef struct fetch_in {
+    /** The local directory to fetch into. */
+    const char *directory;
+    /** The local path template, relative to the directory. */
+    const char *layout;
+    /** The number of download threads, each with its own connection.
+        0 means downloading between query pages on the query
+        connection. */
+    size_t num_threads;
+    /** The transfer buffer size. */
+    size_t buffer_size;
+    /** A local cache, or NULL. */
+    const local_cache_t *cache;
+} fetch_in_t;
+
+/**
+ * Make a local file path for a data object from a layout template. The
+ * template may contain the placeholders {collection}, which is replaced
+ * by the collection path without its leading '/', and {data_object}.
+ *
+ * @param[in]  directory  The local directory.
+ * @param[in]  layout     The template.
+ * @param[in]  obj        A JSON representation of a data object.
+ * @param[out] error      An error report struct.
+ *
+ * @return A new string, which must be freed by the caller.
+ */
+char *make_layout_path(const char *directory, const char *layout,
+                       json_t *obj, baton_error_t *error);
+
+/**
+ * Create any missing parent directories of a local file path.
+ *
+ * @param[in]  path       A local file path.
+ * @param[out] error      An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int make_parent_dirs(const char *path, baton_error_t *error);
+
+/**
+ * Search for data objects by metadata and get each one to a local file.
+ * Gets start as soon as the first page of query results arrives. When
+ * there are download threads, at most num_threads *
+ * FETCH_QUEUE_PER_THREAD gets are queued, further query pages waiting
+ * until there is room.
+ *
+ * A failure to get a data object does not stop the others; it is
+ * reported in the result for that data object. A data object whose
+ * local path is that of one already fetched is not fetched, but
+ * reported as an error, rather than overwriting it.
+ *
+ * @param[in]  conn       An open iRODS connection, used for the query.
+ * @param[in]  query      A JSON metadata query, as for search_metadata.
+ * @param[in]  zone_name  The zone to search, or NULL.
+ * @param[in]  fetch_in   Fetch inputs.
+ * @param[out] error      An error report struct.
+ *
+ * @return A new JSON array of data objects, one per result, in order of
+ * completion. Each has the local file it was fetched to, or an error.
+ */
+json_t *fetch_metadata_results(rcComm_t *conn, json_t *query,
+                               char *zone_name, fetch_in_t *fetch_in,
+                               baton_error_t *error);
+
+#endif // _BATON_FETCH_H
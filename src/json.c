@@ -21,6 +21,7 @@
  */
 
 #include <errno.h>
+#include <limits.h>
 #include <libgen.h>
 #include <string.h>
 #include <stdlib.h>
@@ -33,6 +34,7 @@
 #include "config.h"
 #include "json.h"
 #include "log.h"
+#include "memory.h"
 #include "utilities.h"
 
 static json_t *get_json_value(json_t *object, const char *name,
@@ -367,6 +369,35 @@ const char *get_file_value(json_t *object, baton_error_t *error) {
                                 NULL, error);
 }
 
+int get_fd_value(json_t *object, baton_error_t *error) {
+    init_baton_error(error);
+
+    json_t *value = get_json_value(object, "path spec", JSON_FD_KEY, NULL,
+                                   error);
+    if (error->code != 0) goto error;
+
+    if (!json_is_integer(value) || json_integer_value(value) < 0 ||
+        json_integer_value(value) > INT_MAX) {
+        set_baton_error(error, CAT_INVALID_ARGUMENT,
+                        "Invalid '%s' attribute: not a file descriptor",
+                        JSON_FD_KEY);
+        goto error;
+    }
+
+    return (int) json_integer_value(value);
+
+error:
+    return -1;
+}
+
+uint64_t get_size_hint(json_t *object) {
+    // As when planning, a size that is not an integer is unknown
+    json_t *value = json_object_get(object, JSON_SIZE_KEY);
+    if (!json_is_integer(value) || json_integer_value(value) < 0) return 0;
+
+    return (uint64_t) json_integer_value(value);
+}
+
 const char *get_query_collection(json_t *object, baton_error_t *error) {
     init_baton_error(error);
 
@@ -601,6 +632,18 @@ int has_op_path(json_t *operation_args) {
     return json_object_get(operation_args, JSON_OP_PATH) != NULL;
 }
 
+int has_op_layout(json_t *operation_args) {
+    return json_object_get(operation_args, JSON_OP_LAYOUT) != NULL;
+}
+
+int has_op_threads(json_t *operation_args) {
+    return json_object_get(operation_args, JSON_OP_THREADS) != NULL;
+}
+
+int has_op_deadline(json_t *operation_args) {
+    return json_object_get(operation_args, JSON_OP_DEADLINE) != NULL;
+}
+
 int op_acl_p(json_t *operation_args) {
     return json_is_true(json_object_get(operation_args, JSON_OP_ACL));
 }
@@ -637,6 +680,10 @@ int op_operation_p(json_t *operation_args) {
     return json_is_true(json_object_get(operation_args, JSON_OP_OPERATION));
 }
 
+int op_parallel_p(json_t *operation_args) {
+    return json_is_true(json_object_get(operation_args, JSON_OP_PARALLEL));
+}
+
 int op_raw_p(json_t *operation_args) {
     return json_is_true(json_object_get(operation_args, JSON_OP_RAW));
 }
@@ -679,6 +726,53 @@ const char *get_op_path(json_t *operation_args, baton_error_t *error) {
                             JSON_OP_PATH, NULL, error);
 }
 
+const char *get_op_layout(json_t *operation_args, baton_error_t *error) {
+    init_baton_error(error);
+
+    return get_string_value(operation_args, "operation layout",
+                            JSON_OP_LAYOUT, NULL, error);
+}
+
+size_t get_op_threads(json_t *operation_args, baton_error_t *error) {
+    init_baton_error(error);
+
+    json_t *value = get_json_value(operation_args, "operation threads",
+                                   JSON_OP_THREADS, NULL, error);
+    if (error->code != 0) goto error;
+
+    if (!json_is_integer(value) || json_integer_value(value) < 0) {
+        set_baton_error(error, CAT_INVALID_ARGUMENT,
+                        "Invalid '%s' attribute: not a non-negative "
+                        "JSON integer", JSON_OP_THREADS);
+        goto error;
+    }
+
+    return (size_t) json_integer_value(value);
+
+error:
+    return 0;
+}
+
+unsigned long get_op_deadline(json_t *operation_args, baton_error_t *error) {
+    init_baton_error(error);
+
+    json_t *value = get_json_value(operation_args, "operation deadline",
+                                   JSON_OP_DEADLINE, NULL, error);
+    if (error->code != 0) goto error;
+
+    if (!json_is_integer(value) || json_integer_value(value) < 0) {
+        set_baton_error(error, CAT_INVALID_ARGUMENT,
+                        "Invalid '%s' attribute: not a non-negative "
+                        "JSON integer", JSON_OP_DEADLINE);
+        goto error;
+    }
+
+    return (unsigned long) json_integer_value(value);
+
+error:
+    return 0;
+}
+
 int has_checksum(json_t *object) {
     baton_error_t error;
 
@@ -688,6 +782,11 @@ int has_checksum(json_t *object) {
                                 NULL, &error) != NULL;
 }
 
+int has_fd(json_t *object) {
+    return json_is_object(object) &&
+        json_object_get(object, JSON_FD_KEY) != NULL;
+}
+
 int has_collection(json_t *object) {
     baton_error_t error;
 
@@ -1253,7 +1352,7 @@ void print_json_stream(json_t *json, FILE *stream) {
     char *json_str = json_dumps(json, JSON_INDENT(0));
     if (json_str) {
         fprintf(stream, "%s\n", json_str);
-        free(json_str);
+        free_json_str(json_str);
     }
 
     return;
@@ -23,6 +23,8 @@
 #ifndef _BATON_JSON_H
 #define _BATON_JSON_H
 
+#include <stdint.h>
+
 #include <jansson.h>
 
 #include "config.h"
@@ -39,6 +41,7 @@
 #define JSON_DIRECTORY_KEY         "directory"
 #define JSON_DIRECTORY_SHORT_KEY   "dir"
 #define JSON_FILE_KEY              "file"
+#define JSON_FD_KEY                "fd"
 #define JSON_COLLECTION_KEY        "collection"
 #define JSON_COLLECTION_SHORT_KEY  "coll"
 #define JSON_DATA_OBJECT_KEY       "data_object"
@@ -48,6 +51,7 @@
 #define JSON_CONTENTS_KEY          "contents"
 #define JSON_SIZE_KEY              "size"
 #define JSON_CHECKSUM_KEY          "checksum"
+#define JSON_DIGEST_KEY            "digest"
 #define JSON_TIMESTAMPS_KEY        "timestamps"
 #define JSON_TIMESTAMPS_SHORT_KEY  "time"
 
@@ -78,6 +82,9 @@
 #define JSON_RESOURCE_KEY          "resource"
 #define JSON_RESOURCE_TYPE_KEY     "type"
 #define JSON_RESOURCE_HIER_KEY     "hierarchy"
+#define JSON_RESOURCE_FREE_SPACE_KEY "free_space"
+#define JSON_RESOURCE_STATUS_KEY   "status"
+#define JSON_RESOURCE_PARENT_KEY   "parent"
 #define JSON_LOCATION_KEY          "location"
 
 // Metadata genquery API operations
@@ -88,10 +95,16 @@
 #define JSON_ARG_META_ADD          "add"
 #define JSON_ARG_META_REM          "rem"
 
+// Metadata query set operations
+#define JSON_ANY_KEY               "any"
+#define JSON_ALL_KEY               "all"
+#define JSON_NOT_KEY               "not"
+
 // SQL specific query operations
 #define JSON_SPECIFIC_KEY          "specific"
 #define JSON_SQL_KEY               "sql"
 #define JSON_SQL_SHORT_KEY         "s"
+#define JSON_ARGS_INDEX_KEY        "args_index"
 
 // baton operations
 #define JSON_TARGET_KEY            "target"
@@ -103,6 +116,9 @@
 
 #define JSON_CHMOD_OP              "chmod"
 #define JSON_CHECKSUM_OP           "checksum"
+#define JSON_COPY_OP               "copy"
+#define JSON_DIGEST_OP             "digest"
+#define JSON_FETCH_OP              "fetch"
 #define JSON_GET_OP                "get"
 #define JSON_LIST_OP               "list"
 #define JSON_METAMOD_OP            "metamod"
@@ -125,6 +141,7 @@
 #define JSON_OP_CONTENTS           "contents"
 #define JSON_OP_OBJECT             "object"
 #define JSON_OP_OPERATION          "operation"
+#define JSON_OP_PARALLEL           "parallel"
 #define JSON_OP_RAW                "raw"
 #define JSON_OP_RECURSE            "recurse"
 #define JSON_OP_REPLICATE          "replicate"
@@ -133,6 +150,10 @@
 #define JSON_OP_SIZE               "size"
 #define JSON_OP_TIMESTAMP          "timestamp"
 #define JSON_OP_PATH               "path"
+#define JSON_OP_LAYOUT             "layout"
+#define JSON_OP_RESOURCE           "resource"
+#define JSON_OP_THREADS            "threads"
+#define JSON_OP_DEADLINE           "deadline_ms"
 
 #define VALID_REPLICATE   "1"
 #define INVALID_REPLICATE "0"
@@ -204,6 +225,31 @@ const char* get_query_collection(json_t *object, baton_error_t *error);
 
 const char *get_collection_value(json_t *object, baton_error_t *error);
 
+const char *get_data_object_value(json_t *object, baton_error_t *error);
+
+const char *get_directory_value(json_t *object, baton_error_t *error);
+
+/**
+ * Return the local file descriptor given by a JSON object, from which
+ * data may be streamed.
+ *
+ * @param[in]  object        A JSON object.
+ * @param[out] error         An error report struct.
+ *
+ * @return A file descriptor on success, -1 on error.
+ */
+int get_fd_value(json_t *object, baton_error_t *error);
+
+/**
+ * Return the expected size in bytes given by a JSON object, or 0 if
+ * it gives none.
+ *
+ * @param[in]  object        A JSON object.
+ *
+ * @return The size.
+ */
+uint64_t get_size_hint(json_t *object);
+
 const char *get_created_timestamp(json_t *object, baton_error_t *error);
 
 const char *get_modified_timestamp(json_t *object, baton_error_t *error);
@@ -252,6 +298,12 @@ json_t *get_operation_target(json_t *envelope, baton_error_t *error);
 
 const char *get_op_path(json_t *operation_args, baton_error_t *error);
 
+const char *get_op_layout(json_t *operation_args, baton_error_t *error);
+
+size_t get_op_threads(json_t *operation_args, baton_error_t *error);
+
+unsigned long get_op_deadline(json_t *operation_args, baton_error_t *error);
+
 int has_operation(json_t *object);
 
 int has_operation_args(json_t *object);
@@ -260,6 +312,12 @@ int has_operation_target(json_t *envelope);
 
 int has_op_path(json_t *operation_args);
 
+int has_op_layout(json_t *operation_args);
+
+int has_op_threads(json_t *operation_args);
+
+int has_op_deadline(json_t *operation_args);
+
 int op_acl_p(json_t *operation_args);
 
 int op_avu_p(json_t *operation_args);
@@ -278,6 +336,8 @@ int op_object_p(json_t *operation_args);
 
 int op_operation_p(json_t *operation_args);
 
+int op_parallel_p(json_t *operation_args);
+
 int op_raw_p(json_t *operation_args);
 
 int op_recurse_p(json_t *operation_args);
@@ -296,6 +356,8 @@ int has_checksum(json_t *object);
 
 int has_collection(json_t *object);
 
+int has_fd(json_t *object);
+
 int has_acl(json_t *object);
 
 int has_timestamps(json_t *object);
@@ -20,18 +20,73 @@
  * @author Joshua C. Randall <jcrandall@alum.mit.edu>
  */
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <jansson.h>
 
 #include "config.h"
 #include "baton.h"
+#include "deadline.h"
 #include "json.h"
 #include "json_query.h"
 #include "log.h"
 #include "query.h"
 #include "utilities.h"
 
+typedef json_t *(*enrich_object_cb) (rcComm_t *conn, json_t *object,
+                                     baton_error_t *error);
+
+typedef int (*enrich_merge_cb) (json_t *object, json_t *rows,
+                                baton_error_t *error);
+
+/**
+ *  @struct enrich_family
+ *  @brief A kind of data added to query results in batches of data
+ *  objects; the first column of its format must be COL_DATA_NAME.
+ */
+typedef struct enrich_family {
+    /** A name for logging. */
+    const char *name;
+    /** The columns to select. */
+    query_format_in_t format;
+    /** Any additional query conditions. */
+    query_cond_t conds[1];
+    /** The number of additional query conditions. */
+    size_t num_conds;
+    /** True if collections are also to have the data added. */
+    int collections;
+    /** Add the data to one object, for those that cannot be batched. */
+    enrich_object_cb add_object;
+    /** Add the result rows for one data object to it. */
+    enrich_merge_cb merge;
+} enrich_family_t;
+
+/**
+ *  @struct specific_batch
+ *  @brief A specific query run once for each of a batch of argument
+ *  tuples.
+ */
+typedef struct specific_batch {
+    char *zone_name;
+    const char *sql;
+    /** The argument tuples, a JSON array of arrays. */
+    json_t *tuples;
+    size_t num_tuples;
+    /** The label format, shared by all the tuples. */
+    query_format_in_t *format;
+    prepare_specific_query_cb prepare_squery;
+    /** The result rows of each tuple, by index. */
+    json_t **results;
+    /** The index of the next tuple to run. */
+    size_t next;
+    /** The first error. */
+    baton_error_t error;
+    pthread_mutex_t mutex;
+} specific_batch_t;
+
 static int is_zone_hint(const char *path) {
     size_t len = strnlen(path, MAX_STR_LEN);
     int is_zone = 1;
@@ -195,6 +250,49 @@ static const char *resource_hierarchy_leaf(const char *hierarchy) {
 }
 #endif
 
+static json_t *make_timestamps(json_t *raw_timestamps, const char *path,
+                               baton_error_t *error) {
+    json_t *timestamps = json_array();
+    if (!timestamps) {
+        set_baton_error(error, -1, "Failed to allocate a new JSON array");
+        goto error;
+    }
+
+    size_t i;
+    json_t *item;
+    json_array_foreach(raw_timestamps, i, item) {
+        const char *repl_num = get_replicate_num(item, error);
+        if (error->code != 0) goto error;
+        const char *created = get_created_timestamp(item, error);
+        if (error->code != 0) goto error;
+        const char *modified = get_modified_timestamp(item, error);
+        if (error->code != 0) goto error;
+
+        json_t *iso_created =
+            make_timestamp(JSON_CREATED_KEY, created, RFC3339_FORMAT,
+                           repl_num, error);
+        if (error->code != 0) goto error;
+
+        json_t *iso_modified =
+            make_timestamp(JSON_MODIFIED_KEY, modified, RFC3339_FORMAT,
+                           repl_num, error);
+        if (error->code != 0) goto error;
+
+        json_array_append_new(timestamps, iso_created);
+        json_array_append_new(timestamps, iso_modified);
+
+        logmsg(DEBUG, "Adding timestamps from replicate %s of '%s'",
+               repl_num, path);
+    }
+
+    return timestamps;
+
+error:
+    if (timestamps) json_decref(timestamps);
+
+    return NULL;
+}
+
 void log_json_error(log_level level, json_error_t *error) {
     logmsg(level, "JSON error: %s, line %d, column %d, position %d",
            error->text, error->line, error->column, error->position);
@@ -239,17 +337,16 @@ error:
     return NULL;
 }
 
-json_t *do_search(rcComm_t *conn, char *zone_name, json_t *query,
-                  query_format_in_t *format,
-                  prepare_avu_search_cb prepare_avu,
-                  prepare_acl_search_cb prepare_acl,
-                  prepare_tps_search_cb prepare_cre,
-                  prepare_tps_search_cb prepare_mod,
-                  baton_error_t *error) {
+static genQueryInp_t *prepare_search(rcComm_t *conn, char *zone_name,
+                                     json_t *query, query_format_in_t *format,
+                                     prepare_avu_search_cb prepare_avu,
+                                     prepare_acl_search_cb prepare_acl,
+                                     prepare_tps_search_cb prepare_cre,
+                                     prepare_tps_search_cb prepare_mod,
+                                     baton_error_t *error) {
     genQueryInp_t *query_in = NULL;
     char *zone_hint         = zone_name;
     char *root_path         = NULL;
-    json_t *items           = NULL;
     json_t *avus;
 
     init_baton_error(error);
@@ -322,73 +419,368 @@ json_t *do_search(rcComm_t *conn, char *zone_name, json_t *query,
         addKeyVal(&query_in->condInput, ZONE_KW, zone_hint);
     }
 
+    if (root_path) free(root_path);
+
+    return query_in;
+
+error:
+    if (root_path) free(root_path);
+    if (query_in)  free_query_input(query_in);
+
+    return NULL;
+}
+
+static int extend_results(json_t *page, void *data, baton_error_t *error) {
+    json_t *results = data;
+
+    int status = json_array_extend(results, page);
+    if (status != 0) {
+        set_baton_error(error, status,
+                        "Failed to add JSON query result to total: "
+                        "error %d", status);
+    }
+
+    return error->code;
+}
+
+json_t *do_search(rcComm_t *conn, char *zone_name, json_t *query,
+                  query_format_in_t *format,
+                  prepare_avu_search_cb prepare_avu,
+                  prepare_acl_search_cb prepare_acl,
+                  prepare_tps_search_cb prepare_cre,
+                  prepare_tps_search_cb prepare_mod,
+                  baton_error_t *error) {
+    genQueryInp_t *query_in = NULL;
+    json_t *items           = NULL;
+
+    query_in = prepare_search(conn, zone_name, query, format, prepare_avu,
+                              prepare_acl, prepare_cre, prepare_mod, error);
+    if (error->code != 0) goto error;
+
     items = do_query(conn, query_in, format->labels, error);
     if (error->code != 0) goto error;
 
-    if (root_path) free(root_path);
     free_query_input(query_in);
     logmsg(TRACE, "Found %d matching items", json_array_size(items));
 
     return items;
 
 error:
-    if (root_path) free(root_path);
     if (query_in)  free_query_input(query_in);
     if (items)     json_decref(items);
 
     return NULL;
 }
 
+int do_search_pages(rcComm_t *conn, char *zone_name, json_t *query,
+                    query_format_in_t *format,
+                    prepare_avu_search_cb prepare_avu,
+                    prepare_acl_search_cb prepare_acl,
+                    prepare_tps_search_cb prepare_cre,
+                    prepare_tps_search_cb prepare_mod,
+                    query_page_cb page_cb, void *data,
+                    baton_error_t *error) {
+    genQueryInp_t *query_in = NULL;
+
+    query_in = prepare_search(conn, zone_name, query, format, prepare_avu,
+                              prepare_acl, prepare_cre, prepare_mod, error);
+    if (error->code != 0) goto finally;
+
+    do_query_pages(conn, query_in, format->labels, page_cb, data, error);
+
+finally:
+    if (query_in) free_query_input(query_in);
+
+    return error->code;
+}
+
 json_t *do_specific(rcComm_t *conn, char *zone_name, json_t *query,
                     prepare_specific_query_cb prepare_squery,
                     prepare_specific_labels_cb prepare_labels,
                     baton_error_t *error) {
+    return do_specific_concurrent(conn, zone_name, query, prepare_squery,
+                                  prepare_labels, 0, error);
+}
+
+// Return true if specific query args are an array of argument tuples
+static int is_args_batch(json_t *args) {
+    return json_array_size(args) > 0 && json_is_array(json_array_get(args, 0));
+}
+
+static json_t *run_specific(rcComm_t *conn, char *zone_name,
+                            const char *sql, json_t *args,
+                            query_format_in_t *format,
+                            prepare_specific_query_cb prepare_squery,
+                            baton_error_t *error) {
+    json_t *items = NULL;
+
+    init_baton_error(error);
+
+    specificQueryInp_t *squery_in = calloc(1, sizeof (specificQueryInp_t));
+    if (!squery_in) {
+        set_baton_error(error, errno, "Failed to allocate memory: error %d %s",
+                        errno, strerror(errno));
+        goto finally;
+    }
+
+    prepare_squery(squery_in, sql, args);
+
+    if (zone_name) {
+        logmsg(TRACE, "Setting zone to '%s'", zone_name);
+        addKeyVal(&squery_in->condInput, ZONE_KW, zone_name);
+    }
+
+    items = do_squery(conn, squery_in, format, error);
+
+finally:
+    if (squery_in) free_squery_input(squery_in);
+
+    return items;
+}
+
+static int run_specific_batch(rcComm_t *conn, specific_batch_t *batch) {
+    baton_error_t error;
+
+    while (1) {
+        pthread_mutex_lock(&batch->mutex);
+        if (batch->error.code != 0 || batch->next == batch->num_tuples) {
+            pthread_mutex_unlock(&batch->mutex);
+            break;
+        }
+        size_t index = batch->next++;
+        pthread_mutex_unlock(&batch->mutex);
+
+        json_t *rows = run_specific(conn, batch->zone_name, batch->sql,
+                                    json_array_get(batch->tuples, index),
+                                    batch->format, batch->prepare_squery,
+                                    &error);
+        if (error.code != 0) {
+            pthread_mutex_lock(&batch->mutex);
+            if (batch->error.code == 0) {
+                set_baton_error(&batch->error, error.code,
+                                "Failed specific query with args at "
+                                "position %zu: %s", index, error.message);
+            }
+            pthread_mutex_unlock(&batch->mutex);
+            break;
+        }
+
+        size_t i;
+        json_t *row;
+        json_array_foreach(rows, i, row) {
+            json_object_set_new(row, JSON_ARGS_INDEX_KEY, json_integer(index));
+        }
+
+        batch->results[index] = rows;
+    }
+
+    return batch->error.code;
+}
+
+static void *specific_batch_worker(void *arg) {
+    specific_batch_t *batch = arg;
+    rodsEnv env;
+
+    rcComm_t *conn = rods_login(&env);
+
+    if (!conn) {
+        pthread_mutex_lock(&batch->mutex);
+        if (batch->error.code == 0) {
+            set_baton_error(&batch->error, -1, "Failed to open a connection "
+                            "for a specific query thread");
+        }
+        pthread_mutex_unlock(&batch->mutex);
+        goto finally;
+    }
+
+    run_specific_batch(conn, batch);
+
+finally:
+    if (conn) rcDisconnect(conn);
+
+    return NULL;
+}
+
+json_t *do_specific_concurrent(rcComm_t *conn, char *zone_name, json_t *query,
+                               prepare_specific_query_cb prepare_squery,
+                               prepare_specific_labels_cb prepare_labels,
+                               size_t num_threads, baton_error_t *error) {
     json_t *items             = NULL;
-    json_t *specific;
+    json_t *args              = NULL;
     query_format_in_t *format = NULL;
+    pthread_t threads[SPECIFIC_MAX_THREADS];
+    size_t num_started        = 0;
 
-    specificQueryInp_t *squery_in = calloc(1, sizeof (specificQueryInp_t));
-    if (!squery_in) goto error;
+    specific_batch_t batch = { .zone_name      = zone_name,
+                               .prepare_squery = prepare_squery };
+
+    init_baton_error(error);
+    init_baton_error(&batch.error);
 
     // specific is mandatory for specific query
-    specific = get_specific(query, error);
+    json_t *specific = get_specific(query, error);
     if (error->code != 0) goto error;
 
-    squery_in = prepare_json_specific_query(squery_in, specific,
-                                            prepare_squery, error);
+    batch.sql = get_specific_sql(specific, error);
     if (error->code != 0) goto error;
 
-    format = prepare_json_specific_labels(conn, specific, prepare_labels, error);
+    args = get_specific_args(specific, error);
     if (error->code != 0) goto error;
 
-    if (zone_name) {
-        logmsg(TRACE, "Setting zone to '%s'", zone_name);
-        addKeyVal(&squery_in->condInput, ZONE_KW, zone_name);
+    // The labels are resolved once, for all argument tuples
+    format = prepare_json_specific_labels(conn, specific, prepare_labels,
+                                          error);
+    if (error->code != 0) goto error;
+
+    if (!format) {
+        set_baton_error(error, -1, "Failed to prepare labels for specific "
+                        "query '%s'", batch.sql);
+        goto error;
     }
 
-    items = do_squery(conn, squery_in, format, error);
-    if (error->code != 0) goto error;
+    batch.format = format;
+
+    if (!is_args_batch(args)) {
+        logmsg(DEBUG, "Preparing specific search s: '%s'", batch.sql);
+
+        items = run_specific(conn, zone_name, batch.sql, args, format,
+                             prepare_squery, error);
+        if (error->code != 0) goto error;
+
+        goto finally;
+    }
+
+    batch.tuples     = args;
+    batch.num_tuples = json_array_size(args);
+
+    size_t index;
+    json_t *tuple;
+    json_array_foreach(args, index, tuple) {
+        size_t i;
+        json_t *value;
+        int valid = json_is_array(tuple) &&
+            json_array_size(tuple) <= SPECIFIC_MAX_ARGS;
+
+        json_array_foreach(tuple, i, value) {
+            if (!json_is_string(value)) valid = 0;
+        }
+
+        if (!valid) {
+            set_baton_error(error, CAT_INVALID_ARGUMENT,
+                            "Invalid specific query args at position %zu: "
+                            "not a JSON array of at most %d strings",
+                            index, SPECIFIC_MAX_ARGS);
+            goto error;
+        }
+    }
+
+    batch.results = calloc(batch.num_tuples, sizeof (json_t *));
+    if (!batch.results) {
+        set_baton_error(error, errno, "Failed to allocate memory: error %d %s",
+                        errno, strerror(errno));
+        goto error;
+    }
+
+    pthread_mutex_init(&batch.mutex, NULL);
+
+    if (num_threads > SPECIFIC_MAX_THREADS) num_threads = SPECIFIC_MAX_THREADS;
+    if (num_threads > batch.num_tuples)     num_threads = batch.num_tuples;
+
+    logmsg(DEBUG, "Running specific query '%s' for %zu argument tuples "
+           "on %zu threads", batch.sql, batch.num_tuples, num_threads);
+
+    if (num_threads == 0) {
+        run_specific_batch(conn, &batch);
+    }
+    else {
+        for (size_t i = 0; i < num_threads; i++) {
+            int status = pthread_create(&threads[i], NULL,
+                                        specific_batch_worker, &batch);
+            if (status != 0) {
+                pthread_mutex_lock(&batch.mutex);
+                if (batch.error.code == 0) {
+                    set_baton_error(&batch.error, status, "Failed to start "
+                                    "a specific query thread: error %d %s",
+                                    status, strerror(status));
+                }
+                pthread_mutex_unlock(&batch.mutex);
+                break;
+            }
+            num_started++;
+        }
+
+        for (size_t i = 0; i < num_started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
 
-    free_squery_input(squery_in);
-    free_specific_labels(format);
+    pthread_mutex_destroy(&batch.mutex);
+
+    if (batch.error.code != 0) {
+        set_baton_error(error, batch.error.code, "%s", batch.error.message);
+        goto error;
+    }
+
+    // Results are reported in the order of the argument tuples
+    items = json_array();
+    if (!items) {
+        set_baton_error(error, -1, "Failed to allocate a new JSON array");
+        goto error;
+    }
+
+    for (size_t i = 0; i < batch.num_tuples; i++) {
+        json_array_extend(items, batch.results[i]);
+    }
+
+finally:
+    if (batch.results) {
+        for (size_t i = 0; i < batch.num_tuples; i++) {
+            if (batch.results[i]) json_decref(batch.results[i]);
+        }
+        free(batch.results);
+    }
+    if (args)   json_decref(args);
+    if (format) free_specific_labels(format);
     logmsg(TRACE, "Found %d matching items", json_array_size(items));
 
     return items;
 
 error:
-    if (squery_in)  free_squery_input(squery_in);
-    if (format)     free_specific_labels(format);
-    if (items)      json_decref(items);
+    if (items) json_decref(items);
+    items = NULL;
 
-    return NULL;
+    goto finally;
 }
 
-json_t *do_query(rcComm_t *conn, genQueryInp_t *query_in,
-                 const char *labels[], baton_error_t *error) {
+// Release the server's statement for a query abandoned before its
+// last page
+static void close_query(rcComm_t *conn, genQueryInp_t *query_in) {
+    genQueryOut_t *query_out = NULL;
+
+    query_in->maxRows = 0;
+    int status = rcGenQuery(conn, query_in, &query_out);
+    if (status < 0 && status != CAT_NO_ROWS_FOUND) {
+        logmsg(WARN, "Failed to close an abandoned query: error %d", status);
+    }
+
+    if (query_out) free_query_output(query_out);
+}
+
+static void close_squery(rcComm_t *conn, specificQueryInp_t *squery_in) {
     genQueryOut_t *query_out = NULL;
-    size_t chunk_num  = 0;
-    int continue_flag = 0;
 
+    squery_in->maxRows = 0;
+    int status = rcSpecificQuery(conn, squery_in, &query_out);
+    if (status < 0 && status != CAT_NO_ROWS_FOUND) {
+        logmsg(WARN, "Failed to close an abandoned specific query: "
+               "error %d", status);
+    }
+
+    if (query_out) free_query_output(query_out);
+}
+
+json_t *do_query(rcComm_t *conn, genQueryInp_t *query_in,
+                 const char *labels[], baton_error_t *error) {
     init_baton_error(error);
 
     json_t *results = json_array();
@@ -397,95 +789,193 @@ json_t *do_query(rcComm_t *conn, genQueryInp_t *query_in,
         goto error;
     }
 
+    do_query_pages(conn, query_in, labels, extend_results, results, error);
+    if (error->code != 0) goto error;
+
+    logmsg(DEBUG, "Obtained a total of %d JSON results",
+           json_array_size(results));
+
+    return results;
+
+error:
+    if (results) json_decref(results);
+
+    return NULL;
+}
+
+int do_query_pages(rcComm_t *conn, genQueryInp_t *query_in,
+                   const char *labels[], query_page_cb page_cb, void *data,
+                   baton_error_t *error) {
+    query_cursor_t cursor = { .conn     = conn,
+                              .query_in = query_in,
+                              .labels   = labels };
+    json_t *chunk;
+
+    init_baton_error(error);
+
     logmsg(DEBUG, "Running query ...");
 
-    while (chunk_num == 0 || continue_flag > 0) {
-        logmsg(DEBUG, "Attempting to get chunk %d of query", chunk_num);
+    while ((chunk = next_query_page(&cursor, error))) {
+        // The callback may run further iRODS API calls on the
+        // connection between pages
+        page_cb(chunk, data, error);
+        json_decref(chunk);
 
-        int status = rcGenQuery(conn, query_in, &query_out);
+        if (error->code != 0) {
+            logmsg(ERROR, error->message);
+            goto error;
+        }
+    }
+    if (error->code != 0) goto error;
 
-        if (status == 0) {
-            logmsg(DEBUG, "Successfully fetched chunk %d of query", chunk_num);
+    logmsg(DEBUG, "Obtained query results in %d chunks", cursor.num_pages);
 
-            if (!query_out) {
-                set_baton_error(error, -1,
-                                "Query result unexpectedly NULL "
-                                "in chunk %d error %d", chunk_num, -1);
-                goto error;
-            }
+    return error->code;
 
-            // Allows query_out to be freed
-            continue_flag = query_out->continueInx;
+error:
+    if (cursor.more) close_query(conn, query_in);
 
-            // Cargo-cult from iRODS clients; not sure this is useful
-            query_in->continueInx = query_out->continueInx;
+    return error->code;
+}
 
-            json_t *chunk = make_json_objects(query_out, labels);
-            if (!chunk) {
-                set_baton_error(error, -1,
-                                "Failed to convert query result to JSON: "
-                                "in chunk %d error %d", chunk_num, -1);
-                goto error;
-            }
+query_cursor_t *open_search_cursor(rcComm_t *conn, char *zone_name,
+                                   json_t *query, query_format_in_t *format,
+                                   prepare_avu_search_cb prepare_avu,
+                                   prepare_acl_search_cb prepare_acl,
+                                   prepare_tps_search_cb prepare_cre,
+                                   prepare_tps_search_cb prepare_mod,
+                                   size_t num_ordered, baton_error_t *error) {
+    query_cursor_t *cursor = NULL;
+    genQueryInp_t *query_in;
+
+    query_in = prepare_search(conn, zone_name, query, format, prepare_avu,
+                              prepare_acl, prepare_cre, prepare_mod, error);
+    if (error->code != 0) goto error;
 
-            logmsg(TRACE, "Converted query result to JSON: in chunk %d of %d",
-                   chunk_num, json_array_size(chunk));
-            chunk_num++;
+    for (size_t i = 0; i < num_ordered && i < format->num_columns; i++) {
+        add_select_modifier(query_in, format->columns[i], ORDER_BY);
+    }
 
-            status = json_array_extend(results, chunk);
-            json_decref(chunk);
+    cursor = calloc(1, sizeof (query_cursor_t));
+    if (!cursor) {
+        set_baton_error(error, errno, "Failed to allocate memory: error %d %s",
+                        errno, strerror(errno));
+        goto error;
+    }
 
-            if (status != 0) {
-                set_baton_error(error, status,
-                                "Failed to add JSON query result to total: "
-                                "in chunk %d error %d", chunk_num, status);
-                goto error;
-            }
+    cursor->conn     = conn;
+    cursor->query_in = query_in;
+    cursor->labels   = format->labels;
 
-            free_query_output(query_out);
-        }
-        else if (status == CAT_NO_ROWS_FOUND && chunk_num > 0) {
-            // Oddly CAT_NO_ROWS_FOUND is also returned at the end of a
-            // batch of chunks; test chunk_num to distinguish catch this
-            logmsg(TRACE, "Got CAT_NO_ROWS_FOUND at end of results!");
-            break;
-        }
-        else if (status == CAT_NO_ROWS_FOUND) {
-            // If this genuinely means no rows have been found, should we
-            // free this, or not? Current iRODS leaves this NULL.
-            logmsg(TRACE, "Query returned no results");
-            break;
+    return cursor;
+
+error:
+    if (query_in) free_query_input(query_in);
+
+    return NULL;
+}
+
+json_t *next_query_page(query_cursor_t *cursor, baton_error_t *error) {
+    genQueryOut_t *query_out = NULL;
+    json_t *chunk            = NULL;
+
+    init_baton_error(error);
+
+    if (cursor->done) return NULL;
+
+    if (check_deadline("query", error) != 0) goto error;
+
+    logmsg(DEBUG, "Attempting to get chunk %d of query", cursor->num_pages);
+
+    trace_span_t span;
+    trace_begin(&span, TRACE_CAT_QUERY, "rcGenQuery", "page %d",
+                cursor->num_pages);
+    int status = rcGenQuery(cursor->conn, cursor->query_in, &query_out);
+    trace_end(&span);
+
+    if (status == 0) {
+        logmsg(DEBUG, "Successfully fetched chunk %d of query",
+               cursor->num_pages);
+
+        if (!query_out) {
+            set_baton_error(error, -1,
+                            "Query result unexpectedly NULL "
+                            "in chunk %d error %d", cursor->num_pages, -1);
+            cursor->more = 0;
+            goto error;
         }
-        else {
-            char *err_subname;
-            const char *err_name = rodsErrorName(status, &err_subname);
-            set_baton_error(error, status,
-                            "Failed to fetch query result: in chunk %d "
-                            "error %d %s", chunk_num, status, err_name);
+
+        // Allows query_out to be freed
+        cursor->more = query_out->continueInx > 0;
+
+        // Cargo-cult from iRODS clients; not sure this is useful
+        cursor->query_in->continueInx = query_out->continueInx;
+
+        chunk = make_json_objects(query_out, cursor->labels);
+        if (!chunk) {
+            set_baton_error(error, -1,
+                            "Failed to convert query result to JSON: "
+                            "in chunk %d error %d", cursor->num_pages, -1);
             goto error;
         }
+
+        logmsg(TRACE, "Converted query result to JSON: in chunk %d of %d",
+               cursor->num_pages, json_array_size(chunk));
+        cursor->num_pages++;
+        if (!cursor->more) cursor->done = 1;
+
+        free_query_output(query_out);
+
+        return chunk;
+    }
+    else if (status == CAT_NO_ROWS_FOUND && cursor->num_pages > 0) {
+        // Oddly CAT_NO_ROWS_FOUND is also returned at the end of a
+        // batch of chunks; test num_pages to distinguish catch this
+        logmsg(TRACE, "Got CAT_NO_ROWS_FOUND at end of results!");
+    }
+    else if (status == CAT_NO_ROWS_FOUND) {
+        // If this genuinely means no rows have been found, should we
+        // free this, or not? Current iRODS leaves this NULL.
+        logmsg(TRACE, "Query returned no results");
+    }
+    else {
+        char *err_subname;
+        const char *err_name = rodsErrorName(status, &err_subname);
+        set_baton_error(error, status,
+                        "Failed to fetch query result: in chunk %d "
+                        "error %d %s", cursor->num_pages, status, err_name);
+        cursor->more = 0;
+        goto error;
     }
 
-    logmsg(DEBUG, "Obtained a total of %d JSON results in %d chunks",
-           chunk_num, json_array_size(results));
+    cursor->more = 0;
+    cursor->done = 1;
 
-    return results;
+    return NULL;
 
 error:
-    if (conn->rError) {
+    if (cursor->conn->rError) {
         logmsg(ERROR, error->message);
-        log_rods_errstack(ERROR, conn->rError);
+        log_rods_errstack(ERROR, cursor->conn->rError);
     }
     else {
         logmsg(ERROR, error->message);
     }
 
     if (query_out) free_query_output(query_out);
-    if (results)   json_decref(results);
+    if (chunk)     json_decref(chunk);
 
     return NULL;
 }
 
+void close_query_cursor(query_cursor_t *cursor) {
+    if (!cursor) return;
+
+    if (cursor->more) close_query(cursor->conn, cursor->query_in);
+    free_query_input(cursor->query_in);
+    free(cursor);
+}
+
 json_t *do_squery(rcComm_t *conn, specificQueryInp_t *squery_in,
                   query_format_in_t *format,
                   baton_error_t *error) {
@@ -497,6 +987,8 @@ json_t *do_squery(rcComm_t *conn, specificQueryInp_t *squery_in,
     char *err_subname;
     int status;
 
+    init_baton_error(error);
+
     json_t *results = json_array();
     if (!results) {
         set_baton_error(error, -1, "Failed to allocate a new JSON array");
@@ -506,6 +998,11 @@ json_t *do_squery(rcComm_t *conn, specificQueryInp_t *squery_in,
     logmsg(DEBUG, "Running specific query ...");
 
     while (chunk_num == 0 || continue_flag > 0) {
+        if (check_deadline("specific query", error) != 0) {
+            if (continue_flag > 0) close_squery(conn, squery_in);
+            goto error;
+        }
+
         logmsg(DEBUG, "Attempting to get chunk %d of query", chunk_num);
 
         status = rcSpecificQuery(conn, squery_in, &query_out);
@@ -542,6 +1039,7 @@ json_t *do_squery(rcComm_t *conn, specificQueryInp_t *squery_in,
             }
 
             if (query_out) free_query_output(query_out);
+            query_out = NULL;
         }
         else if (status == CAT_NO_ROWS_FOUND && chunk_num > 0) {
             // Oddly CAT_NO_ROWS_FOUND is also returned at the end of a
@@ -1013,43 +1511,19 @@ json_t *add_tps_json_object(rcComm_t *conn, json_t *object,
     raw_timestamps = list_timestamps(conn, &rods_path, error);
     if (error->code != 0) goto error;
 
-    timestamps = json_array();
-    if (!timestamps) {
-        set_baton_error(error, -1, "Failed to allocate a new JSON array");
-        goto error;
-    }
-
     // We report timestamps only on data objects. They exist on
     // collections too, but we don't report them to be consistent with
     // the 'ils' command.
     if (represents_data_object(object)) {
-        size_t i;
-        json_t *item;
-        json_array_foreach(raw_timestamps, i, item) {
-            const char *repl_num = get_replicate_num(item, error);
-            if (error->code != 0) goto error;
-            const char *created = get_created_timestamp(item, error);
-            if (error->code != 0) goto error;
-            const char *modified = get_modified_timestamp(item, error);
-            if (error->code != 0) goto error;
-
-            json_t *iso_created =
-                make_timestamp(JSON_CREATED_KEY, created, RFC3339_FORMAT,
-                               repl_num, error);
-            if (error->code != 0) goto error;
-
-            json_t *iso_modified =
-                make_timestamp(JSON_MODIFIED_KEY, modified, RFC3339_FORMAT,
-                               repl_num, error);
-            if (error->code != 0) goto error;
-
-            json_array_append_new(timestamps, iso_created);
-            json_array_append_new(timestamps, iso_modified);
-
-            logmsg(DEBUG, "Adding timestamps from replicate %s of '%s'",
-                   repl_num, path);
+        timestamps = make_timestamps(raw_timestamps, path, error);
+    }
+    else {
+        timestamps = json_array();
+        if (!timestamps) {
+            set_baton_error(error, -1, "Failed to allocate a new JSON array");
         }
     }
+    if (error->code != 0) goto error;
 
     json_object_set_new(object, JSON_TIMESTAMPS_KEY, timestamps);
     if (error->code != 0) goto error;
@@ -1217,6 +1691,391 @@ error:
     return NULL;
 }
 
+static int merge_avus(json_t *object, json_t *rows, baton_error_t *error) {
+    json_t *avus = json_deep_copy(rows);
+    if (!avus) {
+        set_baton_error(error, -1, "Failed to copy AVU data");
+        goto error;
+    }
+
+    add_metadata(object, avus, error);
+
+error:
+    return error->code;
+}
+
+static int merge_acl(json_t *object, json_t *rows, baton_error_t *error) {
+    json_t *perms = json_deep_copy(rows);
+    if (!perms) {
+        set_baton_error(error, -1, "Failed to copy permissions data");
+        goto error;
+    }
+
+    revmap_access_result(perms, error);
+    if (error->code != 0) {
+        json_decref(perms);
+        goto error;
+    }
+
+    add_permissions(object, perms, error);
+
+error:
+    return error->code;
+}
+
+static int merge_checksum(json_t *object, json_t *rows,
+                          baton_error_t *error) {
+    init_baton_error(error);
+
+    if (json_array_size(rows) != 1) {
+        set_baton_error(error, -1, "Expected 1 data object result but "
+                        "found %d. This occurs when the object replicates "
+                        "have different checksum values in the iRODS database",
+                        json_array_size(rows));
+        goto error;
+    }
+
+    json_t *row = json_array_get(rows, 0);
+    json_t *checksum = json_incref(json_object_get(row, JSON_CHECKSUM_KEY));
+
+    add_checksum(object, checksum, error);
+
+error:
+    return error->code;
+}
+
+static int merge_tps(json_t *object, json_t *rows, baton_error_t *error) {
+    init_baton_error(error);
+
+    const char *data_object = get_data_object_value(object, error);
+    if (error->code != 0) goto error;
+
+    json_t *timestamps = make_timestamps(rows, data_object, error);
+    if (error->code != 0) goto error;
+
+    json_object_set_new(object, JSON_TIMESTAMPS_KEY, timestamps);
+
+error:
+    return error->code;
+}
+
+static enrich_family_t avu_family =
+    { .name       = "AVU",
+      .format     = { .num_columns = 4,
+                      .columns     = { COL_DATA_NAME,
+                                       COL_META_DATA_ATTR_NAME,
+                                       COL_META_DATA_ATTR_VALUE,
+                                       COL_META_DATA_ATTR_UNITS },
+                      .labels      = { JSON_DATA_OBJECT_KEY,
+                                       JSON_ATTRIBUTE_KEY, JSON_VALUE_KEY,
+                                       JSON_UNITS_KEY } },
+      .num_conds   = 0,
+      .collections = 1,
+      .add_object  = add_avus_json_object,
+      .merge       = merge_avus };
+
+// As list_permissions, this reports groups unexpanded
+static enrich_family_t acl_family =
+    { .name       = "ACL",
+      .format     = { .num_columns = 4,
+                      .columns     = { COL_DATA_NAME,
+                                       COL_USER_NAME, COL_USER_ZONE,
+                                       COL_DATA_ACCESS_NAME },
+                      .labels      = { JSON_DATA_OBJECT_KEY,
+                                       JSON_OWNER_KEY, JSON_ZONE_KEY,
+                                       JSON_LEVEL_KEY } },
+      .conds       = { { .column   = COL_DATA_TOKEN_NAMESPACE,
+                         .operator = SEARCH_OP_EQUALS,
+                         .value    = ACCESS_NAMESPACE } },
+      .num_conds   = 1,
+      .collections = 1,
+      .add_object  = add_acl_json_object,
+      .merge       = merge_acl };
+
+static enrich_family_t checksum_family =
+    { .name       = "checksum",
+      .format     = { .num_columns = 2,
+                      .columns     = { COL_DATA_NAME, COL_D_DATA_CHECKSUM },
+                      .labels      = { JSON_DATA_OBJECT_KEY,
+                                       JSON_CHECKSUM_KEY },
+                      .good_repl   = 1 },
+      .num_conds   = 0,
+      .collections = 0,
+      .add_object  = add_checksum_json_object,
+      .merge       = merge_checksum };
+
+static enrich_family_t tps_family =
+    { .name       = "timestamp",
+      .format     = { .num_columns = 4,
+                      .columns     = { COL_DATA_NAME,
+                                       COL_D_CREATE_TIME, COL_D_MODIFY_TIME,
+                                       COL_DATA_REPL_NUM },
+                      .labels      = { JSON_DATA_OBJECT_KEY,
+                                       JSON_CREATED_KEY, JSON_MODIFIED_KEY,
+                                       JSON_REPLICATE_KEY } },
+      .num_conds   = 0,
+      .collections = 0,
+      .add_object  = add_tps_json_object,
+      .merge       = merge_tps };
+
+// Names that cannot be quoted in a GenQuery IN clause, or that would
+// not fit in one, are enriched one at a time.
+static int is_batchable_name(const char *name) {
+    size_t len = strnlen(name, ENRICH_MAX_IN_LEN);
+
+    return len + 5 < ENRICH_MAX_IN_LEN && !strchr(name, '\'');
+}
+
+// Run one query for the data objects in a collection whose names are
+// in the in_list, i.e. the names of the entries of by_name from first
+// up to, but not including, last. Then join the result rows to the
+// data objects by name.
+static int enrich_batch(rcComm_t *conn, const char *collection,
+                        const char *in_list, json_t *by_name,
+                        void *first, void *last, enrich_family_t *family,
+                        baton_error_t *error) {
+    genQueryInp_t *query_in = NULL;
+    json_t *rows            = NULL;
+    json_t *rows_by_name    = NULL;
+    query_format_in_t *format = &family->format;
+
+    init_baton_error(error);
+
+    query_in = make_query_input(SEARCH_MAX_ROWS, format->num_columns,
+                                format->columns);
+    if (!query_in) {
+        set_baton_error(error, errno, "Failed to allocate memory: error %d %s",
+                        errno, strerror(errno));
+        goto error;
+    }
+
+    query_cond_t cn = { .column   = COL_COLL_NAME,
+                        .operator = SEARCH_OP_EQUALS,
+                        .value    = collection };
+    query_cond_t dn = { .column   = COL_DATA_NAME,
+                        .operator = SEARCH_OP_IN,
+                        .value    = in_list };
+    add_query_conds(query_in, 2, (query_cond_t []) { cn, dn });
+    if (family->num_conds > 0) {
+        add_query_conds(query_in, family->num_conds, family->conds);
+    }
+    if (format->good_repl) {
+        limit_to_good_repl(query_in);
+    }
+
+    addKeyVal(&query_in->condInput, ZONE_KW, collection);
+    rows = do_query(conn, query_in, format->labels, error);
+    if (error->code != 0) goto error;
+
+    logmsg(DEBUG, "Obtained %zu %s rows for data objects %s in '%s'",
+           json_array_size(rows), family->name, in_list, collection);
+
+    rows_by_name = json_object();
+    if (!rows_by_name) {
+        set_baton_error(error, -1, "Failed to allocate a new JSON object");
+        goto error;
+    }
+
+    size_t i;
+    json_t *row;
+    json_array_foreach(rows, i, row) {
+        json_t *name = json_object_get(row, JSON_DATA_OBJECT_KEY);
+        if (!json_is_string(name)) continue;
+
+        json_t *name_rows = json_object_get(rows_by_name,
+                                            json_string_value(name));
+        if (!name_rows) {
+            name_rows = json_array();
+            json_object_set_new(rows_by_name, json_string_value(name),
+                                name_rows);
+        }
+        json_array_append(name_rows, row);
+
+        // Leave only the columns that belong in the enriched object
+        json_object_del(row, JSON_DATA_OBJECT_KEY);
+    }
+
+    for (void *iter = first; iter != last;
+         iter = json_object_iter_next(by_name, iter)) {
+        const char *name = json_object_iter_key(iter);
+        json_t *objects  = json_object_iter_value(iter);
+        json_t *empty    = NULL;
+
+        json_t *name_rows = json_object_get(rows_by_name, name);
+        if (!name_rows) {
+            name_rows = empty = json_array();
+        }
+
+        size_t j;
+        json_t *object;
+        json_array_foreach(objects, j, object) {
+            family->merge(object, name_rows, error);
+            if (error->code != 0) break;
+        }
+
+        if (empty) json_decref(empty);
+        if (error->code != 0) goto error;
+    }
+
+    free_query_input(query_in);
+    json_decref(rows);
+    json_decref(rows_by_name);
+
+    return error->code;
+
+error:
+    logmsg(ERROR, "Failed to add %s data to data objects in '%s': "
+           "error %d %s", family->name, collection, error->code,
+           error->message);
+
+    if (query_in)     free_query_input(query_in);
+    if (rows)         json_decref(rows);
+    if (rows_by_name) json_decref(rows_by_name);
+
+    return error->code;
+}
+
+static int enrich_collection(rcComm_t *conn, const char *collection,
+                             json_t *by_name, enrich_family_t *family,
+                             baton_error_t *error) {
+    char in_list[ENRICH_MAX_IN_LEN];
+    size_t len       = 0;
+    size_t num_names = 0;
+
+    init_baton_error(error);
+
+    void *first = json_object_iter(by_name);
+    void *iter  = first;
+    while (iter) {
+        const char *name = json_object_iter_key(iter);
+        size_t name_len  = strlen(name) + 3; // Quotes and separator
+
+        if (num_names == ENRICH_MAX_NAMES ||
+            len + name_len + 1 >= ENRICH_MAX_IN_LEN) {
+            snprintf(in_list + len, sizeof in_list - len, ")");
+            enrich_batch(conn, collection, in_list, by_name, first, iter,
+                         family, error);
+            if (error->code != 0) goto finally;
+
+            len       = 0;
+            num_names = 0;
+            first     = iter;
+        }
+
+        len += snprintf(in_list + len, sizeof in_list - len, "%s'%s'",
+                        num_names == 0 ? "(" : ",", name);
+        num_names++;
+
+        iter = json_object_iter_next(by_name, iter);
+    }
+
+    if (num_names > 0) {
+        snprintf(in_list + len, sizeof in_list - len, ")");
+        enrich_batch(conn, collection, in_list, by_name, first, NULL,
+                     family, error);
+    }
+
+finally:
+    return error->code;
+}
+
+static json_t *enrich_json_array(rcComm_t *conn, json_t *array,
+                                 enrich_family_t *family,
+                                 baton_error_t *error) {
+    json_t *groups = NULL;
+
+    init_baton_error(error);
+
+    if (!json_is_array(array)) {
+        set_baton_error(error, CAT_INVALID_ARGUMENT,
+                        "Invalid target: not a JSON array");
+        goto error;
+    }
+
+    // Group data objects by collection, then by name. A name maps to
+    // an array in case the same data object occurs more than once.
+    groups = json_object();
+    if (!groups) {
+        set_baton_error(error, -1, "Failed to allocate a new JSON object");
+        goto error;
+    }
+
+    size_t i;
+    json_t *item;
+    json_array_foreach(array, i, item) {
+        if (represents_data_object(item)) {
+            const char *collection = get_collection_value(item, error);
+            if (error->code != 0) goto error;
+            const char *data_object = get_data_object_value(item, error);
+            if (error->code != 0) goto error;
+
+            if (is_batchable_name(data_object)) {
+                json_t *by_name = json_object_get(groups, collection);
+                if (!by_name) {
+                    by_name = json_object();
+                    json_object_set_new(groups, collection, by_name);
+                }
+
+                json_t *objects = json_object_get(by_name, data_object);
+                if (!objects) {
+                    objects = json_array();
+                    json_object_set_new(by_name, data_object, objects);
+                }
+
+                if (json_array_append(objects, item) != 0) {
+                    set_baton_error(error, -1, "Failed to group data "
+                                    "object '%s/%s'", collection,
+                                    data_object);
+                    goto error;
+                }
+                continue;
+            }
+        }
+        else if (!family->collections) {
+            continue;
+        }
+
+        family->add_object(conn, item, error);
+        if (error->code != 0) goto error;
+    }
+
+    const char *collection;
+    json_t *by_name;
+    json_object_foreach(groups, collection, by_name) {
+        enrich_collection(conn, collection, by_name, family, error);
+        if (error->code != 0) goto error;
+    }
+
+    json_decref(groups);
+
+    return array;
+
+error:
+    if (groups) json_decref(groups);
+
+    return NULL;
+}
+
+json_t *add_acl_json_array_batched(rcComm_t *conn, json_t *array,
+                                   baton_error_t *error) {
+    return enrich_json_array(conn, array, &acl_family, error);
+}
+
+json_t *add_avus_json_array_batched(rcComm_t *conn, json_t *array,
+                                    baton_error_t *error) {
+    return enrich_json_array(conn, array, &avu_family, error);
+}
+
+json_t *add_checksum_json_array_batched(rcComm_t *conn, json_t *array,
+                                        baton_error_t *error) {
+    return enrich_json_array(conn, array, &checksum_family, error);
+}
+
+json_t *add_tps_json_array_batched(rcComm_t *conn, json_t *array,
+                                   baton_error_t *error) {
+    return enrich_json_array(conn, array, &tps_family, error);
+}
+
 json_t *map_access_args(json_t *query, baton_error_t *error) {
     json_t *user_info = NULL;
 
@@ -30,6 +30,50 @@
 #include "query.h"
 #include "utilities.h"
 
+/** The maximum number of data objects enriched by one query. */
+#define ENRICH_MAX_NAMES  100
+
+/** The maximum length of the list of data object names in one query. */
+#define ENRICH_MAX_IN_LEN 2048
+
+/** The maximum number of arguments of a specific query. */
+#define SPECIFIC_MAX_ARGS    10
+
+/** The maximum number of threads running a batch of specific queries. */
+#define SPECIFIC_MAX_THREADS 64
+
+/**
+ * Typedef for callbacks receiving query results one page at a time.
+ *
+ * @param[in]  page          A JSON array of objects, one per result row,
+ *                           owned by the caller.
+ * @param[in]  data          Callback-specific data.
+ * @param[out] error         An error report struct. Setting an error stops
+ *                           the query.
+ *
+ * @return 0 on success, error code on failure.
+ */
+typedef int (*query_page_cb) (json_t *page, void *data, baton_error_t *error);
+
+/**
+ *  @struct query_cursor
+ *  @brief A general query read one page at a time.
+ */
+typedef struct query_cursor {
+    /** The connection on which the query runs. */
+    rcComm_t *conn;
+    /** The query input. */
+    genQueryInp_t *query_in;
+    /** The labels of the selected columns. */
+    const char **labels;
+    /** The number of pages read. */
+    size_t num_pages;
+    /** True while the server holds unread pages. */
+    int more;
+    /** True once the last page has been read. */
+    int done;
+} query_cursor_t;
+
 /**
  * Log the current JSON error state through the underlying logging
  * mechanism.
@@ -80,6 +124,38 @@ json_t *do_search(rcComm_t *conn, char *zone_name, json_t *query,
                   prepare_tps_search_cb prepare_mod,
                   baton_error_t *error);
 
+/**
+ * Execute a general query as do_search does, passing the results to a
+ * callback as each page arrives, rather than collecting them.
+ *
+ * @param[in]  conn          An open iRODS connection.
+ * @param[in]  zone          The zone in which to search.
+ * @param[in]  query         The search query formulated as JSON.
+ * @param[in]  format        Query format parameters indicating which columns
+ *                           to return.
+ * @param[in]  prepare_avu   Callback to add any AVU-fetching clauses to the
+ *                           query.
+ * @param[in]  prepare_acl   Callback to add any ACL-fetching clauses to the
+ *                           query.
+ * @param[in]  prepare_cre   Callback to add any creation timestamp clauses
+ *                           to the query.
+ * @param[in]  prepare_mod   Callback to add any modification timestamp clauses
+ *                           to the query.
+ * @param[in]  page_cb       Callback receiving each page of results.
+ * @param[in]  data          Data passed to the page callback.
+ * @param[in,out] error      An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int do_search_pages(rcComm_t *conn, char *zone_name, json_t *query,
+                    query_format_in_t *format,
+                    prepare_avu_search_cb prepare_avu,
+                    prepare_acl_search_cb prepare_acl,
+                    prepare_tps_search_cb prepare_cre,
+                    prepare_tps_search_cb prepare_mod,
+                    query_page_cb page_cb, void *data,
+                    baton_error_t *error);
+
 /**
  * Execute a specific query and obtain results as a JSON array of objects.
  * Columns in the query are mapped to JSON object properties specified
@@ -99,6 +175,33 @@ json_t *do_specific(rcComm_t *conn, char *zone_name, json_t *query,
                     prepare_specific_labels_cb prepare_labels,
                     baton_error_t *error);
 
+/**
+ * Execute a specific query, as do_specific. The query's args may be
+ * an array of argument tuples, each a JSON array of strings, in which
+ * case the query is run once for each tuple, with the labels resolved
+ * once for all of them. Each result row then has an "args_index"
+ * property, the position of its tuple, and rows are reported in order
+ * of tuple.
+ *
+ * @param[in]  conn          An open iRODS connection.
+ * @param[in]  zone_name     The zone in which to search (can be NULL for
+ *                           default zone).
+ * @param[in]  query         The search query formulated as JSON.
+ * @param[in]  prepare_squery Callback preparing each query input.
+ * @param[in]  prepare_labels Callback preparing the labels.
+ * @param[in]  num_threads   The number of tuples to run concurrently,
+ *                           each thread with its own connection. 0
+ *                           runs them in turn on conn.
+ * @param[in,out] error      An error report struct.
+ *
+ * @return A newly constructed JSON array of objects, one per result row. The
+ * caller must free this after use.
+ */
+json_t *do_specific_concurrent(rcComm_t *conn, char *zone_name, json_t *query,
+                               prepare_specific_query_cb prepare_squery,
+                               prepare_specific_labels_cb prepare_labels,
+                               size_t num_threads, baton_error_t *error);
+
 /**
  * Execute a general query and obtain results as a JSON array of objects.
  * Columns in the query are mapped to JSON object properties specified
@@ -116,6 +219,73 @@ json_t *do_specific(rcComm_t *conn, char *zone_name, json_t *query,
 json_t *do_query(rcComm_t *conn, genQueryInp_t *query_in,
                  const char *labels[], baton_error_t *error);
 
+/**
+ * Execute a general query, passing the results to a callback one page
+ * at a time. The callback may use the connection between pages.
+ *
+ * @param[in]  conn          An open iRODS connection.
+ * @param[in]  query_in      A populated query input.
+ * @param[in]  labels        An array of as many labels as there were columns
+ *                           selected in the query.
+ * @param[in]  page_cb       Callback receiving each page of results.
+ * @param[in]  data          Data passed to the page callback.
+ * @param[in,out] error      An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int do_query_pages(rcComm_t *conn, genQueryInp_t *query_in,
+                   const char *labels[], query_page_cb page_cb, void *data,
+                   baton_error_t *error);
+
+/**
+ * Prepare a search for reading one page at a time, at the caller's
+ * pace, as for do_search_pages. Several cursors may be open on one
+ * connection at once, each holding a statement on the server.
+ *
+ * @param[in]  conn          An open iRODS connection.
+ * @param[in]  zone_name     The zone in which to search (can be NULL for
+ *                           default zone).
+ * @param[in]  query         The search query formulated as JSON.
+ * @param[in]  format        The columns and labels of the results.
+ * @param[in]  prepare_avu   Callback adding AVU conditions.
+ * @param[in]  prepare_acl   Callback adding ACL conditions.
+ * @param[in]  prepare_cre   Callback adding created timestamp conditions.
+ * @param[in]  prepare_mod   Callback adding modified timestamp conditions.
+ * @param[in]  num_ordered   The number of leading columns by which the
+ *                           server is to order the results. 0 for
+ *                           unordered.
+ * @param[in,out] error      An error report struct.
+ *
+ * @return A new cursor, which the caller must close after use.
+ */
+query_cursor_t *open_search_cursor(rcComm_t *conn, char *zone_name,
+                                   json_t *query, query_format_in_t *format,
+                                   prepare_avu_search_cb prepare_avu,
+                                   prepare_acl_search_cb prepare_acl,
+                                   prepare_tps_search_cb prepare_cre,
+                                   prepare_tps_search_cb prepare_mod,
+                                   size_t num_ordered, baton_error_t *error);
+
+/**
+ * Read the next page of results from a cursor.
+ *
+ * @param[in]  cursor        An open cursor.
+ * @param[in,out] error      An error report struct.
+ *
+ * @return A newly constructed JSON array of objects, one per result row,
+ * or NULL after the last page or on error. The caller must free this
+ * after use.
+ */
+json_t *next_query_page(query_cursor_t *cursor, baton_error_t *error);
+
+/**
+ * Close a cursor, releasing the server's statement if pages remain
+ * unread.
+ *
+ * @param[in]  cursor        A cursor, or NULL.
+ */
+void close_query_cursor(query_cursor_t *cursor);
+
 /**
  * Execute a specific query and obtain results as a JSON array of objects.
  * Columns in the query are mapped to JSON object properties specified
@@ -263,6 +433,31 @@ json_t *add_checksum_json_array(rcComm_t *conn, json_t *array,
 json_t *add_checksum_json_object(rcComm_t *conn, json_t *object,
                                  baton_error_t *error);
 
+/**
+ * Add data to an array of collections and data objects, as
+ * add_acl_json_array, add_avus_json_array, add_checksum_json_array and
+ * add_tps_json_array, respectively. Data objects are grouped by
+ * collection and the data for up to ENRICH_MAX_NAMES of them are
+ * fetched with a single query, rather than one per data object.
+ *
+ * @param[in]  conn      An open iRODS connection.
+ * @param[in]  array     A JSON array of collections and data objects.
+ * @param[out] error     An error report struct.
+ *
+ * @return The array, with data added.
+ */
+json_t *add_acl_json_array_batched(rcComm_t *conn, json_t *array,
+                                   baton_error_t *error);
+
+json_t *add_avus_json_array_batched(rcComm_t *conn, json_t *array,
+                                    baton_error_t *error);
+
+json_t *add_checksum_json_array_batched(rcComm_t *conn, json_t *array,
+                                        baton_error_t *error);
+
+json_t *add_tps_json_array_batched(rcComm_t *conn, json_t *array,
+                                   baton_error_t *error);
+
 json_t *map_access_args(json_t *access, baton_error_t *error);
 
 json_t *revmap_access_result(json_t *access, baton_error_t *error);
@@ -316,19 +316,23 @@ json_t *list_path(rcComm_t *conn, rodsPath_t *rods_path, option_flags flags,
                 if (error->code != 0) goto error;
 
                 if (flags & PRINT_ACL) {
-                    contents = add_acl_json_array(conn, contents, error);
+                    contents = add_acl_json_array_batched(conn, contents,
+                                                          error);
                     if (error->code != 0) goto error;
                 }
                 if (flags & PRINT_AVU) {
-                    contents = add_avus_json_array(conn, contents, error);
+                    contents = add_avus_json_array_batched(conn, contents,
+                                                           error);
                     if (error->code != 0) goto error;
                 }
                 if (flags & PRINT_CHECKSUM) {
-                    contents = add_checksum_json_array(conn, contents, error);
+                    contents = add_checksum_json_array_batched(conn, contents,
+                                                               error);
                     if (error->code != 0) goto error;
                 }
                 if (flags & PRINT_TIMESTAMP) {
-                    contents = add_tps_json_array(conn, contents, error);
+                    contents = add_tps_json_array_batched(conn, contents,
+                                                          error);
                     if (error->code != 0) goto error;
                 }
                 if (flags & PRINT_REPLICATE) {
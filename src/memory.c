@@ -0,0 +1,327 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file memory.c
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "log.h"
+#include "memory.h"
+
+// Each allocation is preceded by its size and the envelope charged
+// for it, in a header that keeps the allocation aligned for any type
+#define HEADER_SIZE 16
+
+typedef struct alloc_header {
+    size_t size;
+    /** The generation of the envelope charged, or 0 for none. */
+    uint64_t generation;
+} alloc_header_t;
+
+typedef struct envelope_memory {
+    /** The generation of the envelope in progress, or 0 for none. */
+    uint64_t generation;
+    size_t limit;
+    size_t live;
+    size_t peak;
+    size_t allocations;
+    int exceeded;
+} envelope_memory_t;
+
+#define MAX_OP_NAME_LEN 32
+
+typedef struct op_memory {
+    char name[MAX_OP_NAME_LEN];
+    size_t envelopes;
+    size_t exceeded;
+    size_t total_peak_bytes;
+    size_t max_peak_bytes;
+    size_t json_nodes;
+    size_t max_json_nodes;
+} op_memory_t;
+
+static int enabled = 0;
+
+// Counters updated by every thread allocating JSON
+static size_t live_bytes  = 0;
+static size_t peak_bytes  = 0;
+static size_t allocations = 0;
+
+// The last envelope generation issued, to any thread
+static uint64_t generations = 0;
+
+// The envelope in progress on this thread. Only this thread's
+// allocations are charged to it and refused by its limit, so that
+// threads working concurrently, such as the write-behind flush, are
+// not failed by the envelope being processed.
+static __thread envelope_memory_t envelope;
+
+static pthread_mutex_t ops_mutex = PTHREAD_MUTEX_INITIALIZER;
+static op_memory_t ops[MEMORY_MAX_OPS];
+static size_t num_ops           = 0;
+static size_t num_envelopes     = 0;
+static size_t num_exceeded      = 0;
+static op_memory_t largest;
+static size_t largest_sequence  = 0;
+
+static void raise_peak(size_t *peak, size_t live) {
+    size_t current = __atomic_load_n(peak, __ATOMIC_RELAXED);
+    while (live > current &&
+           !__atomic_compare_exchange_n(peak, &current, live, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void *accounting_malloc(size_t size) {
+    if (envelope.generation > 0 && envelope.limit > 0 &&
+        envelope.live + size > envelope.limit) {
+        envelope.exceeded = 1;
+        return NULL;
+    }
+
+    char *ptr = malloc(size + HEADER_SIZE);
+    if (!ptr) return NULL;
+
+    alloc_header_t *header = (alloc_header_t *) ptr;
+    header->size       = size;
+    header->generation = envelope.generation;
+
+    if (envelope.generation > 0) {
+        envelope.live += size;
+        envelope.allocations++;
+        if (envelope.live > envelope.peak) envelope.peak = envelope.live;
+    }
+
+    size_t live = __atomic_add_fetch(&live_bytes, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    raise_peak(&peak_bytes, live);
+
+    return ptr + HEADER_SIZE;
+}
+
+static void accounting_free(void *ptr) {
+    if (!ptr) return;
+
+    char *start = (char *) ptr - HEADER_SIZE;
+    alloc_header_t *header = (alloc_header_t *) start;
+
+    // Only the envelope's own thread can credit it. Values it allocated
+    // that another thread frees remain counted as live.
+    if (header->generation > 0 &&
+        header->generation == envelope.generation) {
+        envelope.live -= header->size;
+    }
+
+    __atomic_sub_fetch(&live_bytes, header->size, __ATOMIC_RELAXED);
+
+    free(start);
+}
+
+void enable_memory_accounting(void) {
+    json_set_alloc_funcs(accounting_malloc, accounting_free);
+    enabled = 1;
+}
+
+int memory_accounting_enabled(void) {
+    return enabled;
+}
+
+void begin_envelope_memory(size_t limit) {
+    memset(&envelope, 0, sizeof (envelope_memory_t));
+    envelope.generation = __atomic_add_fetch(&generations, 1,
+                                             __ATOMIC_RELAXED);
+    envelope.limit = limit;
+}
+
+int end_envelope_memory(memory_stats_t *stats) {
+    stats->live_bytes  = envelope.live;
+    stats->peak_bytes  = envelope.peak;
+    stats->allocations = envelope.allocations;
+
+    int exceeded = envelope.exceeded;
+    memset(&envelope, 0, sizeof (envelope_memory_t));
+
+    return exceeded;
+}
+
+static op_memory_t *find_op(const char *op) {
+    for (size_t i = 0; i < num_ops; i++) {
+        if (strncmp(ops[i].name, op, MAX_OP_NAME_LEN) == 0) return &ops[i];
+    }
+
+    // Operations beyond the last slot are counted together in it
+    if (num_ops == MEMORY_MAX_OPS) return &ops[MEMORY_MAX_OPS - 1];
+
+    op_memory_t *entry = &ops[num_ops++];
+    snprintf(entry->name, MAX_OP_NAME_LEN, "%s",
+             num_ops == MEMORY_MAX_OPS ? "other" : op);
+
+    return entry;
+}
+
+void record_envelope_memory(const char *op, size_t sequence,
+                            memory_stats_t *stats, size_t json_nodes,
+                            int exceeded) {
+    logmsg(DEBUG, "Envelope %zu '%s' peaked at %zu bytes in %zu "
+           "allocations, leaving %zu bytes and %zu JSON values",
+           sequence, op, stats->peak_bytes, stats->allocations,
+           stats->live_bytes, json_nodes);
+
+    pthread_mutex_lock(&ops_mutex);
+
+    op_memory_t *entry = find_op(op);
+    entry->envelopes++;
+    entry->total_peak_bytes += stats->peak_bytes;
+    entry->json_nodes       += json_nodes;
+    if (exceeded) entry->exceeded++;
+    if (stats->peak_bytes > entry->max_peak_bytes) {
+        entry->max_peak_bytes = stats->peak_bytes;
+    }
+    if (json_nodes > entry->max_json_nodes) {
+        entry->max_json_nodes = json_nodes;
+    }
+
+    num_envelopes++;
+    if (exceeded) num_exceeded++;
+
+    if (num_envelopes == 1 || stats->peak_bytes > largest.max_peak_bytes) {
+        snprintf(largest.name, MAX_OP_NAME_LEN, "%s", op);
+        largest.max_peak_bytes = stats->peak_bytes;
+        largest.max_json_nodes = json_nodes;
+        largest_sequence       = sequence;
+    }
+
+    pthread_mutex_unlock(&ops_mutex);
+}
+
+void get_memory_stats(memory_stats_t *stats) {
+    stats->live_bytes  = __atomic_load_n(&live_bytes, __ATOMIC_RELAXED);
+    stats->peak_bytes  = __atomic_load_n(&peak_bytes, __ATOMIC_RELAXED);
+    stats->allocations = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+}
+
+json_t *memory_report(baton_error_t *error) {
+    json_t *report     = NULL;
+    json_t *op_reports = NULL;
+    memory_stats_t stats;
+
+    init_baton_error(error);
+    get_memory_stats(&stats);
+
+    pthread_mutex_lock(&ops_mutex);
+
+    op_reports = json_object();
+    if (!op_reports) {
+        set_baton_error(error, -1, "Failed to allocate a new JSON object");
+        goto error;
+    }
+
+    for (size_t i = 0; i < num_ops; i++) {
+        op_memory_t *entry = &ops[i];
+        json_t *op_report =
+            json_pack("{s:I, s:I, s:I, s:I, s:I, s:I}",
+                      "envelopes",        (json_int_t) entry->envelopes,
+                      "exceeded",         (json_int_t) entry->exceeded,
+                      "total_peak_bytes", (json_int_t) entry->total_peak_bytes,
+                      "max_peak_bytes",   (json_int_t) entry->max_peak_bytes,
+                      "json_nodes",       (json_int_t) entry->json_nodes,
+                      "max_json_nodes",   (json_int_t) entry->max_json_nodes);
+        if (!op_report) {
+            set_baton_error(error, -1, "Failed to pack a memory report");
+            goto error;
+        }
+
+        json_object_set_new(op_reports, entry->name, op_report);
+    }
+
+    json_t *largest_report = json_null();
+    if (num_envelopes > 0) {
+        largest_report =
+            json_pack("{s:I, s:s, s:I, s:I}",
+                      "sequence",   (json_int_t) largest_sequence,
+                      "operation",  largest.name,
+                      "peak_bytes", (json_int_t) largest.max_peak_bytes,
+                      "json_nodes", (json_int_t) largest.max_json_nodes);
+        if (!largest_report) {
+            set_baton_error(error, -1, "Failed to pack a memory report");
+            goto error;
+        }
+    }
+
+    report = json_pack("{s:I, s:I, s:I, s:I, s:I, s:o, s:o}",
+                       "live_bytes",       (json_int_t) stats.live_bytes,
+                       "peak_bytes",       (json_int_t) stats.peak_bytes,
+                       "allocations",      (json_int_t) stats.allocations,
+                       "envelopes",        (json_int_t) num_envelopes,
+                       "exceeded",         (json_int_t) num_exceeded,
+                       "largest_envelope", largest_report,
+                       "operations",       op_reports);
+    op_reports = NULL; // Stolen by json_pack, even on failure
+    if (!report) {
+        set_baton_error(error, -1, "Failed to pack a memory report");
+        goto error;
+    }
+
+    pthread_mutex_unlock(&ops_mutex);
+
+    return report;
+
+error:
+    pthread_mutex_unlock(&ops_mutex);
+    if (op_reports) json_decref(op_reports);
+
+    return NULL;
+}
+
+size_t count_json_nodes(json_t *json) {
+    if (!json) return 0;
+
+    size_t count = 1;
+
+    if (json_is_object(json)) {
+        const char *key;
+        json_t *value;
+        json_object_foreach(json, key, value) {
+            count += count_json_nodes(value);
+        }
+    }
+    else if (json_is_array(json)) {
+        size_t i;
+        json_t *value;
+        json_array_foreach(json, i, value) {
+            count += count_json_nodes(value);
+        }
+    }
+
+    return count;
+}
+
+void free_json_str(char *str) {
+    if (!str) return;
+
+    if (enabled) {
+        accounting_free(str);
+    }
+    else {
+        free(str);
+    }
+}
@@ -0,0 +1,139 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file memory.h
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#ifndef _BATON_MEMORY_H
+#define _BATON_MEMORY_H
+
+#include <errno.h>
+#include <stddef.h>
+
+#include <jansson.h>
+
+#include "config.h"
+#include "error.h"
+
+/** The error code of an envelope that exceeded its memory limit. */
+#define MEMORY_LIMIT_EXCEEDED ENOMEM
+
+/** The maximum number of operation types counted separately. */
+#define MEMORY_MAX_OPS 32
+
+/**
+ *  @struct memory_stats
+ *  @brief Counters of memory allocated for JSON.
+ */
+typedef struct memory_stats {
+    /** The number of bytes allocated and not yet freed. */
+    size_t live_bytes;
+    /** The largest number of bytes live at once. */
+    size_t peak_bytes;
+    /** The number of allocations made. */
+    size_t allocations;
+} memory_stats_t;
+
+/**
+ * Count the memory allocated for JSON by installing accounting
+ * allocators in jansson. This must be called before any JSON value is
+ * created, as values allocated before it cannot be freed afterwards.
+ */
+void enable_memory_accounting(void);
+
+/**
+ * Return true if memory accounting is enabled.
+ *
+ * @return 1 if enabled, 0 otherwise.
+ */
+int memory_accounting_enabled(void);
+
+/**
+ * Start counting the memory used by an envelope on the calling thread.
+ * Only the allocations made by the calling thread are charged to the
+ * envelope, and only they are refused by its limit. Allocations by
+ * other threads during the envelope, such as those flushing
+ * write-behind or fetching data, are neither charged nor refused.
+ *
+ * @param[in]  limit      The number of bytes the envelope may have live
+ *                        at once. Allocations beyond it fail. 0 means
+ *                        unbounded.
+ */
+void begin_envelope_memory(size_t limit);
+
+/**
+ * Stop counting the memory used by the envelope on the calling thread
+ * and lift its limit.
+ *
+ * @param[out] stats      The live bytes remaining allocated by the
+ *                        envelope, its peak bytes and the number of
+ *                        allocations it made.
+ *
+ * @return 1 if an allocation failed because the envelope reached its
+ * limit, 0 otherwise.
+ */
+int end_envelope_memory(memory_stats_t *stats);
+
+/**
+ * Add the memory used by an envelope to the totals for its operation.
+ *
+ * @param[in]  op          The operation name.
+ * @param[in]  sequence    The position of the envelope in the input.
+ * @param[in]  stats       The envelope's counters, from
+ *                         end_envelope_memory.
+ * @param[in]  json_nodes  The number of JSON values in its result.
+ * @param[in]  exceeded    True if it reached its memory limit.
+ */
+void record_envelope_memory(const char *op, size_t sequence,
+                            memory_stats_t *stats, size_t json_nodes,
+                            int exceeded);
+
+/**
+ * Copy the counters for the whole process.
+ *
+ * @param[out] stats      A struct to receive the counters.
+ */
+void get_memory_stats(memory_stats_t *stats);
+
+/**
+ * Return a summary of the memory used by the process, by each type of
+ * operation and by the envelope having the highest peak.
+ *
+ * @param[out] error      An error report struct.
+ *
+ * @return A new JSON object.
+ */
+json_t *memory_report(baton_error_t *error);
+
+/**
+ * Count the values in a JSON value, including itself.
+ *
+ * @param[in]  json       A JSON value. May be NULL.
+ *
+ * @return The number of values.
+ */
+size_t count_json_nodes(json_t *json);
+
+/**
+ * Free a string allocated by jansson, such as one returned by
+ * json_dumps, with the allocator jansson is using.
+ *
+ * @param[in]  str        A string. May be NULL.
+ */
+void free_json_str(char *str);
+
+#endif // _BATON_MEMORY_H
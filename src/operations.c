@@ -19,6 +19,10 @@
  * @author Keith James <kdj@sanger.ac.uk>, Rob Davies <rmd@sanger.ac.uk>
  */
 
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "config.h"
 #include "time.h"
 
@@ -33,6 +37,9 @@ rcComm_t *connection;
 int run_timeout_thread = 1;
 // Condition variable to exit the timeout thread when work is complete
 pthread_cond_t watchdog_cond = PTHREAD_COND_INITIALIZER;
+// The descriptor from which do_operation reads envelopes, which may
+// not also be the source of a data object's content, or -1
+static int envelope_fd = -1;
 
 // Refresh the connection every timeout seconds
 void *connection_timeout(void *timeout) {
@@ -65,6 +72,167 @@ void *connection_timeout(void *timeout) {
     return 0;
 }
 
+// Print a JSON value to the output, counting a failure to print as
+// an error
+static void print_output(output_writer_t *writer, json_t *json,
+                         int *error_count) {
+    baton_error_t error;
+    output_json(writer, json, &error);
+    if (error.code != 0) {
+        logmsg(ERROR, "Failed to print result: %s", error.message);
+        (*error_count)++;
+    }
+}
+
+// Print the outcome of an item; either the item with an error report,
+// the envelope with its result, or the bare result
+static void report_item(output_writer_t *writer, json_t *item,
+                        json_t *result, baton_error_t *error,
+                        int *error_count) {
+    if (error->code != 0) {
+        // On error, add an error report to the input JSON as a
+        // property and print the input JSON. A NULL result should
+        // always be an error.
+        (*error_count)++;
+        add_error_value(item, error);
+        print_output(writer, item, error_count);
+    }
+    else {
+        if (has_operation(item) && has_operation_target(item)) {
+            // It's an envelope, so we add the result to the input
+            // JSON as a property and print the input JSON, The
+            // result will be freed as part of the input JSON.
+            baton_error_t rerror;
+            add_result(item, result, &rerror);
+            if (rerror.code != 0) {
+                logmsg(ERROR, "Failed to add error report to item in "
+                       "stream. Error code %d: %s",
+                       rerror.code, rerror.message);
+                (*error_count)++;
+            }
+            print_output(writer, item, error_count);
+        }
+        else {
+            // There is no envelope and there is some result JSON,
+            // so we print the result JSON. The result is not
+            // freed as part of the input JSON, so we free it here.
+            print_output(writer, result, error_count);
+            json_decref(result);
+        }
+    }
+}
+
+// Print items that have been flushed from the write-behind buffer,
+// which already carry their results or error reports
+static void report_write_behind(output_writer_t *writer, json_t *done,
+                                size_t num_errors, int *error_count) {
+    size_t i;
+    json_t *item;
+    json_array_foreach(done, i, item) {
+        print_output(writer, item, error_count);
+    }
+
+    *error_count += num_errors;
+
+    json_decref(done);
+}
+
+// Return true if an item's operation prints data object content
+// directly to stdout, rather than in its result
+static int prints_content_p(json_t *item, baton_json_op fn,
+                            operation_args_t *args) {
+    if (fn == baton_json_get_op) return (args->flags & PRINT_RAW) != 0;
+
+    if (fn != baton_json_dispatch_op || !has_operation_target(item)) return 0;
+
+    baton_error_t error;
+    const char *op = get_operation(item, &error);
+    if (error.code != 0 || !op || !str_equals(op, JSON_GET_OP, MAX_STR_LEN)) {
+        return 0;
+    }
+
+    if (args->flags & PRINT_RAW) return 1;
+    if (!has_operation_args(item)) return 0;
+
+    json_t *op_args = get_operation_args(item, &error);
+
+    return error.code == 0 && op_raw_p(op_args);
+}
+
+// Return the name of an item's operation, for memory accounting
+static const char *operation_label(json_t *item) {
+    if (has_operation(item)) {
+        baton_error_t error;
+        const char *op = get_operation(item, &error);
+        if (error.code == 0 && op) return op;
+    }
+
+    return "item";
+}
+
+// Count the memory used by an item's operation and, if it reached
+// the memory limit, replace its outcome with an error
+static json_t *account_item(json_t *item, json_t *result, size_t sequence,
+                            operation_args_t *args, baton_error_t *error) {
+    memory_stats_t stats;
+    int exceeded = end_envelope_memory(&stats);
+
+    if (exceeded) {
+        // Whatever the operation made of its failed allocations,
+        // the result may be incomplete
+        if (result) json_decref(result);
+        result = NULL;
+
+        set_baton_error(error, MEMORY_LIMIT_EXCEEDED,
+                        "Operation exceeded the memory limit of %zu bytes",
+                        args->max_envelope_memory);
+    }
+
+    record_envelope_memory(operation_label(item), sequence, &stats,
+                           count_json_nodes(result), exceeded);
+
+    return result;
+}
+
+// Print a summary of memory use to STDERR
+static void report_memory(void) {
+    baton_error_t error;
+    json_t *report = memory_report(&error);
+    if (error.code != 0) {
+        logmsg(ERROR, "Failed to report memory use: %s", error.message);
+        return;
+    }
+
+    print_json_stream(report, stderr);
+    json_decref(report);
+}
+
+// Record that every item read, up to the given position, has been
+// processed and its result printed. Output is flushed before a
+// checkpoint is written so that it never gets ahead of the
+// results. Checkpoint write failures are logged, but do not stop
+// processing.
+static void checkpoint_items(output_writer_t *writer,
+                             checkpoint_t *checkpoint, size_t sequence,
+                             long offset, int force) {
+    checkpoint->sequence = sequence;
+    checkpoint->offset   = offset;
+
+    if (!checkpoint_due(checkpoint, force)) return;
+
+    baton_error_t error;
+    flush_output(writer, &error);
+    if (error.code != 0) {
+        logmsg(ERROR, "Not writing checkpoint: %s", error.message);
+        return;
+    }
+
+    write_checkpoint(checkpoint, &error);
+    if (error.code != 0) {
+        logmsg(ERROR, "Failed to write checkpoint: %s", error.message);
+    }
+}
+
 static int iterate_json(FILE *input, rodsEnv *env, baton_json_op fn,
                         operation_args_t *args,
                         int *item_count, int *error_count) {
@@ -72,6 +240,15 @@ static int iterate_json(FILE *input, rodsEnv *env, baton_json_op fn,
     int timeout = args->max_connect_time;
     pthread_t tid;
     int thread_status = -1;
+    write_behind_t *wb = NULL;
+    output_writer_t *writer = NULL;
+
+    // The position after the last item read and whether any items
+    // read are still buffered for write-behind
+    checkpoint_t checkpoint = { .path = args->checkpoint, .offset = 0 };
+    size_t sequence = 0;
+    long offset     = 0;
+    int pending     = 0;
 
     if (timeout < 10) {
         logmsg(ERROR, "The connection timeout (--connect-time argument) "
@@ -80,21 +257,95 @@ static int iterate_json(FILE *input, rodsEnv *env, baton_json_op fn,
         goto finally;
     }
 
+    // Results are collected and written together, unless each is to
+    // be flushed
+    size_t capacity = args->output_buffer_size;
+    if (capacity == 0) capacity = OUTPUT_DEFAULT_BUFFER_SIZE;
+    if (args->flags & FLUSH) capacity = 0;
+
+    unsigned long latency_ms = args->output_latency_ms;
+    if (latency_ms == 0) latency_ms = OUTPUT_DEFAULT_LATENCY_MS;
+
+    baton_error_t output_error;
+    writer = open_output_writer(stdout, capacity, latency_ms, &output_error);
+    if (output_error.code != 0) {
+        logmsg(ERROR, "Failed to open output: %s", output_error.message);
+        status = 1;
+        goto finally;
+    }
+
     thread_status = pthread_create(&tid, NULL, &connection_timeout, &timeout);
     if (thread_status != 0) {
         logmsg(ERROR, "Failed to start connection management thread: %d", thread_status);
         goto finally;
     }
 
+    if (args->write_behind > 0) {
+        baton_error_t error;
+        wb = start_write_behind(args->write_behind, args->flags, &error);
+        if (error.code != 0) {
+            logmsg(ERROR, "Failed to start write-behind: %s", error.message);
+            status = 1;
+            goto finally;
+        }
+        logmsg(DEBUG, "Write-behind of up to %zu AVU operations",
+               args->write_behind);
+    }
+
+    if (args->checkpoint && args->resume) {
+        baton_error_t error;
+        resume_from_checkpoint(input, &checkpoint, &error);
+        if (error.code != 0) {
+            logmsg(ERROR, "Failed to resume: %s", error.message);
+            status = 1;
+            goto finally;
+        }
+
+        sequence = checkpoint.sequence;
+        offset   = checkpoint.offset;
+    }
+
     while (!exit_flag && !feof(input)) {
+        // Results are written while waiting for more input, so that
+        // an interactive caller is not kept waiting for them. That
+        // includes those of any buffered metamod operations, which
+        // would otherwise wait until the buffer filled.
+        if (!input_waiting(input)) {
+            if (pending) {
+                size_t num_errors;
+                json_t *done = write_behind_flush(wb, &num_errors);
+                report_write_behind(writer, done, num_errors, error_count);
+                pending = 0;
+                checkpoint_items(writer, &checkpoint, sequence, offset, 0);
+            }
+
+            baton_error_t error;
+            flush_output(writer, &error);
+        }
+
         size_t jflags = JSON_DISABLE_EOF_CHECK | JSON_REJECT_DUPLICATES;
         json_error_t load_error;
+
+        trace_span_t parse_span;
+        trace_begin(&parse_span, TRACE_CAT_PARSE, "json_loadf", "item %zu",
+                    sequence + 1);
         json_t *item = json_loadf(input, jflags, &load_error); // JSON alloc
+        trace_end(&parse_span);
+
+        if (!item && feof(input)) continue;
+
+        // The position after this item, which becomes the checkpoint
+        // position once the item has been processed
+        size_t item_sequence = sequence + 1;
+        long item_offset     = ftell(input);
 
         if (!item) {
-            if (!feof(input)) {
-                logmsg(ERROR, "JSON error at line %d, column %d: %s",
-                       load_error.line, load_error.column, load_error.text);
+            logmsg(ERROR, "JSON error at line %d, column %d: %s",
+                   load_error.line, load_error.column, load_error.text);
+            sequence = item_sequence;
+            offset   = item_offset;
+            if (!pending) {
+                checkpoint_items(writer, &checkpoint, sequence, offset, 0);
             }
             continue;
         }
@@ -104,9 +355,48 @@ static int iterate_json(FILE *input, rodsEnv *env, baton_json_op fn,
                    item_count);
             (*error_count)++;
             json_decref(item);
+            sequence = item_sequence;
+            offset   = item_offset;
+            if (!pending) {
+                checkpoint_items(writer, &checkpoint, sequence, offset, 0);
+            }
             continue;
         }
 
+        if (wb) {
+            size_t num_errors;
+
+            if (write_behind_item_p(item, fn)) {
+                baton_error_t error;
+                write_behind_add(wb, item, &error);
+                if (error.code != 0) {
+                    report_item(writer, item, NULL, &error, error_count);
+                }
+
+                json_t *done = write_behind_done(wb, &num_errors);
+                report_write_behind(writer, done, num_errors, error_count);
+
+                (*item_count)++;
+                json_decref(item);
+                sequence = item_sequence;
+                offset   = item_offset;
+                pending  = 1;
+                continue;
+            }
+
+            // Any other operation must see the effects of those
+            // buffered before it
+            json_t *done = write_behind_flush(wb, &num_errors);
+            report_write_behind(writer, done, num_errors, error_count);
+            pending = 0;
+        }
+
+        // Content printed directly must follow the results before it
+        if (prints_content_p(item, fn, args)) {
+            baton_error_t error;
+            flush_output(writer, &error);
+        }
+
         pthread_mutex_lock(&conn_mutex); // Lock before connecting and executing a job
         logmsg(DEBUG, "Work to do, lock obtained");
         if (!connection) {
@@ -115,52 +405,53 @@ static int iterate_json(FILE *input, rodsEnv *env, baton_json_op fn,
             if (!connection) {
                 status = 1;
                 pthread_mutex_unlock(&conn_mutex);
+                json_decref(item);
                 goto finally;
             }
         }
 
+        int accounting = memory_accounting_enabled();
+        if (accounting) begin_envelope_memory(args->max_envelope_memory);
+
+        const char *op_name =
+            json_string_value(json_object_get(item, JSON_OP_KEY));
+
+        trace_span_t envelope_span;
+        trace_begin(&envelope_span, TRACE_CAT_ENVELOPE, "envelope",
+                    "item %zu %s", item_sequence, op_name ? op_name : "-");
+
         baton_error_t error;
         json_t *result = fn(env, connection, item, args, &error);
-        pthread_mutex_unlock(&conn_mutex); // Unlock before processing the result
-        logmsg(DEBUG, "Work done, lock released");
+        trace_end(&envelope_span);
 
-        if (error.code != 0) {
-            // On error, add an error report to the input JSON as a
-            // property and print the input JSON. A NULL result should
-            // always be an error.
-            (*error_count)++;
-            add_error_value(item, &error);
-            print_json(item);
+        if (accounting) {
+            result = account_item(item, result, item_sequence, args, &error);
         }
-        else {
-            if (has_operation(item) && has_operation_target(item)) {
-                // It's an envelope, so we add the result to the input
-                // JSON as a property and print the input JSON, The
-                // result will be freed as part of the input JSON.
-                baton_error_t rerror;
-                add_result(item, result, &rerror);
-                if (rerror.code != 0) {
-                    logmsg(ERROR, "Failed to add error report to item %d "
-                           "in stream. Error code %d: %s", item_count,
-                           rerror.code, rerror.message);
-                    (*error_count)++;
-                }
-                print_json(item);
-            }
-            else {
-                // There is no envelope and there is some result JSON,
-                // so we print the result JSON. The result is not
-                // freed as part of the input JSON, so we free it here.
-                print_json(result);
-                json_decref(result);
-            }
+
+        if (error.code == DEADLINE_EXPIRED && connection) {
+            // The server may still be working on the abandoned
+            // operation, so later ones use a new connection
+            logmsg(NOTICE, "Closing the connection after an operation "
+                   "passed its deadline");
+            rcDisconnect(connection);
+            connection = NULL;
         }
+        pthread_mutex_unlock(&conn_mutex); // Unlock before processing the result
+        logmsg(DEBUG, "Work done, lock released");
 
-        if (args->flags & FLUSH) fflush(stdout);
+        report_item(writer, item, result, &error, error_count);
 
         (*item_count)++;
 
         json_decref(item); // JSON free
+
+        // An operation that failed while stopping on a signal may have
+        // been cut short, so it is left to be repeated on resuming
+        if (exit_flag && error.code != 0) continue;
+
+        sequence = item_sequence;
+        offset   = item_offset;
+        checkpoint_items(writer, &checkpoint, sequence, offset, 0);
     } // while
 
     if (exit_flag) {
@@ -170,6 +461,21 @@ static int iterate_json(FILE *input, rodsEnv *env, baton_json_op fn,
     }
 
 finally:
+    if (wb) {
+        // The final flush happens even when exiting on a signal
+        size_t num_errors;
+        json_t *done = write_behind_flush(wb, &num_errors);
+        report_write_behind(writer, done, num_errors, error_count);
+        stop_write_behind(wb);
+        pending = 0;
+    }
+
+    // Every item read has now been printed, including when draining
+    // after a signal
+    if (writer && !pending) {
+        checkpoint_items(writer, &checkpoint, sequence, offset, 1);
+    }
+
     pthread_mutex_lock(&conn_mutex);
     run_timeout_thread = 0;
     pthread_cond_signal(&watchdog_cond); // Unblock the thread waiting on cond
@@ -188,6 +494,10 @@ finally:
         }
     }
 
+    close_output_writer(writer);
+
+    if (memory_accounting_enabled()) report_memory();
+
     return status;
 }
 
@@ -203,7 +513,9 @@ int do_operation(FILE *input, baton_json_op fn, operation_args_t *args) {
       goto error;
     }
 
+    envelope_fd = fileno(input);
     status = iterate_json(input, &env, fn, args, &item_count, &error_count);
+    envelope_fd = -1;
     if (status != 0) goto error;
 
     if (error_count > 0) {
@@ -225,6 +537,27 @@ error:
     return status;
 }
 
+option_flags get_op_flags(json_t *operation_args, option_flags flags,
+                          baton_error_t *error) {
+    operation_desc_t desc;
+    decode_operation_args(operation_args, flags, &desc, error);
+
+    return desc.flags;
+}
+
+// Return a result to which fields may be added without adding them to
+// the target it may be. The copy is shallow, sharing the values of the
+// target.
+static json_t *extend_result(json_t *result, baton_error_t *error) {
+    json_t *copy = json_copy(result);
+    if (!copy) {
+        set_baton_error(error, -1, "Failed to allocate memory for result");
+    }
+    json_decref(result);
+
+    return copy;
+}
+
 json_t *baton_json_dispatch_op(rodsEnv *env, rcComm_t *conn, json_t *envelope,
                                operation_args_t *args, baton_error_t *error) {
     json_t *result = NULL;
@@ -232,138 +565,181 @@ json_t *baton_json_dispatch_op(rodsEnv *env, rcComm_t *conn, json_t *envelope,
     operation_args_t args_copy = { .flags       = args->flags,
                                    .buffer_size = args->buffer_size,
                                    .zone_name   = args->zone_name,
-                                   .path        = NULL };
-
-    const char *op = get_operation(envelope, error);
+                                   .path        = NULL,
+                                   .cache_dir   = args->cache_dir,
+                                   .cache_size  = args->cache_size,
+                                   .layout      = NULL,
+                                   .resource    = NULL,
+                                   .num_threads = args->num_threads,
+                                   .write_behind = args->write_behind,
+                                   .deadline_ms = args->deadline_ms };
+
+    operation_desc_t desc;
+    decode_envelope(envelope, args->flags, &desc, error);
     if (error->code != 0) goto finally;
 
-    if (!op) {
-        set_baton_error(error, -1, "No baton operation given");
-        goto finally;
+    const char *op = desc.name;
+    json_t *target = desc.target;
+    args_copy.flags = desc.flags;
+
+    if (desc.path) {
+        char *tmp = copy_str(desc.path, MAX_STR_LEN);
+        if (!tmp) {
+            set_baton_error(error, errno, "Failed to copy string '%s'",
+                            desc.path);
+            goto finally;
+        }
+
+        args_copy.path = tmp;
+    }
+
+    if (desc.layout) {
+        char *tmp = copy_str(desc.layout, MAX_STR_LEN);
+        if (!tmp) {
+            set_baton_error(error, errno, "Failed to copy string '%s'",
+                            desc.layout);
+            goto finally;
+        }
+
+        args_copy.layout = tmp;
     }
 
-    json_t *target = get_operation_target(envelope, error);
-    if (error->code != 0) goto finally;
-
-    if (has_operation(envelope)) {
-        json_t *args = get_operation_args(envelope, error);
-        if (error->code != 0)  goto finally;
-
-        option_flags flags = args_copy.flags;
-        if (op_acl_p(args))           flags = flags | PRINT_ACL;
-        if (op_avu_p(args))           flags = flags | PRINT_AVU;
-        if (op_checksum_p(args))      flags = flags |
-                                          CALCULATE_CHECKSUM |
-                                          PRINT_CHECKSUM;
-        if (op_verify_p(args))        flags = flags |
-                                          VERIFY_CHECKSUM |
-                                          PRINT_CHECKSUM;
-        if (op_contents_p(args))      flags = flags | PRINT_CONTENTS;
-        if (op_replicate_p(args))     flags = flags | PRINT_REPLICATE;
-        if (op_size_p(args))          flags = flags | PRINT_SIZE;
-        if (op_timestamp_p(args))     flags = flags | PRINT_TIMESTAMP;
-        if (op_raw_p(args))           flags = flags | PRINT_RAW;
-        if (op_save_p(args))          flags = flags | SAVE_FILES;
-        if (op_recurse_p(args))       flags = flags | RECURSIVE;
-        if (op_force_p(args))         flags = flags | FORCE;
-        if (op_collection_p(args))    flags = flags | SEARCH_COLLECTIONS;
-        if (op_object_p(args))        flags = flags | SEARCH_OBJECTS;
-        if (op_single_server_p(args)) flags = flags | SINGLE_SERVER;
-        args_copy.flags = flags;
-
-        if (has_operation(args)) {
-            const char *arg = get_operation(args, error);
+    if (desc.resource) {
+        char *tmp = copy_str(desc.resource, MAX_STR_LEN);
+        if (!tmp) {
+            set_baton_error(error, errno, "Failed to copy string '%s'",
+                            desc.resource);
+            goto finally;
+        }
+
+        args_copy.resource = tmp;
+    }
+
+    if (desc.has_threads)  args_copy.num_threads = desc.num_threads;
+    if (desc.has_deadline) args_copy.deadline_ms = desc.deadline_ms;
+
+    if (args_copy.deadline_ms > 0) {
+        logmsg(DEBUG, "Operation '%s' has a deadline of %lu ms", op,
+               args_copy.deadline_ms);
+        set_deadline(args_copy.deadline_ms);
+    }
+
+    logmsg(DEBUG, "Dispatching to operation '%s'", op);
+
+    switch (desc.type) {
+        case OPERATION_CHMOD:
+            result = baton_json_chmod_op(env, conn, target, &args_copy,
+                                         error);
+            break;
+
+        case OPERATION_CHECKSUM:
+            result = baton_json_checksum_op(env, conn, target, &args_copy,
+                                            error);
             if (error->code != 0) goto finally;
 
-            logmsg(DEBUG, "Detected operation '%s'", op);
-            if (str_equals(arg, JSON_ARG_META_ADD, MAX_STR_LEN)) {
-                args_copy.flags = flags | ADD_AVU;
+            if (args_copy.flags & PRINT_CHECKSUM) {
+                if (check_deadline("checksum", error) != 0) {
+                    json_decref(result);
+                    result = NULL;
+                    goto finally;
+                }
+
+                // The caller's target is printed as it was sent
+                result = extend_result(result, error);
+                if (error->code != 0) goto finally;
+
+                result = add_checksum_json_object(conn, result, error);
             }
-            else if (str_equals(arg, JSON_ARG_META_REM, MAX_STR_LEN)) {
-                args_copy.flags = flags | REMOVE_AVU;
+            break;
+
+        case OPERATION_COPY:
+            result = baton_json_copy_op(env, conn, target, &args_copy, error);
+            break;
+
+        case OPERATION_DIGEST:
+            result = baton_json_digest_op(env, conn, target, &args_copy,
+                                          error);
+            break;
+
+        case OPERATION_LIST:
+            result = baton_json_list_op(env, conn, target, &args_copy, error);
+            break;
+
+        case OPERATION_METAMOD:
+            result = baton_json_metamod_op(env, conn, target, &args_copy,
+                                           error);
+            break;
+
+        case OPERATION_METAQUERY:
+            result = baton_json_metaquery_op(env, conn, target, &args_copy,
+                                             error);
+            break;
+
+        case OPERATION_GET:
+            result = baton_json_get_op(env, conn, target, &args_copy, error);
+            break;
+
+        case OPERATION_FETCH:
+            result = baton_json_fetch_op(env, conn, target, &args_copy, error);
+            break;
+
+        case OPERATION_PUT:
+            if (args_copy.flags & SINGLE_SERVER) {
+                logmsg(DEBUG, "Single-server mode, falling back "
+                       "to operation 'write'");
+                result = baton_json_write_op(env, conn, target, &args_copy,
+                                             error);
             }
             else {
-                set_baton_error(error, -1,
-                                "Invalid baton operation argument '%s'", arg);
-              goto finally;
+                result = baton_json_put_op(env, conn, target, &args_copy,
+                                           error);
             }
-        }
-
-        if (has_op_path(args)) {
-            const char *path = get_op_path(args, error);
             if (error->code != 0) goto finally;
 
-            char *tmp = copy_str(path, MAX_STR_LEN);
-            if (!tmp) {
-                set_baton_error(error, errno, "Failed to copy string '%s'",
-                                path);
-                goto finally;
+            if (args_copy.flags & PRINT_CHECKSUM) {
+                if (check_deadline("put", error) != 0) {
+                    json_decref(result);
+                    result = NULL;
+                    goto finally;
+                }
+
+                // The caller's target is printed as it was sent
+                result = extend_result(result, error);
+                if (error->code != 0) goto finally;
+
+                result = add_checksum_json_object(conn, result, error);
             }
+            break;
 
-            args_copy.path = tmp;
-        }
-    }
+        case OPERATION_MOVE:
+            result = baton_json_move_op(env, conn, target, &args_copy, error);
+            break;
 
-    logmsg(DEBUG, "Dispatching to operation '%s'", op);
+        case OPERATION_RM:
+            result = baton_json_rm_op(env, conn, target, &args_copy, error);
+            break;
 
-    if (str_equals(op, JSON_CHMOD_OP, MAX_STR_LEN)) {
-        result = baton_json_chmod_op(env, conn, target, &args_copy, error);
-    }
-    else if (str_equals(op, JSON_CHECKSUM_OP, MAX_STR_LEN)) {
-        result = baton_json_checksum_op(env, conn, target, &args_copy, error);
-        if (error->code != 0) goto finally;
+        case OPERATION_MKCOLL:
+            result = baton_json_mkcoll_op(env, conn, target, &args_copy,
+                                          error);
+            break;
 
-        if (args_copy.flags & PRINT_CHECKSUM) {
-            result = add_checksum_json_object(conn, result, error);
-            if (error->code != 0) goto finally;
-        }
-    }
-    else if (str_equals(op, JSON_LIST_OP, MAX_STR_LEN)) {
-        result = baton_json_list_op(env, conn, target, &args_copy, error);
-    }
-    else if (str_equals(op, JSON_METAMOD_OP, MAX_STR_LEN)) {
-        result = baton_json_metamod_op(env, conn, target, &args_copy, error);
-    }
-    else if (str_equals(op, JSON_METAQUERY_OP, MAX_STR_LEN)) {
-        result = baton_json_metaquery_op(env, conn, target, &args_copy, error);
-    }
-    else if (str_equals(op, JSON_GET_OP, MAX_STR_LEN)) {
-        result = baton_json_get_op(env, conn, target, &args_copy, error);
-    }
-    else if (str_equals(op, JSON_PUT_OP, MAX_STR_LEN)) {
-        if (args_copy.flags & SINGLE_SERVER) {
-            logmsg(DEBUG, "Single-server mode, falling back "
-                   "to operation 'write'");
-            result = baton_json_write_op(env, conn, target, &args_copy, error);
-        }
-        else {
-            result = baton_json_put_op(env, conn, target, &args_copy, error);
-        }
-        if (error->code != 0) goto finally;
+        case OPERATION_RMCOLL:
+            result = baton_json_rmcoll_op(env, conn, target, &args_copy,
+                                          error);
+            break;
 
-        if (args_copy.flags & PRINT_CHECKSUM) {
-            result = add_checksum_json_object(conn, result, error);
-            if (error->code != 0) goto finally;
-        }
-    }
-    else if (str_equals(op, JSON_MOVE_OP, MAX_STR_LEN)) {
-        result = baton_json_move_op(env, conn, target, &args_copy, error);
-    }
-    else if (str_equals(op, JSON_RM_OP, MAX_STR_LEN)) {
-        result = baton_json_rm_op(env, conn, target, &args_copy, error);
-    }
-    else if (str_equals(op, JSON_MKCOLL_OP, MAX_STR_LEN)) {
-        result = baton_json_mkcoll_op(env, conn, target, &args_copy, error);
-    }
-    else if (str_equals(op, JSON_RMCOLL_OP, MAX_STR_LEN)) {
-        result = baton_json_rmcoll_op(env, conn, target, &args_copy, error);
-    }
-    else {
-        set_baton_error(error, -1, "Invalid baton operation '%s'", op);
+        default:
+            set_baton_error(error, -1, "Invalid baton operation '%s'", op);
+            break;
     }
 
 finally:
-    if (args_copy.path) free(args_copy.path);
+    clear_deadline();
+
+    if (args_copy.path)   free(args_copy.path);
+    if (args_copy.layout)   free(args_copy.layout);
+    if (args_copy.resource) free(args_copy.resource);
 
     return result;
 }
@@ -390,6 +766,35 @@ finally:
     return result;
 }
 
+json_t *baton_json_digest_op(rodsEnv *env, rcComm_t *conn, json_t *target,
+                             operation_args_t *args, baton_error_t *error) {
+    json_t *result = NULL;
+    rodsPath_t rods_path;
+    memset(&rods_path, 0, sizeof (rodsPath_t));
+
+    char *path = json_to_path(target, error);
+    if (error->code != 0) goto finally;
+
+    resolve_rods_path(conn, env, &rods_path, path, args->flags, error);
+    if (error->code != 0) goto finally;
+
+    result = digest_collection(conn, &rods_path, args->flags, error);
+    if (error->code != 0) goto finally;
+
+finally:
+    if (rods_path.rodsObjStat) free(rods_path.rodsObjStat);
+    if (path) free(path);
+
+    return result;
+}
+
+// Return the target of an operation as its result. The result is the
+// target itself, rather than a copy of it, so that a large target is
+// not duplicated in memory. An envelope still prints both.
+static json_t *target_result(json_t *target) {
+    return json_incref(target);
+}
+
 json_t *baton_json_chmod_op(rodsEnv *env, rcComm_t *conn, json_t *target,
                             operation_args_t *args, baton_error_t *error) {
     json_t *result = NULL;
@@ -418,11 +823,7 @@ json_t *baton_json_chmod_op(rodsEnv *env, rcComm_t *conn, json_t *target,
         if (error->code != 0) goto finally;
     }
 
-    result = json_deep_copy(target);
-    if (!result) {
-        set_baton_error(error, -1, "Internal error: failed to deep-copy "
-                        "result for %s", path);
-    }
+    result = target_result(target);
 
 finally:
     if (path) free(path);
@@ -458,17 +859,20 @@ json_t *baton_json_checksum_op(rodsEnv *env, rcComm_t *conn, json_t *target,
     jchecksum = checksum_to_json(checksum, error);
     if (error->code != 0) goto finally;
 
-    add_checksum(target, jchecksum, error);
+    // The checksum is added to the result, leaving the target unchanged
+    result = extend_result(target_result(target), error);
     if (error->code != 0) {
-        // Only free this on error. On success, it becomes owned by target
         json_decref(jchecksum);
         goto finally;
     }
 
-    result = json_deep_copy(target);
-    if (!result) {
-        set_baton_error(error, -1, "Internal error: failed to deep-copy "
-                        "result for %s", path);
+    add_checksum(result, jchecksum, error);
+    if (error->code != 0) {
+        // Only free this on error. On success, it becomes owned by result
+        json_decref(jchecksum);
+        json_decref(result);
+        result = NULL;
+        goto finally;
     }
 
 finally:
@@ -479,19 +883,52 @@ finally:
     return result;
 }
 
+// Resolve the collections of a query and of any queries nested in it
+static int resolve_query_collections(json_t *query, rcComm_t *conn,
+                                     rodsEnv *env, option_flags flags,
+                                     baton_error_t *error) {
+    init_baton_error(error);
+
+    if (has_collection(query)) {
+        resolve_collection(query, conn, env, flags, error);
+        if (error->code != 0) goto finally;
+    }
+
+    if (is_query_set(query)) {
+        const char *keys[] = { JSON_ANY_KEY, JSON_ALL_KEY };
+        size_t index;
+        json_t *member;
+
+        for (size_t i = 0; i < 2; i++) {
+            json_array_foreach(json_object_get(query, keys[i]), index,
+                               member) {
+                resolve_query_collections(member, conn, env, flags, error);
+                if (error->code != 0) goto finally;
+            }
+        }
+
+        json_t *negated = json_object_get(query, JSON_NOT_KEY);
+        if (negated) {
+            resolve_query_collections(negated, conn, env, flags, error);
+        }
+    }
+
+finally:
+    return error->code;
+}
+
 json_t *baton_json_metaquery_op(rodsEnv *env, rcComm_t *conn, json_t *target,
                                 operation_args_t *args, baton_error_t *error) {
     json_t *result = NULL;
 
-    if (has_collection(target)) {
-        resolve_collection(target, conn, env, args->flags, error);
-        if (error->code != 0) goto finally;
-    }
+    resolve_query_collections(target, conn, env, args->flags, error);
+    if (error->code != 0) goto finally;
 
     char *zone_name = args->zone_name;
     logmsg(DEBUG, "Metadata query in zone '%s'", zone_name);
 
-    result = search_metadata(conn, target, zone_name, args->flags, error);
+    result = search_metadata_concurrent(conn, target, zone_name, args->flags,
+                                        args->num_threads, error);
 
 finally:
     return result;
@@ -535,11 +972,7 @@ json_t *baton_json_metamod_op(rodsEnv *env, rcComm_t *conn, json_t *target,
         if (error->code != 0) goto finally;
     }
 
-    result = json_deep_copy(target);
-    if (!result) {
-        set_baton_error(error, -1, "Internal error: failed to deep-copy "
-                        "result for %s", path);
-    }
+    result = target_result(target);
 
 finally:
     if (path) free(path);
@@ -548,6 +981,44 @@ finally:
     return result;
 }
 
+json_t *baton_json_fetch_op(rodsEnv *env, rcComm_t *conn, json_t *target,
+                            operation_args_t *args, baton_error_t *error) {
+    json_t *result = NULL;
+    local_cache_t cache;
+
+    if (has_collection(target)) {
+        resolve_collection(target, conn, env, args->flags, error);
+        if (error->code != 0) goto finally;
+    }
+
+    const char *directory = get_directory_value(target, error);
+    if (error->code != 0) goto finally;
+
+    fetch_in_t fetch_in = { .directory   = directory ? directory : ".",
+                            .layout      = args->layout ? args->layout :
+                                           FETCH_DEFAULT_LAYOUT,
+                            .num_threads = args->num_threads,
+                            .buffer_size = args->buffer_size,
+                            .cache       = NULL };
+
+    if (args->cache_dir) {
+        cache.dir      = args->cache_dir;
+        cache.max_size = args->cache_size;
+        fetch_in.cache = &cache;
+    }
+
+    char *zone_name = args->zone_name;
+    logmsg(DEBUG, "Fetching metadata query results in zone '%s' to '%s' "
+           "with layout '%s'", zone_name, fetch_in.directory,
+           fetch_in.layout);
+
+    result = fetch_metadata_results(conn, target, zone_name, &fetch_in,
+                                    error);
+
+finally:
+    return result;
+}
+
 json_t *baton_json_get_op(rodsEnv *env, rcComm_t *conn, json_t *target,
                           operation_args_t *args, baton_error_t *error) {
     json_t *result = NULL;
@@ -568,24 +1039,37 @@ json_t *baton_json_get_op(rodsEnv *env, rcComm_t *conn, json_t *target,
     logmsg(DEBUG, "Using a 'get' buffer size of %zu bytes", bsize);
 
     if (args->flags & SAVE_FILES) {
-        result = json_deep_copy(target);
-        if (!result) {
-            set_baton_error(error, errno,
-                            "Failed to allocate memory for result");
-            goto finally;
+        if (args->cache_dir) {
+            local_cache_t cache = { .dir      = args->cache_dir,
+                                    .max_size = args->cache_size };
+            logmsg(DEBUG, "Using a local cache in '%s'", cache.dir);
+
+            get_data_obj_file_cached(conn, &rods_path, file, bsize, &cache,
+                                     error);
+        }
+        else if (args->flags & PARALLEL_TRANSFER) {
+            if (args->num_threads > INT_MAX) {
+                set_baton_error(error, CAT_INVALID_ARGUMENT,
+                                "Invalid number of threads %zu",
+                                args->num_threads);
+                goto finally;
+            }
+
+            get_data_obj_file_parallel(conn, &rods_path, file,
+                                       (int) args->num_threads, error);
+        }
+        else {
+            get_data_obj_file(conn, &rods_path, file, bsize, error);
         }
-        get_data_obj_file(conn, &rods_path, file, bsize, error);
         if (error->code != 0) goto finally;
+
+        result = target_result(target);
     }
     else if (args->flags & PRINT_RAW) {
-        result = json_deep_copy(target);
-        if (!result) {
-            set_baton_error(error, errno,
-                            "Failed to allocate memory for result");
-            goto finally;
-        }
         get_data_obj_stream(conn, &rods_path, stdout, bsize, error);
         if (error->code != 0) goto finally;
+
+        result = target_result(target);
     }
     else {
         result = ingest_data_obj(conn, &rods_path, args->flags, bsize, error);
@@ -599,20 +1083,74 @@ finally:
     return result;
 }
 
+// Open the local source of a write, which is a file descriptor if the
+// target gives one, otherwise a file path, which may be a named pipe
+static FILE *open_write_source(json_t *target, char **source,
+                               baton_error_t *error) {
+    FILE *in = NULL;
+
+    if (has_fd(target)) {
+        int fd = get_fd_value(target, error);
+        if (error->code != 0) goto finally;
+
+        // Reading the envelopes' own stream would consume the envelopes
+        // that follow as content
+        if (fd == envelope_fd) {
+            set_baton_error(error, CAT_INVALID_ARGUMENT,
+                            "Invalid '%s' attribute: file descriptor %d "
+                            "is the input of envelopes", JSON_FD_KEY, fd);
+            goto finally;
+        }
+
+        *source = calloc(32, sizeof (char));
+        if (!*source) {
+            set_baton_error(error, errno, "Failed to allocate memory: "
+                            "error %d %s", errno, strerror(errno));
+            goto finally;
+        }
+        snprintf(*source, 32, "file descriptor %d", fd);
+
+        // The descriptor belongs to the caller, so a duplicate is read
+        // and closed
+        int dup_fd = dup(fd);
+        if (dup_fd >= 0) in = fdopen(dup_fd, "r");
+        if (!in) {
+            set_baton_error(error, errno,
+                            "Failed to open %s for reading: error %d %s",
+                            *source, errno, strerror(errno));
+            if (dup_fd >= 0) close(dup_fd);
+        }
+        goto finally;
+    }
+
+    *source = json_to_local_path(target, error);
+    if (error->code != 0) goto finally;
+
+    in = fopen(*source, "r");
+    if (!in) {
+        set_baton_error(error, errno,
+                        "Failed to open '%s' for reading: error %d %s",
+                        *source, errno, strerror(errno));
+    }
+
+finally:
+    return in;
+}
+
 json_t *baton_json_write_op(rodsEnv *env, rcComm_t *conn, json_t *target,
                             operation_args_t *args, baton_error_t *error) {
     json_t *result = NULL;
-    char *file     = NULL;
-    char *path = json_to_path(target, error);
-    if (error->code != 0) goto finally;
-
+    char *source   = NULL;
+    FILE *in       = NULL;
+    char resource[NAME_LEN] = "";
+    uint64_t size_hint      = 0;
     rodsPath_t rods_path;
     memset(&rods_path, 0, sizeof (rodsPath_t));
 
-    resolve_rods_path(conn, env, &rods_path, path, args->flags, error);
+    char *path = json_to_path(target, error);
     if (error->code != 0) goto finally;
 
-    file = json_to_local_path(target, error);
+    resolve_rods_path(conn, env, &rods_path, path, args->flags, error);
     if (error->code != 0) goto finally;
 
     if (!represents_data_object(target)) {
@@ -621,44 +1159,85 @@ json_t *baton_json_write_op(rodsEnv *env, rcComm_t *conn, json_t *target,
         goto finally;
     }
 
-    size_t bsize = args->buffer_size;
-    logmsg(DEBUG, "Using a 'write' buffer size of %zu bytes", bsize);
+    in = open_write_source(target, &source, error);
+    if (error->code != 0) goto finally;
 
-    FILE *in = fopen(file, "r");
-    if (!in) {
-        set_baton_error(error, errno,
-                        "Failed to open '%s' for reading: error %d %s",
-                        file, errno, strerror(errno));
-        goto finally;
+    // A stream of unknown size is placed on a resource with any free
+    // space. In single-server mode, the server's own choice is kept,
+    // as another resource may be on another server.
+    size_hint = get_size_hint(target);
+    if (!(args->flags & SINGLE_SERVER)) {
+        acquire_resource(conn, rods_path.outPath, size_hint, resource,
+                         error);
+        if (error->code != 0) {
+            fclose(in);
+            goto finally;
+        }
     }
 
-    write_data_obj(conn, in, &rods_path, bsize, args->flags, error);
+    size_t bsize = args->buffer_size;
+    logmsg(DEBUG, "Using a 'write' buffer size of %zu bytes", bsize);
+
+    write_data_obj_sized(conn, in, &rods_path,
+                         resource[0] != '\0' ? resource : NULL, bsize,
+                         size_hint, args->flags, error);
     int status = fclose(in);
 
     if (error->code != 0) goto finally;
     if (status != 0) {
         set_baton_error(error, errno,
                         "Failed to close '%s': error %d %s",
-                        file, errno, strerror(errno));
+                        source, errno, strerror(errno));
+        goto finally;
     }
 
+    result = target_result(target);
+
 finally:
+    release_resource(resource, size_hint);
+
     if (path) free(path);
     if (rods_path.rodsObjStat) free(rods_path.rodsObjStat);
-    if (file) free(file);
+    if (source) free(source);
 
     return result;
 }
 
+// Return true if a put must stream its content, because it comes from
+// a file descriptor or a file that is not a regular one, such as a
+// named pipe, which the server's put cannot read
+static int put_needs_stream(json_t *target) {
+    if (has_fd(target)) return 1;
+
+    baton_error_t error;
+    struct stat st;
+    int is_stream = 0;
+
+    char *file = json_to_local_path(target, &error);
+    if (error.code == 0 && stat(file, &st) == 0) {
+        is_stream = !S_ISREG(st.st_mode);
+    }
+    if (file) free(file);
+
+    return is_stream;
+}
+
 json_t *baton_json_put_op(rodsEnv *env, rcComm_t *conn, json_t *target,
                           operation_args_t *args, baton_error_t *error) {
     json_t *result     = NULL;
     char *file         = NULL;
     char *def_resource = NULL;
     char *checksum     = NULL;
+    char resource[NAME_LEN] = "";
+    uint64_t size           = 0;
     rodsPath_t rods_path;
     memset(&rods_path, 0, sizeof (rodsPath_t));
 
+    if (put_needs_stream(target)) {
+        logmsg(DEBUG, "Streaming source, falling back to operation 'write'");
+        return baton_json_write_op(env, conn, target, args, error);
+    }
+
     char *path = json_to_path(target, error);
     if (error->code != 0) goto finally;
 
@@ -668,7 +1247,17 @@ json_t *baton_json_put_op(rodsEnv *env, rcComm_t *conn, json_t *target,
     file = json_to_local_path(target, error);
     if (error->code != 0) goto finally;
 
-    if (strnlen(env->rodsDefResource, NAME_LEN) > 0) {
+    struct stat st;
+    if (stat(file, &st) == 0) size = (uint64_t) st.st_size;
+
+    acquire_resource(conn, rods_path.outPath, size, resource, error);
+    if (error->code != 0) goto finally;
+
+    if (resource[0] != '\0') {
+        def_resource = resource;
+        logmsg(DEBUG, "Using least-loaded iRODS resource '%s'", def_resource);
+    }
+    else if (strnlen(env->rodsDefResource, NAME_LEN) > 0) {
         def_resource = env->rodsDefResource;
         logmsg(DEBUG, "Using default iRODS resource '%s'", def_resource);
     }
@@ -689,13 +1278,11 @@ json_t *baton_json_put_op(rodsEnv *env, rcComm_t *conn, json_t *target,
         goto finally;
     }
 
-    result = json_deep_copy(target);
-    if (!result) {
-        set_baton_error(error, -1, "Internal error: failed to deep-copy "
-                        "result for %s", path);
-    }
+    result = target_result(target);
 
 finally:
+    release_resource(resource, size);
+
     if (checksum) free(checksum);
     if (path) free(path);
     if (rods_path.rodsObjStat) free(rods_path.rodsObjStat);
@@ -722,12 +1309,44 @@ json_t *baton_json_move_op(rodsEnv *env, rcComm_t *conn, json_t *target,
     move_rods_path(conn, &rods_path, new_path, error);
     if (error->code != 0) goto finally;
 
-    result = json_deep_copy(target);
-    if (!result) {
-        set_baton_error(error, -1, "Internal error: failed to deep-copy "
-                        "result for %s", path);
+    result = target_result(target);
+
+finally:
+    if (path) free(path);
+    if (rods_path.rodsObjStat) free(rods_path.rodsObjStat);
+
+    return result;
+}
+
+json_t *baton_json_copy_op(rodsEnv *env, rcComm_t *conn, json_t *target,
+                           operation_args_t *args, baton_error_t *error) {
+    json_t *result = NULL;
+    rodsPath_t rods_path;
+    memset(&rods_path, 0, sizeof (rodsPath_t));
+
+    char *path = json_to_path(target, error);
+    if (error->code != 0) goto finally;
+
+    resolve_rods_path(conn, env, &rods_path, path, args->flags, error);
+    if (error->code != 0) goto finally;
+
+    copy_in_t copy_in = { .resource    = args->resource,
+                          .num_threads = args->num_threads };
+    if (copy_in.num_threads > COPY_MAX_THREADS) {
+        logmsg(WARN, "Limiting copy threads from %zu to %d",
+               copy_in.num_threads, COPY_MAX_THREADS);
+        copy_in.num_threads = COPY_MAX_THREADS;
     }
 
+    copy_out_t copy_out;
+    logmsg(DEBUG, "Copying '%s' to '%s'", path, args->path);
+
+    copy_path(conn, &rods_path, args->path, &copy_in, args->flags,
+              &copy_out, error);
+    if (error->code != 0) goto finally;
+
+    result = target_result(target);
+
 finally:
     if (path) free(path);
     if (rods_path.rodsObjStat) free(rods_path.rodsObjStat);
@@ -758,11 +1377,7 @@ json_t *baton_json_rm_op(rodsEnv *env, rcComm_t *conn,
     remove_data_object(conn, &rods_path, args->flags, error);
     if (error->code != 0) goto finally;
 
-    result = json_deep_copy(target);
-    if (!result) {
-        set_baton_error(error, -1, "Internal error: failed to deep-copy "
-                        "result for %s", path);
-    }
+    result = target_result(target);
 
 finally:
     if (path) free(path);
@@ -794,11 +1409,7 @@ json_t *baton_json_mkcoll_op(rodsEnv *env, rcComm_t *conn,
     create_collection(conn, &rods_path, args->flags, error);
     if (error->code != 0) goto finally;
 
-    result = json_deep_copy(target);
-    if (!result) {
-        set_baton_error(error, -1, "Internal error: failed to deep-copy "
-                        "result for %s", path);
-    }
+    result = target_result(target);
 
 finally:
     if (path) free(path);
@@ -830,11 +1441,7 @@ json_t *baton_json_rmcoll_op(rodsEnv *env, rcComm_t *conn,
     remove_collection(conn, &rods_path, args->flags, error);
     if (error->code != 0) goto finally;
 
-    result = json_deep_copy(target);
-    if (!result) {
-        set_baton_error(error, -1, "Internal error: failed to deep-copy "
-                        "result for %s", path);
-    }
+    result = target_result(target);
 
 finally:
     if (path) free(path);
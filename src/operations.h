@@ -92,7 +92,9 @@ typedef enum {
     /** Avoid any operations that contact servers other than rodshost */
     SINGLE_SERVER      = 1 << 20,
     /** Use advisory write lock on server */
-    WRITE_LOCK         = 1 << 21
+    WRITE_LOCK         = 1 << 21,
+    /** Use the server's parallel transfer for saving files */
+    PARALLEL_TRANSFER  = 1 << 22
 } option_flags;
 
 typedef struct operation_args {
@@ -101,6 +103,18 @@ typedef struct operation_args {
     char *zone_name;
     char *path;
     unsigned long max_connect_time;
+    char *cache_dir;
+    size_t cache_size;
+    char *layout;
+    char *resource;
+    size_t num_threads;
+    size_t write_behind;
+    unsigned long deadline_ms;
+    char *checkpoint;
+    int resume;
+    size_t output_buffer_size;
+    unsigned long output_latency_ms;
+    size_t max_envelope_memory;
 } operation_args_t;
 
 /**
@@ -138,6 +152,19 @@ typedef json_t *(*baton_json_op) (rodsEnv *env,
  */
 int do_operation(FILE *input, baton_json_op fn, operation_args_t *args);
 
+/**
+ * Return the function behaviour options given by the arguments of an
+ * operation envelope, in addition to those already set.
+ *
+ * @param[in]  operation_args  The JSON arguments of an envelope.
+ * @param[in]  flags           The options already set.
+ * @param[out] error           An error report struct.
+ *
+ * @return The combined options.
+ */
+option_flags get_op_flags(json_t *operation_args, option_flags flags,
+                          baton_error_t *error);
+
 json_t *baton_json_dispatch_op(rodsEnv *env, rcComm_t *conn,
                                json_t *target, operation_args_t *args,
                                baton_error_t *error);
@@ -154,6 +181,14 @@ json_t *baton_json_checksum_op(rodsEnv *env, rcComm_t *conn,
                                json_t *target, operation_args_t *args,
                                baton_error_t *error);
 
+json_t *baton_json_copy_op(rodsEnv *env, rcComm_t *conn,
+                           json_t *target, operation_args_t *args,
+                           baton_error_t *error);
+
+json_t *baton_json_digest_op(rodsEnv *env, rcComm_t *conn,
+                             json_t *target, operation_args_t *args,
+                             baton_error_t *error);
+
 json_t *baton_json_metaquery_op(rodsEnv *env, rcComm_t *conn,
                                 json_t *target, operation_args_t *args,
                                 baton_error_t *error);
@@ -162,6 +197,10 @@ json_t *baton_json_metamod_op(rodsEnv *env, rcComm_t *conn,
                               json_t *target, operation_args_t *args,
                               baton_error_t *error);
 
+json_t *baton_json_fetch_op(rodsEnv *env, rcComm_t *conn,
+                            json_t *target, operation_args_t *args,
+                            baton_error_t *error);
+
 json_t *baton_json_get_op(rodsEnv *env, rcComm_t *conn,
                           json_t *target, operation_args_t *args,
                           baton_error_t *error);
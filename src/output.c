@@ -0,0 +1,322 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file output.c
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "log.h"
+#include "memory.h"
+#include "output.h"
+#include "trace.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static char line_end[] = "\n";
+
+static void add_ms(struct timespec *ts, unsigned long ms) {
+    ts->tv_sec  += ms / 1000;
+    ts->tv_nsec += (long) (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static int time_before(struct timespec *a, struct timespec *b) {
+    return a->tv_sec < b->tv_sec ||
+        (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// Write the results held, with the mutex held. Results are freed
+// whether or not they could be written, so that a broken pipe does
+// not accumulate them.
+static int write_results(output_writer_t *writer) {
+    if (writer->num_results == 0) return writer->status;
+
+    trace_span_t span;
+    trace_begin(&span, TRACE_CAT_OUTPUT, "write_results", "%zu results",
+                writer->num_results);
+
+    // The vectors are copied so that those written in part can be
+    // adjusted while the originals are kept to be freed
+    struct iovec vectors[OUTPUT_MAX_RESULTS * 2];
+    size_t num_iov = writer->num_results * 2;
+    struct iovec *iov = vectors;
+    memcpy(vectors, writer->iov, num_iov * sizeof (struct iovec));
+
+    // Content printed to the stream precedes the results
+    if (writer->status == 0 && fflush(writer->stream) != 0) {
+        writer->status = errno;
+    }
+
+    while (writer->status == 0 && num_iov > 0) {
+        int count = num_iov > IOV_MAX ? IOV_MAX : (int) num_iov;
+        ssize_t nw = writev(writer->fd, iov, count);
+        if (nw < 0) {
+            if (errno == EINTR) continue;
+            writer->status = errno;
+            break;
+        }
+        writer->num_writes++;
+
+        // Skip the vectors written, adjusting any written in part
+        size_t n = nw;
+        while (num_iov > 0 && n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            num_iov--;
+        }
+        if (num_iov > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    trace_end(&span);
+
+    if (writer->status != 0) {
+        logmsg(ERROR, "Failed to write %zu results: error %d %s",
+               writer->num_results, writer->status,
+               strerror(writer->status));
+    }
+    else {
+        logmsg(DEBUG, "Wrote %zu results, %zu bytes",
+               writer->num_results, writer->num_bytes);
+    }
+
+    // Every other vector is the shared line end
+    for (size_t i = 0; i < writer->num_results * 2; i += 2) {
+        free_json_str(writer->iov[i].iov_base);
+    }
+    writer->num_results = 0;
+    writer->num_bytes   = 0;
+
+    return writer->status;
+}
+
+// Write results once the oldest has been held for the latency budget
+static void *output_timer(void *arg) {
+    output_writer_t *writer = arg;
+
+    pthread_mutex_lock(&writer->mutex);
+    while (!writer->stop) {
+        if (writer->num_results == 0) {
+            pthread_cond_wait(&writer->added, &writer->mutex);
+            continue;
+        }
+
+        struct timespec due = writer->oldest;
+        add_ms(&due, writer->latency_ms);
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (time_before(&now, &due)) {
+            pthread_cond_timedwait(&writer->added, &writer->mutex, &due);
+            continue;
+        }
+
+        write_results(writer);
+    }
+    pthread_mutex_unlock(&writer->mutex);
+
+    return NULL;
+}
+
+output_writer_t *open_output_writer(FILE *stream, size_t capacity,
+                                    unsigned long latency_ms,
+                                    baton_error_t *error) {
+    pthread_condattr_t attr;
+    int attr_init = 0;
+
+    init_baton_error(error);
+
+    output_writer_t *writer = calloc(1, sizeof (output_writer_t));
+    if (!writer) {
+        set_baton_error(error, errno, "Failed to allocate memory: error %d %s",
+                        errno, strerror(errno));
+        goto error;
+    }
+
+    writer->stream     = stream;
+    writer->fd         = fileno(stream);
+    writer->capacity   = capacity;
+    writer->latency_ms = latency_ms;
+
+    // The timer waits on the monotonic clock, as the latency is
+    // measured with it
+    pthread_condattr_init(&attr);
+    attr_init = 1;
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->added, &attr);
+
+    if (latency_ms == 0) goto finally;
+
+    int status = pthread_create(&writer->thread, NULL, output_timer, writer);
+    if (status != 0) {
+        set_baton_error(error, status, "Failed to start output thread: "
+                        "error %d %s", status, strerror(status));
+        pthread_mutex_destroy(&writer->mutex);
+        pthread_cond_destroy(&writer->added);
+        goto error;
+    }
+
+finally:
+    pthread_condattr_destroy(&attr);
+
+    return writer;
+
+error:
+    if (attr_init) pthread_condattr_destroy(&attr);
+    if (writer) free(writer);
+
+    return NULL;
+}
+
+int output_json(output_writer_t *writer, json_t *json, baton_error_t *error) {
+    init_baton_error(error);
+
+    char *json_str = json_dumps(json, JSON_INDENT(0));
+    if (!json_str) {
+        set_baton_error(error, -1, "Failed to serialise JSON result");
+        goto finally;
+    }
+
+    pthread_mutex_lock(&writer->mutex);
+
+    size_t i = writer->num_results * 2;
+    writer->iov[i].iov_base     = json_str;
+    writer->iov[i].iov_len      = strlen(json_str);
+    writer->iov[i + 1].iov_base = line_end;
+    writer->iov[i + 1].iov_len  = 1;
+
+    if (writer->num_results == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &writer->oldest);
+    }
+    writer->num_results++;
+    writer->num_bytes += writer->iov[i].iov_len + 1;
+
+    if (writer->num_bytes >= writer->capacity ||
+        writer->num_results == OUTPUT_MAX_RESULTS) {
+        write_results(writer);
+    }
+    else if (writer->latency_ms > 0 && writer->num_results == 1) {
+        pthread_cond_signal(&writer->added);
+    }
+
+    if (writer->status != 0) {
+        set_baton_error(error, writer->status, "Failed to write results: "
+                        "error %d %s", writer->status,
+                        strerror(writer->status));
+    }
+
+    pthread_mutex_unlock(&writer->mutex);
+
+finally:
+    return error->code;
+}
+
+int flush_output(output_writer_t *writer, baton_error_t *error) {
+    init_baton_error(error);
+
+    pthread_mutex_lock(&writer->mutex);
+
+    write_results(writer);
+    if (writer->status == 0 && fflush(writer->stream) != 0) {
+        writer->status = errno;
+    }
+
+    if (writer->status != 0) {
+        set_baton_error(error, writer->status, "Failed to write results: "
+                        "error %d %s", writer->status,
+                        strerror(writer->status));
+    }
+
+    pthread_mutex_unlock(&writer->mutex);
+
+    return error->code;
+}
+
+void close_output_writer(output_writer_t *writer) {
+    if (!writer) return;
+
+    baton_error_t error;
+    flush_output(writer, &error);
+
+    if (writer->latency_ms > 0) {
+        pthread_mutex_lock(&writer->mutex);
+        writer->stop = 1;
+        pthread_cond_signal(&writer->added);
+        pthread_mutex_unlock(&writer->mutex);
+
+        pthread_join(writer->thread, NULL);
+    }
+    pthread_mutex_destroy(&writer->mutex);
+    pthread_cond_destroy(&writer->added);
+
+    logmsg(DEBUG, "Made %zu output writes", writer->num_writes);
+
+    free(writer);
+}
+
+// Return the number of bytes read into a stream's buffer and not yet
+// consumed, where the C library allows it to be seen, or 0
+static size_t buffered_input(FILE *input) {
+#ifdef __GLIBC__
+    return input->_IO_read_end - input->_IO_read_ptr;
+#else
+    return 0;
+#endif
+}
+
+int input_waiting(FILE *input) {
+    // Whitespace between items is consumed, as the JSON parser would
+    // do, so that it alone does not count as input waiting. Reading
+    // from the buffer never waits on the descriptor.
+    while (buffered_input(input) > 0) {
+        int c = getc(input);
+        if (!isspace(c)) {
+            ungetc(c, input);
+            return 1;
+        }
+    }
+
+    int fd = fileno(input);
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) return 1;
+
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int status;
+    do {
+        status = poll(&pfd, 1, 0);
+    } while (status < 0 && errno == EINTR);
+
+    return status > 0;
+}
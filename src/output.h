@@ -0,0 +1,145 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file output.h
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#ifndef _BATON_OUTPUT_H
+#define _BATON_OUTPUT_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include <jansson.h>
+
+#include "config.h"
+#include "error.h"
+
+/** The default number of bytes of results collected before writing. */
+#define OUTPUT_DEFAULT_BUFFER_SIZE (1024 * 1024)
+
+/** The default time in milliseconds a result may be held before
+    writing. */
+#define OUTPUT_DEFAULT_LATENCY_MS  20
+
+/** The maximum number of results collected before writing. */
+#define OUTPUT_MAX_RESULTS 512
+
+/**
+ *  @struct output_writer
+ *  @brief A writer collecting serialised JSON results for output.
+ *
+ *  Results are held as they were serialised, one per line, and
+ *  written together by a single writev(2) when the buffer fills,
+ *  when flushed by the caller, or by a timer thread once the oldest
+ *  has been held for the latency budget.
+ *
+ *  The writer shares its file descriptor with a stdio stream, which
+ *  is flushed before each write, so that content printed to the
+ *  stream is written ahead of the results held. To keep results
+ *  ahead of such content, flush the writer before printing it.
+ */
+typedef struct output_writer {
+    /** The stdio stream sharing the descriptor. */
+    FILE *stream;
+    /** The descriptor written. */
+    int fd;
+    /** The number of bytes collected before writing. */
+    size_t capacity;
+    /** The time in milliseconds a result may be held. */
+    unsigned long latency_ms;
+    /** The results and their line ends. */
+    struct iovec iov[OUTPUT_MAX_RESULTS * 2];
+    /** The number of results held. */
+    size_t num_results;
+    /** The number of bytes held. */
+    size_t num_bytes;
+    /** The time at which the oldest result held was added. */
+    struct timespec oldest;
+    /** The number of write system calls made. */
+    size_t num_writes;
+    /** The first write error, errno, which stops further writes. */
+    int status;
+    /** True when the timer thread is to exit. */
+    int stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t added;
+    pthread_t thread;
+} output_writer_t;
+
+/**
+ * Open a writer on a stdio stream and start its timer thread.
+ *
+ * @param[in]  stream      A stdio stream, typically stdout.
+ * @param[in]  capacity    The number of bytes of results collected before
+ *                         writing. 0 writes each result as it is added.
+ * @param[in]  latency_ms  The time in milliseconds a result may be held
+ *                         before writing. 0 for no limit.
+ * @param[out] error       An error report struct.
+ *
+ * @return A new writer, which must be closed with close_output_writer.
+ */
+output_writer_t *open_output_writer(FILE *stream, size_t capacity,
+                                    unsigned long latency_ms,
+                                    baton_error_t *error);
+
+/**
+ * Serialise a JSON value on a single line and add it to the writer,
+ * writing the results held if the writer is full.
+ *
+ * @param[in]  writer     A writer.
+ * @param[in]  json       A JSON value.
+ * @param[out] error      An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int output_json(output_writer_t *writer, json_t *json, baton_error_t *error);
+
+/**
+ * Write all the results held.
+ *
+ * @param[in]  writer     A writer.
+ * @param[out] error      An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int flush_output(output_writer_t *writer, baton_error_t *error);
+
+/**
+ * Write all the results held, stop the timer thread and free the
+ * writer. Write errors are logged.
+ *
+ * @param[in]  writer     A writer.
+ */
+void close_output_writer(output_writer_t *writer);
+
+/**
+ * Return true if more input can be read from a stream without
+ * waiting, either because it is buffered or because the descriptor
+ * is ready. Regular files are always ready. Buffered input is found
+ * only where the C library allows it to be seen; whitespace found
+ * there is consumed. The descriptor flags are never changed.
+ *
+ * @param[in]  input      A stdio stream.
+ *
+ * @return 1 if input is waiting, 0 otherwise.
+ */
+int input_waiting(FILE *input);
+
+#endif // _BATON_OUTPUT_H
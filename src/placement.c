@@ -0,0 +1,307 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file placement.c
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "json.h"
+#include "json_query.h"
+#include "log.h"
+#include "placement.h"
+#include "query.h"
+#include "utilities.h"
+
+// The candidate resources of one zone, listed once per refresh
+// interval and shared by all uploads of the process
+static struct {
+    pthread_mutex_t mutex;
+    int enabled;
+    char zone[NAME_LEN];
+    time_t listed;
+    int failed;
+    resource_load_t resources[PLACEMENT_MAX_RESOURCES];
+    size_t num_resources;
+} placement = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+int select_resource(const resource_load_t *resources, size_t num_resources,
+                    uint64_t size) {
+    int selected = -1;
+    uint64_t max_headroom = 0;
+
+    for (size_t i = 0; i < num_resources; i++) {
+        const resource_load_t *r = &resources[i];
+        if (r->in_flight >= r->free_space) continue;
+
+        uint64_t headroom = r->free_space - r->in_flight;
+        if (headroom <= size) continue;
+
+        if (selected < 0 || headroom > max_headroom) {
+            selected     = (int) i;
+            max_headroom = headroom;
+        }
+    }
+
+    return selected;
+}
+
+void set_resource_placement(int enabled) {
+    pthread_mutex_lock(&placement.mutex);
+    placement.enabled = enabled;
+    pthread_mutex_unlock(&placement.mutex);
+}
+
+int resource_placement_enabled(void) {
+    pthread_mutex_lock(&placement.mutex);
+    int enabled = placement.enabled;
+    pthread_mutex_unlock(&placement.mutex);
+
+    return enabled;
+}
+
+static resource_load_t *find_resource(const char *name) {
+    for (size_t i = 0; i < placement.num_resources; i++) {
+        if (str_equals(placement.resources[i].name, name, NAME_LEN)) {
+            return &placement.resources[i];
+        }
+    }
+
+    return NULL;
+}
+
+static const char *row_value(json_t *row, const char *key) {
+    return json_string_value(json_object_get(row, key));
+}
+
+// Parse a row of the resource listing into a candidate, returning 0
+// if the resource cannot be the target of an upload
+static int parse_candidate(json_t *row, resource_load_t *candidate) {
+    const char *name   = row_value(row, JSON_RESOURCE_KEY);
+    const char *space  = row_value(row, JSON_RESOURCE_FREE_SPACE_KEY);
+    const char *status = row_value(row, JSON_RESOURCE_STATUS_KEY);
+    const char *parent = row_value(row, JSON_RESOURCE_PARENT_KEY);
+    const char *type   = row_value(row, JSON_RESOURCE_TYPE_KEY);
+
+    if (!name) return 0;
+
+    // Only the root of a hierarchy may be named for an upload
+    if (parent && parent[0] != '\0') return 0;
+
+    if (status && str_equals(status, PLACEMENT_STATUS_DOWN, NAME_LEN)) {
+        logmsg(DEBUG, "Excluding resource '%s' as it is down", name);
+        return 0;
+    }
+
+    if (!space || space[0] == '\0') {
+        logmsg(DEBUG, "Excluding resource '%s' as it has no free space "
+               "recorded", name);
+        return 0;
+    }
+
+    errno = 0;
+    char *endptr;
+    unsigned long long free_space = strtoull(space, &endptr, 10);
+    if (errno != 0 || endptr == space) {
+        logmsg(WARN, "Excluding resource '%s' as its free space '%s' "
+               "is not a number", name, space);
+        return 0;
+    }
+
+    snprintf(candidate->name, NAME_LEN, "%s", name);
+    candidate->free_space = (uint64_t) free_space;
+    candidate->in_flight  = 0;
+
+    logmsg(DEBUG, "Resource '%s' of type '%s' has %llu bytes free", name,
+           type ? type : "unknown", free_space);
+
+    return 1;
+}
+
+// List the candidate resources of a zone, keeping the bytes in flight
+// to any that were listed before. Call with the placement mutex held.
+static int list_candidates(rcComm_t *conn, const char *zone,
+                           baton_error_t *error) {
+    genQueryInp_t *query_in = NULL;
+    json_t *rows            = NULL;
+    resource_load_t listed[PLACEMENT_MAX_RESOURCES];
+    size_t num_listed = 0;
+
+    query_format_in_t resc_format =
+        { .num_columns = 5,
+          .columns     = { COL_R_RESC_NAME, COL_R_FREE_SPACE,
+                           COL_R_RESC_STATUS, COL_R_TYPE_NAME,
+                           COL_R_RESC_PARENT },
+          .labels      = { JSON_RESOURCE_KEY, JSON_RESOURCE_FREE_SPACE_KEY,
+                           JSON_RESOURCE_STATUS_KEY, JSON_RESOURCE_TYPE_KEY,
+                           JSON_RESOURCE_PARENT_KEY } };
+
+    init_baton_error(error);
+
+    query_in = make_query_input(PLACEMENT_MAX_RESOURCES,
+                                resc_format.num_columns,
+                                resc_format.columns);
+    query_cond_t zn = { .column   = COL_R_ZONE_NAME,
+                        .operator = SEARCH_OP_EQUALS,
+                        .value    = zone };
+    query_in = add_query_conds(query_in, 1, (query_cond_t []) { zn });
+    addKeyVal(&query_in->condInput, ZONE_KW, zone);
+
+    rows = do_query(conn, query_in, resc_format.labels, error);
+    if (error->code != 0) goto finally;
+
+    size_t index;
+    json_t *row;
+    json_array_foreach(rows, index, row) {
+        if (num_listed == PLACEMENT_MAX_RESOURCES) {
+            logmsg(WARN, "Considering only the first %d resources in "
+                   "zone '%s'", PLACEMENT_MAX_RESOURCES, zone);
+            break;
+        }
+
+        resource_load_t *candidate = &listed[num_listed];
+        if (!parse_candidate(row, candidate)) continue;
+
+        // Uploads still in flight count against the relisted resource
+        if (str_equals(placement.zone, zone, NAME_LEN)) {
+            resource_load_t *previous = find_resource(candidate->name);
+            if (previous) candidate->in_flight = previous->in_flight;
+        }
+
+        num_listed++;
+    }
+
+    if (num_listed == 0) {
+        logmsg(WARN, "No resources in zone '%s' have free space recorded; "
+               "uploads will use the default resource", zone);
+    }
+    else {
+        logmsg(DEBUG, "Listed %zu candidate resources in zone '%s'",
+               num_listed, zone);
+    }
+
+    memcpy(placement.resources, listed, num_listed * sizeof (resource_load_t));
+    placement.num_resources = num_listed;
+    snprintf(placement.zone, NAME_LEN, "%s", zone);
+    placement.listed = time(NULL);
+
+finally:
+    if (query_in) free_query_input(query_in);
+    if (rows)     json_decref(rows);
+
+    return error->code;
+}
+
+int acquire_resource(rcComm_t *conn, const char *path, uint64_t size,
+                     char *resource, baton_error_t *error) {
+    char *zone = NULL;
+
+    init_baton_error(error);
+    resource[0] = '\0';
+
+    if (!resource_placement_enabled()) goto finally;
+
+    zone = parse_zone_name(path);
+    if (!zone) {
+        set_baton_error(error, CAT_INVALID_ARGUMENT,
+                        "Failed to parse a zone name from '%s'", path);
+        goto finally;
+    }
+
+    // The listing is made with the mutex held, so that concurrent
+    // uploads wait for it rather than each making their own
+    pthread_mutex_lock(&placement.mutex);
+
+    time_t now = time(NULL);
+    time_t interval = placement.failed ? PLACEMENT_RETRY_SECONDS :
+        PLACEMENT_REFRESH_SECONDS;
+    if (placement.listed == 0 || now - placement.listed >= interval ||
+        !str_equals(placement.zone, zone, NAME_LEN)) {
+        baton_error_t list_error;
+        list_candidates(conn, zone, &list_error);
+
+        // Placement is an optimisation, so a failed listing falls back
+        // to the default resource rather than failing the upload, and
+        // is not retried by every upload that follows
+        placement.failed = list_error.code != 0;
+        if (placement.failed) {
+            logmsg(WARN, "Failed to list the resources of zone '%s'; "
+                   "retrying in %d seconds: %s", zone,
+                   PLACEMENT_RETRY_SECONDS, list_error.message);
+
+            if (!str_equals(placement.zone, zone, NAME_LEN)) {
+                placement.num_resources = 0;
+            }
+            snprintf(placement.zone, NAME_LEN, "%s", zone);
+            placement.listed = now;
+        }
+    }
+
+    int selected = select_resource(placement.resources,
+                                   placement.num_resources, size);
+    if (selected >= 0) {
+        resource_load_t *chosen = &placement.resources[selected];
+        chosen->in_flight += size;
+        snprintf(resource, NAME_LEN, "%s", chosen->name);
+    }
+
+    pthread_mutex_unlock(&placement.mutex);
+
+    if (resource[0] != '\0') {
+        logmsg(DEBUG, "Placing %llu bytes for '%s' on resource '%s'",
+               (unsigned long long) size, path, resource);
+    }
+    else {
+        logmsg(DEBUG, "No resource can accept %llu bytes for '%s'; using "
+               "the default", (unsigned long long) size, path);
+    }
+
+finally:
+    if (zone) free(zone);
+
+    return error->code;
+}
+
+void release_resource(const char *resource, uint64_t size) {
+    if (!resource || resource[0] == '\0') return;
+
+    pthread_mutex_lock(&placement.mutex);
+
+    // The resource may have gone from the listing since it was chosen
+    resource_load_t *r = find_resource(resource);
+    if (r) {
+        r->in_flight = r->in_flight > size ? r->in_flight - size : 0;
+    }
+
+    pthread_mutex_unlock(&placement.mutex);
+}
+
+void clear_resource_placement(void) {
+    pthread_mutex_lock(&placement.mutex);
+
+    placement.zone[0]       = '\0';
+    placement.listed        = 0;
+    placement.failed        = 0;
+    placement.num_resources = 0;
+
+    pthread_mutex_unlock(&placement.mutex);
+}
@@ -0,0 +1,131 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file placement.h
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#ifndef _BATON_PLACEMENT_H
+#define _BATON_PLACEMENT_H
+
+#include <stdint.h>
+
+#include <rodsClient.h>
+
+#include "config.h"
+#include "error.h"
+
+/** The maximum number of candidate resources considered. */
+#define PLACEMENT_MAX_RESOURCES 256
+
+/** The time in seconds for which the listed resources are used before
+    they are listed again. */
+#define PLACEMENT_REFRESH_SECONDS 300
+
+/** The time in seconds after a failed listing before the resources
+    are listed again. */
+#define PLACEMENT_RETRY_SECONDS 30
+
+/** The resource status the server gives a resource taken out of
+    service. */
+#define PLACEMENT_STATUS_DOWN "down"
+
+/**
+ *  @struct resource_load
+ *  @brief A candidate resource and the bytes placed on it.
+ */
+typedef struct resource_load {
+    /** The resource name. */
+    char name[NAME_LEN];
+    /** The free space recorded in the catalogue, in bytes. */
+    uint64_t free_space;
+    /** The bytes of uploads from this process to the resource that
+        have not yet completed. */
+    uint64_t in_flight;
+} resource_load_t;
+
+/**
+ * Return the index of the least-loaded of a set of resources that can
+ * accept a further upload of a given size. The load of a resource is
+ * its free space less the bytes in flight to it; a resource is
+ * eligible if that exceeds the size. Ties are broken by position.
+ *
+ * @param[in]  resources      The candidate resources.
+ * @param[in]  num_resources  The number of candidates.
+ * @param[in]  size           The size of the upload, in bytes.
+ *
+ * @return The index of the chosen resource, or -1 if none is eligible.
+ */
+int select_resource(const resource_load_t *resources, size_t num_resources,
+                    uint64_t size);
+
+/**
+ * Set whether uploads are placed on the least-loaded resource, rather
+ * than on the default resource of the iRODS environment.
+ *
+ * @param[in]  enabled    1 to place uploads by load, 0 otherwise.
+ */
+void set_resource_placement(int enabled);
+
+/**
+ * Return true if uploads are placed by load.
+ */
+int resource_placement_enabled(void);
+
+/**
+ * Choose the resource for an upload into a zone and count its bytes
+ * as in flight to that resource until release_resource is called.
+ *
+ * The candidates are the root resources of the zone that are not down
+ * and that have free space recorded in the catalogue. They are listed
+ * in one query on first use and again once PLACEMENT_REFRESH_SECONDS
+ * have passed, keeping the bytes in flight to each. If placement is
+ * not enabled, or no candidate can accept the upload, no resource is
+ * chosen and the caller should fall back to its default. A failed
+ * listing is logged and is not an error; any earlier listing of the
+ * zone continues to be used, or else no resource is chosen, until the
+ * listing is retried after PLACEMENT_RETRY_SECONDS.
+ *
+ * @param[in]  conn       An open iRODS connection.
+ * @param[in]  path       The iRODS path of the upload, giving its zone.
+ * @param[in]  size       The size of the upload, in bytes.
+ * @param[out] resource   A buffer of NAME_LEN bytes to receive the
+ *                        resource name, or an empty string if none
+ *                        was chosen.
+ * @param[out] error      An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int acquire_resource(rcComm_t *conn, const char *path, uint64_t size,
+                     char *resource, baton_error_t *error);
+
+/**
+ * Count an upload to a resource as complete, whether or not it
+ * succeeded.
+ *
+ * @param[in]  resource   A resource name from acquire_resource. May be
+ *                        empty.
+ * @param[in]  size       The size with which it was acquired.
+ */
+void release_resource(const char *resource, uint64_t size);
+
+/**
+ * Forget the listed resources and the bytes in flight to them, so
+ * that they are listed again on next use.
+ */
+void clear_resource_placement(void);
+
+#endif // _BATON_PLACEMENT_H
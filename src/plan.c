@@ -0,0 +1,513 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file plan.c
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "config.h"
+#include "baton.h"
+#include "plan.h"
+
+// The estimates below count the client API calls each operation makes,
+// following the code paths in operations.c. Each path-based operation
+// starts with a stat to resolve its path.
+#define PLAN_STAT_CALLS 1
+
+static size_t plan_window(plan_t *plan) {
+    return plan->args->write_behind > 0 ? plan->args->write_behind :
+        PLAN_DEFAULT_WINDOW;
+}
+
+static size_t num_transfer_calls(size_t bytes, size_t buffer_size) {
+    if (buffer_size == 0 || bytes == 0) return 1;
+
+    return (bytes + buffer_size - 1) / buffer_size;
+}
+
+// The number of metadata queries made to add the requested data to a
+// single result. Where there are many results, the queries are made
+// for each batch of results, so the number depends on the results.
+static size_t num_enrichment_calls(option_flags flags) {
+    size_t calls = 0;
+
+    if (flags & PRINT_AVU)       calls++;
+    if (flags & PRINT_ACL)       calls++;
+    if (flags & PRINT_CHECKSUM)  calls++;
+    if (flags & PRINT_TIMESTAMP) calls++;
+    if (flags & PRINT_REPLICATE) calls++;
+    if (flags & PRINT_SIZE)      calls++;
+
+    return calls;
+}
+
+static int add_estimate(plan_t *plan, const char *op, size_t calls,
+                        int calls_known, size_t bytes, int bytes_known,
+                        baton_error_t *error) {
+    json_t *estimate = json_object_get(plan->operations, op);
+    if (!estimate) {
+        estimate = json_pack("{s:I, s:I, s:I, s:I, s:I}",
+                             JSON_PLAN_COUNT_KEY,         (json_int_t) 0,
+                             JSON_PLAN_CALLS_KEY,         (json_int_t) 0,
+                             JSON_PLAN_UNKNOWN_CALLS_KEY, (json_int_t) 0,
+                             JSON_PLAN_BYTES_KEY,         (json_int_t) 0,
+                             JSON_PLAN_UNKNOWN_BYTES_KEY, (json_int_t) 0);
+        if (!estimate ||
+            json_object_set_new(plan->operations, op, estimate) != 0) {
+            set_baton_error(error, -1, "Failed to allocate an estimate "
+                            "for operation '%s'", op);
+            goto finally;
+        }
+    }
+
+    const char *keys[] = { JSON_PLAN_COUNT_KEY, JSON_PLAN_CALLS_KEY,
+                           JSON_PLAN_UNKNOWN_CALLS_KEY, JSON_PLAN_BYTES_KEY,
+                           JSON_PLAN_UNKNOWN_BYTES_KEY };
+    size_t values[]    = { 1, calls, calls_known ? 0 : 1,
+                           bytes_known ? bytes : 0, bytes_known ? 0 : 1 };
+
+    for (size_t i = 0; i < sizeof keys / sizeof keys[0]; i++) {
+        json_t *value = json_object_get(estimate, keys[i]);
+        json_integer_set(value, json_integer_value(value) +
+                         (json_int_t) values[i]);
+    }
+
+finally:
+    return error->code;
+}
+
+// Account for the pending metamod operations as they would be flushed
+// by write-behind: one stat per path and one call per AVU operation
+// remaining after coalescing
+static int flush_plan_batch(plan_t *plan, baton_error_t *error) {
+    init_baton_error(error);
+
+    if (json_array_size(plan->batch.items) == 0) goto finally;
+
+    plan->num_avus_coalesced += plan->batch.num_ops;
+    plan->num_paths_batched  += json_object_size(plan->batch.paths);
+
+    free_write_behind_batch(&plan->batch);
+    init_write_behind_batch(&plan->batch, error);
+
+finally:
+    return error->code;
+}
+
+static int plan_metamod(plan_t *plan, json_t *item, json_t *target,
+                        option_flags flags, baton_error_t *error) {
+    write_behind_batch_add(&plan->batch, item, flags, error);
+    if (error->code != 0) goto finally;
+
+    size_t num_avus = json_array_size(json_object_get(target, JSON_AVUS_KEY));
+    plan->num_avus += num_avus;
+    plan->num_metamod++;
+
+    add_estimate(plan, JSON_METAMOD_OP, PLAN_STAT_CALLS + num_avus, 1, 0, 1,
+                 error);
+    if (error->code != 0) goto finally;
+
+    if (plan->batch.num_ops >= plan_window(plan)) {
+        flush_plan_batch(plan, error);
+    }
+
+finally:
+    return error->code;
+}
+
+static int plan_get(plan_t *plan, json_t *target, option_flags flags,
+                    baton_error_t *error) {
+    char *path = json_to_path(target, error);
+    if (error->code != 0) goto finally;
+
+    // The size is known only if the target came from a listing that
+    // included it
+    json_t *size   = json_object_get(target, JSON_SIZE_KEY);
+    int size_known = json_is_integer(size);
+    size_t bytes   = size_known ? json_integer_value(size) : 0;
+
+    // Open, read and close
+    size_t calls = PLAN_STAT_CALLS + 2 +
+        num_transfer_calls(bytes, plan->args->buffer_size);
+
+    if ((flags & SAVE_FILES) && plan->args->cache_dir) {
+        // The checksum query made to look up the cache
+        calls++;
+        plan->num_cached++;
+    }
+
+    add_estimate(plan, JSON_GET_OP, calls, 1, bytes, size_known, error);
+
+finally:
+    if (path) free(path);
+
+    return error->code;
+}
+
+static int plan_put(plan_t *plan, json_t *target, option_flags flags,
+                    baton_error_t *error) {
+    char *path = NULL;
+    char *file = NULL;
+
+    path = json_to_path(target, error);
+    if (error->code != 0) goto finally;
+
+    struct stat st;
+    int size_known = 0;
+    int is_stream  = has_fd(target);
+    size_t bytes   = 0;
+
+    if (!is_stream) {
+        file = json_to_local_path(target, error);
+        if (error->code != 0) goto finally;
+
+        size_known = stat(file, &st) == 0;
+        if (!size_known) {
+            logmsg(WARN, "Failed to stat local file '%s': error %d %s",
+                   file, errno, strerror(errno));
+        }
+        else if (!S_ISREG(st.st_mode)) {
+            size_known = 0;
+            is_stream  = 1;
+        }
+        else {
+            bytes = (size_t) st.st_size;
+        }
+    }
+
+    // A stream's size is known only from the target's hint
+    if (is_stream) {
+        bytes      = get_size_hint(target);
+        size_known = bytes > 0;
+    }
+
+    size_t calls;
+    if ((flags & SINGLE_SERVER) || is_stream) {
+        // Open, write and close
+        calls = 2 + num_transfer_calls(bytes, plan->args->buffer_size);
+    }
+    else {
+        calls = 1;
+    }
+
+    if (flags & PRINT_CHECKSUM) calls++;
+
+    add_estimate(plan, JSON_PUT_OP, calls, 1, bytes, size_known, error);
+
+finally:
+    if (path) free(path);
+    if (file) free(file);
+
+    return error->code;
+}
+
+static int plan_path_op(plan_t *plan, const char *op, json_t *target,
+                        size_t calls, int calls_known, baton_error_t *error) {
+    char *path = json_to_path(target, error);
+    if (error->code != 0) goto finally;
+
+    add_estimate(plan, op, PLAN_STAT_CALLS + calls, calls_known, 0, 1, error);
+
+finally:
+    if (path) free(path);
+
+    return error->code;
+}
+
+static int plan_query(plan_t *plan, const char *op, json_t *target,
+                      option_flags flags, baton_error_t *error) {
+    size_t calls = 0;
+
+    if (has_collection(target)) calls += PLAN_STAT_CALLS;
+
+    // As search_metadata, one query per type of item searched, for
+    // each AVU query of a query set
+    size_t num_leaves = count_query_leaves(target);
+    if (flags & SEARCH_COLLECTIONS) calls += num_leaves;
+    if (flags & SEARCH_OBJECTS)     calls += num_leaves;
+    if (!(flags & (SEARCH_COLLECTIONS | SEARCH_OBJECTS))) {
+        calls += 2 * num_leaves;
+    }
+
+    // The results are enriched in batches, so the number of calls
+    // to do so, like the number of pages of results, is not known
+    if (num_enrichment_calls(flags) > 0) plan->num_enriched++;
+
+    // The number of results, and therefore the number of bytes
+    // fetched, is not known without running the query
+    int is_fetch = str_equals(op, JSON_FETCH_OP, MAX_STR_LEN);
+
+    add_estimate(plan, op, calls, 0, 0, !is_fetch, error);
+
+    return error->code;
+}
+
+int plan_item(plan_t *plan, json_t *item, baton_error_t *error) {
+    init_baton_error(error);
+
+    plan->num_items++;
+
+    operation_desc_t desc;
+    decode_envelope(item, plan->args->flags, &desc, error);
+    if (error->code != 0) goto finally;
+
+    const char *op     = desc.name;
+    json_t *target     = desc.target;
+    option_flags flags = desc.flags;
+    size_t num_threads = desc.has_threads ? desc.num_threads :
+        plan->args->num_threads;
+
+    if (desc.type == OPERATION_METAMOD) {
+        plan_metamod(plan, item, target, flags, error);
+        goto finally;
+    }
+
+    // As in iterate_json, any other operation flushes pending metamod
+    // operations first
+    flush_plan_batch(plan, error);
+    if (error->code != 0) goto finally;
+
+    if (desc.type == OPERATION_CHMOD) {
+        plan_path_op(plan, op, target, 1, 1, error);
+    }
+    else if (desc.type == OPERATION_CHECKSUM) {
+        plan_path_op(plan, op, target, (flags & PRINT_CHECKSUM) ? 2 : 1, 1,
+                     error);
+    }
+    else if (desc.type == OPERATION_DIGEST) {
+        // One query lists the collections of the tree, then one more
+        // lists the data objects of each, which cannot be counted
+        // without listing them
+        plan_path_op(plan, op, target, 2, 0, error);
+    }
+    else if (desc.type == OPERATION_COPY) {
+        // Data are copied between servers, so no bytes pass through
+        // the client. Each data object is copied in one call, with two
+        // checksum queries to verify it and a listing and an update
+        // for each of its AVUs and ACLs; a collection's are counted as
+        // one, as its contents are not listed here
+        size_t calls = 1;
+        if (flags & VERIFY_CHECKSUM) calls += 2;
+        if (flags & PRINT_AVU)       calls += 2;
+        if (flags & PRINT_ACL)       calls += 2;
+
+        plan_path_op(plan, op, target, calls,
+                     represents_data_object(target), error);
+        if (error->code != 0) goto finally;
+
+        if (num_threads > COPY_MAX_THREADS) num_threads = COPY_MAX_THREADS;
+        if (num_threads > plan->max_threads) plan->max_threads = num_threads;
+    }
+    else if (desc.type == OPERATION_LIST) {
+        size_t calls      = 1 + num_enrichment_calls(flags);
+        int calls_known   = 1;
+
+        if ((flags & PRINT_CONTENTS) && !represents_data_object(target)) {
+            // The data objects and sub-collections of a collection are
+            // listed separately, with their data added in batches
+            calls       = 3;
+            calls_known = 0;
+            if (num_enrichment_calls(flags) > 0) plan->num_enriched++;
+        }
+
+        plan_path_op(plan, op, target, calls, calls_known, error);
+    }
+    else if (desc.type == OPERATION_METAQUERY) {
+        plan_query(plan, op, target, flags, error);
+    }
+    else if (desc.type == OPERATION_FETCH) {
+        plan_query(plan, op, target, flags & ~SEARCH_COLLECTIONS, error);
+        if (error->code != 0) goto finally;
+
+        if (num_threads > plan->max_threads) plan->max_threads = num_threads;
+        if (plan->args->cache_dir) plan->num_cached++;
+    }
+    else if (desc.type == OPERATION_GET) {
+        plan_get(plan, target, flags, error);
+    }
+    else if (desc.type == OPERATION_PUT) {
+        plan_put(plan, target, flags, error);
+    }
+    else if (desc.type == OPERATION_MOVE   ||
+             desc.type == OPERATION_RM     ||
+             desc.type == OPERATION_MKCOLL ||
+             desc.type == OPERATION_RMCOLL) {
+        plan_path_op(plan, op, target, 1, 1, error);
+    }
+    else {
+        set_baton_error(error, -1, "Invalid baton operation '%s'", op);
+    }
+
+finally:
+    if (error->code != 0) plan->num_invalid++;
+
+    return error->code;
+}
+
+json_t *plan_report(plan_t *plan, baton_error_t *error) {
+    json_t *report = NULL;
+
+    flush_plan_batch(plan, error);
+    if (error->code != 0) goto error;
+
+    int write_behind = plan->args->write_behind > 0;
+    size_t batched_calls = plan->num_paths_batched + plan->num_avus_coalesced;
+    size_t unbatched_calls = plan->num_metamod * PLAN_STAT_CALLS +
+        plan->num_avus;
+
+    // Metamod operations are estimated individually above; with
+    // write-behind, they are made in batches instead
+    json_t *metamod = json_object_get(plan->operations, JSON_METAMOD_OP);
+    if (metamod && write_behind) {
+        json_object_set_new(metamod, JSON_PLAN_CALLS_KEY,
+                            json_integer(batched_calls));
+    }
+
+    json_int_t calls         = 0;
+    json_int_t unknown_calls = 0;
+    json_int_t bytes         = 0;
+    const char *op;
+    json_t *estimate;
+    json_object_foreach(plan->operations, op, estimate) {
+        calls += json_integer_value(json_object_get(estimate,
+                                                    JSON_PLAN_CALLS_KEY));
+        unknown_calls +=
+            json_integer_value(json_object_get(estimate,
+                                               JSON_PLAN_UNKNOWN_CALLS_KEY));
+        bytes += json_integer_value(json_object_get(estimate,
+                                                    JSON_PLAN_BYTES_KEY));
+    }
+
+    size_t connections = plan->num_items > plan->num_invalid ? 1 : 0;
+    if (write_behind && plan->num_metamod > 0) connections++;
+    connections += plan->max_threads;
+
+    size_t calls_saved = unbatched_calls > batched_calls ?
+        unbatched_calls - batched_calls : 0;
+
+    report = json_pack("{s:I, s:I, s:I, s:I, s:I, s:I, s:O, "
+                       "s:{s:{s:b, s:I, s:I, s:I, s:I}, s:{s:b, s:I}, s:I}}",
+                       JSON_PLAN_ITEMS_KEY,
+                       (json_int_t) plan->num_items,
+                       JSON_PLAN_INVALID_KEY,
+                       (json_int_t) plan->num_invalid,
+                       JSON_PLAN_CONNECTIONS_KEY,
+                       (json_int_t) connections,
+                       JSON_PLAN_CALLS_KEY,         calls,
+                       JSON_PLAN_UNKNOWN_CALLS_KEY, unknown_calls,
+                       JSON_PLAN_BYTES_KEY,         bytes,
+                       JSON_PLAN_OPERATIONS_KEY,    plan->operations,
+                       JSON_PLAN_OPTIMISATIONS_KEY,
+                       JSON_PLAN_WRITE_BEHIND_KEY,
+                       JSON_PLAN_ENABLED_KEY, write_behind,
+                       JSON_PLAN_WINDOW_KEY,
+                       (json_int_t) plan_window(plan),
+                       JSON_PLAN_AVUS_KEY,
+                       (json_int_t) plan->num_avus,
+                       JSON_PLAN_COALESCED_AVUS_KEY,
+                       (json_int_t) plan->num_avus_coalesced,
+                       JSON_PLAN_CALLS_SAVED_KEY,
+                       (json_int_t) calls_saved,
+                       JSON_PLAN_CACHE_KEY,
+                       JSON_PLAN_ENABLED_KEY, plan->args->cache_dir != NULL,
+                       JSON_PLAN_OPERATIONS_KEY,
+                       (json_int_t) plan->num_cached,
+                       JSON_PLAN_ENRICHMENT_KEY,
+                       (json_int_t) plan->num_enriched);
+    if (!report) {
+        set_baton_error(error, -1, "Failed to allocate a plan report");
+        goto error;
+    }
+
+    return report;
+
+error:
+    return NULL;
+}
+
+int do_plan(FILE *input, operation_args_t *args) {
+    int status    = 0;
+    json_t *report = NULL;
+    baton_error_t error;
+
+    plan_t plan = { .args       = args,
+                    .operations = json_object() };
+
+    if (!input || !plan.operations) {
+        status = 1;
+        goto finally;
+    }
+
+    init_write_behind_batch(&plan.batch, &error);
+    if (error.code != 0) {
+        logmsg(ERROR, "%s", error.message);
+        status = 1;
+        goto finally;
+    }
+
+    while (!exit_flag && !feof(input)) {
+        size_t jflags = JSON_DISABLE_EOF_CHECK | JSON_REJECT_DUPLICATES;
+        json_error_t load_error;
+        json_t *item = json_loadf(input, jflags, &load_error); // JSON alloc
+
+        if (!item) {
+            if (!feof(input)) {
+                logmsg(ERROR, "JSON error at line %d, column %d: %s",
+                       load_error.line, load_error.column, load_error.text);
+            }
+            continue;
+        }
+
+        if (!json_is_object(item)) {
+            logmsg(ERROR, "Item %zu in stream was not a JSON object; "
+                   "skipping", plan.num_items);
+            plan.num_items++;
+            plan.num_invalid++;
+            json_decref(item);
+            continue;
+        }
+
+        plan_item(&plan, item, &error);
+        if (error.code != 0) {
+            logmsg(ERROR, "Item %zu in stream cannot be planned: %s",
+                   plan.num_items - 1, error.message);
+        }
+
+        json_decref(item); // JSON free
+    }
+
+    report = plan_report(&plan, &error);
+    if (error.code != 0) {
+        logmsg(ERROR, "%s", error.message);
+        status = 1;
+        goto finally;
+    }
+
+    print_json(report);
+    if (plan.num_invalid > 0) status = 1;
+
+finally:
+    free_write_behind_batch(&plan.batch);
+    if (plan.operations) json_decref(plan.operations);
+    if (report)          json_decref(report);
+
+    return status;
+}
@@ -0,0 +1,131 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file plan.h
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#ifndef _BATON_PLAN_H
+#define _BATON_PLAN_H
+
+#include <stdio.h>
+
+#include <jansson.h>
+
+#include "config.h"
+#include "error.h"
+#include "operations.h"
+#include "write_behind.h"
+
+#define JSON_PLAN_ITEMS_KEY         "items"
+#define JSON_PLAN_INVALID_KEY       "invalid"
+#define JSON_PLAN_OPERATIONS_KEY    "operations"
+#define JSON_PLAN_COUNT_KEY         "count"
+#define JSON_PLAN_CALLS_KEY         "calls"
+#define JSON_PLAN_BYTES_KEY         "bytes"
+#define JSON_PLAN_UNKNOWN_BYTES_KEY "unknown_bytes"
+#define JSON_PLAN_UNKNOWN_CALLS_KEY "unknown_calls"
+#define JSON_PLAN_CONNECTIONS_KEY   "connections"
+#define JSON_PLAN_OPTIMISATIONS_KEY "optimisations"
+#define JSON_PLAN_ENABLED_KEY       "enabled"
+
+#define JSON_PLAN_WRITE_BEHIND_KEY  "write_behind"
+#define JSON_PLAN_CACHE_KEY         "local_cache"
+#define JSON_PLAN_ENRICHMENT_KEY    "batched_enrichment"
+
+#define JSON_PLAN_WINDOW_KEY         "window"
+#define JSON_PLAN_AVUS_KEY           "avus"
+#define JSON_PLAN_COALESCED_AVUS_KEY "coalesced_avus"
+#define JSON_PLAN_CALLS_SAVED_KEY    "calls_saved"
+
+/** The write-behind window assumed when estimating its benefit for a
+    stream that does not use it. */
+#define PLAN_DEFAULT_WINDOW 1000
+
+/**
+ *  @struct plan
+ *  @brief The accumulated estimate for a stream of envelopes.
+ */
+typedef struct plan {
+    /** Operation arguments shared by the stream. */
+    operation_args_t *args;
+    /** The number of items read. */
+    size_t num_items;
+    /** The number of items that could not be planned. */
+    size_t num_invalid;
+    /** A JSON object mapping operation names to their estimates. */
+    json_t *operations;
+    /** The largest number of threads of any fetch operation. */
+    size_t max_threads;
+    /** Metamod items, batched as they would be for write-behind. */
+    write_behind_batch_t batch;
+    /** The number of AVU operations in metamod items. */
+    size_t num_avus;
+    /** The number of AVU operations remaining after coalescing. */
+    size_t num_avus_coalesced;
+    /** The number of path resolutions after batching metamod items. */
+    size_t num_paths_batched;
+    /** The number of metamod items. */
+    size_t num_metamod;
+    /** The number of operations that would consult the local cache. */
+    size_t num_cached;
+    /** The number of operations whose results are enriched in batches. */
+    size_t num_enriched;
+} plan_t;
+
+/**
+ * Estimate the server calls and bytes transferred for one envelope
+ * and add them to a plan. The server is not contacted; only local
+ * files are examined.
+ *
+ * The calls of an operation whose results are not known until it
+ * runs, such as a metaquery or the listing of a collection's
+ * contents, are counted as a minimum: one call per query, without
+ * further pages or the calls that add data to each batch of results.
+ * Such operations are counted as having unknown calls, as a get of
+ * unknown size is counted as having unknown bytes.
+ *
+ * @param[in,out] plan    A plan.
+ * @param[in]     item    A baton-do envelope.
+ * @param[out]    error   An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int plan_item(plan_t *plan, json_t *item, baton_error_t *error);
+
+/**
+ * Make a JSON report of a plan, finishing any metamod batch.
+ *
+ * @param[in,out] plan    A plan.
+ * @param[out]    error   An error report struct.
+ *
+ * @return A new JSON object.
+ */
+json_t *plan_report(plan_t *plan, baton_error_t *error);
+
+/**
+ * Read a stream of baton-do envelopes and print a JSON report of the
+ * server calls, bytes and connections they are expected to use, and
+ * the optimisations that would apply, without performing them.
+ *
+ * @param[in]  input      A file handle.
+ * @param[in]  args       Operation arguments.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int do_plan(FILE *input, operation_args_t *args);
+
+#endif // _BATON_PLAN_H
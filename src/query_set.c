@@ -0,0 +1,938 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file query_set.c
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "baton.h"
+#include "json.h"
+#include "log.h"
+#include "query_set.h"
+
+// The clauses a query set passes down to the queries within it that
+// lack their own
+static const char *clause_keys[][2] = {
+    { JSON_COLLECTION_KEY, JSON_COLLECTION_SHORT_KEY },
+    { JSON_ACCESS_KEY,     NULL                      },
+    { JSON_TIMESTAMPS_KEY, JSON_TIMESTAMPS_SHORT_KEY }
+};
+
+#define NUM_CLAUSE_KEYS (sizeof clause_keys / sizeof clause_keys[0])
+
+typedef struct set_search set_search_t;
+
+// The results of one AVU query, read a page at a time from a cursor
+// on the query connection, from a query thread, or from a sorted
+// array in memory
+typedef struct leaf_source {
+    set_search_t *search;
+    // The AVU query, with the clauses inherited from enclosing sets
+    json_t *query;
+    query_cursor_t *cursor;
+
+    int threaded;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    json_t *queue[QUERY_SET_QUEUE_PAGES];
+    size_t head;
+    size_t count;
+    int finished;
+    int cancelled;
+    baton_error_t thread_error;
+
+    json_t *page;
+    size_t index;
+    // The last row passed, for checking the server's ordering
+    json_t *prev;
+    int checked;
+    int exhausted;
+} leaf_source_t;
+
+typedef enum {
+    SET_LEAF,
+    SET_ANY,
+    SET_ALL
+} set_node_type;
+
+typedef struct set_node {
+    set_node_type type;
+    leaf_source_t *leaf;
+    struct set_node **members;
+    size_t num_members;
+    // The negated members of an "all"
+    struct set_node **excluded;
+    size_t num_excluded;
+} set_node_t;
+
+struct set_search {
+    rcComm_t *conn;
+    char *zone_name;
+    query_format_in_t *format;
+    prepare_avu_search_cb prepare_avu;
+    prepare_acl_search_cb prepare_acl;
+    prepare_tps_search_cb prepare_cre;
+    prepare_tps_search_cb prepare_mod;
+    size_t num_ordered;
+
+    leaf_source_t *leaves;
+    size_t num_leaves;
+
+    int disordered;
+    baton_error_t error;
+};
+
+static json_t *get_clause(json_t *object, size_t i) {
+    json_t *value = json_object_get(object, clause_keys[i][0]);
+    if (!value && clause_keys[i][1]) {
+        value = json_object_get(object, clause_keys[i][1]);
+    }
+
+    return value;
+}
+
+static void set_clause(json_t *object, size_t i, json_t *value) {
+    json_object_del(object, clause_keys[i][0]);
+    if (clause_keys[i][1]) json_object_del(object, clause_keys[i][1]);
+
+    json_object_set(object, clause_keys[i][0], value);
+}
+
+static const char *row_value(json_t *row, const char *key) {
+    const char *value = json_string_value(json_object_get(row, key));
+
+    return value ? value : "";
+}
+
+static int compare_row_ptrs(const void *a, const void *b) {
+    return compare_query_rows(*(json_t * const *) a, *(json_t * const *) b);
+}
+
+static json_t *sort_query_rows(json_t *rows, baton_error_t *error) {
+    json_t **elts  = NULL;
+    json_t *sorted = NULL;
+
+    size_t num_rows = json_array_size(rows);
+    elts = calloc(num_rows + 1, sizeof (json_t *));
+    if (!elts) {
+        set_baton_error(error, errno, "Failed to allocate memory: error %d %s",
+                        errno, strerror(errno));
+        goto error;
+    }
+
+    for (size_t i = 0; i < num_rows; i++) {
+        elts[i] = json_array_get(rows, i);
+    }
+    qsort(elts, num_rows, sizeof (json_t *), compare_row_ptrs);
+
+    sorted = json_array();
+    if (!sorted) {
+        set_baton_error(error, -1, "Failed to allocate a new JSON array");
+        goto error;
+    }
+
+    for (size_t i = 0; i < num_rows; i++) {
+        json_array_append(sorted, elts[i]);
+    }
+
+    free(elts);
+
+    return sorted;
+
+error:
+    if (elts) free(elts);
+
+    return NULL;
+}
+
+static int search_stopped(set_search_t *search) {
+    return search->error.code != 0 || search->disordered;
+}
+
+static void *leaf_query_worker(void *arg) {
+    leaf_source_t *src     = arg;
+    set_search_t *search   = src->search;
+    query_cursor_t *cursor = NULL;
+    rodsEnv env;
+    baton_error_t error;
+
+    init_baton_error(&error);
+
+    rcComm_t *conn = rods_login(&env);
+
+    if (!conn) {
+        set_baton_error(&error, -1, "Failed to open a connection for "
+                        "a query thread");
+        goto finally;
+    }
+
+    cursor = open_search_cursor(conn, search->zone_name, src->query,
+                                search->format, search->prepare_avu,
+                                search->prepare_acl, search->prepare_cre,
+                                search->prepare_mod, search->num_ordered,
+                                &error);
+    if (error.code != 0) goto finally;
+
+    json_t *page;
+    while ((page = next_query_page(cursor, &error))) {
+        pthread_mutex_lock(&src->mutex);
+        while (src->count == QUERY_SET_QUEUE_PAGES && !src->cancelled) {
+            pthread_cond_wait(&src->changed, &src->mutex);
+        }
+
+        if (src->cancelled) {
+            pthread_mutex_unlock(&src->mutex);
+            json_decref(page);
+            break;
+        }
+
+        src->queue[(src->head + src->count) % QUERY_SET_QUEUE_PAGES] = page;
+        src->count++;
+        pthread_cond_broadcast(&src->changed);
+        pthread_mutex_unlock(&src->mutex);
+    }
+
+finally:
+    close_query_cursor(cursor);
+    if (conn) rcDisconnect(conn);
+
+    pthread_mutex_lock(&src->mutex);
+    src->finished     = 1;
+    src->thread_error = error;
+    pthread_cond_broadcast(&src->changed);
+    pthread_mutex_unlock(&src->mutex);
+
+    return NULL;
+}
+
+static int start_source(leaf_source_t *src, int threaded,
+                        baton_error_t *error) {
+    set_search_t *search = src->search;
+
+    init_baton_error(error);
+
+    if (threaded) {
+        // The thread has a private copy, as reference counts are not
+        // shared safely between threads
+        json_t *query = json_deep_copy(src->query);
+        if (!query) {
+            set_baton_error(error, -1, "Failed to copy a query for "
+                            "a query thread");
+            goto finally;
+        }
+        json_decref(src->query);
+        src->query = query;
+
+        pthread_mutex_init(&src->mutex, NULL);
+        pthread_cond_init(&src->changed, NULL);
+        src->threaded = 1;
+
+        int status = pthread_create(&src->thread, NULL, leaf_query_worker,
+                                    src);
+        if (status != 0) {
+            pthread_cond_destroy(&src->changed);
+            pthread_mutex_destroy(&src->mutex);
+            src->threaded = 0;
+
+            set_baton_error(error, status, "Failed to start a query "
+                            "thread: error %d %s", status, strerror(status));
+        }
+    }
+    else {
+        src->cursor = open_search_cursor(search->conn, search->zone_name,
+                                         src->query, search->format,
+                                         search->prepare_avu,
+                                         search->prepare_acl,
+                                         search->prepare_cre,
+                                         search->prepare_mod,
+                                         search->num_ordered, error);
+    }
+
+finally:
+    return error->code;
+}
+
+// Return a source to its unstarted state, stopping any thread and
+// releasing any statement held on the server
+static void reset_source(leaf_source_t *src) {
+    if (src->threaded) {
+        pthread_mutex_lock(&src->mutex);
+        src->cancelled = 1;
+        pthread_cond_broadcast(&src->changed);
+        pthread_mutex_unlock(&src->mutex);
+
+        pthread_join(src->thread, NULL);
+
+        while (src->count > 0) {
+            json_decref(src->queue[src->head]);
+            src->head = (src->head + 1) % QUERY_SET_QUEUE_PAGES;
+            src->count--;
+        }
+
+        pthread_cond_destroy(&src->changed);
+        pthread_mutex_destroy(&src->mutex);
+        src->threaded = 0;
+    }
+
+    if (src->cursor) {
+        close_query_cursor(src->cursor);
+        src->cursor = NULL;
+    }
+
+    if (src->page) json_decref(src->page);
+    if (src->prev) json_decref(src->prev);
+
+    src->page      = NULL;
+    src->prev      = NULL;
+    src->index     = 0;
+    src->head      = 0;
+    src->finished  = 0;
+    src->cancelled = 0;
+    src->checked   = 0;
+    src->exhausted = 0;
+}
+
+static json_t *next_source_page(leaf_source_t *src, baton_error_t *error) {
+    json_t *page = NULL;
+
+    init_baton_error(error);
+
+    if (src->cursor) {
+        page = next_query_page(src->cursor, error);
+    }
+    else if (src->threaded) {
+        pthread_mutex_lock(&src->mutex);
+        while (src->count == 0 && !src->finished) {
+            pthread_cond_wait(&src->changed, &src->mutex);
+        }
+
+        if (src->count > 0) {
+            page = src->queue[src->head];
+            src->head = (src->head + 1) % QUERY_SET_QUEUE_PAGES;
+            src->count--;
+            pthread_cond_broadcast(&src->changed);
+        }
+        else if (src->thread_error.code != 0) {
+            *error = src->thread_error;
+        }
+        pthread_mutex_unlock(&src->mutex);
+    }
+
+    return page;
+}
+
+// Return the current row of a source, borrowed, or NULL once it is
+// exhausted or the search has stopped
+static json_t *source_row(leaf_source_t *src) {
+    set_search_t *search = src->search;
+
+    while (!src->exhausted && !search_stopped(search)) {
+        if (src->page && src->index < json_array_size(src->page)) {
+            json_t *row = json_array_get(src->page, src->index);
+
+            if (!src->checked) {
+                if (src->prev && compare_query_rows(src->prev, row) > 0) {
+                    logmsg(DEBUG, "Query results are not in bytewise order "
+                           "at collection '%s'",
+                           row_value(row, JSON_COLLECTION_KEY));
+                    search->disordered = 1;
+                    break;
+                }
+                src->checked = 1;
+            }
+
+            return row;
+        }
+
+        if (src->page) json_decref(src->page);
+        src->index = 0;
+        src->page  = next_source_page(src, &search->error);
+        if (!src->page) src->exhausted = 1;
+    }
+
+    return NULL;
+}
+
+static void source_advance(leaf_source_t *src) {
+    json_t *row = json_array_get(src->page, src->index);
+
+    if (src->prev) json_decref(src->prev);
+    src->prev = json_incref(row);
+    src->index++;
+    src->checked = 0;
+}
+
+static json_t *node_peek(set_search_t *search, set_node_t *node);
+
+// Advance a node past all its rows that sort with or before a row
+static void node_advance(set_search_t *search, set_node_t *node,
+                         json_t *row) {
+    json_incref(row);
+
+    if (node->type == SET_LEAF) {
+        json_t *current;
+        while ((current = source_row(node->leaf)) &&
+               compare_query_rows(current, row) <= 0) {
+            source_advance(node->leaf);
+        }
+    }
+    else {
+        // The excluded members of an "all" are advanced lazily, when
+        // next compared
+        for (size_t i = 0; i < node->num_members; i++) {
+            node_advance(search, node->members[i], row);
+        }
+    }
+
+    json_decref(row);
+}
+
+static json_t *peek_any(set_search_t *search, set_node_t *node) {
+    json_t *min = NULL;
+
+    for (size_t i = 0; i < node->num_members; i++) {
+        json_t *row = node_peek(search, node->members[i]);
+        if (search_stopped(search)) return NULL;
+
+        if (row && (!min || compare_query_rows(row, min) < 0)) min = row;
+    }
+
+    return min;
+}
+
+// Skip a node to its first row that sorts with or after a row
+static json_t *node_seek(set_search_t *search, set_node_t *node,
+                         json_t *row) {
+    json_t *current;
+    while ((current = node_peek(search, node)) &&
+           compare_query_rows(current, row) < 0) {
+        node_advance(search, node, current);
+    }
+
+    return current;
+}
+
+static json_t *peek_all(set_search_t *search, set_node_t *node) {
+    while (!search_stopped(search)) {
+        json_t *max = NULL;
+
+        for (size_t i = 0; i < node->num_members; i++) {
+            json_t *row = node_peek(search, node->members[i]);
+            if (!row) return NULL;
+
+            if (!max || compare_query_rows(row, max) > 0) max = row;
+        }
+
+        json_incref(max);
+
+        int aligned = 1;
+        for (size_t i = 0; i < node->num_members && aligned; i++) {
+            json_t *row = node_seek(search, node->members[i], max);
+            if (!row) {
+                json_decref(max);
+                return NULL;
+            }
+
+            if (compare_query_rows(row, max) != 0) aligned = 0;
+        }
+
+        if (aligned) {
+            int excluded = 0;
+            for (size_t i = 0; i < node->num_excluded && !excluded; i++) {
+                json_t *row = node_seek(search, node->excluded[i], max);
+                if (row && compare_query_rows(row, max) == 0) excluded = 1;
+            }
+
+            if (!excluded) {
+                json_decref(max);
+                return search_stopped(search) ?
+                    NULL : node_peek(search, node->members[0]);
+            }
+
+            node_advance(search, node, max);
+        }
+
+        json_decref(max);
+    }
+
+    return NULL;
+}
+
+// Return the current row of a node, borrowed, or NULL once it is
+// exhausted or the search has stopped
+static json_t *node_peek(set_search_t *search, set_node_t *node) {
+    switch (node->type) {
+        case SET_LEAF:
+            return source_row(node->leaf);
+        case SET_ANY:
+            return peek_any(search, node);
+        default:
+            return peek_all(search, node);
+    }
+}
+
+static void free_node(set_node_t *node) {
+    if (!node) return;
+
+    for (size_t i = 0; i < node->num_members; i++) {
+        free_node(node->members[i]);
+    }
+    for (size_t i = 0; i < node->num_excluded; i++) {
+        free_node(node->excluded[i]);
+    }
+
+    if (node->members)  free(node->members);
+    if (node->excluded) free(node->excluded);
+    free(node);
+}
+
+static leaf_source_t *add_leaf(set_search_t *search, json_t *query,
+                               json_t *clauses, baton_error_t *error) {
+    if (search->num_leaves == QUERY_SET_MAX_LEAVES) {
+        set_baton_error(error, CAT_INVALID_ARGUMENT,
+                        "Invalid query set: more than %d queries",
+                        QUERY_SET_MAX_LEAVES);
+        goto error;
+    }
+
+    json_t *leaf_query = json_copy(query);
+    if (!leaf_query) {
+        set_baton_error(error, -1, "Failed to copy a query");
+        goto error;
+    }
+
+    for (size_t i = 0; i < NUM_CLAUSE_KEYS; i++) {
+        json_t *value = get_clause(clauses, i);
+        if (value) set_clause(leaf_query, i, value);
+    }
+
+    leaf_source_t *src = &search->leaves[search->num_leaves++];
+    src->search = search;
+    src->query  = leaf_query;
+
+    return src;
+
+error:
+    return NULL;
+}
+
+static set_node_t *build_node(set_search_t *search, json_t *query,
+                              json_t *inherited, size_t depth,
+                              baton_error_t *error) {
+    set_node_t *node = NULL;
+    json_t *clauses  = NULL;
+
+    if (!json_is_object(query)) {
+        set_baton_error(error, CAT_INVALID_ARGUMENT,
+                        "Invalid query set member: not a JSON object");
+        goto error;
+    }
+
+    if (depth > QUERY_SET_MAX_DEPTH) {
+        set_baton_error(error, CAT_INVALID_ARGUMENT,
+                        "Invalid query set: nested more than %d deep",
+                        QUERY_SET_MAX_DEPTH);
+        goto error;
+    }
+
+    if (json_object_get(query, JSON_NOT_KEY)) {
+        set_baton_error(error, CAT_INVALID_ARGUMENT,
+                        "Invalid query set: '%s' is valid only as "
+                        "a member of '%s'", JSON_NOT_KEY, JSON_ALL_KEY);
+        goto error;
+    }
+
+    json_t *avus = json_object_get(query, JSON_AVUS_KEY);
+    json_t *any  = json_object_get(query, JSON_ANY_KEY);
+    json_t *all  = json_object_get(query, JSON_ALL_KEY);
+
+    if ((avus != NULL) + (any != NULL) + (all != NULL) != 1) {
+        set_baton_error(error, CAT_INVALID_ARGUMENT,
+                        "Invalid query set member: expected exactly one "
+                        "of '%s', '%s' or '%s'",
+                        JSON_AVUS_KEY, JSON_ANY_KEY, JSON_ALL_KEY);
+        goto error;
+    }
+
+    clauses = inherited ? json_copy(inherited) : json_object();
+    if (!clauses) {
+        set_baton_error(error, -1, "Failed to allocate a new JSON object");
+        goto error;
+    }
+
+    for (size_t i = 0; i < NUM_CLAUSE_KEYS; i++) {
+        json_t *value = get_clause(query, i);
+        if (value) set_clause(clauses, i, value);
+    }
+
+    node = calloc(1, sizeof (set_node_t));
+    if (!node) {
+        set_baton_error(error, errno, "Failed to allocate memory: error %d %s",
+                        errno, strerror(errno));
+        goto error;
+    }
+
+    if (avus) {
+        node->type = SET_LEAF;
+        node->leaf = add_leaf(search, query, clauses, error);
+        if (error->code != 0) goto error;
+    }
+    else {
+        const char *key = any ? JSON_ANY_KEY : JSON_ALL_KEY;
+        json_t *members = any ? any : all;
+        size_t num_members = json_array_size(members);
+
+        if (!json_is_array(members) || num_members == 0) {
+            set_baton_error(error, CAT_INVALID_ARGUMENT,
+                            "Invalid '%s' query: not a non-empty JSON array",
+                            key);
+            goto error;
+        }
+
+        node->type     = any ? SET_ANY : SET_ALL;
+        node->members  = calloc(num_members, sizeof (set_node_t *));
+        node->excluded = calloc(num_members, sizeof (set_node_t *));
+        if (!node->members || !node->excluded) {
+            set_baton_error(error, errno, "Failed to allocate memory: "
+                            "error %d %s", errno, strerror(errno));
+            goto error;
+        }
+
+        for (size_t i = 0; i < num_members; i++) {
+            json_t *member  = json_array_get(members, i);
+            json_t *negated = json_object_get(member, JSON_NOT_KEY);
+
+            if (negated && all) {
+                if (json_object_size(member) != 1) {
+                    set_baton_error(error, CAT_INVALID_ARGUMENT,
+                                    "Invalid '%s' member at position %zu: "
+                                    "'%s' must be its only property",
+                                    key, i, JSON_NOT_KEY);
+                    goto error;
+                }
+
+                set_node_t *child = build_node(search, negated, clauses,
+                                               depth + 1, error);
+                if (error->code != 0) goto error;
+                node->excluded[node->num_excluded++] = child;
+            }
+            else {
+                set_node_t *child = build_node(search, member, clauses,
+                                               depth + 1, error);
+                if (error->code != 0) goto error;
+                node->members[node->num_members++] = child;
+            }
+        }
+
+        if (node->num_members == 0) {
+            set_baton_error(error, CAT_INVALID_ARGUMENT,
+                            "Invalid '%s' query: at least one member "
+                            "must not be negated", key);
+            goto error;
+        }
+    }
+
+    json_decref(clauses);
+
+    return node;
+
+error:
+    if (clauses) json_decref(clauses);
+    free_node(node);
+
+    return NULL;
+}
+
+static set_node_t *prepare_set(set_search_t *search, json_t *query,
+                               baton_error_t *error) {
+    set_node_t *root = NULL;
+
+    init_baton_error(&search->error);
+
+    search->leaves = calloc(QUERY_SET_MAX_LEAVES, sizeof (leaf_source_t));
+    if (!search->leaves) {
+        set_baton_error(error, errno, "Failed to allocate memory: error %d %s",
+                        errno, strerror(errno));
+        goto finally;
+    }
+
+    root = build_node(search, query, NULL, 0, error);
+
+finally:
+    return root;
+}
+
+static void free_set(set_search_t *search, set_node_t *root) {
+    free_node(root);
+
+    if (search->leaves) {
+        for (size_t i = 0; i < search->num_leaves; i++) {
+            reset_source(&search->leaves[i]);
+            json_decref(search->leaves[i].query);
+        }
+
+        free(search->leaves);
+    }
+}
+
+static int merge_set(set_search_t *search, set_node_t *root, json_t *results,
+                     baton_error_t *error) {
+    json_t *row;
+
+    init_baton_error(error);
+
+    while ((row = node_peek(search, root))) {
+        int status = json_array_append(results, row);
+        if (status != 0) {
+            set_baton_error(error, status, "Failed to add a query result");
+            goto finally;
+        }
+
+        node_advance(search, root, row);
+    }
+
+    if (search->error.code != 0) {
+        set_baton_error(error, search->error.code, "%s",
+                        search->error.message);
+    }
+
+finally:
+    return error->code;
+}
+
+// Replace the sources of a search with their results, sorted in memory
+static int materialize_sources(set_search_t *search, baton_error_t *error) {
+    init_baton_error(error);
+    init_baton_error(&search->error);
+    search->disordered = 0;
+
+    for (size_t i = 0; i < search->num_leaves; i++) {
+        leaf_source_t *src = &search->leaves[i];
+        reset_source(src);
+
+        json_t *rows = do_search(search->conn, search->zone_name, src->query,
+                                 search->format, search->prepare_avu,
+                                 search->prepare_acl, search->prepare_cre,
+                                 search->prepare_mod, error);
+        if (error->code != 0) goto finally;
+
+        src->page = sort_query_rows(rows, error);
+        json_decref(rows);
+        if (error->code != 0) goto finally;
+    }
+
+finally:
+    return error->code;
+}
+
+int is_query_set(json_t *query) {
+    return json_is_object(query) &&
+        (json_object_get(query, JSON_ANY_KEY) ||
+         json_object_get(query, JSON_ALL_KEY) ||
+         json_object_get(query, JSON_NOT_KEY));
+}
+
+size_t count_query_leaves(json_t *query) {
+    if (!is_query_set(query)) return 1;
+
+    size_t num_leaves = 0;
+    size_t index;
+    json_t *member;
+
+    json_array_foreach(json_object_get(query, JSON_ANY_KEY), index, member) {
+        num_leaves += count_query_leaves(member);
+    }
+    json_array_foreach(json_object_get(query, JSON_ALL_KEY), index, member) {
+        num_leaves += count_query_leaves(member);
+    }
+
+    json_t *negated = json_object_get(query, JSON_NOT_KEY);
+    if (negated) num_leaves += count_query_leaves(negated);
+
+    return num_leaves;
+}
+
+json_t *map_query_set_access_args(json_t *query, baton_error_t *error) {
+    init_baton_error(error);
+
+    query = map_access_args(query, error);
+    if (error->code != 0) goto error;
+
+    if (is_query_set(query)) {
+        const char *keys[] = { JSON_ANY_KEY, JSON_ALL_KEY };
+        size_t index;
+        json_t *member;
+
+        for (size_t i = 0; i < 2; i++) {
+            json_array_foreach(json_object_get(query, keys[i]), index,
+                               member) {
+                map_query_set_access_args(member, error);
+                if (error->code != 0) goto error;
+            }
+        }
+
+        json_t *negated = json_object_get(query, JSON_NOT_KEY);
+        if (negated) {
+            map_query_set_access_args(negated, error);
+            if (error->code != 0) goto error;
+        }
+    }
+
+    return query;
+
+error:
+    return NULL;
+}
+
+int compare_query_rows(json_t *a, json_t *b) {
+    int cmp = strcmp(row_value(a, JSON_COLLECTION_KEY),
+                     row_value(b, JSON_COLLECTION_KEY));
+    if (cmp == 0) {
+        cmp = strcmp(row_value(a, JSON_DATA_OBJECT_KEY),
+                     row_value(b, JSON_DATA_OBJECT_KEY));
+    }
+
+    return cmp;
+}
+
+json_t *combine_query_results(json_t *query, json_t *leaf_results,
+                              baton_error_t *error) {
+    set_search_t search = { 0 };
+    set_node_t *root    = NULL;
+    json_t *results     = NULL;
+
+    init_baton_error(error);
+
+    root = prepare_set(&search, query, error);
+    if (error->code != 0) goto error;
+
+    if (!json_is_array(leaf_results) ||
+        json_array_size(leaf_results) != search.num_leaves) {
+        set_baton_error(error, CAT_INVALID_ARGUMENT,
+                        "Invalid query set results: expected an array of "
+                        "%zu result arrays", search.num_leaves);
+        goto error;
+    }
+
+    for (size_t i = 0; i < search.num_leaves; i++) {
+        json_t *rows = json_array_get(leaf_results, i);
+        if (!json_is_array(rows)) {
+            set_baton_error(error, CAT_INVALID_ARGUMENT,
+                            "Invalid query set results at position %zu: "
+                            "not a JSON array", i);
+            goto error;
+        }
+
+        search.leaves[i].page = sort_query_rows(rows, error);
+        if (error->code != 0) goto error;
+    }
+
+    results = json_array();
+    if (!results) {
+        set_baton_error(error, -1, "Failed to allocate a new JSON array");
+        goto error;
+    }
+
+    merge_set(&search, root, results, error);
+    if (error->code != 0) goto error;
+
+    free_set(&search, root);
+
+    return results;
+
+error:
+    free_set(&search, root);
+    if (results) json_decref(results);
+
+    return NULL;
+}
+
+json_t *do_search_set(rcComm_t *conn, char *zone_name, json_t *query,
+                      query_format_in_t *format,
+                      prepare_avu_search_cb prepare_avu,
+                      prepare_acl_search_cb prepare_acl,
+                      prepare_tps_search_cb prepare_cre,
+                      prepare_tps_search_cb prepare_mod,
+                      size_t num_threads, baton_error_t *error) {
+    set_node_t *root = NULL;
+    json_t *results  = NULL;
+
+    set_search_t search = { .conn        = conn,
+                            .zone_name   = zone_name,
+                            .format      = format,
+                            .prepare_avu = prepare_avu,
+                            .prepare_acl = prepare_acl,
+                            .prepare_cre = prepare_cre,
+                            .prepare_mod = prepare_mod };
+
+    // Order by collection and then by data object name, where selected
+    search.num_ordered = (format->num_columns > 1 &&
+                          format->columns[1] == COL_DATA_NAME) ? 2 : 1;
+
+    init_baton_error(error);
+
+    root = prepare_set(&search, query, error);
+    if (error->code != 0) goto error;
+
+    results = json_array();
+    if (!results) {
+        set_baton_error(error, -1, "Failed to allocate a new JSON array");
+        goto error;
+    }
+
+    logmsg(DEBUG, "Merging %zu queries, %zu on their own connections",
+           search.num_leaves,
+           num_threads < search.num_leaves ? num_threads : search.num_leaves);
+
+    for (size_t i = 0; i < search.num_leaves; i++) {
+        start_source(&search.leaves[i], i < num_threads, error);
+        if (error->code != 0) goto error;
+    }
+
+    merge_set(&search, root, results, error);
+    if (error->code != 0) goto error;
+
+    if (search.disordered) {
+        logmsg(NOTICE, "The server does not order query results "
+               "bytewise; combining them in memory");
+
+        json_array_clear(results);
+
+        materialize_sources(&search, error);
+        if (error->code != 0) goto error;
+
+        merge_set(&search, root, results, error);
+        if (error->code != 0) goto error;
+    }
+
+    free_set(&search, root);
+    logmsg(TRACE, "Found %zu matching items", json_array_size(results));
+
+    return results;
+
+error:
+    free_set(&search, root);
+    if (results) json_decref(results);
+
+    return NULL;
+}
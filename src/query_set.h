@@ -0,0 +1,133 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file query_set.h
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#ifndef _BATON_QUERY_SET_H
+#define _BATON_QUERY_SET_H
+
+#include <rodsClient.h>
+#include <jansson.h>
+
+#include "config.h"
+#include "error.h"
+#include "json_query.h"
+
+/** The maximum number of metadata queries combined in one query
+    set. Each holds a statement open on the server while results are
+    merged. */
+#define QUERY_SET_MAX_LEAVES 32
+
+/** The maximum depth of nesting of a query set. */
+#define QUERY_SET_MAX_DEPTH  8
+
+/** The number of result pages queued ahead by each query thread. */
+#define QUERY_SET_QUEUE_PAGES 2
+
+/**
+ * Return true if a metadata query combines other queries with "any"
+ * (union), "all" (intersection) or "not" (difference).
+ *
+ * @param[in]  query      A JSON metadata query.
+ *
+ * @return 1 if the query is a query set, 0 otherwise.
+ */
+int is_query_set(json_t *query);
+
+/**
+ * Return the number of AVU queries a metadata query runs for each type
+ * of item searched.
+ *
+ * @param[in]  query      A JSON metadata query.
+ *
+ * @return The number of AVU queries, 1 for a query that is not a set.
+ */
+size_t count_query_leaves(json_t *query);
+
+/**
+ * Map the access levels of a metadata query and of every query nested
+ * within it to iCAT tokens, as map_access_args.
+ *
+ * @param[in]  query      A JSON metadata query.
+ * @param[out] error      An error report struct.
+ *
+ * @return The query, modified in place.
+ */
+json_t *map_query_set_access_args(json_t *query, baton_error_t *error);
+
+/**
+ * Compare two query result rows by collection and then by data object
+ * name, bytewise.
+ *
+ * @param[in]  a          A JSON result row.
+ * @param[in]  b          A JSON result row.
+ *
+ * @return An integer less than, equal to, or greater than zero if a
+ * sorts before, with, or after b.
+ */
+int compare_query_rows(json_t *a, json_t *b);
+
+/**
+ * Combine the results of the AVU queries of a query set, in memory.
+ *
+ * @param[in]  query        A JSON query set.
+ * @param[in]  leaf_results A JSON array of the result arrays of each AVU
+ *                          query of the set, depth-first, in any order.
+ * @param[out] error        An error report struct.
+ *
+ * @return A new JSON array of the combined results, sorted by path
+ * and without duplicates.
+ */
+json_t *combine_query_results(json_t *query, json_t *leaf_results,
+                              baton_error_t *error);
+
+/**
+ * Search with a query set. Each AVU query of the set runs as its own
+ * general query, ordered by path, and the results are combined by a
+ * merge that reads a page at a time from each, so that no query's
+ * results are held in full. If the server's ordering is found not to
+ * be bytewise, the results are combined in memory instead.
+ *
+ * @param[in]  conn          An open iRODS connection.
+ * @param[in]  zone_name     The zone in which to search (can be NULL for
+ *                           default zone).
+ * @param[in]  query         The query set, with access levels mapped.
+ * @param[in]  format        The columns and labels of the results. The
+ *                           collection column must be first, followed
+ *                           by any data object column.
+ * @param[in]  prepare_avu   Callback adding AVU conditions.
+ * @param[in]  prepare_acl   Callback adding ACL conditions.
+ * @param[in]  prepare_cre   Callback adding created timestamp conditions.
+ * @param[in]  prepare_mod   Callback adding modified timestamp conditions.
+ * @param[in]  num_threads   The number of AVU queries to run concurrently,
+ *                           each on its own connection. The rest page
+ *                           on the query connection. 0 runs all of them
+ *                           on the query connection.
+ * @param[in,out] error      An error report struct.
+ *
+ * @return A new JSON array of results, sorted by path.
+ */
+json_t *do_search_set(rcComm_t *conn, char *zone_name, json_t *query,
+                      query_format_in_t *format,
+                      prepare_avu_search_cb prepare_avu,
+                      prepare_acl_search_cb prepare_acl,
+                      prepare_tps_search_cb prepare_cre,
+                      prepare_tps_search_cb prepare_mod,
+                      size_t num_threads, baton_error_t *error);
+
+#endif // _BATON_QUERY_SET_H
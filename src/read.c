@@ -22,8 +22,11 @@
 #include <assert.h>
 
 #include "config.h"
-#include "compat_checksum.h"
+#include "buffer_pool.h"
+#include "deadline.h"
+#include "digest.h"
 #include "read.h"
+#include "trace.h"
 
 static char *do_slurp(rcComm_t *conn, rodsPath_t *rods_path,
                       size_t buffer_size, baton_error_t *error) {
@@ -122,9 +125,12 @@ error:
     return NULL;
 }
 
-data_obj_file_t *open_data_obj(rcComm_t *conn, rodsPath_t *rods_path,
-                               int open_flag, int flags,
-                               baton_error_t *error) {
+static data_obj_file_t *open_data_obj_sized(rcComm_t *conn,
+                                            rodsPath_t *rods_path,
+                                            const char *default_resource,
+                                            int open_flag, int flags,
+                                            uint64_t size_hint,
+                                            baton_error_t *error) {
     data_obj_file_t *data_obj = NULL;
     dataObjInp_t obj_open_in;
     int descriptor;
@@ -151,8 +157,14 @@ data_obj_file_t *open_data_obj(rcComm_t *conn, rodsPath_t *rods_path,
         case (O_WRONLY):
           obj_open_in.openFlags  = O_WRONLY;
           obj_open_in.createMode = 0750;
-          obj_open_in.dataSize   = 0;
+          obj_open_in.dataSize   = (rodsLong_t) size_hint;
           addKeyVal(&obj_open_in.condInput, FORCE_FLAG_KW, "");
+          if (default_resource) {
+              logmsg(DEBUG, "Using '%s' as the default iRODS resource",
+                     default_resource);
+              addKeyVal(&obj_open_in.condInput, DEF_RESC_NAME_KW,
+                        default_resource);
+          }
           descriptor = rcDataObjCreate(conn, &obj_open_in);
           clearKeyVal(&obj_open_in.condInput);
           break;
@@ -185,8 +197,9 @@ data_obj_file_t *open_data_obj(rcComm_t *conn, rodsPath_t *rods_path,
     data_obj->flags               = obj_open_in.openFlags;
     data_obj->open_obj            = calloc(1, sizeof (openedDataObjInp_t));
     data_obj->open_obj->l1descInx = descriptor;
-    data_obj->md5_last_read       = calloc(33, sizeof (char));
-    data_obj->md5_last_write      = calloc(33, sizeof (char));
+    data_obj->scheme              = get_default_digest_scheme();
+    data_obj->checksum_last_read  = calloc(MAX_CHECKSUM_LEN, sizeof (char));
+    data_obj->checksum_last_write = calloc(MAX_CHECKSUM_LEN, sizeof (char));
 
     return data_obj;
 
@@ -196,6 +209,26 @@ error:
     return NULL;
 }
 
+data_obj_file_t *open_data_obj(rcComm_t *conn, rodsPath_t *rods_path,
+                               int open_flag, int flags,
+                               baton_error_t *error) {
+    return open_data_obj_sized(conn, rods_path, NULL, open_flag, flags, 0,
+                               error);
+}
+
+data_obj_file_t *create_data_obj(rcComm_t *conn, rodsPath_t *rods_path,
+                                 const char *default_resource,
+                                 uint64_t size_hint, int flags,
+                                 baton_error_t *error) {
+    if (size_hint > 0) {
+        logmsg(DEBUG, "Creating '%s' with an expected size of %llu bytes",
+               rods_path->outPath, (unsigned long long) size_hint);
+    }
+
+    return open_data_obj_sized(conn, rods_path, default_resource, O_WRONLY,
+                               flags, size_hint, error);
+}
+
 int close_data_obj(rcComm_t *conn, data_obj_file_t *data_obj) {
     logmsg(DEBUG, "Closing '%s'", data_obj->path);
     int status = rcDataObjClose(conn, data_obj->open_obj);
@@ -206,9 +239,9 @@ int close_data_obj(rcComm_t *conn, data_obj_file_t *data_obj) {
 void free_data_obj(data_obj_file_t *data_obj) {
     assert(data_obj);
 
-    if (data_obj->open_obj)       free(data_obj->open_obj);
-    if (data_obj->md5_last_read)  free(data_obj->md5_last_read);
-    if (data_obj->md5_last_write) free(data_obj->md5_last_write);
+    if (data_obj->open_obj)            free(data_obj->open_obj);
+    if (data_obj->checksum_last_read)  free(data_obj->checksum_last_read);
+    if (data_obj->checksum_last_write) free(data_obj->checksum_last_write);
 
     free(data_obj);
 }
@@ -217,6 +250,12 @@ size_t read_chunk(rcComm_t *conn, data_obj_file_t *data_obj, char *buffer,
                   size_t len, baton_error_t *error) {
     init_baton_error(error);
 
+    if (deadline_expired()) {
+        set_baton_error(error, DEADLINE_EXPIRED,
+                        "Deadline expired reading from '%s'", data_obj->path);
+        return 0;
+    }
+
     data_obj->open_obj->len = len;
 
     bytesBuf_t obj_read_out;
@@ -226,7 +265,11 @@ size_t read_chunk(rcComm_t *conn, data_obj_file_t *data_obj, char *buffer,
 
     logmsg(DEBUG, "Reading up to %zu bytes from '%s'", len, data_obj->path);
 
+    trace_span_t span;
+    trace_begin(&span, TRACE_CAT_TRANSFER, "rcDataObjRead", "%zu %s", len,
+                data_obj->path);
     int num_read = rcDataObjRead(conn, data_obj->open_obj, &obj_read_out);
+    trace_end(&span);
     if (num_read < 0) {
         char *err_subname;
         const char *err_name = rodsErrorName(num_read, &err_subname);
@@ -248,7 +291,9 @@ size_t read_data_obj(rcComm_t *conn, data_obj_file_t *data_obj,
     size_t num_read    = 0;
     size_t num_written = 0;
     char *buffer       = NULL;
+    digest_t digest;
 
+    memset(&digest, 0, sizeof digest);
     init_baton_error(error);
 
     if (buffer_size == 0) {
@@ -257,16 +302,11 @@ size_t read_data_obj(rcComm_t *conn, data_obj_file_t *data_obj,
         goto finally;
     }
 
-    buffer = calloc(buffer_size +1, sizeof (char));
-    if (!buffer) {
-        logmsg(ERROR, "Failed to allocate memory: error %d %s",
-               errno, strerror(errno));
-        goto finally;
-    }
+    buffer = lease_buffer(buffer_size, error);
+    if (error->code != 0) goto finally;
 
-    unsigned char digest[16];
-    MD5_CTX context;
-    compat_MD5Init(&context);
+    init_digest(&digest, data_obj->scheme, error);
+    if (error->code != 0) goto finally;
 
     size_t nr, nw;
     while ((nr = read_chunk(conn, data_obj, buffer, buffer_size, error)) > 0) {
@@ -283,12 +323,13 @@ size_t read_data_obj(rcComm_t *conn, data_obj_file_t *data_obj,
         nw = nr;
         num_written += nw;
 
-        compat_MD5Update(&context, (unsigned char*) buffer, nr);
-        memset(buffer, 0, buffer_size);
+        update_digest(&digest, buffer, nr);
     }
 
-    compat_MD5Final(digest, &context);
-    set_md5_last_read(data_obj, digest);
+    if (error->code != 0) goto finally;
+
+    final_digest(&digest, data_obj->checksum_last_read, error);
+    if (error->code != 0) goto finally;
 
     if (num_read != num_written) {
         set_baton_error(error, -1, "Read %zu bytes from '%s' but wrote "
@@ -296,16 +337,17 @@ size_t read_data_obj(rcComm_t *conn, data_obj_file_t *data_obj,
         goto finally;
     }
 
-    if (!validate_md5_last_read(conn, data_obj)) {
-        logmsg(WARN, "Checksum mismatch for '%s' having MD5 %s on reading",
-               data_obj->path, data_obj->md5_last_read);
+    if (!validate_checksum_last_read(conn, data_obj)) {
+        logmsg(WARN, "Checksum mismatch for '%s' having checksum %s on "
+               "reading", data_obj->path, data_obj->checksum_last_read);
     }
 
-    logmsg(NOTICE, "Wrote %zu bytes from '%s' to stream having MD5 %s",
-           num_written, data_obj->path, data_obj->md5_last_read);
+    logmsg(NOTICE, "Wrote %zu bytes from '%s' to stream having checksum %s",
+           num_written, data_obj->path, data_obj->checksum_last_read);
 
 finally:
-    if (buffer) free(buffer);
+    free_digest(&digest);
+    release_buffer(buffer, buffer_size);
 
     return num_written;
 }
@@ -314,19 +356,16 @@ char *slurp_data_obj(rcComm_t *conn, data_obj_file_t *data_obj,
                      size_t buffer_size, baton_error_t *error) {
     char *buffer  = NULL;
     char *content = NULL;
+    digest_t digest;
 
+    memset(&digest, 0, sizeof digest);
     init_baton_error(error);
 
-    buffer = calloc(buffer_size +1, sizeof (char));
-    if (!buffer) {
-        logmsg(ERROR, "Failed to allocate memory: error %d %s",
-               errno, strerror(errno));
-        goto error;
-    }
+    buffer = lease_buffer(buffer_size, error);
+    if (error->code != 0) goto error;
 
-    unsigned char digest[16];
-    MD5_CTX context;
-    compat_MD5Init(&context);
+    init_digest(&digest, data_obj->scheme, error);
+    if (error->code != 0) goto error;
 
     size_t capacity = buffer_size;
     size_t num_read = 0;
@@ -358,30 +397,32 @@ char *slurp_data_obj(rcComm_t *conn, data_obj_file_t *data_obj,
         }
 
         memcpy(content + num_read, buffer, nr);
-        memset(buffer, 0, buffer_size);
+        update_digest(&digest, buffer, nr);
         num_read += nr;
     }
 
+    if (error->code != 0) goto error;
+
     logmsg(DEBUG, "Final capacity %zu, offset %zu", capacity, num_read);
 
-    compat_MD5Update(&context, (unsigned char *) content, num_read);
-    compat_MD5Final(digest, &context);
-    set_md5_last_read(data_obj, digest);
+    final_digest(&digest, data_obj->checksum_last_read, error);
+    if (error->code != 0) goto error;
 
-    if (!validate_md5_last_read(conn, data_obj)) {
-        logmsg(WARN, "Checksum mismatch for '%s' having MD5 %s on reading",
-               data_obj->path, data_obj->md5_last_read);
+    if (!validate_checksum_last_read(conn, data_obj)) {
+        logmsg(WARN, "Checksum mismatch for '%s' having checksum %s on "
+               "reading", data_obj->path, data_obj->checksum_last_read);
     }
 
-    logmsg(NOTICE, "Wrote %zu bytes from '%s' to buffer having MD5 %s",
-           num_read, data_obj->path, data_obj->md5_last_read);
+    logmsg(NOTICE, "Wrote %zu bytes from '%s' to buffer having checksum %s",
+           num_read, data_obj->path, data_obj->checksum_last_read);
 
-    if (buffer) free(buffer);
+    release_buffer(buffer, buffer_size);
 
     return content;
 
 error:
-    if (buffer)  free(buffer);
+    free_digest(&digest);
+    release_buffer(buffer, buffer_size);
     if (content) free(content);
 
     return NULL;
@@ -432,6 +473,86 @@ finally:
     return error->code;
 }
 
+int get_data_obj_file_parallel(rcComm_t *conn, rodsPath_t *rods_path,
+                               const char *local_path, int num_threads,
+                               baton_error_t *error) {
+    dataObjInp_t obj_get_in;
+    char *tmpname = NULL;
+
+    init_baton_error(error);
+
+    memset(&obj_get_in, 0, sizeof obj_get_in);
+
+    if (num_threads < 0) {
+        set_baton_error(error, -1, "Invalid num_threads argument %d",
+                        num_threads);
+        goto finally;
+    }
+
+    // Currently only data objects are supported
+    if (rods_path->objType != DATA_OBJ_T) {
+        set_baton_error(error, USER_INPUT_PATH_ERR,
+                        "Cannot write the contents of '%s' because "
+                        "it is not a data object", rods_path->outPath);
+        goto finally;
+    }
+
+    if (deadline_expired()) {
+        set_baton_error(error, DEADLINE_EXPIRED,
+                        "Deadline expired before getting '%s'",
+                        rods_path->outPath);
+        goto finally;
+    }
+
+    tmpname = copy_str(local_path, MAX_STR_LEN);
+    if (!tmpname) {
+        set_baton_error(error, errno, "Failed to copy string '%s'",
+                        local_path);
+        goto finally;
+    }
+
+    snprintf(obj_get_in.objPath, MAX_NAME_LEN, "%s", rods_path->outPath);
+    obj_get_in.openFlags = O_RDONLY;
+    obj_get_in.oprType   = GET_OPR;
+
+    // The server chooses the number of streams from the size when
+    // numThreads is 0
+    obj_get_in.numThreads = num_threads;
+    if (rods_path->rodsObjStat) {
+        obj_get_in.dataSize = rods_path->rodsObjStat->objSize;
+    }
+
+    // Replace any existing file, as get_data_obj_file does, and have
+    // the client check the file against the catalogue checksum
+    addKeyVal(&obj_get_in.condInput, FORCE_FLAG_KW, "");
+    addKeyVal(&obj_get_in.condInput, VERIFY_CHKSUM_KW, "");
+
+    logmsg(DEBUG, "Getting '%s' to '%s' using %d threads (0 for the "
+           "server's choice)", rods_path->outPath, local_path, num_threads);
+
+    trace_span_t span;
+    trace_begin(&span, TRACE_CAT_TRANSFER, "rcDataObjGet", "%s",
+                rods_path->outPath);
+    int status = rcDataObjGet(conn, &obj_get_in, tmpname);
+    trace_end(&span);
+    if (status < 0) {
+        char *err_subname;
+        const char *err_name = rodsErrorName(status, &err_subname);
+        set_baton_error(error, status,
+                        "Failed to get data object: '%s' error %d %s",
+                        rods_path->outPath, status, err_name);
+        goto finally;
+    }
+
+    logmsg(NOTICE, "Got '%s' to '%s'", rods_path->outPath, local_path);
+
+finally:
+    clearKeyVal(&obj_get_in.condInput);
+    if (tmpname) free(tmpname);
+
+    return error->code;
+}
+
 int get_data_obj_stream(rcComm_t *conn, rodsPath_t *rods_path, FILE *out,
                         size_t buffer_size, baton_error_t *error) {
     data_obj_file_t *data_obj = NULL;
@@ -573,29 +694,53 @@ error:
 }
 
 void set_md5_last_read(data_obj_file_t *data_obj, unsigned char digest[16]) {
-    char *md5 = data_obj->md5_last_read;
+    char *md5 = data_obj->checksum_last_read;
     for (int i = 0; i < 16; i++) {
         snprintf(md5 + i * 2, 3, "%02x", digest[i]);
     }
 }
 
 int validate_md5_last_read(rcComm_t *conn, data_obj_file_t *data_obj) {
-    dataObjInp_t obj_md5_in;
-    memset(&obj_md5_in, 0, sizeof obj_md5_in);
+    return validate_checksum_last_read(conn, data_obj);
+}
+
+int validate_checksum_last_read(rcComm_t *conn, data_obj_file_t *data_obj) {
+    dataObjInp_t obj_chksum_in;
+    memset(&obj_chksum_in, 0, sizeof obj_chksum_in);
 
-    snprintf(obj_md5_in.objPath, MAX_NAME_LEN, "%s", data_obj->path);
+    snprintf(obj_chksum_in.objPath, MAX_NAME_LEN, "%s", data_obj->path);
 
-    char *md5 = NULL;
-    int status = rcDataObjChksum(conn, &obj_md5_in, &md5);
+    char *checksum = NULL;
+    int status = rcDataObjChksum(conn, &obj_chksum_in, &checksum);
     if (status < 0) goto finally;
 
-    logmsg(DEBUG, "Comparing last read MD5 of '%s' with expected MD5 of '%s'",
-           data_obj->md5_last_read, md5);
+    digest_scheme scheme = checksum_scheme(checksum);
+    if (scheme == DIGEST_UNKNOWN) {
+        logmsg(DEBUG, "Not validating '%s'; its checksum '%s' has an "
+               "unknown hash scheme", data_obj->path, checksum);
+        status = -1;
+        goto finally;
+    }
+
+    if (scheme != data_obj->scheme) {
+        // The zone hashes differently from our environment. Follow
+        // the zone from now on, so that later transfers can be checked
+        logmsg(NOTICE, "Not validating '%s'; read with %s but the "
+               "catalogue has %s. Using %s from now on", data_obj->path,
+               digest_scheme_name(data_obj->scheme),
+               digest_scheme_name(scheme), digest_scheme_name(scheme));
+        set_default_digest_scheme(scheme);
+        status = -1;
+        goto finally;
+    }
 
-    status = str_equals_ignore_case(data_obj->md5_last_read, md5, 32);
+    logmsg(DEBUG, "Comparing last read checksum of '%s' with expected "
+           "checksum of '%s'", data_obj->checksum_last_read, checksum);
+
+    status = checksum_equals(data_obj->checksum_last_read, checksum);
 
 finally:
-    if (md5) free(md5);
+    if (checksum) free(checksum);
 
     return status;
 }
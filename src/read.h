@@ -22,9 +22,12 @@
 #ifndef _BATON_READ_H
 #define _BATON_READ_H
 
+#include <stdint.h>
+
 #include <rodsClient.h>
 
 #include "config.h"
+#include "digest.h"
 #include "list.h"
 
 /**
@@ -38,10 +41,13 @@ typedef struct data_obj_file {
     int flags;
     /** Opened data object handle */
     openedDataObjInp_t *open_obj;
-    /** The MD5 calculated last time the object was read completely */
-    char *md5_last_read;
-    /** The MD5 calculated last time the object was written completely */
-    char *md5_last_write;
+    /** The hash scheme of checksums calculated on the client */
+    digest_scheme scheme;
+    /** The checksum calculated last time the object was read completely */
+    char *checksum_last_read;
+    /** The checksum calculated last time the object was written
+        completely */
+    char *checksum_last_write;
 } data_obj_file_t;
 
 /**
@@ -65,6 +71,27 @@ typedef struct data_obj_file {
 data_obj_file_t *open_data_obj(rcComm_t *conn, rodsPath_t *rods_path,
                                int open_flag, int flags, baton_error_t *error);
 
+/**
+ * Create a data object for writing, as open_data_obj with O_WRONLY,
+ * giving the server the expected size of its content. The server may
+ * use the size to choose a resource or to preallocate space.
+ *
+ * @param[in]  conn       An open iRODS connection.
+ * @param[in]  rods_path  An iRODS data object path.
+ * @param[in]  default_resource
+ *                        An iRODS resource name. Optional, may be NULL.
+ * @param[in]  size_hint  The expected size in bytes, 0 if unknown.
+ * @param[in]  flags      WRITE_LOCK to use an advisory lock server-side.
+ *                        Optional.
+ * @param[out] error      An error report struct.
+ *
+ * @return A new struct, which must be freed by the caller.
+ */
+data_obj_file_t *create_data_obj(rcComm_t *conn, rodsPath_t *rods_path,
+                                 const char *default_resource,
+                                 uint64_t size_hint, int flags,
+                                 baton_error_t *error);
+
 int close_data_obj(rcComm_t *conn, data_obj_file_t *obj_file);
 
 void free_data_obj(data_obj_file_t *obj_file);
@@ -120,14 +147,53 @@ int get_data_obj_file(rcComm_t *conn, rodsPath_t *rods_path,
                       const char *local_path, size_t buffer_size,
                       baton_error_t *error);
 
+/**
+ * Get a data object to a local file using the server's parallel
+ * transfer (rcDataObjGet), which may stream content over several
+ * connections to the server's data transfer ports rather than
+ * through the control connection. The local file is replaced if it
+ * exists and is verified against the catalogue checksum.
+ *
+ * @param[in]  conn        An open iRODS connection.
+ * @param[in]  rods_path   An iRODS data object path.
+ * @param[in]  local_path  The local file path.
+ * @param[in]  num_threads The number of transfer threads. 0 lets the
+ *                         server choose, according to the object's size.
+ * @param[out] error       An error report struct.
+ *
+ * @return 0 on success, iRODS error code on failure.
+ */
+int get_data_obj_file_parallel(rcComm_t *conn, rodsPath_t *rods_path,
+                               const char *local_path, int num_threads,
+                               baton_error_t *error);
+
 int get_data_obj_stream(rcComm_t *conn, rodsPath_t *rods_path, FILE *out,
                         size_t buffer_size, baton_error_t *error);
 
 char *checksum_data_obj(rcComm_t *conn, rodsPath_t *rods_path,
                         option_flags flags, baton_error_t *error);
 
+/**
+ * Compare the checksum calculated last time a data object was read
+ * completely with its checksum in the catalogue, which the server
+ * calculates if absent.
+ *
+ * If the catalogue checksum is of a different hash scheme, the two
+ * cannot be compared and the client switches to that scheme for
+ * subsequent transfers.
+ *
+ * @param[in]  conn       An open iRODS connection.
+ * @param[in]  obj_file   A data object handle.
+ *
+ * @return 1 if the checksums match, 0 if they do not, or a negative
+ * value if they could not be compared.
+ */
+int validate_checksum_last_read(rcComm_t *conn, data_obj_file_t *obj_file);
+
+__attribute__((deprecated("checksums are set on reading")))
 void set_md5_last_read(data_obj_file_t *obj_file, unsigned char digest[16]);
 
+__attribute__((deprecated("use validate_checksum_last_read instead")))
 int validate_md5_last_read(rcComm_t *conn, data_obj_file_t *obj_file);
 
 #endif // _BATON_READ_H
@@ -0,0 +1,510 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file tar.c
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "log.h"
+#include "tar.h"
+
+#define TAR_NAME_LEN   100
+#define TAR_PREFIX_LEN 155
+#define TAR_PAX_NAME   "././@PaxHeader"
+
+#define TAR_TYPE_OLD_FILE   '\0'
+#define TAR_TYPE_PAX_GLOBAL 'g'
+#define TAR_TYPE_GNU_NAME   'L'
+#define TAR_TYPE_GNU_LINK   'K'
+
+// The ustar header layout, every field being a NUL-padded string or
+// a NUL-terminated octal number
+typedef struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} tar_header_t;
+
+static void format_octal(char *field, size_t len, uint64_t value) {
+    snprintf(field, len, "%0*" PRIo64, (int) len - 1, value);
+}
+
+// Split a name into a ustar prefix and name at a '/', returning the
+// length of the prefix, or -1 if the name cannot be split
+static int split_name(const char *name, size_t len) {
+    if (len <= TAR_NAME_LEN) return 0;
+
+    for (size_t i = len - TAR_NAME_LEN - 1; i < len && i <= TAR_PREFIX_LEN;
+         i++) {
+        if (name[i] == '/' && i > 0 && len - i - 1 > 0) return (int) i;
+    }
+
+    return -1;
+}
+
+static void format_ustar(char *block, const char *name, size_t len,
+                         int prefix_len, char type, uint64_t size,
+                         time_t mtime) {
+    tar_header_t *header = (tar_header_t *) block;
+    memset(block, 0, TAR_BLOCK_SIZE);
+
+    if (prefix_len > 0) {
+        memcpy(header->prefix, name, prefix_len);
+        memcpy(header->name, name + prefix_len + 1, len - prefix_len - 1);
+    }
+    else {
+        memcpy(header->name, name,
+               len < TAR_NAME_LEN ? len : TAR_NAME_LEN);
+    }
+
+    int mode = type == TAR_TYPE_DIRECTORY ? TAR_DIRECTORY_MODE :
+        TAR_FILE_MODE;
+
+    format_octal(header->mode,  sizeof header->mode,  mode);
+    format_octal(header->uid,   sizeof header->uid,   0);
+    format_octal(header->gid,   sizeof header->gid,   0);
+    format_octal(header->size,  sizeof header->size,
+                 size > TAR_MAX_USTAR_SIZE ? 0 : size);
+    format_octal(header->mtime, sizeof header->mtime,
+                 mtime > 0 ? (uint64_t) mtime : 0);
+
+    header->typeflag = type;
+    memcpy(header->magic, "ustar", 6);
+    memcpy(header->version, "00", 2);
+
+    // The checksum is calculated with its own field as spaces
+    memset(header->chksum, ' ', sizeof header->chksum);
+    unsigned int sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+        sum += (unsigned char) block[i];
+    }
+    snprintf(header->chksum, sizeof header->chksum - 1, "%06o", sum);
+    header->chksum[7] = ' ';
+}
+
+static size_t num_digits(size_t n) {
+    size_t digits = 1;
+    for (; n >= 10; n /= 10) digits++;
+
+    return digits;
+}
+
+// Append a pax record, whose length includes its own digits
+static size_t format_pax_record(char *buffer, size_t capacity,
+                                const char *key, const char *value) {
+    size_t len = strlen(key) + strlen(value) + 3; // ' ', '=' and '\n'
+
+    // Adding the digits may carry the length over a power of 10
+    size_t total = len + 1;
+    while (num_digits(total) != total - len) total++;
+
+    if (total >= capacity) return 0;
+
+    snprintf(buffer, capacity, "%zu %s=%s\n", total, key, value);
+
+    return total;
+}
+
+size_t format_tar_header(char *header, const char *name, char type,
+                         uint64_t size, time_t mtime, baton_error_t *error) {
+    init_baton_error(error);
+
+    size_t len = strlen(name);
+    if (len == 0) {
+        set_baton_error(error, -1, "Invalid tar entry name: empty");
+        return 0;
+    }
+
+    int prefix_len = split_name(name, len);
+    if (prefix_len >= 0 && size <= TAR_MAX_USTAR_SIZE) {
+        format_ustar(header, name, len, prefix_len, type, size, mtime);
+        return TAR_BLOCK_SIZE;
+    }
+
+    // The pax data follow the pax header block and precede the ustar
+    // header, each padded to a block
+    char *data = header + TAR_BLOCK_SIZE;
+    size_t capacity = TAR_MAX_HEADER_SIZE - 2 * TAR_BLOCK_SIZE;
+    size_t data_len = 0;
+
+    if (prefix_len < 0) {
+        size_t n = format_pax_record(data, capacity, "path", name);
+        if (n == 0) {
+            set_baton_error(error, -1, "Invalid tar entry name '%s': "
+                            "too long", name);
+            return 0;
+        }
+        data_len += n;
+    }
+
+    if (size > TAR_MAX_USTAR_SIZE) {
+        char value[32];
+        snprintf(value, sizeof value, "%" PRIu64, size);
+
+        size_t n = format_pax_record(data + data_len, capacity - data_len,
+                                     "size", value);
+        if (n == 0) {
+            set_baton_error(error, -1, "Invalid tar entry name '%s': "
+                            "too long", name);
+            return 0;
+        }
+        data_len += n;
+    }
+
+    size_t padding = tar_padding(data_len);
+    memset(data + data_len, 0, padding);
+
+    format_ustar(header, TAR_PAX_NAME, strlen(TAR_PAX_NAME), 0,
+                 TAR_TYPE_PAX, data_len, mtime);
+
+    // The ustar header keeps as much of the name as fits, for readers
+    // without pax support
+    char *ustar = data + data_len + padding;
+    if (prefix_len < 0) {
+        const char *tail = name + len - (len < TAR_NAME_LEN ? len :
+                                         TAR_NAME_LEN);
+        format_ustar(ustar, tail, strlen(tail), 0, type, size, mtime);
+    }
+    else {
+        format_ustar(ustar, name, len, prefix_len, type, size, mtime);
+    }
+
+    return TAR_BLOCK_SIZE + data_len + padding + TAR_BLOCK_SIZE;
+}
+
+size_t tar_padding(uint64_t size) {
+    size_t rem = size % TAR_BLOCK_SIZE;
+
+    return rem == 0 ? 0 : TAR_BLOCK_SIZE - rem;
+}
+
+int read_tar_content(FILE *in, char *buffer, size_t len,
+                     baton_error_t *error) {
+    init_baton_error(error);
+
+    if (fread(buffer, 1, len, in) != len) {
+        if (ferror(in)) {
+            set_baton_error(error, errno, "Failed to read the archive: "
+                            "error %d %s", errno, strerror(errno));
+        }
+        else {
+            set_baton_error(error, -1, "Failed to read the archive: "
+                            "unexpected end of input");
+        }
+    }
+
+    return error->code;
+}
+
+static int is_zero_block(const char *block) {
+    for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+        if (block[i] != '\0') return 0;
+    }
+
+    return 1;
+}
+
+// Parse an octal field, or a GNU base-256 field, which has its high
+// bit set
+static int parse_number(const char *field, size_t len, uint64_t *value) {
+    uint64_t n = 0;
+
+    if ((unsigned char) field[0] & 0x80) {
+        if ((unsigned char) field[0] & 0x40) return -1; // Negative
+
+        n = (unsigned char) field[0] & 0x3f;
+        for (size_t i = 1; i < len; i++) {
+            if (n >> 56) return -1;
+            n = (n << 8) | (unsigned char) field[i];
+        }
+        *value = n;
+
+        return 0;
+    }
+
+    size_t i = 0;
+    while (i < len && field[i] == ' ') i++;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+        if (n >> 61) return -1;
+        n = (n << 3) | (uint64_t) (field[i] - '0');
+    }
+    if (i < len && field[i] != '\0' && field[i] != ' ') return -1;
+
+    *value = n;
+
+    return 0;
+}
+
+static int valid_checksum(const char *block) {
+    const tar_header_t *header = (const tar_header_t *) block;
+
+    uint64_t expected;
+    if (parse_number(header->chksum, sizeof header->chksum, &expected) != 0) {
+        return 0;
+    }
+
+    // Some old archivers summed signed bytes
+    unsigned int sum = 0;
+    int signed_sum   = 0;
+    for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+        int in_chksum = i >= offsetof(tar_header_t, chksum) &&
+            i < offsetof(tar_header_t, chksum) + sizeof header->chksum;
+        sum        += in_chksum ? ' ' : (unsigned char) block[i];
+        signed_sum += in_chksum ? ' ' : (signed char) block[i];
+    }
+
+    return expected == sum || (int64_t) expected == signed_sum;
+}
+
+// Read the content of an extended header, NUL-terminated
+static char *read_extension(FILE *in, uint64_t size, baton_error_t *error) {
+    if (size > TAR_MAX_PAX_SIZE) {
+        set_baton_error(error, -1, "Invalid tar extended header: %" PRIu64
+                        " bytes exceeds the maximum of %d", size,
+                        TAR_MAX_PAX_SIZE);
+        return NULL;
+    }
+
+    size_t len = size + tar_padding(size);
+    char *data = calloc(len + 1, sizeof (char));
+    if (!data) {
+        set_baton_error(error, errno, "Failed to allocate memory: "
+                        "error %d %s", errno, strerror(errno));
+        return NULL;
+    }
+
+    if (read_tar_content(in, data, len, error) != 0) {
+        free(data);
+        return NULL;
+    }
+    data[size] = '\0';
+
+    return data;
+}
+
+// Apply the path and size records of a pax extended header
+static int parse_pax_records(const char *data, size_t len, char *path,
+                             uint64_t *size, int *has_size,
+                             baton_error_t *error) {
+    size_t pos = 0;
+
+    while (pos < len && data[pos] != '\0') {
+        char *end;
+        unsigned long record_len = strtoul(data + pos, &end, 10);
+
+        if (end == data + pos || *end != ' ' || record_len == 0 ||
+            record_len > len - pos || data[pos + record_len - 1] != '\n') {
+            set_baton_error(error, -1, "Invalid tar extended header record "
+                            "at offset %zu", pos);
+            return error->code;
+        }
+
+        // A record is "<length> <key>=<value>\n"
+        const char *key     = end + 1;
+        const char *newline = data + pos + record_len - 1;
+        const char *equals  = memchr(key, '=', newline - key);
+        if (!equals) {
+            set_baton_error(error, -1, "Invalid tar extended header record "
+                            "at offset %zu", pos);
+            return error->code;
+        }
+        const char *value = equals + 1;
+        size_t key_len    = equals - key;
+        size_t value_len  = newline - value;
+
+        if (key_len == 4 && strncmp(key, "path", 4) == 0) {
+            if (value_len >= TAR_MAX_NAME_LEN) {
+                set_baton_error(error, -1, "Invalid tar entry name: longer "
+                                "than %d", TAR_MAX_NAME_LEN - 1);
+                return error->code;
+            }
+            memcpy(path, value, value_len);
+            path[value_len] = '\0';
+        }
+        else if (key_len == 4 && strncmp(key, "size", 4) == 0) {
+            char number[32] = { 0 };
+            if (value_len == 0 || value_len >= sizeof number) {
+                set_baton_error(error, -1, "Invalid tar entry size in "
+                                "extended header");
+                return error->code;
+            }
+            memcpy(number, value, value_len);
+
+            errno = 0;
+            *size = strtoull(number, &end, 10);
+            if (errno != 0 || *end != '\0') {
+                set_baton_error(error, -1, "Invalid tar entry size '%s' in "
+                                "extended header", number);
+                return error->code;
+            }
+            *has_size = 1;
+        }
+
+        pos += record_len;
+    }
+
+    return error->code;
+}
+
+int read_tar_header(FILE *in, tar_entry_t *entry, baton_error_t *error) {
+    char block[TAR_BLOCK_SIZE];
+    char long_name[TAR_MAX_NAME_LEN] = { 0 };
+    uint64_t pax_size = 0;
+    int has_pax_size  = 0;
+    char *data        = NULL;
+
+    init_baton_error(error);
+    memset(entry, 0, sizeof (tar_entry_t));
+
+    while (1) {
+        // An archive ending without its zero blocks is accepted, as GNU
+        // tar does
+        size_t nr = fread(block, 1, TAR_BLOCK_SIZE, in);
+        if (nr == 0 && !ferror(in) && long_name[0] == '\0' &&
+            !has_pax_size) {
+            logmsg(WARN, "The archive ended without end-of-archive blocks");
+            return 1;
+        }
+        if (nr != TAR_BLOCK_SIZE) {
+            read_tar_content(in, block + nr, TAR_BLOCK_SIZE - nr, error);
+            goto finally;
+        }
+
+        if (is_zero_block(block)) return 1;
+
+        if (!valid_checksum(block)) {
+            set_baton_error(error, -1, "Invalid tar header: bad checksum");
+            goto finally;
+        }
+
+        const tar_header_t *header = (const tar_header_t *) block;
+
+        uint64_t size;
+        if (parse_number(header->size, sizeof header->size, &size) != 0) {
+            set_baton_error(error, -1, "Invalid tar header: bad size");
+            goto finally;
+        }
+
+        switch (header->typeflag) {
+            case TAR_TYPE_PAX:
+                data = read_extension(in, size, error);
+                if (error->code != 0) goto finally;
+
+                parse_pax_records(data, size, long_name, &pax_size,
+                                  &has_pax_size, error);
+                if (error->code != 0) goto finally;
+
+                free(data);
+                data = NULL;
+                continue;
+
+            case TAR_TYPE_GNU_NAME:
+                data = read_extension(in, size, error);
+                if (error->code != 0) goto finally;
+
+                if (strlen(data) >= TAR_MAX_NAME_LEN) {
+                    set_baton_error(error, -1, "Invalid tar entry name: "
+                                    "longer than %d", TAR_MAX_NAME_LEN - 1);
+                    goto finally;
+                }
+                snprintf(long_name, sizeof long_name, "%s", data);
+
+                free(data);
+                data = NULL;
+                continue;
+
+            case TAR_TYPE_PAX_GLOBAL:
+            case TAR_TYPE_GNU_LINK:
+                skip_tar_content(in, size, error);
+                if (error->code != 0) goto finally;
+                continue;
+
+            default:
+                break;
+        }
+
+        if (long_name[0] != '\0') {
+            snprintf(entry->name, sizeof entry->name, "%s", long_name);
+        }
+        else if (memcmp(header->magic, "ustar", 5) == 0 &&
+                 header->prefix[0] != '\0') {
+            snprintf(entry->name, sizeof entry->name, "%.*s/%.*s",
+                     (int) strnlen(header->prefix, sizeof header->prefix),
+                     header->prefix,
+                     (int) strnlen(header->name, sizeof header->name),
+                     header->name);
+        }
+        else {
+            snprintf(entry->name, sizeof entry->name, "%.*s",
+                     (int) strnlen(header->name, sizeof header->name),
+                     header->name);
+        }
+
+        entry->type = header->typeflag == TAR_TYPE_OLD_FILE ?
+            TAR_TYPE_FILE : header->typeflag;
+        entry->size = has_pax_size ? pax_size : size;
+
+        // Old archives mark directories by their trailing '/' alone
+        size_t len = strlen(entry->name);
+        if (entry->type == TAR_TYPE_FILE && len > 0 &&
+            entry->name[len - 1] == '/') {
+            entry->type = TAR_TYPE_DIRECTORY;
+        }
+
+        goto finally;
+    }
+
+finally:
+    if (data) free(data);
+
+    return error->code;
+}
+
+int skip_tar_content(FILE *in, uint64_t size, baton_error_t *error) {
+    char block[TAR_BLOCK_SIZE];
+    uint64_t len = size + tar_padding(size);
+
+    init_baton_error(error);
+
+    while (len > 0) {
+        size_t n = len < TAR_BLOCK_SIZE ? len : TAR_BLOCK_SIZE;
+        if (read_tar_content(in, block, n, error) != 0) break;
+        len -= n;
+    }
+
+    return error->code;
+}
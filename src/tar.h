@@ -0,0 +1,139 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file tar.h
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#ifndef _BATON_TAR_H
+#define _BATON_TAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "config.h"
+#include "error.h"
+
+/** The size of a tar block. Headers and content are padded to it. */
+#define TAR_BLOCK_SIZE 512
+
+/** The size of the zero blocks that end an archive. */
+#define TAR_END_SIZE (2 * TAR_BLOCK_SIZE)
+
+/** The largest header, including any pax extended header. */
+#define TAR_MAX_HEADER_SIZE (8 * TAR_BLOCK_SIZE)
+
+/** The largest size a ustar header can hold, without a pax size. */
+#define TAR_MAX_USTAR_SIZE 077777777777ULL
+
+/** The longest entry name read from an archive. */
+#define TAR_MAX_NAME_LEN 1024
+
+/** The largest pax extended header read from an archive. */
+#define TAR_MAX_PAX_SIZE (64 * 1024)
+
+#define TAR_TYPE_FILE      '0'
+#define TAR_TYPE_DIRECTORY '5'
+#define TAR_TYPE_PAX       'x'
+
+#define TAR_FILE_MODE      0644
+#define TAR_DIRECTORY_MODE 0755
+
+/**
+ * Format the header of a POSIX tar archive entry. Names too long for
+ * a ustar header, and sizes too large for one, are given in a pax
+ * extended header preceding it.
+ *
+ * @param[out] header     A buffer of at least TAR_MAX_HEADER_SIZE bytes.
+ * @param[in]  name       The entry name, relative to the archive root.
+ *                        Directory names end with '/'.
+ * @param[in]  type       TAR_TYPE_FILE or TAR_TYPE_DIRECTORY.
+ * @param[in]  size       The content size in bytes, 0 for directories.
+ * @param[in]  mtime      The modification time.
+ * @param[out] error      An error report struct.
+ *
+ * @return The number of header bytes, a multiple of TAR_BLOCK_SIZE, or
+ * 0 on error.
+ */
+size_t format_tar_header(char *header, const char *name, char type,
+                         uint64_t size, time_t mtime, baton_error_t *error);
+
+/**
+ * Return the number of zero bytes that follow content of a given size,
+ * to fill its last block.
+ *
+ * @param[in]  size       The content size in bytes.
+ *
+ * @return The number of padding bytes.
+ */
+size_t tar_padding(uint64_t size);
+
+/**
+ *  @struct tar_entry
+ *  @brief An entry read from a tar archive.
+ */
+typedef struct tar_entry {
+    /** The entry name, from any pax or GNU long name header. */
+    char name[TAR_MAX_NAME_LEN];
+    /** The entry type, TAR_TYPE_FILE for regular files, including
+        those of the old '\0' type. */
+    char type;
+    /** The content size in bytes. */
+    uint64_t size;
+} tar_entry_t;
+
+/**
+ * Read the next entry header from a tar archive, consuming any pax or
+ * GNU long name headers before it. The stream is left at the start of
+ * the entry's content, which must be read or skipped, with its
+ * padding, before the next entry.
+ *
+ * @param[in]  in         The archive stream.
+ * @param[out] entry      The entry.
+ * @param[out] error      An error report struct.
+ *
+ * @return 0 on reading an entry, 1 at the end of the archive, or an
+ * error code on failure.
+ */
+int read_tar_header(FILE *in, tar_entry_t *entry, baton_error_t *error);
+
+/**
+ * Read content from a tar archive, failing if the archive ends first.
+ *
+ * @param[in]  in         The archive stream.
+ * @param[out] buffer     A buffer of at least len bytes.
+ * @param[in]  len        The number of bytes to read.
+ * @param[out] error      An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int read_tar_content(FILE *in, char *buffer, size_t len,
+                     baton_error_t *error);
+
+/**
+ * Skip content in a tar archive, and the padding that follows it.
+ *
+ * @param[in]  in         The archive stream.
+ * @param[in]  size       The number of bytes of content to skip.
+ * @param[out] error      An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int skip_tar_content(FILE *in, uint64_t size, baton_error_t *error);
+
+#endif // _BATON_TAR_H
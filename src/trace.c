@@ -0,0 +1,280 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file trace.c
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "log.h"
+#include "trace.h"
+
+typedef struct trace_event {
+    const char *category;
+    const char *name;
+    uint64_t start_us;
+    uint64_t duration_us;
+    char arg[TRACE_ARG_LEN];
+} trace_event_t;
+
+typedef struct trace_block {
+    trace_event_t events[TRACE_BLOCK_EVENTS];
+    size_t num_events;
+    struct trace_block *next;
+} trace_block_t;
+
+// The events of one thread. Only that thread adds to it; the buffer is
+// kept after the thread exits, to be written by stop_trace.
+typedef struct trace_buffer {
+    int tid;
+    trace_block_t *first;
+    trace_block_t *last;
+    size_t num_events;
+    size_t num_dropped;
+    struct trace_buffer *next;
+} trace_buffer_t;
+
+static struct {
+    // Guards the list of buffers, which changes once per thread
+    pthread_mutex_t mutex;
+    int enabled;
+    FILE *out;
+    struct timespec start;
+    trace_buffer_t *buffers;
+    int num_threads;
+    // Incremented by each trace, so that a thread does not use a
+    // buffer freed at the end of an earlier one
+    int generation;
+} tracer = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread trace_buffer_t *thread_buffer = NULL;
+static __thread int thread_generation = 0;
+
+static uint64_t elapsed_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    int64_t sec  = now.tv_sec  - tracer.start.tv_sec;
+    int64_t nsec = now.tv_nsec - tracer.start.tv_nsec;
+
+    return (uint64_t) (sec * 1000000 + nsec / 1000);
+}
+
+static trace_buffer_t *register_thread(void) {
+    trace_buffer_t *buffer = calloc(1, sizeof (trace_buffer_t));
+    if (!buffer) {
+        logmsg(ERROR, "Failed to allocate memory: error %d %s",
+               errno, strerror(errno));
+        return NULL;
+    }
+
+    pthread_mutex_lock(&tracer.mutex);
+    buffer->tid       = ++tracer.num_threads;
+    buffer->next      = tracer.buffers;
+    tracer.buffers    = buffer;
+    thread_generation = tracer.generation;
+    pthread_mutex_unlock(&tracer.mutex);
+
+    return buffer;
+}
+
+static trace_event_t *next_event(trace_buffer_t *buffer) {
+    if (buffer->num_events >= TRACE_MAX_EVENTS) {
+        buffer->num_dropped++;
+        return NULL;
+    }
+
+    trace_block_t *block = buffer->last;
+    if (!block || block->num_events == TRACE_BLOCK_EVENTS) {
+        block = calloc(1, sizeof (trace_block_t));
+        if (!block) {
+            buffer->num_dropped++;
+            return NULL;
+        }
+
+        if (buffer->last) buffer->last->next = block;
+        else              buffer->first = block;
+        buffer->last = block;
+    }
+
+    buffer->num_events++;
+
+    return &block->events[block->num_events++];
+}
+
+int start_trace(const char *path, baton_error_t *error) {
+    init_baton_error(error);
+
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        set_baton_error(error, errno, "Failed to open trace file '%s': "
+                        "error %d %s", path, errno, strerror(errno));
+        goto finally;
+    }
+
+    pthread_mutex_lock(&tracer.mutex);
+    tracer.out = out;
+    tracer.generation++;
+    pthread_mutex_unlock(&tracer.mutex);
+
+    clock_gettime(CLOCK_MONOTONIC, &tracer.start);
+    __atomic_store_n(&tracer.enabled, 1, __ATOMIC_RELEASE);
+
+    logmsg(DEBUG, "Tracing to '%s'", path);
+
+finally:
+    return error->code;
+}
+
+int trace_enabled(void) {
+    return __atomic_load_n(&tracer.enabled, __ATOMIC_ACQUIRE);
+}
+
+void trace_begin(trace_span_t *span, const char *category, const char *name,
+                 const char *format, ...) {
+    span->active = trace_enabled();
+    if (!span->active) return;
+
+    span->category = category;
+    span->name     = name;
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(span->arg, TRACE_ARG_LEN, format, args);
+    va_end(args);
+
+    span->start_us = elapsed_us();
+}
+
+void trace_end(trace_span_t *span) {
+    if (!span->active || !trace_enabled()) return;
+
+    uint64_t end_us = elapsed_us();
+
+    if (!thread_buffer ||
+        thread_generation != __atomic_load_n(&tracer.generation,
+                                             __ATOMIC_ACQUIRE)) {
+        thread_buffer = register_thread();
+    }
+    if (!thread_buffer) return;
+
+    trace_event_t *event = next_event(thread_buffer);
+    if (!event) return;
+
+    event->category    = span->category;
+    event->name        = span->name;
+    event->start_us    = span->start_us;
+    event->duration_us = end_us - span->start_us;
+    memcpy(event->arg, span->arg, TRACE_ARG_LEN);
+}
+
+// Write a string as the content of a JSON string
+static void write_json_chars(FILE *out, const char *str) {
+    for (const unsigned char *c = (const unsigned char *) str; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', out);
+            fputc(*c, out);
+        }
+        else if (*c < 0x20) {
+            fprintf(out, "\\u%04x", *c);
+        }
+        else {
+            fputc(*c, out);
+        }
+    }
+}
+
+int stop_trace(baton_error_t *error) {
+    size_t num_events  = 0;
+    size_t num_dropped = 0;
+
+    init_baton_error(error);
+
+    if (!trace_enabled()) goto finally;
+    __atomic_store_n(&tracer.enabled, 0, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&tracer.mutex);
+
+    FILE *out = tracer.out;
+    long pid  = (long) getpid();
+    int first = 1;
+
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    trace_buffer_t *buffer = tracer.buffers;
+    while (buffer) {
+        trace_block_t *block = buffer->first;
+        while (block) {
+            for (size_t i = 0; i < block->num_events; i++) {
+                trace_event_t *event = &block->events[i];
+
+                fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"%s\","
+                        "\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,"
+                        "\"pid\":%ld,\"tid\":%d,\"args\":{\"detail\":\"",
+                        first ? "" : ",", event->name, event->category,
+                        (unsigned long long) event->start_us,
+                        (unsigned long long) event->duration_us,
+                        pid, buffer->tid);
+                write_json_chars(out, event->arg);
+                fprintf(out, "\"}}");
+                first = 0;
+            }
+
+            trace_block_t *next_block = block->next;
+            free(block);
+            block = next_block;
+        }
+
+        num_events  += buffer->num_events;
+        num_dropped += buffer->num_dropped;
+
+        trace_buffer_t *next_buffer = buffer->next;
+        free(buffer);
+        buffer = next_buffer;
+    }
+
+    fprintf(out, "\n]}\n");
+
+    tracer.buffers     = NULL;
+    tracer.num_threads = 0;
+    tracer.out         = NULL;
+
+    pthread_mutex_unlock(&tracer.mutex);
+
+    if (num_dropped > 0) {
+        logmsg(WARN, "Dropped %zu trace events beyond %d per thread",
+               num_dropped, TRACE_MAX_EVENTS);
+    }
+    logmsg(DEBUG, "Wrote %zu trace events", num_events);
+
+    int failed = ferror(out);
+    if (fclose(out) != 0) failed = 1;
+    if (failed) {
+        set_baton_error(error, EIO, "Failed to write the trace file");
+    }
+
+finally:
+    return error->code;
+}
@@ -0,0 +1,118 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file trace.h
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#ifndef _BATON_TRACE_H
+#define _BATON_TRACE_H
+
+#include <stdint.h>
+
+#include "config.h"
+#include "error.h"
+
+/** The maximum length of the detail recorded with an event. */
+#define TRACE_ARG_LEN     96
+
+/** The number of events in each block of a thread's buffer. */
+#define TRACE_BLOCK_EVENTS 4096
+
+/** The maximum number of events recorded by each thread. Later events
+    are counted, but not recorded. */
+#define TRACE_MAX_EVENTS  (256 * 1024)
+
+#define TRACE_CAT_ENVELOPE "envelope"
+#define TRACE_CAT_PARSE    "parse"
+#define TRACE_CAT_QUERY    "query"
+#define TRACE_CAT_STAT     "stat"
+#define TRACE_CAT_METADATA "metadata"
+#define TRACE_CAT_TRANSFER "transfer"
+#define TRACE_CAT_LOGIN    "login"
+#define TRACE_CAT_OUTPUT   "output"
+
+/**
+ *  @struct trace_span
+ *  @brief An event in progress, from trace_begin to trace_end.
+ */
+typedef struct trace_span {
+    /** True if the event is being traced. */
+    int active;
+    /** The event category, a string constant. */
+    const char *category;
+    /** The event name, a string constant. */
+    const char *name;
+    /** The start time, in microseconds from the start of the trace. */
+    uint64_t start_us;
+    /** Detail of the event, such as a path. */
+    char arg[TRACE_ARG_LEN];
+} trace_span_t;
+
+/**
+ * Start recording events, to be written to a file in the Chrome
+ * trace-event format by stop_trace. The file is created immediately,
+ * so that it is known to be writable before any work is done.
+ *
+ * Each thread records its events in its own buffer, without locking,
+ * so that tracing does not serialise the threads it observes.
+ *
+ * @param[in]  path       The path of the trace file.
+ * @param[out] error      An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int start_trace(const char *path, baton_error_t *error);
+
+/**
+ * Return true if events are being recorded.
+ */
+int trace_enabled(void);
+
+/**
+ * Begin an event on the calling thread. The detail is formatted only
+ * if events are being recorded, so that an untraced call costs one
+ * test of a flag.
+ *
+ * @param[out] span       A span to pass to trace_end.
+ * @param[in]  category   The event category, a string constant.
+ * @param[in]  name       The event name, a string constant.
+ * @param[in]  format     A format string for the event detail, followed
+ *                        by its arguments.
+ */
+void trace_begin(trace_span_t *span, const char *category, const char *name,
+                 const char *format, ...);
+
+/**
+ * End an event begun on the calling thread, recording it.
+ *
+ * @param[in]  span       A span from trace_begin.
+ */
+void trace_end(trace_span_t *span);
+
+/**
+ * Stop recording events and write those recorded to the trace file as
+ * a Chrome trace-event JSON object, which may be opened with Perfetto
+ * or chrome://tracing. Call once all the threads recording events have
+ * finished.
+ *
+ * @param[out] error      An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int stop_trace(baton_error_t *error);
+
+#endif // _BATON_TRACE_H
@@ -0,0 +1,468 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file tree_digest.c
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "json.h"
+#include "json_query.h"
+#include "log.h"
+#include "query.h"
+#include "tree_digest.h"
+#include "utilities.h"
+
+typedef struct tree_coll {
+    char *path;
+    char digest[MAX_CHECKSUM_LEN];
+} tree_coll_t;
+
+typedef struct tree {
+    /** The root collection. */
+    const char *root;
+    /** The collections of the tree, sorted by path once listed. */
+    tree_coll_t *colls;
+    size_t num_colls;
+    size_t capacity;
+    /** The number of data objects without a checksum. */
+    size_t num_unchecksummed;
+} tree_t;
+
+typedef struct tree_members {
+    tree_t *tree;
+    tree_entry_t *entries;
+    size_t num_entries;
+    size_t capacity;
+} tree_members_t;
+
+static int compare_tree_entries(const void *a, const void *b) {
+    const tree_entry_t *ea = a;
+    const tree_entry_t *eb = b;
+
+    int cmp = strcmp(ea->name, eb->name);
+    if (cmp != 0) return cmp;
+    if (ea->type != eb->type) return ea->type < eb->type ? -1 : 1;
+
+    // Replicates with a checksum sort before those without
+    int ea_empty = ea->checksum[0] == '\0';
+    int eb_empty = eb->checksum[0] == '\0';
+    if (ea_empty != eb_empty) return ea_empty - eb_empty;
+
+    return strcmp(ea->checksum, eb->checksum);
+}
+
+int digest_tree_entries(tree_entry_t *entries, size_t num_entries,
+                        char *digest, baton_error_t *error) {
+    digest_t context;
+
+    init_baton_error(error);
+
+    if (num_entries > 0) {
+        qsort(entries, num_entries, sizeof (tree_entry_t),
+              compare_tree_entries);
+    }
+
+    // The hash is always SHA-256, but it covers the checksums as the
+    // catalogue holds them, so the digests of trees in zones using
+    // different checksum schemes always differ
+    init_digest(&context, DIGEST_SHA256, error);
+    if (error->code != 0) goto finally;
+
+    for (size_t i = 0; i < num_entries; i++) {
+        tree_entry_t *entry = &entries[i];
+
+        // Further replicates of a data object follow the one used
+        if (i > 0 && entry->type == entries[i - 1].type &&
+            strcmp(entry->name, entries[i - 1].name) == 0) continue;
+
+        // Each field is terminated by a NUL, which cannot occur in a
+        // name, so that no two sequences of members hash the same
+        const char *type = entry->type == TREE_ENTRY_COLLECTION ? "c" : "d";
+        update_digest(&context, type, 2);
+        update_digest(&context, entry->name, strlen(entry->name) + 1);
+
+        if (entry->type == TREE_ENTRY_DATA_OBJECT) {
+            char size[32];
+            snprintf(size, sizeof size, "%" PRIu64, entry->size);
+            update_digest(&context, size, strlen(size) + 1);
+        }
+
+        update_digest(&context, entry->checksum, strlen(entry->checksum) + 1);
+    }
+
+    final_digest(&context, digest, error);
+
+finally:
+    return error->code;
+}
+
+// Compare collection paths as strcmp, but with the separator ordered
+// before any other character, so that each collection is followed
+// immediately by the collections within it, "a", "a/b", "a-b"
+static int compare_tree_colls(const void *a, const void *b) {
+    const tree_coll_t *ca = a;
+    const tree_coll_t *cb = b;
+    const unsigned char *pa = (const unsigned char *) ca->path;
+    const unsigned char *pb = (const unsigned char *) cb->path;
+
+    while (*pa && *pa == *pb) {
+        pa++;
+        pb++;
+    }
+
+    int xa = *pa == '/' ? 1 : *pa;
+    int xb = *pb == '/' ? 1 : *pb;
+
+    return xa - xb;
+}
+
+static int add_tree_coll(tree_t *tree, const char *path,
+                         baton_error_t *error) {
+    if (tree->num_colls == tree->capacity) {
+        size_t new_capacity = tree->capacity == 0 ? 64 : tree->capacity * 2;
+        tree_coll_t *tmp = realloc(tree->colls, new_capacity *
+                                   sizeof (tree_coll_t));
+        if (!tmp) {
+            set_baton_error(error, errno, "Failed to allocate memory: "
+                            "error %d %s", errno, strerror(errno));
+            return error->code;
+        }
+
+        tree->colls    = tmp;
+        tree->capacity = new_capacity;
+    }
+
+    char *copy = copy_str(path, MAX_NAME_LEN);
+    if (!copy) {
+        set_baton_error(error, errno, "Failed to copy string '%s'", path);
+        return error->code;
+    }
+
+    tree_coll_t *coll = &tree->colls[tree->num_colls++];
+    memset(coll, 0, sizeof (tree_coll_t));
+    coll->path = copy;
+
+    return 0;
+}
+
+static void free_tree(tree_t *tree) {
+    for (size_t i = 0; i < tree->num_colls; i++) {
+        free(tree->colls[i].path);
+    }
+    if (tree->colls) free(tree->colls);
+}
+
+static int add_tree_member(tree_members_t *members, tree_entry_type type,
+                           const char *name, uint64_t size,
+                           const char *checksum, baton_error_t *error) {
+    if (members->num_entries == members->capacity) {
+        size_t new_capacity = members->capacity == 0 ? 256 :
+            members->capacity * 2;
+        tree_entry_t *tmp = realloc(members->entries, new_capacity *
+                                    sizeof (tree_entry_t));
+        if (!tmp) {
+            set_baton_error(error, errno, "Failed to allocate memory: "
+                            "error %d %s", errno, strerror(errno));
+            return error->code;
+        }
+
+        members->entries  = tmp;
+        members->capacity = new_capacity;
+    }
+
+    char *copy = copy_str(name, MAX_NAME_LEN);
+    if (!copy) {
+        set_baton_error(error, errno, "Failed to copy string '%s'", name);
+        return error->code;
+    }
+
+    tree_entry_t *entry = &members->entries[members->num_entries++];
+    memset(entry, 0, sizeof (tree_entry_t));
+    entry->type = type;
+    entry->name = copy;
+    entry->size = size;
+    snprintf(entry->checksum, MAX_CHECKSUM_LEN, "%s",
+             checksum ? checksum : "");
+
+    return 0;
+}
+
+static void free_tree_members(tree_members_t *members) {
+    for (size_t i = 0; i < members->num_entries; i++) {
+        free(members->entries[i].name);
+    }
+    if (members->entries) free(members->entries);
+}
+
+// Return true if path is a collection strictly within the collection
+// parent, of length len
+static int is_within(const char *parent, size_t len, const char *path) {
+    if (strncmp(path, parent, len) != 0) return 0;
+
+    // The zone root "/" is the only collection ending with a slash
+    if (len > 0 && parent[len - 1] == '/') return path[len] != '\0';
+
+    return path[len] == '/' && path[len + 1] != '\0';
+}
+
+static int add_coll_rows(json_t *page, void *data, baton_error_t *error) {
+    tree_t *tree = data;
+    size_t root_len = strlen(tree->root);
+    size_t index;
+    json_t *row;
+
+    json_array_foreach(page, index, row) {
+        const char *path =
+            json_string_value(json_object_get(row, JSON_COLLECTION_KEY));
+
+        // The root is added when the tree is created and the LIKE
+        // condition also matches any siblings sharing its prefix
+        if (!path || !is_within(tree->root, root_len, path)) continue;
+
+        add_tree_coll(tree, path, error);
+        if (error->code != 0) break;
+    }
+
+    return error->code;
+}
+
+static int add_obj_rows(json_t *page, void *data, baton_error_t *error) {
+    tree_members_t *members = data;
+    size_t index;
+    json_t *row;
+
+    json_array_foreach(page, index, row) {
+        const char *name =
+            json_string_value(json_object_get(row, JSON_DATA_OBJECT_KEY));
+        const char *size =
+            json_string_value(json_object_get(row, JSON_SIZE_KEY));
+        const char *checksum =
+            json_string_value(json_object_get(row, JSON_CHECKSUM_KEY));
+        if (!name) continue;
+
+        if (!checksum || checksum[0] == '\0') {
+            members->tree->num_unchecksummed++;
+        }
+
+        add_tree_member(members, TREE_ENTRY_DATA_OBJECT, name,
+                        size ? strtoull(size, NULL, 10) : 0, checksum,
+                        error);
+        if (error->code != 0) break;
+    }
+
+    return error->code;
+}
+
+static int list_tree_colls(rcComm_t *conn, tree_t *tree,
+                           baton_error_t *error) {
+    genQueryInp_t *query_in = NULL;
+
+    query_format_in_t col_format =
+        { .num_columns = 1,
+          .columns     = { COL_COLL_NAME },
+          .labels      = { JSON_COLLECTION_KEY } };
+
+    init_baton_error(error);
+
+    add_tree_coll(tree, tree->root, error);
+    if (error->code != 0) goto finally;
+
+    query_in = make_query_input(TREE_DIGEST_MAX_ROWS, col_format.num_columns,
+                                col_format.columns);
+    if (!query_in) {
+        set_baton_error(error, errno, "Failed to allocate memory: "
+                        "error %d %s", errno, strerror(errno));
+        goto finally;
+    }
+
+    query_in = prepare_path_search(query_in, tree->root);
+    addKeyVal(&query_in->condInput, ZONE_KW, tree->root);
+
+    do_query_pages(conn, query_in, col_format.labels, add_coll_rows, tree,
+                   error);
+    if (error->code != 0) goto finally;
+
+    qsort(tree->colls, tree->num_colls, sizeof (tree_coll_t),
+          compare_tree_colls);
+
+finally:
+    if (query_in) free_query_input(query_in);
+
+    return error->code;
+}
+
+static int list_tree_objs(rcComm_t *conn, tree_t *tree, const char *path,
+                          tree_members_t *members, baton_error_t *error) {
+    genQueryInp_t *query_in = NULL;
+
+    query_format_in_t obj_format =
+        { .num_columns = 3,
+          .columns     = { COL_DATA_NAME, COL_DATA_SIZE,
+                           COL_D_DATA_CHECKSUM },
+          .labels      = { JSON_DATA_OBJECT_KEY, JSON_SIZE_KEY,
+                           JSON_CHECKSUM_KEY } };
+
+    init_baton_error(error);
+
+    query_in = make_query_input(TREE_DIGEST_MAX_ROWS, obj_format.num_columns,
+                                obj_format.columns);
+    if (!query_in) {
+        set_baton_error(error, errno, "Failed to allocate memory: "
+                        "error %d %s", errno, strerror(errno));
+        goto finally;
+    }
+
+    query_cond_t cn = { .column   = COL_COLL_NAME,
+                        .operator = SEARCH_OP_EQUALS,
+                        .value    = path };
+    query_in = add_query_conds(query_in, 1, (query_cond_t []) { cn });
+    query_in = limit_to_good_repl(query_in);
+    addKeyVal(&query_in->condInput, ZONE_KW, tree->root);
+
+    do_query_pages(conn, query_in, obj_format.labels, add_obj_rows, members,
+                   error);
+
+finally:
+    if (query_in) free_query_input(query_in);
+
+    return error->code;
+}
+
+// Calculate the digests of the collection at index i of the tree and
+// of all the collections within it, returning the index of the first
+// collection following them
+static size_t digest_subtree(rcComm_t *conn, tree_t *tree, size_t i,
+                             baton_error_t *error) {
+    tree_members_t members = { .tree = tree };
+    const char *path = tree->colls[i].path;
+    size_t len = strlen(path);
+    size_t next = i + 1;
+
+    list_tree_objs(conn, tree, path, &members, error);
+    if (error->code != 0) goto finally;
+
+    // Each collection reached here is a child; its own descendants
+    // are consumed by the recursion
+    while (next < tree->num_colls &&
+           is_within(path, len, tree->colls[next].path)) {
+        size_t child = next;
+        next = digest_subtree(conn, tree, child, error);
+        if (error->code != 0) goto finally;
+
+        const char *name = strrchr(tree->colls[child].path, '/') + 1;
+        add_tree_member(&members, TREE_ENTRY_COLLECTION, name, 0,
+                        tree->colls[child].digest, error);
+        if (error->code != 0) goto finally;
+    }
+
+    digest_tree_entries(members.entries, members.num_entries,
+                        tree->colls[i].digest, error);
+    if (error->code != 0) goto finally;
+
+    logmsg(DEBUG, "Digest of '%s' with %zu members is %s", path,
+           members.num_entries, tree->colls[i].digest);
+
+finally:
+    free_tree_members(&members);
+
+    return next;
+}
+
+json_t *digest_collection(rcComm_t *conn, rodsPath_t *rods_path,
+                          option_flags flags, baton_error_t *error) {
+    tree_t tree    = { .root = rods_path->outPath };
+    json_t *result = NULL;
+
+    init_baton_error(error);
+
+    if (rods_path->objState == NOT_EXIST_ST) {
+        set_baton_error(error, USER_FILE_DOES_NOT_EXIST,
+                        "Path '%s' does not exist "
+                        "(or lacks access permission)", rods_path->outPath);
+        goto error;
+    }
+
+    if (rods_path->objType != COLL_OBJ_T) {
+        set_baton_error(error, USER_INPUT_PATH_ERR,
+                        "Failed to digest '%s' as it is not a collection",
+                        rods_path->outPath);
+        goto error;
+    }
+
+    list_tree_colls(conn, &tree, error);
+    if (error->code != 0) goto error;
+
+    logmsg(DEBUG, "Digesting %zu collections in '%s'", tree.num_colls,
+           rods_path->outPath);
+
+    digest_subtree(conn, &tree, 0, error);
+    if (error->code != 0) goto error;
+
+    if (tree.num_unchecksummed > 0) {
+        logmsg(WARN, "%zu data objects in '%s' have no checksum; the "
+               "digest covers only their names and sizes",
+               tree.num_unchecksummed, rods_path->outPath);
+    }
+
+    result = json_pack("{s:s, s:s}",
+                       JSON_COLLECTION_KEY, rods_path->outPath,
+                       JSON_DIGEST_KEY,     tree.colls[0].digest);
+    if (!result) {
+        set_baton_error(error, -1, "Failed to pack digest of '%s'",
+                        rods_path->outPath);
+        goto error;
+    }
+
+    if (flags & PRINT_CONTENTS) {
+        json_t *contents = json_array();
+        if (!contents) {
+            set_baton_error(error, -1, "Failed to allocate a new JSON array");
+            goto error;
+        }
+        json_object_set_new(result, JSON_CONTENTS_KEY, contents);
+
+        for (size_t i = 1; i < tree.num_colls; i++) {
+            json_t *coll = json_pack("{s:s, s:s}",
+                                     JSON_COLLECTION_KEY, tree.colls[i].path,
+                                     JSON_DIGEST_KEY,     tree.colls[i].digest);
+            if (!coll) {
+                set_baton_error(error, -1, "Failed to pack digest of '%s'",
+                                tree.colls[i].path);
+                goto error;
+            }
+            json_array_append_new(contents, coll);
+        }
+    }
+
+    free_tree(&tree);
+
+    return result;
+
+error:
+    logmsg(ERROR, "Failed to digest '%s': error %d %s",
+           rods_path->outPath, error->code, error->message);
+
+    if (result) json_decref(result);
+    free_tree(&tree);
+
+    return NULL;
+}
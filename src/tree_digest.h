@@ -0,0 +1,116 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file tree_digest.h
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#ifndef _BATON_TREE_DIGEST_H
+#define _BATON_TREE_DIGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <jansson.h>
+#include <rodsClient.h>
+
+#include "config.h"
+#include "digest.h"
+#include "error.h"
+#include "operations.h"
+
+/** The number of rows fetched in each page of the catalogue queries
+    made for a tree digest, which are expected to return many rows. */
+#define TREE_DIGEST_MAX_ROWS 256
+
+/**
+ *  @enum tree_entry_type
+ *  @brief The types of the members of a collection.
+ */
+typedef enum {
+    TREE_ENTRY_DATA_OBJECT,
+    TREE_ENTRY_COLLECTION
+} tree_entry_type;
+
+/**
+ *  @struct tree_entry
+ *  @brief A member of a collection, as it contributes to the digest of
+ *  the collection.
+ */
+typedef struct tree_entry {
+    tree_entry_type type;
+    /** The name of the member within the collection. */
+    char *name;
+    /** The size of a data object. */
+    uint64_t size;
+    /** The catalogue checksum of a data object, which may be empty,
+        or the digest of a collection. */
+    char checksum[MAX_CHECKSUM_LEN];
+} tree_entry_t;
+
+/**
+ * Calculate the digest of a collection from its members. The members
+ * are sorted by name, so that the digest does not depend on the order
+ * in which they were listed. The digest is a SHA-256 hash of the type,
+ * name, size and checksum of each data object and the type, name and
+ * digest of each sub-collection, formatted as an iRODS checksum.
+ *
+ * A data object may be given once for each of its replicates. The
+ * replicate with the lowest non-empty checksum is used.
+ *
+ * @param[in,out] entries     The members of a collection, which are
+ *                            sorted in place.
+ * @param[in]     num_entries The number of members.
+ * @param[out]    digest      A buffer of at least MAX_CHECKSUM_LEN.
+ * @param[out]    error       An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int digest_tree_entries(tree_entry_t *entries, size_t num_entries,
+                        char *digest, baton_error_t *error);
+
+/**
+ * Calculate a hierarchical digest of a collection and everything in
+ * it, from the names, sizes and catalogue checksums of its data
+ * objects. The digest of each collection covers the digests of its
+ * sub-collections, so two trees are identical if their digests are
+ * equal, and where they differ, only the sub-collections whose digests
+ * differ need be compared further. Names are relative to each
+ * collection, so trees at different paths, or in different zones, may
+ * be compared. The catalogue checksums are hashed as they are, so
+ * trees may be compared only where their data objects were checksummed
+ * with the same scheme; an MD5 tree never matches its SHA-256 copy.
+ *
+ * The collections of the tree are listed in one query and the data
+ * objects of each collection in another. Only good replicates are
+ * considered. Data objects without a catalogue checksum contribute
+ * their name and size only.
+ *
+ * @param[in]  conn         An open iRODS connection.
+ * @param[in]  rods_path    A resolved iRODS collection path.
+ * @param[in]  flags        Function behaviour options. PRINT_CONTENTS
+ *                          includes the digest of every sub-collection
+ *                          in the result.
+ * @param[out] error        An error report struct.
+ *
+ * @return A new JSON object giving the collection and its digest, and
+ * optionally, its contents as an array of sub-collections and their
+ * digests, each followed by the collections within it.
+ */
+json_t *digest_collection(rcComm_t *conn, rodsPath_t *rods_path,
+                          option_flags flags, baton_error_t *error);
+
+#endif // _BATON_TREE_DIGEST_H
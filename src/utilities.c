@@ -175,6 +175,21 @@ finally:
     return value;
 }
 
+int parse_unsigned(const char *str, unsigned long *value) {
+    char *end;
+
+    // strtoul accepts a sign, which would wrap a negative number
+    if (*str < '0' || *str > '9') return -1;
+
+    errno = 0;
+    unsigned long parsed = strtoul(str, &end, 10);
+    if (errno != 0 || *end != '\0') return -1;
+
+    *value = parsed;
+
+    return 0;
+}
+
 FILE *maybe_stdin(const char *path) {
     FILE *stream;
 
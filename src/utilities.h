@@ -46,6 +46,8 @@ char *parse_zone_name(const char *path);
 
 size_t parse_size(const char *str);
 
+int parse_unsigned(const char *str, unsigned long *value);
+
 FILE *maybe_stdin(const char *path);
 
 char *format_timestamp(const char *timestamp, const char *format);
@@ -0,0 +1,171 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file workload.c
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "utilities.h"
+#include "workload.h"
+
+uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+
+    return *state * UINT64_C(2685821657736338717);
+}
+
+size_t random_below(uint64_t *state, size_t n) {
+    return n == 0 ? 0 : (size_t) (next_random(state) % n);
+}
+
+uint64_t seeded_random_state(unsigned long seed, size_t index) {
+    uint64_t state = (uint64_t) seed * UINT64_C(0x9E3779B97F4A7C15) +
+        index + 1;
+    if (state == 0) state = 1;
+    next_random(&state);
+
+    return state;
+}
+
+size_t random_size(uint64_t *state, size_t min, size_t max) {
+    if (max <= min) return min;
+
+    size_t bits = 0;
+    while (bits < 62 && (max >> (bits + 1)) >= min) bits++;
+
+    size_t base = min << random_below(state, bits + 1);
+    size_t size = base + random_below(state, base);
+
+    return size > max ? max : size;
+}
+
+size_t tree_parent(size_t index, size_t fanout) {
+    return (index - 1) / fanout;
+}
+
+void tree_path(const char *root, size_t index, size_t fanout,
+               char *path, size_t len) {
+    if (index == 0) {
+        snprintf(path, len, "%s", root);
+        return;
+    }
+
+    tree_path(root, tree_parent(index, fanout), fanout, path, len);
+    size_t used = strlen(path);
+    snprintf(path + used, len - used, "/c%zu", index);
+}
+
+size_t tree_level_last(size_t first, size_t num, size_t fanout) {
+    // Level L begins at 1 + f + ... + f^(L-1) and ends at f times that
+    if (first > num / fanout) return num;
+
+    return first * fanout;
+}
+
+double monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+unsigned long parse_count(const char *name, const char *arg) {
+    unsigned long value;
+
+    if (parse_unsigned(arg, &value) != 0) {
+        fprintf(stderr, "Invalid --%s '%s'\n", name, arg);
+        exit(1);
+    }
+
+    return value;
+}
+
+int parse_mix(const char *str, const char *const names[], size_t num_names,
+              unsigned long *weights, unsigned long *total) {
+    char *copy = strdup(str);
+    if (!copy) return -1;
+
+    memset(weights, 0, num_names * sizeof (unsigned long));
+    *total = 0;
+
+    int status = 0;
+    char *saveptr;
+    for (char *tok = strtok_r(copy, ",", &saveptr); tok;
+         tok = strtok_r(NULL, ",", &saveptr)) {
+        char *eq = strchr(tok, '=');
+        unsigned long weight = 1;
+        if (eq) {
+            *eq = '\0';
+            if (parse_unsigned(eq + 1, &weight) != 0) {
+                status = -1;
+                goto finally;
+            }
+        }
+
+        int found = 0;
+        for (size_t i = 0; i < num_names; i++) {
+            if (str_equals(tok, names[i], MAX_STR_LEN)) {
+                weights[i] = weight;
+                found = 1;
+            }
+        }
+        if (!found) {
+            status = -1;
+            goto finally;
+        }
+    }
+
+    for (size_t i = 0; i < num_names; i++) {
+        *total += weights[i];
+    }
+    if (*total == 0) status = -1;
+
+finally:
+    free(copy);
+
+    return status;
+}
+
+size_t choose_weighted(uint64_t *state, const unsigned long *weights,
+                       size_t num, unsigned long total) {
+    unsigned long r = random_below(state, total);
+
+    for (size_t i = 0; i < num; i++) {
+        if (r < weights[i]) return i;
+        r -= weights[i];
+    }
+
+    return 0;
+}
+
+double percentile(const double *sorted, size_t num, double p) {
+    if (num == 0) return 0;
+
+    size_t rank = (size_t) (p / 100.0 * num + 0.999999);
+    if (rank < 1)   rank = 1;
+    if (rank > num) rank = num;
+
+    return sorted[rank - 1];
+}
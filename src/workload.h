@@ -0,0 +1,172 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file workload.h
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#ifndef _BATON_WORKLOAD_H
+#define _BATON_WORKLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+
+/**
+ * Return the next number from a xorshift64* generator, so that a seed
+ * gives the same workload on every platform.
+ *
+ * @param[in,out] state   The generator state, which must not be 0.
+ *
+ * @return A pseudo-random number.
+ */
+uint64_t next_random(uint64_t *state);
+
+/**
+ * Return a pseudo-random number in the range [0, n).
+ *
+ * @param[in,out] state   The generator state.
+ * @param[in]     n       The upper bound.
+ *
+ * @return A pseudo-random number, or 0 if n is 0.
+ */
+size_t random_below(uint64_t *state, size_t n);
+
+/**
+ * Return a generator state derived from a seed and an index, so that
+ * each numbered item of a workload has its own sequence that does not
+ * depend on the order in which the items are made.
+ *
+ * @param[in]  seed       The seed.
+ * @param[in]  index      The index of the item.
+ *
+ * @return A generator state.
+ */
+uint64_t seeded_random_state(unsigned long seed, size_t index);
+
+/**
+ * Return a size distributed roughly evenly over the powers of two
+ * between min and max, so that small and large sizes are equally
+ * represented.
+ *
+ * @param[in,out] state   The generator state.
+ * @param[in]     min     The smallest size.
+ * @param[in]     max     The largest size.
+ *
+ * @return A size in the range [min, max].
+ */
+size_t random_size(uint64_t *state, size_t min, size_t max);
+
+/**
+ * Return the parent of a collection in a tree numbered breadth-first,
+ * the root being 0, where every collection has fanout children. Each
+ * level of the tree is then a contiguous range of numbers.
+ *
+ * @param[in]  index      The number of a collection other than the
+ *                        root.
+ * @param[in]  fanout     The number of children of each collection.
+ *
+ * @return The number of the parent collection.
+ */
+size_t tree_parent(size_t index, size_t fanout);
+
+/**
+ * Write the path of a collection in a tree numbered breadth-first.
+ * Each collection below the root is named c<number>.
+ *
+ * @param[in]  root       The path of the root collection.
+ * @param[in]  index      The number of the collection.
+ * @param[in]  fanout     The number of children of each collection.
+ * @param[out] path       The path.
+ * @param[in]  len        The size of path.
+ */
+void tree_path(const char *root, size_t index, size_t fanout,
+               char *path, size_t len);
+
+/**
+ * Return the last collection in a level of a tree numbered
+ * breadth-first.
+ *
+ * @param[in]  first      The first collection in the level.
+ * @param[in]  num        The number of collections below the root.
+ * @param[in]  fanout     The number of children of each collection.
+ *
+ * @return The number of the last collection in the level.
+ */
+size_t tree_level_last(size_t first, size_t num, size_t fanout);
+
+/**
+ * Return the time in milliseconds on a monotonic clock, for measuring
+ * elapsed time.
+ *
+ * @return The time in milliseconds.
+ */
+double monotonic_ms(void);
+
+/**
+ * Parse a comma-separated list of name=weight pairs giving the relative
+ * frequency of each of a set of operations. A name without a weight
+ * has weight 1 and names not in the list have weight 0.
+ *
+ * @param[in]  str        The list.
+ * @param[in]  names      The names of the operations.
+ * @param[in]  num_names  The number of names.
+ * @param[out] weights    The weight of each operation, num_names long.
+ * @param[out] total      The sum of the weights.
+ *
+ * @return 0 on success, -1 if a name is unknown, a weight is not a
+ * number or every weight is 0.
+ */
+int parse_mix(const char *str, const char *const names[], size_t num_names,
+              unsigned long *weights, unsigned long *total);
+
+/**
+ * Choose an operation at random, in proportion to its weight.
+ *
+ * @param[in,out] state   The generator state.
+ * @param[in]     weights The weight of each operation.
+ * @param[in]     num     The number of operations.
+ * @param[in]     total   The sum of the weights.
+ *
+ * @return The index of an operation.
+ */
+size_t choose_weighted(uint64_t *state, const unsigned long *weights,
+                       size_t num, unsigned long total);
+
+/**
+ * Parse the value of a numeric command line option, reporting an invalid
+ * value on stderr and exiting.
+ *
+ * @param[in]  name       The option name, without the leading dashes.
+ * @param[in]  arg        The option value.
+ *
+ * @return The value.
+ */
+unsigned long parse_count(const char *name, const char *arg);
+
+/**
+ * Return the nearest-rank percentile of a sorted array of samples.
+ *
+ * @param[in]  sorted     The samples, in ascending order.
+ * @param[in]  num        The number of samples.
+ * @param[in]  p          The percentile, from 0 to 100.
+ *
+ * @return The percentile, or 0 if there are no samples.
+ */
+double percentile(const double *sorted, size_t num, double p);
+
+#endif // _BATON_WORKLOAD_H
@@ -29,7 +29,10 @@ int chksumLocFile( const char *fileName, char *chksumStr, const char* );
 #endif
 
 #include "config.h"
-#include "compat_checksum.h"
+#include "buffer_pool.h"
+#include "deadline.h"
+#include "digest.h"
+#include "trace.h"
 #include "write.h"
 
 int put_data_obj(rcComm_t *conn, const char *local_path, rodsPath_t *rods_path,
@@ -116,7 +119,11 @@ int put_data_obj(rcComm_t *conn, const char *local_path, rodsPath_t *rods_path,
     // idempotent.
     addKeyVal(&obj_open_in.condInput, FORCE_FLAG_KW, "");
 
+    trace_span_t span;
+    trace_begin(&span, TRACE_CAT_TRANSFER, "rcDataObjPut", "%s",
+                rods_path->outPath);
     status = rcDataObjPut(conn, &obj_open_in, tmpname);
+    trace_end(&span);
     if (status < 0) {
         char *err_subname;
         const char *err_name = rodsErrorName(status, &err_subname);
@@ -139,11 +146,21 @@ error:
 
 size_t write_data_obj(rcComm_t *conn, FILE *in, rodsPath_t *rods_path,
                       size_t buffer_size, int flags, baton_error_t *error) {
+    return write_data_obj_sized(conn, in, rods_path, NULL, buffer_size, 0,
+                                flags, error);
+}
+
+size_t write_data_obj_sized(rcComm_t *conn, FILE *in, rodsPath_t *rods_path,
+                            const char *default_resource,
+                            size_t buffer_size, uint64_t size_hint,
+                            int flags, baton_error_t *error) {
     data_obj_file_t *obj = NULL;
     char *buffer         = NULL;
     size_t num_read      = 0;
     size_t num_written   = 0;
+    digest_t digest;
 
+    memset(&digest, 0, sizeof digest);
     init_baton_error(error);
 
     if (buffer_size == 0) {
@@ -152,19 +169,18 @@ size_t write_data_obj(rcComm_t *conn, FILE *in, rodsPath_t *rods_path,
         goto finally;
     }
 
-    buffer = calloc(buffer_size +1, sizeof (char));
-    if (!buffer) {
-        logmsg(ERROR, "Failed to allocate memory: error %d %s",
-               errno, strerror(errno));
-        goto finally;
-    }
+    buffer = lease_buffer(buffer_size, error);
+    if (error->code != 0) goto finally;
 
-    obj = open_data_obj(conn, rods_path, O_WRONLY, flags, error);
+    obj = create_data_obj(conn, rods_path, default_resource, size_hint, flags,
+                          error);
     if (error->code != 0) goto finally;
 
-    unsigned char digest[16];
-    MD5_CTX context;
-    compat_MD5Init(&context);
+    init_digest(&digest, obj->scheme, error);
+    if (error->code != 0) {
+        close_data_obj(conn, obj);
+        goto finally;
+    }
 
     size_t nr, nw;
     while ((nr = fread(buffer, 1, buffer_size, in)) > 0) {
@@ -175,16 +191,30 @@ size_t write_data_obj(rcComm_t *conn, FILE *in, rodsPath_t *rods_path,
         if (error->code != 0) {
             logmsg(ERROR, "Failed to write to '%s': error %d %s",
                    obj->path, error->code, error->message);
+            // Release the descriptor, keeping the original error
+            close_data_obj(conn, obj);
             goto finally;
         }
         num_written += nw;
 
-        compat_MD5Update(&context, (unsigned char*) buffer, nr);
-        memset(buffer, 0, buffer_size);
+        update_digest(&digest, buffer, nr);
+    }
+
+    if (ferror(in)) {
+        set_baton_error(error, errno, "Failed to read the stream for '%s': "
+                        "error %d %s", obj->path, errno, strerror(errno));
+        close_data_obj(conn, obj);
+        goto finally;
     }
 
-    compat_MD5Final(digest, &context);
-    set_md5_last_read(obj, digest);
+    final_digest(&digest, obj->checksum_last_write, error);
+    if (error->code != 0) {
+        close_data_obj(conn, obj);
+        goto finally;
+    }
+    // The server reads back what was written to calculate its checksum
+    snprintf(obj->checksum_last_read, MAX_CHECKSUM_LEN, "%s",
+             obj->checksum_last_write);
 
     int status = close_data_obj(conn, obj);
     if (status < 0) {
@@ -197,22 +227,28 @@ size_t write_data_obj(rcComm_t *conn, FILE *in, rodsPath_t *rods_path,
     }
 
     if (num_read != num_written) {
-        set_baton_error(error, -1, "Read %zu bytes but wrote %zu bytes ",
+        set_baton_error(error, -1, "Read %zu bytes but wrote %zu bytes "
                         "to '%s'", num_read, num_written, obj->path);
         goto finally;
     }
 
-    if (!validate_md5_last_read(conn, obj)) {
-        logmsg(WARN, "Checksum mismatch for '%s' having MD5 %s on reading",
-               obj->path, obj->md5_last_read);
+    if (size_hint > 0 && num_written != size_hint) {
+        logmsg(WARN, "Wrote %zu bytes to '%s', but %llu were expected",
+               num_written, obj->path, (unsigned long long) size_hint);
     }
 
-    logmsg(NOTICE, "Wrote %zu bytes to '%s' having MD5 %s",
-           num_written, obj->path, obj->md5_last_read);
+    if (!validate_checksum_last_read(conn, obj)) {
+        logmsg(WARN, "Checksum mismatch for '%s' having checksum %s on "
+               "writing", obj->path, obj->checksum_last_write);
+    }
+
+    logmsg(NOTICE, "Wrote %zu bytes to '%s' having checksum %s",
+           num_written, obj->path, obj->checksum_last_write);
 
 finally:
+    free_digest(&digest);
     if (obj)    free_data_obj(obj);
-    if (buffer) free(buffer);
+    release_buffer(buffer, buffer_size);
 
     return num_written;
 }
@@ -221,6 +257,12 @@ size_t write_chunk(rcComm_t *conn, char *buffer, data_obj_file_t *data_obj,
                    size_t len, baton_error_t *error) {
     init_baton_error(error);
 
+    if (deadline_expired()) {
+        set_baton_error(error, DEADLINE_EXPIRED,
+                        "Deadline expired writing to '%s'", data_obj->path);
+        return 0;
+    }
+
     data_obj->open_obj->len = len;
 
     bytesBuf_t obj_write_in;
@@ -228,7 +270,11 @@ size_t write_chunk(rcComm_t *conn, char *buffer, data_obj_file_t *data_obj,
     obj_write_in.buf = buffer;
     obj_write_in.len = len;
 
+    trace_span_t span;
+    trace_begin(&span, TRACE_CAT_TRANSFER, "rcDataObjWrite", "%zu %s", len,
+                data_obj->path);
     int num_written = rcDataObjWrite(conn, data_obj->open_obj, &obj_write_in);
+    trace_end(&span);
     if (num_written < 0) {
         char *err_subname;
         const char *err_name = rodsErrorName(num_written, &err_subname);
@@ -82,6 +82,31 @@ size_t write_chunk(rcComm_t *conn, char *buffer, data_obj_file_t *obj_file,
 size_t write_data_obj(rcComm_t *conn, FILE *in, rodsPath_t *rods_path,
                       size_t buffer_size, int flags, baton_error_t *error);
 
+/**
+ * Write to a data object from a stream, as write_data_obj, giving the
+ * server the expected size of the content when creating the data
+ * object. The stream may be a pipe, so that a producer's output can be
+ * written without a temporary file. A size that differs from the
+ * number of bytes read is reported as a warning.
+ *
+ * @param[in]  conn        An open iRODS connection.
+ * @param[in]  in          File to read from.
+ * @param[in]  rods_path   An iRODS data object path.
+ * @param[in]  default_resource
+ *                         An iRODS resource name. Optional, may be NULL.
+ * @param[in]  buffer_size The number of bytes to copy at one time.
+ * @param[in]  size_hint   The expected number of bytes, 0 if unknown.
+ * @param[in]  flags       WRITE_LOCK to use an advisory lock server-side.
+                           Optional.
+ * @param[out] error       An error report struct.
+ *
+ * @return The number of bytes copied in total.
+ */
+size_t write_data_obj_sized(rcComm_t *conn, FILE *in, rodsPath_t *rods_path,
+                            const char *default_resource,
+                            size_t buffer_size, uint64_t size_hint,
+                            int flags, baton_error_t *error);
+
 int remove_data_object(rcComm_t *conn, rodsPath_t *rods_path, int flags,
                       baton_error_t *error);
 
@@ -0,0 +1,568 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file write_behind.c
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "config.h"
+#include "baton.h"
+#include "write_behind.h"
+
+// The properties of a pending AVU operation
+#define WB_OPERATION_KEY "operation"
+#define WB_AVU_KEY       "avu"
+#define WB_ITEM_KEY      "item"
+
+// A change made to a batch by buffering one AVU operation, recorded so
+// that the operations of an item may be withdrawn if it cannot be
+// buffered whole
+typedef enum {
+    // A repeat of a pending operation, which left the batch unchanged
+    WB_CHANGE_NONE,
+    // An operation appended at the end of those on its path
+    WB_CHANGE_APPENDED,
+    // A pending operation removed, which it cancelled out
+    WB_CHANGE_CANCELLED
+} wb_change_kind;
+
+typedef struct wb_change {
+    wb_change_kind kind;
+    // The position in the operations on the path
+    size_t position;
+    // The cancelled operation, to be restored
+    json_t *op;
+} wb_change_t;
+
+int init_write_behind_batch(write_behind_batch_t *batch,
+                            baton_error_t *error) {
+    init_baton_error(error);
+
+    batch->items      = json_array();
+    batch->paths      = json_object();
+    batch->num_ops    = 0;
+    batch->num_errors = 0;
+
+    if (!batch->items || !batch->paths) {
+        set_baton_error(error, -1, "Failed to allocate a write-behind batch");
+    }
+
+    return error->code;
+}
+
+void free_write_behind_batch(write_behind_batch_t *batch) {
+    if (batch->items) json_decref(batch->items);
+    if (batch->paths) json_decref(batch->paths);
+
+    batch->items = NULL;
+    batch->paths = NULL;
+}
+
+static int has_item_error(json_t *item) {
+    return json_object_get(item, JSON_ERROR_KEY) != NULL;
+}
+
+// Report only the first error for each item
+static void set_item_error(write_behind_batch_t *batch, json_t *item,
+                           baton_error_t *error) {
+    if (!has_item_error(item)) {
+        add_error_value(item, error);
+        batch->num_errors++;
+    }
+}
+
+static json_t *item_target(json_t *item, baton_error_t *error) {
+    init_baton_error(error);
+
+    if (has_operation(item) && has_operation_target(item)) {
+        return get_operation_target(item, error);
+    }
+
+    return item;
+}
+
+static metadata_op item_operation(json_t *item, option_flags flags,
+                                  baton_error_t *error) {
+    init_baton_error(error);
+
+    if (has_operation(item) && has_operation_args(item)) {
+        json_t *args = get_operation_args(item, error);
+        if (error->code != 0) goto error;
+
+        if (has_operation(args)) {
+            const char *arg = get_operation(args, error);
+            if (error->code != 0) goto error;
+
+            if (str_equals(arg, JSON_ARG_META_ADD, MAX_STR_LEN)) {
+                return META_ADD;
+            }
+            if (str_equals(arg, JSON_ARG_META_REM, MAX_STR_LEN)) {
+                return META_REM;
+            }
+
+            set_baton_error(error, -1,
+                            "Invalid baton operation argument '%s'", arg);
+            goto error;
+        }
+    }
+
+    if (flags & ADD_AVU)    return META_ADD;
+    if (flags & REMOVE_AVU) return META_REM;
+
+    set_baton_error(error, -1, "No metadata operation was specified");
+
+error:
+    return META_ADD;
+}
+
+// Add one AVU operation on a path to a batch, coalescing it with
+// the last pending operation on the same AVU, and record the change
+// made to the batch
+static int add_avu_op(write_behind_batch_t *batch, const char *path,
+                      metadata_op operation, json_t *avu, size_t item_index,
+                      wb_change_t *change, baton_error_t *error) {
+    change->kind = WB_CHANGE_NONE;
+    change->op   = NULL;
+
+    json_t *ops = json_object_get(batch->paths, path);
+    if (!ops) {
+        ops = json_array();
+        if (!ops || json_object_set_new(batch->paths, path, ops) != 0) {
+            set_baton_error(error, -1, "Failed to allocate AVU operations "
+                            "for '%s'", path);
+            goto finally;
+        }
+    }
+
+    for (size_t i = json_array_size(ops); i > 0; i--) {
+        json_t *op = json_array_get(ops, i - 1);
+        if (!json_equal(json_object_get(op, WB_AVU_KEY), avu)) continue;
+
+        json_int_t pending =
+            json_integer_value(json_object_get(op, WB_OPERATION_KEY));
+        if (pending == operation) {
+            logmsg(DEBUG, "Dropping a repeated AVU operation on '%s'",
+                   path);
+            goto finally;
+        }
+        if (pending == META_ADD && operation == META_REM) {
+            logmsg(DEBUG, "Cancelling the addition and removal of an AVU "
+                   "on '%s'", path);
+            change->kind     = WB_CHANGE_CANCELLED;
+            change->position = i - 1;
+            change->op       = json_incref(op);
+            json_array_remove(ops, i - 1);
+            batch->num_ops--;
+            goto finally;
+        }
+
+        break;
+    }
+
+    json_t *op = json_pack("{s:i, s:O, s:I}",
+                           WB_OPERATION_KEY, operation,
+                           WB_AVU_KEY,       avu,
+                           WB_ITEM_KEY,      (json_int_t) item_index);
+    if (!op || json_array_append_new(ops, op) != 0) {
+        set_baton_error(error, -1, "Failed to buffer an AVU operation "
+                        "for '%s'", path);
+        goto finally;
+    }
+
+    change->kind     = WB_CHANGE_APPENDED;
+    change->position = json_array_size(ops) - 1;
+    batch->num_ops++;
+
+finally:
+    return error->code;
+}
+
+// Undo the changes made to the operations on a path, latest first, so
+// that each is undone in the state it was made
+static void undo_avu_ops(write_behind_batch_t *batch, const char *path,
+                         wb_change_t *changes, size_t num_changes) {
+    json_t *ops = json_object_get(batch->paths, path);
+    if (!ops) return;
+
+    for (size_t i = num_changes; i > 0; i--) {
+        wb_change_t *change = &changes[i - 1];
+
+        if (change->kind == WB_CHANGE_APPENDED) {
+            json_array_remove(ops, change->position);
+            batch->num_ops--;
+        }
+        else if (change->kind == WB_CHANGE_CANCELLED) {
+            json_array_insert(ops, change->position, change->op);
+            batch->num_ops++;
+        }
+    }
+
+    if (json_array_size(ops) == 0) json_object_del(batch->paths, path);
+}
+
+// Apply the pending operations in a batch, one path at a time. The
+// first error for each item is recorded on it and successful items
+// have their result added, as they would if unbuffered.
+static void flush_batch(rodsEnv *env, rcComm_t *conn, option_flags flags,
+                        write_behind_batch_t *batch) {
+    const char *path;
+    json_t *ops;
+
+    json_object_foreach(batch->paths, path, ops) {
+        baton_error_t error;
+        rodsPath_t rods_path;
+        memset(&rods_path, 0, sizeof (rodsPath_t));
+
+        init_baton_error(&error);
+
+        if (!conn) {
+            set_baton_error(&error, -1, "Failed to open a connection for "
+                            "write-behind");
+        }
+        else {
+            char *tmp = copy_str(path, MAX_STR_LEN);
+            if (!tmp) {
+                set_baton_error(&error, errno, "Failed to copy string '%s'",
+                                path);
+            }
+            else {
+                resolve_rods_path(conn, env, &rods_path, tmp, flags, &error);
+                free(tmp);
+            }
+        }
+
+        size_t i;
+        json_t *op;
+        json_array_foreach(ops, i, op) {
+            json_int_t index =
+                json_integer_value(json_object_get(op, WB_ITEM_KEY));
+            json_t *item = json_array_get(batch->items, index);
+
+            if (error.code == 0) {
+                metadata_op operation = (metadata_op)
+                    json_integer_value(json_object_get(op, WB_OPERATION_KEY));
+                json_t *avu = json_object_get(op, WB_AVU_KEY);
+
+                baton_error_t op_error;
+                modify_json_metadata(conn, &rods_path, operation, avu,
+                                     &op_error);
+                if (op_error.code != 0) {
+                    set_item_error(batch, item, &op_error);
+                }
+            }
+            else {
+                set_item_error(batch, item, &error);
+            }
+        }
+
+        logmsg(DEBUG, "Flushed %zu AVU operations on '%s'",
+               json_array_size(ops), path);
+
+        if (rods_path.rodsObjStat) free(rods_path.rodsObjStat);
+    }
+
+    size_t i;
+    json_t *item;
+    json_array_foreach(batch->items, i, item) {
+        if (has_item_error(item)) continue;
+
+        if (has_operation(item) && has_operation_target(item)) {
+            baton_error_t error;
+            json_t *target = get_operation_target(item, &error);
+            add_result(item, json_incref(target), &error);
+            if (error.code != 0) set_item_error(batch, item, &error);
+        }
+    }
+}
+
+static void *write_behind_worker(void *arg) {
+    write_behind_t *wb = arg;
+    rcComm_t *conn     = NULL;
+    rodsEnv env;
+
+    pthread_mutex_lock(&wb->mutex);
+    while (1) {
+        while (!wb->busy && !wb->stop) {
+            pthread_cond_wait(&wb->work, &wb->mutex);
+        }
+
+        if (!wb->busy) break;
+        pthread_mutex_unlock(&wb->mutex);
+
+        if (!conn) {
+            logmsg(NOTICE, "Opening a new iRODS connection for write-behind");
+            conn = rods_login(&env);
+        }
+
+        logmsg(DEBUG, "Flushing %zu AVU operations for %zu items",
+               wb->flushing.num_ops, json_array_size(wb->flushing.items));
+        flush_batch(&env, conn, wb->flags, &wb->flushing);
+
+        pthread_mutex_lock(&wb->mutex);
+        json_array_extend(wb->done, wb->flushing.items);
+        wb->done_errors += wb->flushing.num_errors;
+        free_write_behind_batch(&wb->flushing);
+
+        wb->busy = 0;
+        pthread_cond_broadcast(&wb->idle);
+    }
+    pthread_mutex_unlock(&wb->mutex);
+
+    if (conn) rcDisconnect(conn);
+
+    return NULL;
+}
+
+// Hand the filling batch to the flushing thread
+static int hand_off(write_behind_t *wb, baton_error_t *error) {
+    write_behind_batch_t next;
+
+    init_baton_error(error);
+
+    init_write_behind_batch(&next, error);
+    if (error->code != 0) {
+        free_write_behind_batch(&next);
+        goto finally;
+    }
+
+    pthread_mutex_lock(&wb->mutex);
+    while (wb->busy) {
+        pthread_cond_wait(&wb->idle, &wb->mutex);
+    }
+
+    wb->flushing = wb->filling;
+    wb->filling  = next;
+    wb->busy     = 1;
+    pthread_cond_signal(&wb->work);
+    pthread_mutex_unlock(&wb->mutex);
+
+finally:
+    return error->code;
+}
+
+write_behind_t *start_write_behind(size_t window, option_flags flags,
+                                   baton_error_t *error) {
+    init_baton_error(error);
+
+    write_behind_t *wb = calloc(1, sizeof (write_behind_t));
+    if (!wb) {
+        set_baton_error(error, errno, "Failed to allocate memory: error %d %s",
+                        errno, strerror(errno));
+        goto error;
+    }
+
+    wb->window = window;
+    wb->flags  = flags;
+    wb->done   = json_array();
+    if (!wb->done) {
+        set_baton_error(error, -1, "Failed to allocate a new JSON array");
+        goto error;
+    }
+
+    init_write_behind_batch(&wb->filling, error);
+    if (error->code != 0) goto error;
+
+    pthread_mutex_init(&wb->mutex, NULL);
+    pthread_cond_init(&wb->work, NULL);
+    pthread_cond_init(&wb->idle, NULL);
+
+    int status = pthread_create(&wb->thread, NULL, write_behind_worker, wb);
+    if (status != 0) {
+        set_baton_error(error, status, "Failed to start write-behind "
+                        "thread: error %d %s", status, strerror(status));
+        pthread_mutex_destroy(&wb->mutex);
+        pthread_cond_destroy(&wb->work);
+        pthread_cond_destroy(&wb->idle);
+        goto error;
+    }
+
+    return wb;
+
+error:
+    if (wb) {
+        free_write_behind_batch(&wb->filling);
+        if (wb->done) json_decref(wb->done);
+        free(wb);
+    }
+
+    return NULL;
+}
+
+int write_behind_item_p(json_t *item, baton_json_op fn) {
+    if (fn == baton_json_metamod_op) return 1;
+
+    if (fn == baton_json_dispatch_op && has_operation_target(item)) {
+        baton_error_t error;
+        const char *op = get_operation(item, &error);
+
+        return error.code == 0 && op &&
+            str_equals(op, JSON_METAMOD_OP, MAX_STR_LEN);
+    }
+
+    return 0;
+}
+
+int write_behind_batch_add(write_behind_batch_t *batch, json_t *item,
+                           option_flags flags, baton_error_t *error) {
+    char *path           = NULL;
+    wb_change_t *changes = NULL;
+    size_t num_changes   = 0;
+
+    json_t *target = item_target(item, error);
+    if (error->code != 0) goto finally;
+
+    metadata_op operation = item_operation(item, flags, error);
+    if (error->code != 0) goto finally;
+
+    path = json_to_path(target, error);
+    if (error->code != 0) goto finally;
+
+    json_t *avus = json_object_get(target, JSON_AVUS_KEY);
+    if (!json_is_array(avus)) {
+        set_baton_error(error, -1, "AVU data for %s is not in a JSON array",
+                        path);
+        goto finally;
+    }
+
+    // Check every AVU before buffering any of them, so that an item is
+    // either rejected now or buffered whole
+    size_t i;
+    json_t *avu;
+    json_array_foreach(avus, i, avu) {
+        get_avu_attribute(avu, error);
+        if (error->code != 0) goto finally;
+        get_avu_value(avu, error);
+        if (error->code != 0) goto finally;
+    }
+
+    changes = calloc(json_array_size(avus) + 1, sizeof (wb_change_t));
+    if (!changes) {
+        set_baton_error(error, errno, "Failed to allocate memory: error %d %s",
+                        errno, strerror(errno));
+        goto finally;
+    }
+
+    // The item is added only once all its operations are buffered, at
+    // the index they refer to
+    size_t index = json_array_size(batch->items);
+    json_array_foreach(avus, i, avu) {
+        add_avu_op(batch, path, operation, avu, index, &changes[num_changes],
+                   error);
+        if (error->code != 0) goto finally;
+        num_changes++;
+    }
+
+    if (json_array_append(batch->items, item) != 0) {
+        set_baton_error(error, -1, "Failed to buffer item for %s", path);
+        goto finally;
+    }
+
+finally:
+    if (changes) {
+        // An item that is reported as failed must leave nothing in the
+        // batch to be applied
+        if (error->code != 0) {
+            undo_avu_ops(batch, path, changes, num_changes);
+        }
+
+        for (size_t j = 0; j < num_changes; j++) {
+            if (changes[j].op) json_decref(changes[j].op);
+        }
+        free(changes);
+    }
+    if (path) free(path);
+
+    return error->code;
+}
+
+int write_behind_add(write_behind_t *wb, json_t *item, baton_error_t *error) {
+    write_behind_batch_add(&wb->filling, item, wb->flags, error);
+    if (error->code != 0) goto finally;
+
+    // The item is buffered, so a failure to hand off the batch is not
+    // its failure; the batch is handed off with a later item or flush
+    if (wb->filling.num_ops >= wb->window) {
+        baton_error_t hand_off_error;
+        hand_off(wb, &hand_off_error);
+        if (hand_off_error.code != 0) {
+            logmsg(WARN, "Failed to hand off the write-behind buffer: %s",
+                   hand_off_error.message);
+        }
+    }
+
+finally:
+    return error->code;
+}
+
+json_t *write_behind_done(write_behind_t *wb, size_t *num_errors) {
+    json_t *done = json_array();
+
+    *num_errors = 0;
+
+    pthread_mutex_lock(&wb->mutex);
+    if (done) {
+        json_t *tmp = wb->done;
+        wb->done    = done;
+        done        = tmp;
+
+        *num_errors     = wb->done_errors;
+        wb->done_errors = 0;
+    }
+    pthread_mutex_unlock(&wb->mutex);
+
+    return done;
+}
+
+json_t *write_behind_flush(write_behind_t *wb, size_t *num_errors) {
+    if (json_array_size(wb->filling.items) > 0) {
+        baton_error_t error;
+        hand_off(wb, &error);
+        if (error.code != 0) {
+            logmsg(ERROR, "Failed to flush write-behind buffer: %s",
+                   error.message);
+        }
+    }
+
+    pthread_mutex_lock(&wb->mutex);
+    while (wb->busy) {
+        pthread_cond_wait(&wb->idle, &wb->mutex);
+    }
+    pthread_mutex_unlock(&wb->mutex);
+
+    return write_behind_done(wb, num_errors);
+}
+
+void stop_write_behind(write_behind_t *wb) {
+    pthread_mutex_lock(&wb->mutex);
+    wb->stop = 1;
+    pthread_cond_signal(&wb->work);
+    pthread_mutex_unlock(&wb->mutex);
+
+    pthread_join(wb->thread, NULL);
+
+    pthread_mutex_destroy(&wb->mutex);
+    pthread_cond_destroy(&wb->work);
+    pthread_cond_destroy(&wb->idle);
+
+    free_write_behind_batch(&wb->filling);
+    free_write_behind_batch(&wb->flushing);
+    if (wb->done) json_decref(wb->done);
+
+    free(wb);
+}
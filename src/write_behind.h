@@ -0,0 +1,189 @@
+/**
+ * Copyright (C) 2022 Genome Research Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file write_behind.h
+ * @author Keith James <kdj@sanger.ac.uk>
+ */
+
+#ifndef _BATON_WRITE_BEHIND_H
+#define _BATON_WRITE_BEHIND_H
+
+#include <pthread.h>
+
+#include <jansson.h>
+
+#include "config.h"
+#include "error.h"
+#include "operations.h"
+
+/**
+ *  @struct write_behind_batch
+ *  @brief Metadata operations buffered for one flush.
+ */
+typedef struct write_behind_batch {
+    /** The metamod items, in order of arrival. */
+    json_t *items;
+    /** A JSON object mapping each path to an array of its pending AVU
+        operations, in order of arrival. */
+    json_t *paths;
+    /** The number of pending AVU operations. */
+    size_t num_ops;
+    /** The number of items that failed. */
+    size_t num_errors;
+} write_behind_batch_t;
+
+/**
+ *  @struct write_behind
+ *  @brief A write-behind buffer for metamod operations.
+ *
+ *  Items are acknowledged into a filling batch, where an AVU added
+ *  and then removed from the same path cancels out and a repeated
+ *  operation is dropped. When the filling batch reaches the window
+ *  size, it is handed to a flushing thread, which has its own
+ *  connection and applies the operations one path at a time. Items
+ *  are reported, each with its result or first error, once their
+ *  batch has been flushed.
+ */
+typedef struct write_behind {
+    /** The number of AVU operations buffered before a flush. */
+    size_t window;
+    /** Function behaviour options. */
+    option_flags flags;
+    /** The batch accepting new items. */
+    write_behind_batch_t filling;
+    /** The batch being flushed. */
+    write_behind_batch_t flushing;
+    /** Flushed items not yet reported. */
+    json_t *done;
+    /** The number of flushed items that failed, not yet reported. */
+    size_t done_errors;
+    /** True while the flushing batch is being flushed. */
+    int busy;
+    /** True when the flushing thread is to exit. */
+    int stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+    pthread_t thread;
+} write_behind_t;
+
+/**
+ * Initialise an empty batch.
+ *
+ * @param[out] batch      A batch.
+ * @param[out] error      An error report struct.
+ *
+ * @return 0 on success, error code on failure.
+ */
+int init_write_behind_batch(write_behind_batch_t *batch,
+                            baton_error_t *error);
+
+/**
+ * Add a metamod item to a batch, coalescing its AVU operations with
+ * those already pending on the same path.
+ *
+ * @param[in]  batch      A batch.
+ * @param[in]  item       A metamod item, either a bare target or an
+ *                        envelope. On success, the batch takes a
+ *                        reference to it.
+ * @param[in]  flags      Function behaviour options, giving the metadata
+ *                        operation for bare targets.
+ * @param[out] error      An error report struct.
+ *
+ * @return 0 on success, error code on failure, when the item has not
+ * been added.
+ */
+int write_behind_batch_add(write_behind_batch_t *batch, json_t *item,
+                           option_flags flags, baton_error_t *error);
+
+/**
+ * Free the contents of a batch.
+ *
+ * @param[in]  batch      A batch.
+ */
+void free_write_behind_batch(write_behind_batch_t *batch);
+
+/**
+ * Start a write-behind buffer and its flushing thread.
+ *
+ * @param[in]  window     The number of AVU operations to buffer before
+ *                        a flush.
+ * @param[in]  flags      Function behaviour options.
+ * @param[out] error      An error report struct.
+ *
+ * @return A new write-behind buffer, which must be stopped with
+ * stop_write_behind.
+ */
+write_behind_t *start_write_behind(size_t window, option_flags flags,
+                                   baton_error_t *error);
+
+/**
+ * Return true if a JSON item is a metamod operation that may be
+ * buffered.
+ *
+ * @param[in]  item       A JSON item from the input stream.
+ * @param[in]  fn         The function processing the stream.
+ *
+ * @return 1 if the item may be buffered, 0 otherwise.
+ */
+int write_behind_item_p(json_t *item, baton_json_op fn);
+
+/**
+ * Add a metamod item, either a bare target or an envelope, to the
+ * buffer. If the buffer is full, hand it to the flushing thread,
+ * first waiting for any flush in progress.
+ *
+ * @param[in]  wb         A write-behind buffer.
+ * @param[in]  item       A metamod item. On success, the buffer takes a
+ *                        reference to it.
+ * @param[out] error      An error report struct.
+ *
+ * @return 0 on success, error code on failure, when the item has not
+ * been added.
+ */
+int write_behind_add(write_behind_t *wb, json_t *item, baton_error_t *error);
+
+/**
+ * Take the items that have been flushed since the last call, without
+ * waiting.
+ *
+ * @param[in]  wb         A write-behind buffer.
+ * @param[out] num_errors The number of the items that failed.
+ *
+ * @return A new JSON array of items, each with its result or error.
+ */
+json_t *write_behind_done(write_behind_t *wb, size_t *num_errors);
+
+/**
+ * Flush all buffered items and wait for the flush to complete.
+ *
+ * @param[in]  wb         A write-behind buffer.
+ * @param[out] num_errors The number of the items that failed.
+ *
+ * @return A new JSON array of items, each with its result or error.
+ */
+json_t *write_behind_flush(write_behind_t *wb, size_t *num_errors);
+
+/**
+ * Stop the flushing thread and free the buffer. Any items not yet
+ * flushed are discarded, so write_behind_flush should be called
+ * first.
+ *
+ * @param[in]  wb         A write-behind buffer.
+ */
+void stop_write_behind(write_behind_t *wb);
+
+#endif // _BATON_WRITE_BEHIND_H
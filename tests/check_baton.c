@@ -19,7 +19,11 @@
  */
 
 #include <assert.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <jansson.h>
@@ -31,6 +35,7 @@
 #include "../src/read.h"
 #include "../src/compat_checksum.h"
 #include "../src/signal_handler.h"
+#include "../src/workload.h"
 
 int exit_flag;
 
@@ -258,6 +263,131 @@ START_TEST(test_parse_size) {
 }
 END_TEST
 
+// Can we parse counts, rejecting anything but a whole decimal number?
+START_TEST(test_parse_unsigned) {
+    unsigned long value = 99;
+    ck_assert_int_eq(parse_unsigned("0", &value), 0);
+    ck_assert_int_eq(value, 0);
+    ck_assert_int_eq(parse_unsigned("1024", &value), 0);
+    ck_assert_int_eq(value, 1024);
+
+    ck_assert_int_ne(parse_unsigned("", &value), 0);
+    ck_assert_int_ne(parse_unsigned("-1", &value), 0);
+    ck_assert_int_ne(parse_unsigned(" 1", &value), 0);
+    ck_assert_int_ne(parse_unsigned("1k", &value), 0);
+    ck_assert_int_ne(parse_unsigned("99999999999999999999999", &value), 0);
+    ck_assert_int_eq(value, 1024);
+}
+END_TEST
+
+// Can we parse the relative frequencies of a mix of operations?
+START_TEST(test_parse_mix) {
+    const char *names[] = { "list", "get", "put" };
+    unsigned long weights[3];
+    unsigned long total;
+
+    ck_assert_int_eq(parse_mix("list=3,put", names, 3, weights, &total), 0);
+    ck_assert_int_eq(weights[0], 3);
+    ck_assert_int_eq(weights[1], 0);
+    ck_assert_int_eq(weights[2], 1);
+    ck_assert_int_eq(total, 4);
+
+    // A later weight for the same name replaces the earlier
+    ck_assert_int_eq(parse_mix("get=2,get=5", names, 3, weights, &total), 0);
+    ck_assert_int_eq(weights[1], 5);
+    ck_assert_int_eq(total, 5);
+
+    ck_assert_int_ne(parse_mix("", names, 3, weights, &total), 0);
+    ck_assert_int_ne(parse_mix("list=0", names, 3, weights, &total), 0);
+    ck_assert_int_ne(parse_mix("list=x", names, 3, weights, &total), 0);
+    ck_assert_int_ne(parse_mix("list=-1", names, 3, weights, &total), 0);
+    ck_assert_int_ne(parse_mix("list=", names, 3, weights, &total), 0);
+    ck_assert_int_ne(parse_mix("list,rm", names, 3, weights, &total), 0);
+
+    // Choices follow the weights and never pick a zero-weight name
+    uint64_t rng = 1;
+    size_t counts[3] = { 0, 0, 0 };
+    ck_assert_int_eq(parse_mix("list=3,put", names, 3, weights, &total), 0);
+    for (int i = 0; i < 4000; i++) {
+        counts[choose_weighted(&rng, weights, 3, total)]++;
+    }
+    ck_assert_int_eq(counts[1], 0);
+    ck_assert(counts[0] > 2 * counts[2]);
+}
+END_TEST
+
+// Can we find the nearest-rank percentiles of samples?
+START_TEST(test_percentile) {
+    double sorted[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+
+    ck_assert(percentile(sorted, 0, 50) == 0);
+    ck_assert(percentile(sorted, 1, 99) == 1);
+
+    ck_assert(percentile(sorted, 10, 0)   == 1);
+    ck_assert(percentile(sorted, 10, 10)  == 1);
+    ck_assert(percentile(sorted, 10, 11)  == 2);
+    ck_assert(percentile(sorted, 10, 50)  == 5);
+    ck_assert(percentile(sorted, 10, 90)  == 9);
+    ck_assert(percentile(sorted, 10, 99)  == 10);
+    ck_assert(percentile(sorted, 10, 100) == 10);
+}
+END_TEST
+
+// Do seeded sizes repeat and stay within their range?
+START_TEST(test_random_size) {
+    uint64_t rng1 = 42;
+    uint64_t rng2 = 42;
+
+    for (int i = 0; i < 1000; i++) {
+        size_t size = random_size(&rng1, 1024, 1024 * 1024);
+        ck_assert(size >= 1024);
+        ck_assert(size <= 1024 * 1024);
+        ck_assert_int_eq(size, random_size(&rng2, 1024, 1024 * 1024));
+    }
+
+    ck_assert_int_eq(random_size(&rng1, 512, 512), 512);
+    ck_assert_int_eq(random_below(&rng1, 0), 0);
+}
+END_TEST
+
+// Can we number and name the collections of a breadth-first tree?
+START_TEST(test_tree_path) {
+    char path[64];
+
+    ck_assert_int_eq(tree_parent(1, 3), 0);
+    ck_assert_int_eq(tree_parent(3, 3), 0);
+    ck_assert_int_eq(tree_parent(4, 3), 1);
+    ck_assert_int_eq(tree_parent(12, 3), 3);
+    ck_assert_int_eq(tree_parent(13, 3), 4);
+
+    tree_path("/r", 0, 3, path, sizeof path);
+    ck_assert_str_eq(path, "/r");
+    tree_path("/r", 4, 3, path, sizeof path);
+    ck_assert_str_eq(path, "/r/c1/c4");
+    tree_path("/r", 13, 3, path, sizeof path);
+    ck_assert_str_eq(path, "/r/c1/c4/c13");
+
+    // Long paths are truncated
+    tree_path("/r", 13, 3, path, 8);
+    ck_assert_str_eq(path, "/r/c1/c");
+
+    // Levels are 1-3, 4-12 and 13-39, the last cut short at 20
+    ck_assert_int_eq(tree_level_last(1, 20, 3), 3);
+    ck_assert_int_eq(tree_level_last(4, 20, 3), 12);
+    ck_assert_int_eq(tree_level_last(13, 20, 3), 20);
+    ck_assert_int_eq(tree_level_last(1, 2, 3), 2);
+    ck_assert_int_eq(tree_level_last(1, 5, 1), 1);
+
+    // Each item's sequence depends only on the seed and its index
+    uint64_t s1 = seeded_random_state(1, 0);
+    uint64_t s2 = seeded_random_state(1, 0);
+    ck_assert(s1 != 0);
+    ck_assert(next_random(&s1) == next_random(&s2));
+    ck_assert(seeded_random_state(1, 0) != seeded_random_state(1, 1));
+    ck_assert(seeded_random_state(1, 0) != seeded_random_state(2, 0));
+}
+END_TEST
+
 // Can we coerce ISO-8859-1 to UTF-8?
 START_TEST(test_to_utf8) {
     char in[2]  = { 0, 0 };
@@ -274,6 +404,1078 @@ START_TEST(test_to_utf8) {
 }
 END_TEST
 
+// Can we make file names from checksums?
+START_TEST(test_cache_key) {
+    char key[MAX_CACHE_KEY_LEN];
+    baton_error_t error;
+
+    cache_key("4efe0c1befd6f6ac4621cbdb13241246", key, sizeof key, &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_str_eq(key, "4efe0c1befd6f6ac4621cbdb13241246");
+
+    cache_key("sha2:a+b/c=", key, sizeof key, &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_str_eq(key, "sha2:a-b_c=");
+
+    cache_key("", key, sizeof key, &error);
+    ck_assert_int_ne(error.code, 0);
+
+    cache_key("../etc", key, sizeof key, &error);
+    ck_assert_int_ne(error.code, 0);
+
+    cache_key("0123456789", key, 4, &error);
+    ck_assert_int_ne(error.code, 0);
+}
+END_TEST
+
+// Can we make local paths for data objects from a layout template?
+START_TEST(test_make_layout_path) {
+    baton_error_t error;
+    json_t *obj = json_pack("{s:s, s:s}",
+                            JSON_COLLECTION_KEY,  "/testZone/home/a",
+                            JSON_DATA_OBJECT_KEY, "f1.txt");
+
+    char *path = make_layout_path("out", FETCH_DEFAULT_LAYOUT, obj, &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_str_eq(path, "out/testZone/home/a/f1.txt");
+    free(path);
+
+    path = make_layout_path("out", "{data_object}", obj, &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_str_eq(path, "out/f1.txt");
+    free(path);
+
+    path = make_layout_path("out", "x/{data_object}.bak", obj, &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_str_eq(path, "out/x/f1.txt.bak");
+    free(path);
+
+    path = make_layout_path("out", "{zone}/{data_object}", obj, &error);
+    ck_assert_int_ne(error.code, 0);
+    ck_assert_ptr_eq(path, NULL);
+
+    json_t *coll = json_pack("{s:s}", JSON_COLLECTION_KEY, "/testZone");
+    path = make_layout_path("out", FETCH_DEFAULT_LAYOUT, coll, &error);
+    ck_assert_int_ne(error.code, 0);
+    ck_assert_ptr_eq(path, NULL);
+
+    json_decref(obj);
+    json_decref(coll);
+}
+END_TEST
+
+// Can we estimate the server calls made by a stream of operations,
+// including the effect of coalescing metamod operations?
+START_TEST(test_plan_items) {
+    baton_error_t error;
+    operation_args_t args = { .flags        = 0,
+                              .buffer_size  = 1024,
+                              .write_behind = 0 };
+    plan_t plan = { .args       = &args,
+                    .operations = json_object() };
+    init_write_behind_batch(&plan.batch, &error);
+    ck_assert_int_eq(error.code, 0);
+
+    const char *items[] = {
+        "{\"operation\": \"metamod\","
+        " \"arguments\": {\"operation\": \"add\"},"
+        " \"target\": {\"collection\": \"/testZone/a\","
+        "            \"data_object\": \"f1.txt\","
+        "            \"avus\": [{\"attribute\": \"x\", \"value\": \"1\"}]}}",
+        "{\"operation\": \"metamod\","
+        " \"arguments\": {\"operation\": \"rem\"},"
+        " \"target\": {\"collection\": \"/testZone/a\","
+        "            \"data_object\": \"f1.txt\","
+        "            \"avus\": [{\"attribute\": \"x\", \"value\": \"1\"}]}}",
+        "{\"operation\": \"metamod\","
+        " \"arguments\": {\"operation\": \"add\"},"
+        " \"target\": {\"collection\": \"/testZone/a\","
+        "            \"data_object\": \"f1.txt\","
+        "            \"avus\": [{\"attribute\": \"y\", \"value\": \"2\"}]}}",
+        "{\"operation\": \"list\","
+        " \"arguments\": {\"contents\": true, \"avu\": true},"
+        " \"target\": {\"collection\": \"/testZone/a\"}}",
+        "{\"operation\": \"metaquery\","
+        " \"arguments\": {\"object\": true, \"avu\": true},"
+        " \"target\": {\"avus\": [{\"attribute\": \"x\", \"value\": \"1\"}]}}",
+        "{\"operation\": \"get\","
+        " \"arguments\": {\"save\": true},"
+        " \"target\": {\"collection\": \"/testZone/a\","
+        "            \"data_object\": \"f1.txt\","
+        "            \"size\": 2048}}",
+        "{\"operation\": \"frobnicate\","
+        " \"target\": {\"collection\": \"/testZone/a\"}}"
+    };
+    size_t num_items = sizeof items / sizeof items[0];
+
+    for (size_t i = 0; i < num_items; i++) {
+        json_error_t load_error;
+        json_t *item = json_loads(items[i], 0, &load_error);
+        ck_assert_ptr_ne(item, NULL);
+
+        plan_item(&plan, item, &error);
+        if (i < num_items - 1) {
+            ck_assert_int_eq(error.code, 0);
+        }
+        else {
+            ck_assert_int_ne(error.code, 0);
+        }
+        json_decref(item);
+    }
+
+    json_t *report = plan_report(&plan, &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_ptr_ne(report, NULL);
+
+    ck_assert_int_eq(json_integer_value(json_object_get(report, "items")), 7);
+    ck_assert_int_eq(json_integer_value(json_object_get(report, "invalid")), 1);
+    ck_assert_int_eq(json_integer_value(json_object_get(report,
+                                                        "connections")), 1);
+
+    json_t *ops = json_object_get(report, "operations");
+    json_t *metamod = json_object_get(ops, "metamod");
+    ck_assert_int_eq(json_integer_value(json_object_get(metamod, "count")), 3);
+    ck_assert_int_eq(json_integer_value(json_object_get(metamod, "calls")), 6);
+
+    // Stat, list and list contents (2), with the AVUs of the contents
+    // added in batches whose number depends on the contents
+    json_t *list = json_object_get(ops, "list");
+    ck_assert_int_eq(json_integer_value(json_object_get(list, "calls")), 4);
+    ck_assert_int_eq(json_integer_value(json_object_get(list,
+                                                        "unknown_calls")), 1);
+
+    // One query for data objects, with the AVUs of the results added
+    // in batches
+    json_t *metaquery = json_object_get(ops, "metaquery");
+    ck_assert_int_eq(json_integer_value(json_object_get(metaquery,
+                                                        "calls")), 1);
+    ck_assert_int_eq(json_integer_value(json_object_get(metaquery,
+                                                        "unknown_calls")), 1);
+
+    // Stat, open, read (2) and close
+    json_t *get = json_object_get(ops, "get");
+    ck_assert_int_eq(json_integer_value(json_object_get(get, "calls")), 5);
+    ck_assert_int_eq(json_integer_value(json_object_get(get, "bytes")), 2048);
+    ck_assert_int_eq(json_integer_value(json_object_get(get,
+                                                        "unknown_calls")), 0);
+
+    ck_assert_int_eq(json_integer_value(json_object_get(report, "calls")), 16);
+    ck_assert_int_eq(json_integer_value(json_object_get(report,
+                                                        "unknown_calls")), 2);
+    ck_assert_int_eq(json_integer_value(json_object_get(report, "bytes")),
+                     2048);
+
+    // The added and removed AVU cancel out, leaving a single stat and
+    // AVU addition
+    json_t *opts = json_object_get(report, "optimisations");
+    json_t *wb   = json_object_get(opts, "write_behind");
+    ck_assert(json_is_false(json_object_get(wb, "enabled")));
+    ck_assert_int_eq(json_integer_value(json_object_get(wb, "avus")), 3);
+    ck_assert_int_eq(json_integer_value(json_object_get(wb,
+                                                        "coalesced_avus")), 1);
+    ck_assert_int_eq(json_integer_value(json_object_get(wb,
+                                                        "calls_saved")), 4);
+    ck_assert_int_eq(json_integer_value(json_object_get(opts,
+                                                        "batched_enrichment")),
+                     2);
+
+    json_decref(report);
+    json_decref(plan.operations);
+    free_write_behind_batch(&plan.batch);
+}
+END_TEST
+
+// Can we calculate checksums in each hash scheme, formatted as iRODS
+// does?
+START_TEST(test_digest) {
+    const char *md5    = "900150983cd24fb0d6963f7d28e17f72";
+    const char *sha256 = "sha2:ungWv48Bz+pBQUDeXa4iI7ADYaOWF3qctBD/YfIAFa0=";
+    char checksum[MAX_CHECKSUM_LEN];
+    digest_t digest;
+    baton_error_t error;
+
+    ck_assert_int_eq(parse_digest_scheme("md5"), DIGEST_MD5);
+    ck_assert_int_eq(parse_digest_scheme("SHA256"), DIGEST_SHA256);
+    ck_assert_int_eq(parse_digest_scheme("SHA512"), DIGEST_UNKNOWN);
+
+    ck_assert_int_eq(init_digest(&digest, DIGEST_MD5, &error), 0);
+    update_digest(&digest, "a", 1);
+    update_digest(&digest, "bc", 2);
+    ck_assert_int_eq(final_digest(&digest, checksum, &error), 0);
+    ck_assert_str_eq(checksum, md5);
+
+    ck_assert_int_eq(init_digest(&digest, DIGEST_SHA256, &error), 0);
+    update_digest(&digest, "abc", 3);
+    ck_assert_int_eq(final_digest(&digest, checksum, &error), 0);
+    ck_assert_str_eq(checksum, sha256);
+
+    ck_assert_int_eq(checksum_scheme(md5), DIGEST_MD5);
+    ck_assert_int_eq(checksum_scheme(sha256), DIGEST_SHA256);
+    ck_assert_int_eq(checksum_scheme("sha2:abc"), DIGEST_UNKNOWN);
+    ck_assert_int_eq(checksum_scheme("900150983cd24fb0"), DIGEST_UNKNOWN);
+
+    // MD5 is hexadecimal and compared ignoring case, while base64 is not
+    ck_assert(checksum_equals(md5, "900150983CD24FB0D6963F7D28E17F72"));
+    ck_assert(!checksum_equals(sha256,
+                               "sha2:UNGwV48bZ+PbqudExA4Ii7adYAowf3QCTbd/"
+                               "yFiafA0="));
+    ck_assert(!checksum_equals(md5, sha256));
+}
+END_TEST
+
+// Are transfer buffers page-aligned and reused once released?
+START_TEST(test_buffer_pool) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    buffer_pool_stats_t stats;
+    baton_error_t error;
+
+    drain_buffer_pool();
+    set_buffer_pool_limit(0);
+
+    ck_assert_ptr_eq(lease_buffer(0, &error), NULL);
+    ck_assert_int_ne(error.code, 0);
+
+    char *buffer = lease_buffer(5000, &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_ptr_ne(buffer, NULL);
+    ck_assert_int_eq((uintptr_t) buffer % page_size, 0);
+    memset(buffer, 1, 5000);
+
+    get_buffer_pool_stats(&stats);
+    ck_assert_int_eq(stats.leased_bytes, 8192); // Rounded up to its class
+    release_buffer(buffer, 5000);
+
+    // The same size class is reused without allocating
+    char *reused = lease_buffer(8192, &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_ptr_eq(reused, buffer);
+    release_buffer(reused, 8192);
+
+    get_buffer_pool_stats(&stats);
+    ck_assert_int_eq(stats.leases, 2);
+    ck_assert_int_eq(stats.allocations, 1);
+    ck_assert_int_eq(stats.leased_bytes, 0);
+    ck_assert_int_eq(stats.idle_bytes, 8192);
+
+    // Idle buffers are evicted to keep within the limit
+    set_buffer_pool_limit(16384);
+    char *larger = lease_buffer(16384, &error);
+    ck_assert_int_eq(error.code, 0);
+
+    get_buffer_pool_stats(&stats);
+    ck_assert_int_eq(stats.leased_bytes, 16384);
+    ck_assert_int_eq(stats.idle_bytes, 0);
+    ck_assert_int_eq(stats.waits, 0);
+    release_buffer(larger, 16384);
+
+    // A sole lease larger than the limit is granted
+    char *oversize = lease_buffer(32768, &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_ptr_ne(oversize, NULL);
+    release_buffer(oversize, 32768);
+
+    get_buffer_pool_stats(&stats);
+    ck_assert_int_eq(stats.leased_bytes, 0);
+    ck_assert_int_le(stats.idle_bytes, 16384);
+
+    drain_buffer_pool();
+    set_buffer_pool_limit(BUFFER_POOL_DEFAULT_LIMIT);
+}
+END_TEST
+
+// Are results held until flushed and written in order with content
+// printed to the same stream?
+START_TEST(test_output_writer) {
+    baton_error_t error;
+    struct stat st;
+    char content[64];
+
+    FILE *stream = tmpfile();
+    ck_assert_ptr_ne(stream, NULL);
+
+    output_writer_t *writer = open_output_writer(stream, 1024, 0, &error);
+    ck_assert_int_eq(error.code, 0);
+
+    json_t *result = json_pack("{s:i}", "a", 1);
+    ck_assert_int_eq(output_json(writer, result, &error), 0);
+    ck_assert_int_eq(output_json(writer, result, &error), 0);
+    ck_assert_int_eq(fstat(fileno(stream), &st), 0);
+    ck_assert_int_eq(st.st_size, 0);
+
+    ck_assert_int_eq(flush_output(writer, &error), 0);
+    fprintf(stream, "raw\n");
+    ck_assert_int_eq(output_json(writer, result, &error), 0);
+    close_output_writer(writer);
+
+    // Two results in one write, the raw content, then the last
+    rewind(stream);
+    size_t len = fread(content, 1, sizeof content - 1, stream);
+    content[len] = '\0';
+    ck_assert_str_eq(content, "{\"a\": 1}\n{\"a\": 1}\nraw\n{\"a\": 1}\n");
+
+    json_decref(result);
+    fclose(stream);
+}
+END_TEST
+
+// Is input found waiting when buffered in the stream, but not when
+// only whitespace remains?
+START_TEST(test_input_waiting) {
+    int pipe_fd[2];
+    ck_assert_int_eq(pipe(pipe_fd), 0);
+
+    FILE *in = fdopen(pipe_fd[0], "r");
+    ck_assert_ptr_ne(in, NULL);
+
+    // Reading the first character buffers the rest, leaving the
+    // descriptor with nothing to read
+    ck_assert_int_eq(write(pipe_fd[1], "ab \n", 4), 4);
+    ck_assert_int_eq(getc(in), 'a');
+#ifdef __GLIBC__
+    ck_assert(input_waiting(in));
+#endif
+    ck_assert_int_eq(getc(in), 'b');
+    ck_assert(!input_waiting(in));
+    ck_assert(!ferror(in));
+
+    // The descriptor flags are left alone
+    ck_assert_int_eq(fcntl(pipe_fd[0], F_GETFL) & O_NONBLOCK, 0);
+
+    ck_assert_int_eq(write(pipe_fd[1], "c", 1), 1);
+    ck_assert(input_waiting(in));
+    ck_assert_int_eq(getc(in), 'c');
+
+    // The end of input is left for the reader to find
+    close(pipe_fd[1]);
+    ck_assert(input_waiting(in));
+    ck_assert_int_eq(getc(in), EOF);
+    ck_assert(feof(in));
+    fclose(in);
+
+    FILE *file = tmpfile();
+    ck_assert(input_waiting(file));
+    fclose(file);
+}
+END_TEST
+
+// Can we count the values in a JSON result?
+START_TEST(test_count_json_nodes) {
+    json_t *result = json_pack("{s:s, s:[{s:s, s:s}, {s:s, s:s}]}",
+                               "collection", "/zone/coll",
+                               "avus",
+                               "attribute", "a", "value", "x",
+                               "attribute", "b", "value", "y");
+
+    ck_assert_int_eq(count_json_nodes(NULL), 0);
+    ck_assert_int_eq(count_json_nodes(json_null()), 1);
+    ck_assert_int_eq(count_json_nodes(result), 9);
+
+    json_decref(result);
+}
+END_TEST
+
+static void *allocate_large_json(void *arg) {
+    char *content = calloc(65536, sizeof (char));
+    memset(content, 'x', 65535);
+
+    *((json_t **) arg) = json_string(content);
+    free(content);
+
+    return NULL;
+}
+
+// Is an envelope's memory limit applied only to the thread processing
+// it, while other threads allocate?
+START_TEST(test_envelope_memory_threads) {
+    enable_memory_accounting();
+
+    begin_envelope_memory(4096);
+
+    // Another thread allocating more than the limit is not refused,
+    // nor charged to the envelope
+    json_t *other = NULL;
+    pthread_t thread;
+    ck_assert_int_eq(pthread_create(&thread, NULL, allocate_large_json,
+                                    &other), 0);
+    ck_assert_int_eq(pthread_join(thread, NULL), 0);
+    ck_assert_ptr_ne(other, NULL);
+
+    json_t *small = json_string("small");
+    ck_assert_ptr_ne(small, NULL);
+
+    memory_stats_t stats;
+    ck_assert_int_eq(end_envelope_memory(&stats), 0);
+    ck_assert_int_gt(stats.allocations, 0);
+    ck_assert_int_lt(stats.peak_bytes, 4096);
+
+    // The thread processing the envelope is refused beyond the limit
+    begin_envelope_memory(4096);
+    json_t *large = NULL;
+    allocate_large_json(&large);
+    ck_assert_ptr_eq(large, NULL);
+    ck_assert_int_eq(end_envelope_memory(&stats), 1);
+
+    json_decref(other);
+    json_decref(small);
+}
+END_TEST
+
+// Can we decode an envelope's operation and arguments?
+START_TEST(test_decode_envelope) {
+    const char *names[] = { JSON_CHMOD_OP,   JSON_CHECKSUM_OP,
+                            JSON_FETCH_OP,   JSON_GET_OP,
+                            JSON_LIST_OP,    JSON_METAMOD_OP,
+                            JSON_METAQUERY_OP, JSON_PUT_OP,
+                            JSON_MOVE_OP,    JSON_RM_OP,
+                            JSON_MKCOLL_OP,  JSON_RMCOLL_OP,
+                            JSON_DIGEST_OP,  JSON_COPY_OP };
+    operation_type types[] = { OPERATION_CHMOD,   OPERATION_CHECKSUM,
+                               OPERATION_FETCH,   OPERATION_GET,
+                               OPERATION_LIST,    OPERATION_METAMOD,
+                               OPERATION_METAQUERY, OPERATION_PUT,
+                               OPERATION_MOVE,    OPERATION_RM,
+                               OPERATION_MKCOLL,  OPERATION_RMCOLL,
+                               OPERATION_DIGEST, OPERATION_COPY };
+    for (size_t i = 0; i < sizeof names / sizeof names[0]; i++) {
+        ck_assert_int_eq(lookup_operation(names[i]), types[i]);
+    }
+    ck_assert_int_eq(lookup_operation("rm"), OPERATION_UNKNOWN);
+    ck_assert_int_eq(lookup_operation(""), OPERATION_UNKNOWN);
+
+    json_t *envelope =
+        json_pack("{s:s, s:{s:s}, s:{s:b, s:b, s:b, s:b, s:b, s:b, s:b, "
+                  "s:b, s:b, s:b, s:b, s:b, s:b, s:b, s:b, s:b, s:b, "
+                  "s:s, s:s, s:s, s:s, s:i, s:i}}",
+                  JSON_OP_KEY, JSON_METAMOD_OP,
+                  JSON_TARGET_KEY, JSON_COLLECTION_KEY, "/zone/coll",
+                  JSON_OP_ARGS_KEY,
+                  JSON_OP_ACL,           1,
+                  JSON_OP_AVU,           1,
+                  JSON_OP_CHECKSUM,      1,
+                  JSON_OP_VERIFY,        1,
+                  JSON_OP_FORCE,         1,
+                  JSON_OP_COLLECTION,    1,
+                  JSON_OP_CONTENTS,      1,
+                  JSON_OP_OBJECT,        1,
+                  JSON_OP_PARALLEL,      1,
+                  JSON_OP_RAW,           1,
+                  JSON_OP_RECURSE,       1,
+                  JSON_OP_REPLICATE,     1,
+                  JSON_OP_SAVE,          1,
+                  JSON_OP_SINGLE_SERVER, 1,
+                  JSON_OP_SIZE,          1,
+                  JSON_OP_TIMESTAMP,     1,
+                  "unknown",             1,
+                  JSON_OP_SHORT_KEY,     JSON_ARG_META_ADD,
+                  JSON_OP_PATH,          "/zone/dest",
+                  JSON_OP_LAYOUT,        "flat",
+                  JSON_OP_RESOURCE,      "replResc",
+                  JSON_OP_THREADS,       4,
+                  JSON_OP_DEADLINE,      500);
+
+    operation_desc_t desc;
+    baton_error_t error;
+    decode_envelope(envelope, FLUSH, &desc, &error);
+    ck_assert_int_eq(error.code, 0);
+
+    ck_assert_int_eq(desc.type, OPERATION_METAMOD);
+    ck_assert_str_eq(desc.name, JSON_METAMOD_OP);
+    ck_assert_ptr_eq(desc.target, json_object_get(envelope,
+                                                  JSON_TARGET_KEY));
+    ck_assert_int_eq(desc.flags,
+                     FLUSH | PRINT_ACL | PRINT_AVU | CALCULATE_CHECKSUM |
+                     VERIFY_CHECKSUM | PRINT_CHECKSUM | FORCE |
+                     SEARCH_COLLECTIONS | PRINT_CONTENTS | SEARCH_OBJECTS |
+                     PARALLEL_TRANSFER | PRINT_RAW | RECURSIVE |
+                     PRINT_REPLICATE | SAVE_FILES | SINGLE_SERVER |
+                     PRINT_SIZE | PRINT_TIMESTAMP | ADD_AVU);
+    ck_assert_str_eq(desc.path, "/zone/dest");
+    ck_assert_str_eq(desc.layout, "flat");
+    ck_assert_str_eq(desc.resource, "replResc");
+    ck_assert(desc.has_threads);
+    ck_assert_int_eq(desc.num_threads, 4);
+    ck_assert(desc.has_deadline);
+    ck_assert_int_eq(desc.deadline_ms, 500);
+
+    // The same flags as the individual predicates
+    json_t *args = json_object_get(envelope, JSON_OP_ARGS_KEY);
+    ck_assert_int_eq(get_op_flags(args, FLUSH, &error), desc.flags);
+
+    // False values set no flags and arguments are optional
+    json_t *bare = json_pack("{s:s, s:{s:s}, s:{s:b}}",
+                             JSON_OP_SHORT_KEY, JSON_LIST_OP,
+                             JSON_TARGET_KEY, JSON_COLLECTION_KEY, "/zone",
+                             JSON_OP_ARGS_SHORT_KEY, JSON_OP_ACL, 0);
+    decode_envelope(bare, 0, &desc, &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_int_eq(desc.type, OPERATION_LIST);
+    ck_assert_int_eq(desc.flags, 0);
+    ck_assert_ptr_eq(desc.path, NULL);
+    ck_assert_ptr_eq(desc.resource, NULL);
+    ck_assert(!desc.has_threads);
+
+    json_object_del(bare, JSON_OP_ARGS_SHORT_KEY);
+    decode_envelope(bare, 0, &desc, &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_ptr_eq(desc.args, NULL);
+
+    // Invalid arguments are reported
+    json_object_set_new(args, JSON_OP_THREADS, json_integer(-1));
+    decode_envelope(envelope, 0, &desc, &error);
+    ck_assert_int_ne(error.code, 0);
+
+    json_object_set_new(args, JSON_OP_THREADS, json_integer(1));
+    json_object_set_new(args, JSON_OP_SHORT_KEY, json_string("invalid"));
+    decode_envelope(envelope, 0, &desc, &error);
+    ck_assert_int_ne(error.code, 0);
+
+    json_decref(bare);
+    json_decref(envelope);
+}
+END_TEST
+
+// Can we format tar headers?
+START_TEST(test_format_tar_header) {
+    char header[TAR_MAX_HEADER_SIZE];
+    baton_error_t error;
+
+    ck_assert_uint_eq(format_tar_header(header, "coll/a.txt", TAR_TYPE_FILE,
+                                        100, 1600000000, &error),
+                      TAR_BLOCK_SIZE);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_str_eq(header, "coll/a.txt");
+    ck_assert_str_eq(header + 124, "00000000144"); // size
+    ck_assert_int_eq(header[156], TAR_TYPE_FILE);
+    ck_assert_str_eq(header + 257, "ustar");
+
+    // The checksum is the sum of the bytes, counting itself as spaces
+    unsigned int sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+        sum += (i >= 148 && i < 156) ? ' ' : (unsigned char) header[i];
+    }
+    ck_assert_uint_eq(strtoul(header + 148, NULL, 8), sum);
+
+    ck_assert_uint_eq(format_tar_header(header, "coll/sub/", TAR_TYPE_DIRECTORY,
+                                        0, 0, &error), TAR_BLOCK_SIZE);
+    ck_assert_int_eq(header[156], TAR_TYPE_DIRECTORY);
+
+    // A name too long for ustar is given in a pax header
+    char name[300] = "coll/";
+    for (size_t i = 0; i < 29; i++) strcat(name, "subcoll_" "/");
+    strcat(name, "x.txt");
+    ck_assert(strlen(name) > 255);
+
+    size_t len = format_tar_header(header, name, TAR_TYPE_FILE, 1, 0, &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_uint_eq(len, 3 * TAR_BLOCK_SIZE);
+    ck_assert_int_eq(header[156], TAR_TYPE_PAX);
+    ck_assert_ptr_ne(strstr(header + TAR_BLOCK_SIZE, name), NULL);
+    ck_assert_int_eq(header[2 * TAR_BLOCK_SIZE + 156], TAR_TYPE_FILE);
+
+    // A size too large for ustar is given in a pax header
+    len = format_tar_header(header, "big", TAR_TYPE_FILE,
+                            TAR_MAX_USTAR_SIZE + 1, 0, &error);
+    ck_assert_uint_eq(len, 3 * TAR_BLOCK_SIZE);
+    ck_assert_str_eq(header + TAR_BLOCK_SIZE, "19 size=8589934592\n");
+
+    ck_assert_uint_eq(format_tar_header(header, "", TAR_TYPE_FILE, 0, 0,
+                                        &error), 0);
+    ck_assert_int_ne(error.code, 0);
+
+    ck_assert_uint_eq(tar_padding(0), 0);
+    ck_assert_uint_eq(tar_padding(1), TAR_BLOCK_SIZE - 1);
+    ck_assert_uint_eq(tar_padding(TAR_BLOCK_SIZE), 0);
+}
+END_TEST
+
+// Can we read tar headers?
+START_TEST(test_read_tar_header) {
+    char archive[16 * TAR_BLOCK_SIZE];
+    char long_name[300] = "coll/";
+    tar_entry_t entry;
+    baton_error_t error;
+
+    for (size_t i = 0; i < 29; i++) strcat(long_name, "subcoll_" "/");
+    strcat(long_name, "x.txt");
+
+    memset(archive, 0, sizeof archive);
+    size_t len = format_tar_header(archive, "coll/", TAR_TYPE_DIRECTORY, 0,
+                                   0, &error);
+    len += format_tar_header(archive + len, "coll/a.txt", TAR_TYPE_FILE, 3, 0,
+                             &error);
+    memcpy(archive + len, "abc", 3);
+    len += TAR_BLOCK_SIZE;
+    len += format_tar_header(archive + len, long_name, TAR_TYPE_FILE, 0, 0,
+                             &error);
+
+    FILE *in = fmemopen(archive, len + TAR_END_SIZE, "r");
+    ck_assert_ptr_ne(in, NULL);
+
+    ck_assert_int_eq(read_tar_header(in, &entry, &error), 0);
+    ck_assert_str_eq(entry.name, "coll/");
+    ck_assert_int_eq(entry.type, TAR_TYPE_DIRECTORY);
+
+    ck_assert_int_eq(read_tar_header(in, &entry, &error), 0);
+    ck_assert_str_eq(entry.name, "coll/a.txt");
+    ck_assert_int_eq(entry.type, TAR_TYPE_FILE);
+    ck_assert_int_eq(entry.size, 3);
+
+    char content[TAR_BLOCK_SIZE];
+    ck_assert_int_eq(read_tar_content(in, content, 3, &error), 0);
+    ck_assert(memcmp(content, "abc", 3) == 0);
+    ck_assert_int_eq(read_tar_content(in, content, tar_padding(3),
+                                      &error), 0);
+
+    // The name is taken from the pax header
+    ck_assert_int_eq(read_tar_header(in, &entry, &error), 0);
+    ck_assert_str_eq(entry.name, long_name);
+    ck_assert_int_eq(entry.size, 0);
+
+    ck_assert_int_eq(read_tar_header(in, &entry, &error), 1);
+    ck_assert_int_eq(error.code, 0);
+    fclose(in);
+
+    // A damaged header is rejected
+    archive[0] = 'x';
+    in = fmemopen(archive, len + TAR_END_SIZE, "r");
+    ck_assert_int_ne(read_tar_header(in, &entry, &error), 0);
+    ck_assert_int_ne(error.code, 0);
+    fclose(in);
+
+    // As is an archive that ends inside an entry
+    in = fmemopen(archive + TAR_BLOCK_SIZE, 2 * TAR_BLOCK_SIZE - 1, "r");
+    ck_assert_int_eq(read_tar_header(in, &entry, &error), 0);
+    ck_assert_int_ne(skip_tar_content(in, entry.size, &error), 0);
+    fclose(in);
+}
+END_TEST
+
+// Do uploads go to the resource with the most space not yet claimed?
+START_TEST(test_select_resource) {
+    resource_load_t resources[] = {
+        { .name = "small", .free_space = 1000, .in_flight = 0   },
+        { .name = "large", .free_space = 5000, .in_flight = 0   },
+        { .name = "busy",  .free_space = 8000, .in_flight = 7500 },
+        { .name = "full",  .free_space = 100,  .in_flight = 200  }
+    };
+    size_t num_resources = sizeof resources / sizeof resources[0];
+
+    ck_assert_int_eq(select_resource(resources, num_resources, 100), 1);
+
+    // In-flight bytes are weighed against free space
+    resources[1].in_flight = 4500;
+    ck_assert_int_eq(select_resource(resources, num_resources, 100), 0);
+
+    // A resource without room for the upload is not eligible
+    ck_assert_int_eq(select_resource(resources, num_resources, 1000), -1);
+    ck_assert_int_eq(select_resource(resources, 0, 0), -1);
+
+    // Placement is off by default, so no resource is chosen
+    char resource[NAME_LEN];
+    baton_error_t error;
+    ck_assert(!resource_placement_enabled());
+    ck_assert_int_eq(acquire_resource(NULL, "/zone/obj", 100, resource,
+                                      &error), 0);
+    ck_assert_str_eq(resource, "");
+    release_resource(resource, 100);
+}
+END_TEST
+
+static void *trace_worker(void *arg) {
+    trace_span_t span;
+    trace_begin(&span, TRACE_CAT_TRANSFER, "worker", "%s", (char *) arg);
+    trace_end(&span);
+
+    return NULL;
+}
+
+// Are the events of each thread written as Chrome trace events?
+START_TEST(test_trace) {
+    baton_error_t error;
+    char template[] = "baton_test_trace.XXXXXX";
+    int fd = mkstemp(template);
+    ck_assert(fd >= 0);
+    close(fd);
+
+    // Nothing is recorded until the trace starts
+    trace_span_t span;
+    trace_begin(&span, TRACE_CAT_QUERY, "untraced", "-");
+    trace_end(&span);
+    ck_assert(!trace_enabled());
+
+    ck_assert_int_eq(start_trace(template, &error), 0);
+    ck_assert(trace_enabled());
+
+    trace_begin(&span, TRACE_CAT_STAT, "rcObjStat", "%s", "/zone/a \"b\"\n");
+    trace_end(&span);
+
+    pthread_t thread;
+    ck_assert_int_eq(pthread_create(&thread, NULL, trace_worker, "other"), 0);
+    ck_assert_int_eq(pthread_join(thread, NULL), 0);
+
+    ck_assert_int_eq(stop_trace(&error), 0);
+    ck_assert(!trace_enabled());
+
+    json_error_t load_error;
+    json_t *trace = json_load_file(template, 0, &load_error);
+    ck_assert_ptr_ne(trace, NULL);
+
+    json_t *events = json_object_get(trace, "traceEvents");
+    ck_assert(json_is_array(events));
+    ck_assert_int_eq(json_array_size(events), 2);
+
+    json_int_t tids[2];
+    for (size_t i = 0; i < 2; i++) {
+        json_t *event = json_array_get(events, i);
+        ck_assert_str_eq(json_string_value(json_object_get(event, "ph")), "X");
+        tids[i] = json_integer_value(json_object_get(event, "tid"));
+
+        const char *name = json_string_value(json_object_get(event, "name"));
+        json_t *event_args = json_object_get(event, "args");
+        const char *detail =
+            json_string_value(json_object_get(event_args, "detail"));
+
+        if (str_equals(name, "rcObjStat", MAX_STR_LEN)) {
+            ck_assert_str_eq(json_string_value(json_object_get(event, "cat")),
+                             TRACE_CAT_STAT);
+            ck_assert_str_eq(detail, "/zone/a \"b\"\n");
+        }
+        else {
+            ck_assert_str_eq(name, "worker");
+            ck_assert_str_eq(detail, "other");
+        }
+    }
+
+    // Each thread has its own identifier
+    ck_assert(tids[0] != tids[1]);
+
+    json_decref(trace);
+    unlink(template);
+}
+END_TEST
+
+// Is a collection digest independent of the order of its members?
+START_TEST(test_digest_tree_entries) {
+    baton_error_t error;
+    char digest1[MAX_CHECKSUM_LEN];
+    char digest2[MAX_CHECKSUM_LEN];
+    char digest3[MAX_CHECKSUM_LEN];
+
+    tree_entry_t entries1[] = {
+        { TREE_ENTRY_DATA_OBJECT, "a.txt", 10,
+          "d41d8cd98f00b204e9800998ecf8427e" },
+        { TREE_ENTRY_COLLECTION,  "sub",    0,
+          "sha2:47DEQpj8HBSa+/TImW+5JCeuQeRkm5NMpJWZG3hSuFU=" },
+        { TREE_ENTRY_DATA_OBJECT, "b.txt", 20, "" }
+    };
+    // The same members, listed in another order, with a second
+    // replicate of a.txt that has no checksum
+    tree_entry_t entries2[] = {
+        { TREE_ENTRY_DATA_OBJECT, "b.txt", 20, "" },
+        { TREE_ENTRY_DATA_OBJECT, "a.txt", 10, "" },
+        { TREE_ENTRY_COLLECTION,  "sub",    0,
+          "sha2:47DEQpj8HBSa+/TImW+5JCeuQeRkm5NMpJWZG3hSuFU=" },
+        { TREE_ENTRY_DATA_OBJECT, "a.txt", 10,
+          "d41d8cd98f00b204e9800998ecf8427e" }
+    };
+
+    digest_tree_entries(entries1, 3, digest1, &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert(str_starts_with(digest1, DIGEST_SHA256_PREFIX, MAX_STR_LEN));
+
+    digest_tree_entries(entries2, 4, digest2, &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_str_eq(digest1, digest2);
+
+    // A change of size, checksum or name changes the digest
+    entries2[0].size = 21;
+    digest_tree_entries(entries2, 4, digest3, &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_str_ne(digest1, digest3);
+
+    entries2[0].size = 20;
+    snprintf(entries2[3].checksum, MAX_CHECKSUM_LEN, "%s",
+             "00000000000000000000000000000000");
+    digest_tree_entries(entries2, 4, digest3, &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_str_ne(digest1, digest3);
+
+    entries1[0].name = "c.txt";
+    digest_tree_entries(entries1, 3, digest3, &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_str_ne(digest1, digest3);
+
+    // An empty collection has a digest
+    digest_tree_entries(NULL, 0, digest3, &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert(str_starts_with(digest3, DIGEST_SHA256_PREFIX, MAX_STR_LEN));
+}
+END_TEST
+
+// Can we read a file descriptor and size hint from a stream target?
+START_TEST(test_get_fd_value) {
+    baton_error_t error;
+
+    json_t *target = json_pack("{s:s, s:s, s:i, s:i}",
+                               JSON_COLLECTION_KEY,  "/testZone",
+                               JSON_DATA_OBJECT_KEY, "f1.txt",
+                               JSON_FD_KEY,          3,
+                               JSON_SIZE_KEY,        1024);
+    ck_assert(has_fd(target));
+    ck_assert_int_eq(get_fd_value(target, &error), 3);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert(get_size_hint(target) == 1024);
+
+    json_object_set_new(target, JSON_FD_KEY, json_string("3"));
+    ck_assert_int_eq(get_fd_value(target, &error), -1);
+    ck_assert_int_ne(error.code, 0);
+
+    json_object_set_new(target, JSON_FD_KEY, json_integer(-1));
+    ck_assert_int_eq(get_fd_value(target, &error), -1);
+    ck_assert_int_ne(error.code, 0);
+
+    // A size that is not an integer is unknown
+    json_object_set_new(target, JSON_SIZE_KEY, json_string("1024"));
+    ck_assert(get_size_hint(target) == 0);
+
+    json_t *file = json_pack("{s:s, s:s}",
+                             JSON_DIRECTORY_KEY, "/tmp",
+                             JSON_FILE_KEY,      "f1.txt");
+    ck_assert(!has_fd(file));
+    ck_assert_int_eq(get_fd_value(file, &error), -1);
+    ck_assert_int_ne(error.code, 0);
+    ck_assert(get_size_hint(file) == 0);
+
+    json_decref(target);
+    json_decref(file);
+}
+END_TEST
+
+// Can we combine the results of a query set, sorted and without
+// duplicates?
+START_TEST(test_query_set) {
+    baton_error_t error;
+    json_error_t load_error;
+
+    json_t *query = json_loads
+        ("{\"all\": [{\"any\": [{\"avus\": [{\"a\": \"a\", \"v\": \"1\"}]},"
+         "                     {\"avus\": [{\"a\": \"b\", \"v\": \"1\"}]}]},"
+         "          {\"avus\": [{\"a\": \"c\", \"v\": \"1\"}]},"
+         "          {\"not\": {\"avus\": [{\"a\": \"d\", \"v\": \"1\"}]}}]}",
+         0, &load_error);
+    json_t *leaf_results = json_loads
+        ("[[{\"collection\": \"/z/1\", \"data_object\": \"x\"},"
+         "  {\"collection\": \"/z/1\", \"data_object\": \"y\"},"
+         "  {\"collection\": \"/z/2\", \"data_object\": \"x\"}],"
+         " [{\"collection\": \"/z/3\", \"data_object\": \"x\"},"
+         "  {\"collection\": \"/z/2\", \"data_object\": \"x\"}],"
+         " [{\"collection\": \"/z/1\", \"data_object\": \"x\"},"
+         "  {\"collection\": \"/z/2\", \"data_object\": \"x\"},"
+         "  {\"collection\": \"/z/3\", \"data_object\": \"x\"},"
+         "  {\"collection\": \"/z/1\", \"data_object\": \"y\"}],"
+         " [{\"collection\": \"/z/2\", \"data_object\": \"x\"}]]",
+         0, &load_error);
+    json_t *expected = json_loads
+        ("[{\"collection\": \"/z/1\", \"data_object\": \"x\"},"
+         " {\"collection\": \"/z/1\", \"data_object\": \"y\"},"
+         " {\"collection\": \"/z/3\", \"data_object\": \"x\"}]",
+         0, &load_error);
+
+    ck_assert(is_query_set(query));
+    ck_assert_int_eq(count_query_leaves(query), 4);
+
+    json_t *results = combine_query_results(query, leaf_results, &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert(json_equal(results, expected));
+    json_decref(results);
+
+    // Negation is valid only within an "all" that has other members
+    json_t *no_results = json_pack("[[]]");
+    json_t *bad_not = json_pack("{s:{s:[]}}", JSON_NOT_KEY, JSON_AVUS_KEY);
+    results = combine_query_results(bad_not, no_results, &error);
+    ck_assert_ptr_eq(results, NULL);
+    ck_assert_int_ne(error.code, 0);
+
+    json_t *bad_all = json_pack("{s:[{s:{s:[]}}]}", JSON_ALL_KEY,
+                                JSON_NOT_KEY, JSON_AVUS_KEY);
+    results = combine_query_results(bad_all, no_results, &error);
+    ck_assert_ptr_eq(results, NULL);
+    ck_assert_int_ne(error.code, 0);
+
+    json_decref(query);
+    json_decref(leaf_results);
+    json_decref(expected);
+    json_decref(no_results);
+    json_decref(bad_not);
+    json_decref(bad_all);
+}
+END_TEST
+
+// Do deadlines expire and report a timeout?
+START_TEST(test_deadline) {
+    baton_error_t error;
+
+    ck_assert_int_eq(deadline_expired(), 0);
+
+    set_deadline(60000);
+    ck_assert_int_eq(deadline_expired(), 0);
+    init_baton_error(&error);
+    ck_assert_int_eq(check_deadline("test", &error), 0);
+
+    set_deadline(1);
+    usleep(5000);
+    ck_assert_int_ne(deadline_expired(), 0);
+    init_baton_error(&error);
+    ck_assert_int_eq(check_deadline("test", &error), DEADLINE_EXPIRED);
+    ck_assert_int_eq(error.code, DEADLINE_EXPIRED);
+
+    clear_deadline();
+    ck_assert_int_eq(deadline_expired(), 0);
+
+    set_deadline(1);
+    set_deadline(0);
+    usleep(5000);
+    ck_assert_int_eq(deadline_expired(), 0);
+}
+END_TEST
+
+// Can we record a checkpoint and resume input from it, both by seeking
+// and by skipping items?
+START_TEST(test_checkpoint_resume) {
+    baton_error_t error;
+    char tmp_dir[] = "baton_test_checkpoint.XXXXXX";
+    ck_assert_ptr_ne(mkdtemp(tmp_dir), NULL);
+
+    char input_path[PATH_MAX];
+    char checkpoint_path[PATH_MAX];
+    snprintf(input_path, sizeof input_path, "%s/input.json", tmp_dir);
+    snprintf(checkpoint_path, sizeof checkpoint_path, "%s/checkpoint",
+             tmp_dir);
+
+    FILE *input = fopen(input_path, "w+");
+    ck_assert_ptr_ne(input, NULL);
+    fputs("{\"n\": 1}\n{\"n\": 2}\n{\"n\": 3}\n", input);
+    rewind(input);
+
+    size_t jflags = JSON_DISABLE_EOF_CHECK | JSON_REJECT_DUPLICATES;
+    json_error_t load_error;
+    for (int i = 0; i < 2; i++) {
+        json_t *item = json_loadf(input, jflags, &load_error);
+        ck_assert_ptr_ne(item, NULL);
+        json_decref(item);
+    }
+
+    checkpoint_t checkpoint = { .path     = checkpoint_path,
+                                .offset   = ftell(input),
+                                .sequence = 2 };
+    ck_assert(checkpoint_due(&checkpoint, 1));
+    ck_assert_int_eq(write_checkpoint(&checkpoint, &error), 0);
+    ck_assert(!checkpoint_due(&checkpoint, 1));
+
+    // Seek
+    rewind(input);
+    checkpoint_t resumed = { .path = checkpoint_path };
+    ck_assert_int_eq(resume_from_checkpoint(input, &resumed, &error), 0);
+    ck_assert_int_eq(resumed.sequence, 2);
+
+    json_t *item = json_loadf(input, jflags, &load_error);
+    ck_assert_ptr_ne(item, NULL);
+    ck_assert_int_eq(json_integer_value(json_object_get(item, "n")), 3);
+    json_decref(item);
+
+    // Skip, as for an input that cannot seek
+    checkpoint.offset   = -1;
+    checkpoint.sequence = 1;
+    ck_assert_int_eq(write_checkpoint(&checkpoint, &error), 0);
+
+    rewind(input);
+    ck_assert_int_eq(resume_from_checkpoint(input, &resumed, &error), 0);
+    ck_assert_int_eq(resumed.sequence, 1);
+
+    item = json_loadf(input, jflags, &load_error);
+    ck_assert_ptr_ne(item, NULL);
+    ck_assert_int_eq(json_integer_value(json_object_get(item, "n")), 2);
+    json_decref(item);
+
+    // A missing checkpoint is the start of the input
+    unlink(checkpoint_path);
+    rewind(input);
+    ck_assert_int_eq(resume_from_checkpoint(input, &resumed, &error), 0);
+    ck_assert_int_eq(resumed.sequence, 0);
+
+    fclose(input);
+    unlink(input_path);
+    rmdir(tmp_dir);
+}
+END_TEST
+
+// Can we add local files to a cache, fetch them and evict the least
+// recently used?
+START_TEST(test_cache_add_fetch_evict) {
+    char cache_dir[] = "baton_test_cache.XXXXXX";
+    ck_assert_ptr_ne(mkdtemp(cache_dir), NULL);
+
+    local_cache_t cache = { .dir = cache_dir, .max_size = 0 };
+
+    char file_1k[MAX_PATH_LEN];
+    snprintf(file_1k, MAX_PATH_LEN, "%s/%s/lorem_1k.txt",
+             TEST_ROOT, TEST_DATA_PATH);
+    char file_10k[MAX_PATH_LEN];
+    snprintf(file_10k, MAX_PATH_LEN, "%s/%s/lorem_10k.txt",
+             TEST_ROOT, TEST_DATA_PATH);
+
+    const char *md5_1k  = "1f40c34d28e56efcf9da6732cdc93b8b";
+    const char *md5_10k = "4efe0c1befd6f6ac4621cbdb13241246";
+
+    const char *dest = "baton_test_cache_add_fetch_evict.txt";
+
+    baton_error_t error;
+    ck_assert_int_eq(cache_fetch(&cache, md5_1k, dest, &error), 0);
+    ck_assert_int_eq(error.code, 0);
+
+    ck_assert_int_eq(cache_add(&cache, md5_1k, file_1k, &error), 0);
+    ck_assert_int_eq(cache_add(&cache, md5_10k, file_10k, &error), 0);
+
+    ck_assert_int_eq(cache_fetch(&cache, md5_1k, dest, &error), 1);
+    ck_assert_int_eq(error.code, 0);
+
+    FILE *tmp = fopen(dest, "r");
+    confirm_checksum(tmp, md5_1k);
+    fclose(tmp);
+
+    // Make the 10k entry the most recently used, then bound the
+    // cache so that only it fits
+    char entry_1k[MAX_PATH_LEN];
+    snprintf(entry_1k, MAX_PATH_LEN, "%s/%s", cache_dir, md5_1k);
+    char entry_10k[MAX_PATH_LEN];
+    snprintf(entry_10k, MAX_PATH_LEN, "%s/%s", cache_dir, md5_10k);
+
+    struct timespec old[2] = { { .tv_sec = 1, .tv_nsec = 0 },
+                               { .tv_sec = 0, .tv_nsec = UTIME_OMIT } };
+    ck_assert_int_eq(utimensat(AT_FDCWD, entry_1k, old, 0), 0);
+
+    cache.max_size = 10240;
+    ck_assert_int_eq(cache_evict(&cache, &error), 1);
+    ck_assert_int_eq(error.code, 0);
+
+    ck_assert_int_ne(access(entry_1k, F_OK), 0);
+    ck_assert_int_eq(access(entry_10k, F_OK), 0);
+
+    // The fetched copy outlives its cache entry
+    tmp = fopen(dest, "r");
+    confirm_checksum(tmp, md5_1k);
+    fclose(tmp);
+
+    char lock[MAX_PATH_LEN];
+    snprintf(lock, MAX_PATH_LEN, "%s/%s", cache_dir, CACHE_LOCK_FILE);
+
+    unlink(dest);
+    unlink(entry_10k);
+    unlink(lock);
+    rmdir(cache_dir);
+}
+END_TEST
+
 // Can we log in?
 START_TEST(test_rods_login) {
     rodsEnv env;
@@ -1015,6 +2217,122 @@ START_TEST(test_list_timestamps_coll) {
 }
 END_TEST
 
+static json_t *digest_test_path(rcComm_t *conn, rodsEnv *env,
+                                char *path, option_flags flags) {
+    rodsPath_t rods_path;
+    baton_error_t resolve_error;
+    ck_assert_int_eq(resolve_rods_path(conn, env, &rods_path, path,
+                                       0, &resolve_error), EXIST_ST);
+
+    baton_error_t error;
+    json_t *result = digest_collection(conn, &rods_path, flags, &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_ptr_ne(NULL, result);
+    if (rods_path.rodsObjStat) free(rods_path.rodsObjStat);
+
+    return result;
+}
+
+static const char *digest_value(json_t *result) {
+    return json_string_value(json_object_get(result, JSON_DIGEST_KEY));
+}
+
+// Can we digest a collection tree, one sub-tree at a time?
+START_TEST(test_digest_collection) {
+    rodsEnv env;
+    rcComm_t *conn = rods_login(&env);
+
+    char rods_root[MAX_PATH_LEN];
+    set_current_rods_root(TEST_COLL, rods_root);
+
+    json_t *root = digest_test_path(conn, &env, rods_root, PRINT_CONTENTS);
+    ck_assert_str_eq(json_string_value(json_object_get(root,
+                                                       JSON_COLLECTION_KEY)),
+                     rods_root);
+    ck_assert(str_starts_with(digest_value(root), DIGEST_SHA256_PREFIX,
+                              MAX_STR_LEN));
+
+    // Every collection within the root, each followed by those
+    // within it
+    const char *colls[] = { "a", "a/x", "a/x/m", "a/x/n", "a/x/o",
+                            "a/y", "a/z", "b", "c" };
+    size_t num_colls = sizeof colls / sizeof colls[0];
+    json_t *contents = json_object_get(root, JSON_CONTENTS_KEY);
+    ck_assert_int_eq(json_array_size(contents), num_colls);
+
+    for (size_t i = 0; i < num_colls; i++) {
+        char path[MAX_PATH_LEN];
+        snprintf(path, MAX_PATH_LEN, "%s/%s", rods_root, colls[i]);
+
+        json_t *coll = json_array_get(contents, i);
+        ck_assert_str_eq(json_string_value(json_object_get
+                                           (coll, JSON_COLLECTION_KEY)),
+                         path);
+
+        // A sub-collection digested on its own has the same digest
+        json_t *sub = digest_test_path(conn, &env, path, 0);
+        ck_assert_str_eq(digest_value(sub), digest_value(coll));
+        ck_assert_ptr_eq(NULL, json_object_get(sub, JSON_CONTENTS_KEY));
+        json_decref(sub);
+    }
+
+    // Names are relative, so identical trees at different paths have
+    // the same digest, and different trees do not
+    ck_assert_str_eq(digest_value(json_array_get(contents, 7)),
+                     digest_value(json_array_get(contents, 8)));
+    ck_assert_str_ne(digest_value(json_array_get(contents, 0)),
+                     digest_value(json_array_get(contents, 7)));
+
+    // The digest is repeatable
+    json_t *again = digest_test_path(conn, &env, rods_root, 0);
+    ck_assert_str_eq(digest_value(again), digest_value(root));
+    json_decref(again);
+
+    // A change within b changes the digests of b and the root, but
+    // not of c
+    char coll_path[MAX_PATH_LEN];
+    snprintf(coll_path, MAX_PATH_LEN, "%s/b/new", rods_root);
+
+    rodsPath_t rods_coll_path;
+    baton_error_t resolve_error;
+    resolve_rods_path(conn, &env, &rods_coll_path, coll_path, 0,
+                      &resolve_error);
+    ck_assert_int_eq(resolve_error.code, 0);
+
+    baton_error_t create_error;
+    create_collection(conn, &rods_coll_path, 0, &create_error);
+    ck_assert_int_eq(create_error.code, 0);
+
+    json_t *changed = digest_test_path(conn, &env, rods_root, PRINT_CONTENTS);
+    json_t *changed_contents = json_object_get(changed, JSON_CONTENTS_KEY);
+    ck_assert_int_eq(json_array_size(changed_contents), num_colls + 1);
+    ck_assert_str_ne(digest_value(changed), digest_value(root));
+    ck_assert_str_ne(digest_value(json_array_get(changed_contents, 7)),
+                     digest_value(json_array_get(contents, 7)));
+    ck_assert_str_eq(digest_value(json_array_get(changed_contents, 9)),
+                     digest_value(json_array_get(contents, 8)));
+
+    // A data object is not a tree
+    char obj_path[MAX_PATH_LEN];
+    snprintf(obj_path, MAX_PATH_LEN, "%s/f1.txt", rods_root);
+
+    rodsPath_t rods_obj_path;
+    resolve_rods_path(conn, &env, &rods_obj_path, obj_path, 0,
+                      &resolve_error);
+    ck_assert_int_eq(resolve_error.code, 0);
+
+    baton_error_t error;
+    ck_assert_ptr_eq(NULL, digest_collection(conn, &rods_obj_path, 0,
+                                             &error));
+    ck_assert_int_eq(error.code, USER_INPUT_PATH_ERR);
+
+    json_decref(root);
+    json_decref(changed);
+
+    if (conn) rcDisconnect(conn);
+}
+END_TEST
+
 // Can we search for data objects by their metadata?
 START_TEST(test_search_metadata_obj) {
     option_flags flags = 0;
@@ -1065,6 +2383,148 @@ START_TEST(test_search_metadata_obj) {
 }
 END_TEST
 
+// Does a write-behind batch coalesce operations and leave nothing of an
+// item that cannot be buffered whole?
+START_TEST(test_write_behind_batch_add) {
+    baton_error_t error;
+    write_behind_batch_t batch;
+    ck_assert_int_eq(init_write_behind_batch(&batch, &error), 0);
+
+    const char *path = "/testZone/home/a/f1.txt";
+    json_t *add = json_pack("{s:s, s:s, s:[{s:s, s:s}, {s:s, s:s}]}",
+                            JSON_COLLECTION_KEY,  "/testZone/home/a",
+                            JSON_DATA_OBJECT_KEY, "f1.txt",
+                            JSON_AVUS_KEY,
+                            JSON_ATTRIBUTE_KEY, "a", JSON_VALUE_KEY, "1",
+                            JSON_ATTRIBUTE_KEY, "b", JSON_VALUE_KEY, "2");
+    ck_assert_int_eq(write_behind_batch_add(&batch, add, ADD_AVU, &error), 0);
+    ck_assert_int_eq(batch.num_ops, 2);
+    ck_assert_int_eq(json_array_size(batch.items), 1);
+
+    // The removal of a pending addition cancels it out
+    json_t *rem = json_pack("{s:s, s:s, s:[{s:s, s:s}]}",
+                            JSON_COLLECTION_KEY,  "/testZone/home/a",
+                            JSON_DATA_OBJECT_KEY, "f1.txt",
+                            JSON_AVUS_KEY,
+                            JSON_ATTRIBUTE_KEY, "a", JSON_VALUE_KEY, "1");
+    ck_assert_int_eq(write_behind_batch_add(&batch, rem, REMOVE_AVU,
+                                            &error), 0);
+    ck_assert_int_eq(batch.num_ops, 1);
+    ck_assert_int_eq(json_array_size(batch.items), 2);
+
+    // An item with an invalid AVU is rejected, leaving the operations
+    // of its valid AVUs unbuffered
+    json_t *bad = json_pack("{s:s, s:s, s:[{s:s, s:s}, {s:s}]}",
+                            JSON_COLLECTION_KEY,  "/testZone/home/a",
+                            JSON_DATA_OBJECT_KEY, "f1.txt",
+                            JSON_AVUS_KEY,
+                            JSON_ATTRIBUTE_KEY, "b", JSON_VALUE_KEY, "2",
+                            JSON_ATTRIBUTE_KEY, "c");
+    ck_assert_int_ne(write_behind_batch_add(&batch, bad, REMOVE_AVU,
+                                            &error), 0);
+    ck_assert_int_eq(batch.num_ops, 1);
+    ck_assert_int_eq(json_array_size(batch.items), 2);
+
+    json_t *ops = json_object_get(batch.paths, path);
+    ck_assert_int_eq(json_array_size(ops), 1);
+
+    json_decref(add);
+    json_decref(rem);
+    json_decref(bad);
+    free_write_behind_batch(&batch);
+}
+END_TEST
+
+// Can we buffer metamod operations, coalescing them, and apply them
+// in bulk?
+START_TEST(test_write_behind_metamod) {
+    option_flags flags = 0;
+    rodsEnv env;
+    rcComm_t *conn = rods_login(&env);
+
+    char rods_root[MAX_PATH_LEN];
+    set_current_rods_root(TEST_COLL, rods_root);
+
+    rodsPath_t rods_path;
+    baton_error_t resolve_error;
+    ck_assert_int_eq(resolve_rods_path(conn, &env, &rods_path, rods_root,
+                                       flags, &resolve_error), EXIST_ST);
+
+    baton_error_t start_error;
+    write_behind_t *wb = start_write_behind(100, flags, &start_error);
+    ck_assert_int_eq(start_error.code, 0);
+
+    const char *ops[] = { JSON_ARG_META_ADD, JSON_ARG_META_ADD,
+                          JSON_ARG_META_REM, JSON_ARG_META_ADD };
+    const char *values[] = { "wb1", "wb2", "wb2", "wb1" };
+
+    // The second add is cancelled by the remove and the last add is
+    // a repeat of the first
+    for (size_t i = 0; i < 4; i++) {
+        json_t *item =
+            json_pack("{s:s, s:{s:s}, s:{s:s, s:s, s:[{s:s, s:s}]}}",
+                      JSON_OP_KEY,      JSON_METAMOD_OP,
+                      JSON_OP_ARGS_KEY, JSON_OP_KEY, ops[i],
+                      JSON_TARGET_KEY,
+                      JSON_COLLECTION_KEY,  rods_path.outPath,
+                      JSON_DATA_OBJECT_KEY, "f1.txt",
+                      JSON_AVUS_KEY,
+                      JSON_ATTRIBUTE_KEY, "wb_attr",
+                      JSON_VALUE_KEY,     values[i]);
+
+        baton_error_t add_error;
+        write_behind_add(wb, item, &add_error);
+        ck_assert_int_eq(add_error.code, 0);
+        json_decref(item);
+    }
+
+    // AVUs not in an array are rejected when added
+    json_t *bad_item = json_pack("{s:s, s:s, s:{}}",
+                                 JSON_COLLECTION_KEY,  rods_path.outPath,
+                                 JSON_DATA_OBJECT_KEY, "f1.txt",
+                                 JSON_AVUS_KEY);
+    baton_error_t expected_error;
+    write_behind_add(wb, bad_item, &expected_error);
+    ck_assert_int_ne(expected_error.code, 0);
+    json_decref(bad_item);
+
+    size_t num_errors;
+    json_t *done = write_behind_flush(wb, &num_errors);
+    ck_assert_int_eq(json_array_size(done), 4);
+    ck_assert_int_eq(num_errors, 0);
+
+    for (size_t i = 0; i < 4; i++) {
+        json_t *item = json_array_get(done, i);
+        ck_assert_ptr_ne(json_object_get(item, JSON_RESULT_KEY), NULL);
+        ck_assert_ptr_eq(json_object_get(item, JSON_ERROR_KEY), NULL);
+    }
+
+    json_decref(done);
+    stop_write_behind(wb);
+
+    char obj_path[MAX_PATH_LEN];
+    snprintf(obj_path, MAX_PATH_LEN, "%s/f1.txt", rods_root);
+
+    rodsPath_t obj_rods_path;
+    ck_assert_int_eq(resolve_rods_path(conn, &env, &obj_rods_path, obj_path,
+                                       flags, &resolve_error), EXIST_ST);
+
+    baton_error_t list_error;
+    json_t *results = list_metadata(conn, &obj_rods_path, "wb_attr",
+                                    &list_error);
+    json_t *expected = json_pack("[{s:s, s:s}]",
+                                 JSON_ATTRIBUTE_KEY, "wb_attr",
+                                 JSON_VALUE_KEY,     "wb1");
+    ck_assert_int_eq(list_error.code, 0);
+    ck_assert(json_equal(results, expected));
+
+    json_decref(results);
+    json_decref(expected);
+
+    if (conn) rcDisconnect(conn);
+}
+END_TEST
+
 // Can we search for data objects by their metadata, limiting scope by
 // path?
 START_TEST(test_search_metadata_path_obj) {
@@ -1307,6 +2767,121 @@ START_TEST(test_search_metadata_coll) {
 }
 END_TEST
 
+typedef struct json_sort_entry {
+    char *text;
+    json_t *value;
+} json_sort_entry;
+
+static int compare_json_sort_entries(const void *a, const void *b) {
+    const json_sort_entry *ea = a;
+    const json_sort_entry *eb = b;
+
+    return strcmp(ea->text, eb->text);
+}
+
+// Sort a JSON array in place by the canonical text of its elements, so
+// that arrays whose order is not significant may be compared
+static void sort_json_array(json_t *array) {
+    size_t num = json_array_size(array);
+    json_sort_entry *entries = calloc(num, sizeof (json_sort_entry));
+    ck_assert_ptr_ne(entries, NULL);
+
+    for (size_t i = 0; i < num; i++) {
+        entries[i].value = json_incref(json_array_get(array, i));
+        entries[i].text  = json_dumps(entries[i].value,
+                                      JSON_SORT_KEYS | JSON_COMPACT);
+        ck_assert_ptr_ne(entries[i].text, NULL);
+    }
+
+    qsort(entries, num, sizeof (json_sort_entry), compare_json_sort_entries);
+
+    json_array_clear(array);
+    for (size_t i = 0; i < num; i++) {
+        json_array_append_new(array, entries[i].value);
+        free(entries[i].text);
+    }
+
+    free(entries);
+}
+
+// Does adding data to search results in batches give the same results
+// as adding it to one result at a time?
+START_TEST(test_add_json_array_batched) {
+    option_flags flags = 0;
+    rodsEnv env;
+    rcComm_t *conn = rods_login(&env);
+
+    char rods_root[MAX_PATH_LEN];
+    set_current_rods_root(TEST_COLL, rods_root);
+
+    rodsPath_t rods_path;
+    baton_error_t resolve_error;
+    ck_assert_int_eq(resolve_rods_path(conn, &env, &rods_path, rods_root,
+                                       flags, &resolve_error), EXIST_ST);
+
+    json_t *avu = json_pack("{s:s, s:s}",
+                            JSON_ATTRIBUTE_KEY, "attr1",
+                            JSON_VALUE_KEY,     "value1");
+    json_t *query = json_pack("{s:s, s:[o]}",
+                              JSON_COLLECTION_KEY, rods_path.outPath,
+                              JSON_AVUS_KEY,       avu);
+    flags = SEARCH_COLLECTIONS | SEARCH_OBJECTS;
+
+    baton_error_t error;
+    json_t *results = search_metadata(conn, query, NULL, flags, &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_int_eq(json_array_size(results), 12);
+
+    json_t *batched = json_deep_copy(results);
+
+    baton_error_t error1;
+    add_acl_json_array(conn, results, &error1);
+    ck_assert_int_eq(error1.code, 0);
+    add_avus_json_array(conn, results, &error1);
+    ck_assert_int_eq(error1.code, 0);
+    add_checksum_json_array(conn, results, &error1);
+    ck_assert_int_eq(error1.code, 0);
+    add_tps_json_array(conn, results, &error1);
+    ck_assert_int_eq(error1.code, 0);
+
+    baton_error_t error2;
+    add_acl_json_array_batched(conn, batched, &error2);
+    ck_assert_int_eq(error2.code, 0);
+    add_avus_json_array_batched(conn, batched, &error2);
+    ck_assert_int_eq(error2.code, 0);
+    add_checksum_json_array_batched(conn, batched, &error2);
+    ck_assert_int_eq(error2.code, 0);
+    add_tps_json_array_batched(conn, batched, &error2);
+    ck_assert_int_eq(error2.code, 0);
+
+    const char *keys[] = { JSON_ACCESS_KEY, JSON_AVUS_KEY,
+                           JSON_TIMESTAMPS_KEY };
+    for (size_t i = 0; i < 12; i++) {
+        json_t *obj1 = json_array_get(results, i);
+        json_t *obj2 = json_array_get(batched, i);
+
+        // The order of ACLs, AVUs and timestamps is not significant
+        for (size_t j = 0; j < 3; j++) {
+            json_t *value1 = json_object_get(obj1, keys[j]);
+            json_t *value2 = json_object_get(obj2, keys[j]);
+            ck_assert_ptr_ne(value1, NULL);
+            ck_assert_ptr_ne(value2, NULL);
+            sort_json_array(value1);
+            sort_json_array(value2);
+        }
+
+        ck_assert_ptr_ne(json_object_get(obj2, JSON_CHECKSUM_KEY), NULL);
+        ck_assert(json_equal(obj1, obj2));
+    }
+
+    json_decref(query);
+    json_decref(results);
+    json_decref(batched);
+
+    if (conn) rcDisconnect(conn);
+}
+END_TEST
+
 // Can we add an AVU to a data object?
 START_TEST(test_add_metadata_obj) {
     option_flags flags = 0;
@@ -1917,13 +3492,14 @@ START_TEST(test_slurp_data_obj) {
         data_obj_file_t *obj = open_data_obj(conn, &rods_obj_path,
                                              O_RDONLY, flags, &open_error);
         ck_assert_int_eq(open_error.code, 0);
+        obj->scheme = DIGEST_MD5;
 
         baton_error_t slurp_error;
         char *data = slurp_data_obj(conn, obj, buffer_sizes[i],
                                     &slurp_error);
         ck_assert_int_eq(slurp_error.code, 0);
         ck_assert_int_eq(strnlen(data, 10240), 10240);
-        ck_assert_str_eq(obj->md5_last_read,
+        ck_assert_str_eq(obj->checksum_last_read,
                          "4efe0c1befd6f6ac4621cbdb13241246");
 
         ck_assert_int_eq(close_data_obj(conn, obj), 0);
@@ -1969,7 +3545,88 @@ START_TEST(test_ingest_data_obj) {
 }
 END_TEST
 
-START_TEST(test_get_data_obj_file) {
+START_TEST(test_get_data_obj_file) {
+    option_flags flags = 0;
+    rodsEnv env;
+    rcComm_t *conn = rods_login(&env);
+
+    char rods_root[MAX_PATH_LEN];
+    set_current_rods_root(TEST_COLL, rods_root);
+
+    char obj_path[MAX_PATH_LEN];
+    snprintf(obj_path, MAX_PATH_LEN, "%s/lorem_10k.txt", rods_root);
+
+    rodsPath_t rods_obj_path;
+    baton_error_t resolve_error;
+    ck_assert_int_eq(resolve_rods_path(conn, &env, &rods_obj_path, obj_path,
+                                       flags, &resolve_error), EXIST_ST);
+
+    // Write data object to temp file
+    char template[] = "baton_test_get_data_obj_file.XXXXXX";
+    int fd = mkstemp(template);
+
+    size_t buffer_size = 1024;
+    baton_error_t error;
+    int status = get_data_obj_file(conn, &rods_obj_path, template,
+                                   buffer_size, &error);
+    ck_assert_int_eq(error.code, 0);
+    close(fd);
+
+    // Check the MD5 of the tempfile
+    FILE *tmp = fopen(template, "r");
+    confirm_checksum(tmp, "4efe0c1befd6f6ac4621cbdb13241246");
+    fclose(tmp);
+    unlink(template);
+
+    if (conn) rcDisconnect(conn);
+}
+END_TEST
+
+// Can we get a data object to a file using the server's parallel
+// transfer, for each choice of thread count?
+START_TEST(test_get_data_obj_file_parallel) {
+    option_flags flags = 0;
+    rodsEnv env;
+    rcComm_t *conn = rods_login(&env);
+
+    char rods_root[MAX_PATH_LEN];
+    set_current_rods_root(TEST_COLL, rods_root);
+
+    char obj_path[MAX_PATH_LEN];
+    snprintf(obj_path, MAX_PATH_LEN, "%s/lorem_10k.txt", rods_root);
+
+    rodsPath_t rods_obj_path;
+    baton_error_t resolve_error;
+    ck_assert_int_eq(resolve_rods_path(conn, &env, &rods_obj_path, obj_path,
+                                       flags, &resolve_error), EXIST_ST);
+
+    int num_threads[] = { 0, 1, 4 };
+    for (size_t i = 0; i < 3; i++) {
+        // An existing file is replaced
+        char template[] = "baton_test_get_data_obj_file_parallel.XXXXXX";
+        int fd = mkstemp(template);
+        close(fd);
+
+        baton_error_t error;
+        get_data_obj_file_parallel(conn, &rods_obj_path, template,
+                                   num_threads[i], &error);
+        ck_assert_int_eq(error.code, 0);
+
+        FILE *tmp = fopen(template, "r");
+        confirm_checksum(tmp, "4efe0c1befd6f6ac4621cbdb13241246");
+        fclose(tmp);
+        unlink(template);
+    }
+
+    baton_error_t error;
+    get_data_obj_file_parallel(conn, &rods_obj_path, "unused", -1, &error);
+    ck_assert_int_ne(error.code, 0);
+
+    if (conn) rcDisconnect(conn);
+}
+END_TEST
+
+START_TEST(test_get_data_obj_file_cached) {
     option_flags flags = 0;
     rodsEnv env;
     rcComm_t *conn = rods_login(&env);
@@ -1985,22 +3642,118 @@ START_TEST(test_get_data_obj_file) {
     ck_assert_int_eq(resolve_rods_path(conn, &env, &rods_obj_path, obj_path,
                                        flags, &resolve_error), EXIST_ST);
 
-    // Write data object to temp file
-    char template[] = "baton_test_get_data_obj_file.XXXXXX";
-    int fd = mkstemp(template);
+    char cache_dir[] = "baton_test_get_data_obj_file_cached.XXXXXX";
+    ck_assert_ptr_ne(mkdtemp(cache_dir), NULL);
+
+    local_cache_t cache = { .dir = cache_dir, .max_size = 0 };
+
+    const char *md5 = "4efe0c1befd6f6ac4621cbdb13241246";
+    char entry[MAX_PATH_LEN];
+    snprintf(entry, MAX_PATH_LEN, "%s/%s", cache_dir, md5);
+    char lock[MAX_PATH_LEN];
+    snprintf(lock, MAX_PATH_LEN, "%s/%s", cache_dir, CACHE_LOCK_FILE);
 
     size_t buffer_size = 1024;
     baton_error_t error;
-    int status = get_data_obj_file(conn, &rods_obj_path, template,
-                                   buffer_size, &error);
-    ck_assert_int_eq(error.code, 0);
-    close(fd);
 
-    // Check the MD5 of the tempfile
-    FILE *tmp = fopen(template, "r");
-    confirm_checksum(tmp, "4efe0c1befd6f6ac4621cbdb13241246");
-    fclose(tmp);
-    unlink(template);
+    // The first get is a miss that populates the cache and the
+    // second is a hit
+    const char *dests[] = { "baton_test_get_data_obj_file_cached.1",
+                            "baton_test_get_data_obj_file_cached.2" };
+    for (size_t i = 0; i < 2; i++) {
+        get_data_obj_file_cached(conn, &rods_obj_path, dests[i],
+                                 buffer_size, &cache, &error);
+        ck_assert_int_eq(error.code, 0);
+
+        FILE *tmp = fopen(dests[i], "r");
+        confirm_checksum(tmp, md5);
+        fclose(tmp);
+    }
+
+    struct stat st;
+    ck_assert_int_eq(stat(entry, &st), 0);
+    ck_assert_int_eq(st.st_nlink, 3);
+
+    unlink(dests[0]);
+    unlink(dests[1]);
+    unlink(entry);
+    unlink(lock);
+    rmdir(cache_dir);
+
+    if (conn) rcDisconnect(conn);
+}
+END_TEST
+
+// Can we fetch the results of a metadata query, both between query
+// pages and with download threads, without any overwriting another?
+START_TEST(test_fetch_metadata_results) {
+    rodsEnv env;
+    rcComm_t *conn = rods_login(&env);
+
+    char rods_root[MAX_PATH_LEN];
+    set_current_rods_root(TEST_COLL, rods_root);
+
+    size_t thread_counts[] = { 0, 4 };
+    for (size_t i = 0; i < 2; i++) {
+        char fetch_dir[] = "baton_test_fetch_metadata_results.XXXXXX";
+        ck_assert_ptr_ne(mkdtemp(fetch_dir), NULL);
+
+        fetch_in_t fetch_in = { .directory   = fetch_dir,
+                                .layout      = FETCH_DEFAULT_LAYOUT,
+                                .num_threads = thread_counts[i],
+                                .buffer_size = 1024,
+                                .cache       = NULL };
+
+        json_t *query = json_pack("{s:s, s:[{s:s, s:s}]}",
+                                  JSON_COLLECTION_KEY, rods_root,
+                                  JSON_AVUS_KEY,
+                                  JSON_ATTRIBUTE_KEY, "attr1",
+                                  JSON_VALUE_KEY,     "value1");
+
+        baton_error_t error;
+        json_t *results = fetch_metadata_results(conn, query, NULL,
+                                                 &fetch_in, &error);
+        ck_assert_int_eq(error.code, 0);
+        ck_assert_int_eq(json_array_size(results), 12);
+
+        size_t index;
+        json_t *result;
+        json_array_foreach(results, index, result) {
+            ck_assert_ptr_eq(json_object_get(result, JSON_ERROR_KEY), NULL);
+            const char *file =
+                json_string_value(json_object_get(result, JSON_FILE_KEY));
+            ck_assert_ptr_ne(file, NULL);
+            ck_assert_int_eq(access(file, R_OK), 0);
+        }
+
+        // The default layout mirrors the collections
+        char local_path[MAX_PATH_LEN];
+        snprintf(local_path, MAX_PATH_LEN, "%s/%s/a/x/m/f10.txt",
+                 fetch_dir, rods_root + 1);
+        ck_assert_int_eq(access(local_path, R_OK), 0);
+        json_decref(results);
+
+        // A layout that maps every data object to the same file
+        // fetches only the first and reports the rest as errors
+        fetch_in.layout = "same.txt";
+        results = fetch_metadata_results(conn, query, NULL, &fetch_in,
+                                         &error);
+        ck_assert_int_eq(error.code, 0);
+        ck_assert_int_eq(json_array_size(results), 12);
+
+        size_t num_errors = 0;
+        json_array_foreach(results, index, result) {
+            if (json_object_get(result, JSON_ERROR_KEY)) num_errors++;
+        }
+        ck_assert_int_eq(num_errors, 11);
+
+        json_decref(results);
+        json_decref(query);
+
+        char command[MAX_COMMAND_LEN];
+        snprintf(command, MAX_COMMAND_LEN, "rm -rf %s", fetch_dir);
+        ck_assert_int_eq(system(command), 0);
+    }
 
     if (conn) rcDisconnect(conn);
 }
@@ -2080,6 +3833,129 @@ START_TEST(test_write_data_obj) {
 }
 END_TEST
 
+// Can we write a data object from a file descriptor?
+START_TEST(test_write_json_fd) {
+    option_flags flags = 0;
+    rodsEnv env;
+    rcComm_t *conn = rods_login(&env);
+
+    char file_path[MAX_PATH_LEN];
+    snprintf(file_path, MAX_PATH_LEN, "%s/%s/lorem_10k.txt",
+             TEST_ROOT, TEST_DATA_PATH);
+
+    char rods_root[MAX_PATH_LEN];
+    set_current_rods_root(TEST_COLL, rods_root);
+
+    // The whole file fits in the pipe, so it may be written first
+    char content[10240];
+    FILE *in = fopen(file_path, "r");
+    ck_assert_int_eq(fread(content, 1, sizeof content, in), 10240);
+    fclose(in);
+
+    int pipe_fd[2];
+    ck_assert_int_eq(pipe(pipe_fd), 0);
+    ck_assert_int_eq(write(pipe_fd[1], content, sizeof content), 10240);
+    close(pipe_fd[1]);
+
+    // A size hint that is wrong is reported, but is not an error
+    json_t *target = json_pack("{s:s, s:s, s:i, s:i}",
+                               JSON_COLLECTION_KEY,  rods_root,
+                               JSON_DATA_OBJECT_KEY, "test_write_json_fd.txt",
+                               JSON_FD_KEY,          pipe_fd[0],
+                               JSON_SIZE_KEY,        100);
+
+    operation_args_t args = { .flags       = flags,
+                              .buffer_size = 1024 };
+
+    // Capture the warnings logged to STDERR
+    char log_template[] = "baton_test_write_json_fd.XXXXXX";
+    int log_fd = mkstemp(log_template);
+    fflush(stderr);
+    int stderr_fd = dup(STDERR_FILENO);
+    dup2(log_fd, STDERR_FILENO);
+    log_level threshold = get_log_threshold();
+    set_log_threshold(WARN);
+
+    baton_error_t error;
+    json_t *result = baton_json_write_op(&env, conn, target, &args, &error);
+
+    set_log_threshold(threshold);
+    fflush(stderr);
+    dup2(stderr_fd, STDERR_FILENO);
+    close(stderr_fd);
+
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_ptr_ne(NULL, result);
+
+    char log[4096] = { 0 };
+    ck_assert_int_ge(pread(log_fd, log, sizeof log - 1, 0), 0);
+    ck_assert_ptr_ne(NULL, strstr(log, "but 100 were expected"));
+    close(log_fd);
+    unlink(log_template);
+
+    // The descriptor belongs to the caller and is left open
+    ck_assert_int_eq(close(pipe_fd[0]), 0);
+
+    char obj_path[MAX_PATH_LEN];
+    snprintf(obj_path, MAX_PATH_LEN, "%s/test_write_json_fd.txt", rods_root);
+
+    rodsPath_t rods_obj_path;
+    baton_error_t resolve_error;
+    resolve_rods_path(conn, &env, &rods_obj_path, obj_path, flags,
+                      &resolve_error);
+    ck_assert_int_eq(resolve_error.code, 0);
+
+    baton_error_t list_error;
+    json_t *listed = list_path(conn, &rods_obj_path,
+                               PRINT_SIZE | PRINT_CHECKSUM, &list_error);
+    ck_assert_int_eq(list_error.code, 0);
+    ck_assert_int_eq(json_integer_value(json_object_get(listed,
+                                                        JSON_SIZE_KEY)),
+                     10240);
+    ck_assert_str_eq(json_string_value(json_object_get(listed,
+                                                       JSON_CHECKSUM_KEY)),
+                     "4efe0c1befd6f6ac4621cbdb13241246");
+
+    char template[] = "baton_test_write_json_fd.XXXXXX";
+    int fd = mkstemp(template);
+
+    baton_error_t get_error;
+    get_data_obj_file(conn, &rods_obj_path, template, 1024, &get_error);
+    ck_assert_int_eq(get_error.code, 0);
+    close(fd);
+
+    FILE *tmp = fopen(template, "r");
+    confirm_checksum(tmp, "4efe0c1befd6f6ac4621cbdb13241246");
+    fclose(tmp);
+    unlink(template);
+
+    // The descriptor from which the envelopes are read may not be
+    // named as a source, as it would consume the envelopes that follow
+    FILE *json_tmp = tmpfile();
+    json_t *self = json_pack("{s:s, s:s, s:i}",
+                             JSON_COLLECTION_KEY,  rods_root,
+                             JSON_DATA_OBJECT_KEY, "test_write_json_self.txt",
+                             JSON_FD_KEY,          fileno(json_tmp));
+    json_dumpf(self, json_tmp, 0);
+    rewind(json_tmp);
+
+    ck_assert_int_ne(do_operation(json_tmp, baton_json_write_op, &args), 0);
+    fclose(json_tmp);
+
+    snprintf(obj_path, MAX_PATH_LEN, "%s/test_write_json_self.txt",
+             rods_root);
+    ck_assert_int_ne(resolve_rods_path(conn, &env, &rods_obj_path, obj_path,
+                                       flags, &resolve_error), EXIST_ST);
+
+    json_decref(target);
+    json_decref(result);
+    json_decref(listed);
+    json_decref(self);
+
+    if (conn) rcDisconnect(conn);
+}
+END_TEST
+
 START_TEST(test_put_data_obj) {
     option_flags flags = 0;
     rodsEnv env;
@@ -2169,6 +4045,74 @@ START_TEST(test_put_data_obj) {
 }
 END_TEST
 
+// Does a put that reports its checksum leave the target of its
+// envelope as it was sent?
+START_TEST(test_put_checksum_result) {
+    rodsEnv env;
+    rcComm_t *conn = rods_login(&env);
+
+    char rods_root[MAX_PATH_LEN];
+    set_current_rods_root(TEST_COLL, rods_root);
+
+    char local_dir[MAX_PATH_LEN];
+    snprintf(local_dir, MAX_PATH_LEN, "%s/%s", TEST_ROOT, TEST_DATA_PATH);
+
+    json_t *envelope =
+        json_pack("{s:s, s:{s:b}, s:{s:s, s:s, s:s, s:s}}",
+                  JSON_OP_KEY,      JSON_PUT_OP,
+                  JSON_OP_ARGS_KEY, JSON_OP_CHECKSUM, 1,
+                  JSON_TARGET_KEY,
+                  JSON_COLLECTION_KEY,  rods_root,
+                  JSON_DATA_OBJECT_KEY, "test_put_checksum_result.txt",
+                  JSON_DIRECTORY_KEY,   local_dir,
+                  JSON_FILE_KEY,        "lorem_1k.txt");
+    json_t *sent = json_deep_copy(json_object_get(envelope, JSON_TARGET_KEY));
+
+    operation_args_t args = { .flags       = 0,
+                              .buffer_size = 1024 };
+    baton_error_t error;
+    json_t *result = baton_json_dispatch_op(&env, conn, envelope, &args,
+                                            &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_str_eq(json_string_value(json_object_get(result,
+                                                       JSON_CHECKSUM_KEY)),
+                     "1f40c34d28e56efcf9da6732cdc93b8b");
+
+    ck_assert(json_equal(json_object_get(envelope, JSON_TARGET_KEY), sent));
+
+    json_decref(result);
+    json_decref(sent);
+    json_decref(envelope);
+
+    if (conn) rcDisconnect(conn);
+}
+END_TEST
+
+// Does a failed resource listing fall back to the default resource?
+START_TEST(test_acquire_resource_fallback) {
+    rodsEnv env;
+    rcComm_t *conn = rods_login(&env);
+
+    // Resources cannot be listed in a zone that does not exist
+    char resource[NAME_LEN];
+    baton_error_t error;
+    set_resource_placement(1);
+
+    for (int i = 0; i < 2; i++) {
+        ck_assert_int_eq(acquire_resource(conn, "/no_such_zone/home/obj",
+                                          100, resource, &error), 0);
+        ck_assert_int_eq(error.code, 0);
+        ck_assert_str_eq(resource, "");
+        release_resource(resource, 100);
+    }
+
+    set_resource_placement(0);
+    clear_resource_placement();
+
+    if (conn) rcDisconnect(conn);
+}
+END_TEST
+
 // Can we checksum a data object?
 START_TEST(test_checksum_data_obj) {
     option_flags flags = 0;
@@ -2396,6 +4340,324 @@ START_TEST(test_remove_coll) {
 }
 END_TEST
 
+// Can we copy a collection, with its contents, on the server?
+START_TEST(test_copy_coll) {
+    option_flags flags = RECURSIVE;
+    rodsEnv env;
+    rcComm_t *conn = rods_login(&env);
+
+    char rods_root[MAX_PATH_LEN];
+    set_current_rods_root(TEST_COLL, rods_root);
+
+    char coll_path[MAX_PATH_LEN];
+    snprintf(coll_path, MAX_PATH_LEN, "%s/a", rods_root);
+    char copy_path_buf[MAX_PATH_LEN];
+    snprintf(copy_path_buf, MAX_PATH_LEN, "%s/a_copy", rods_root);
+
+    rodsPath_t rods_coll_path;
+    baton_error_t resolve_error;
+    resolve_rods_path(conn, &env, &rods_coll_path, coll_path,
+                      flags, &resolve_error);
+    ck_assert_int_eq(resolve_error.code, 0);
+
+    copy_in_t copy_in = { .resource = TEST_RESOURCE, .num_threads = 2 };
+    copy_out_t copy_out;
+    baton_error_t copy_error;
+
+    // A collection is only copied recursively
+    copy_path(conn, &rods_coll_path, copy_path_buf, &copy_in, 0,
+              &copy_out, &copy_error);
+    ck_assert_int_ne(copy_error.code, 0);
+
+    // Nor into itself
+    char inner_path[MAX_PATH_LEN];
+    snprintf(inner_path, MAX_PATH_LEN, "%s/x/a", coll_path);
+    copy_path(conn, &rods_coll_path, inner_path, &copy_in, flags,
+              &copy_out, &copy_error);
+    ck_assert_int_ne(copy_error.code, 0);
+
+    ck_assert_int_eq(copy_path(conn, &rods_coll_path, copy_path_buf,
+                               &copy_in, flags | PRINT_AVU, &copy_out,
+                               &copy_error), 0);
+    ck_assert_int_eq(copy_error.code, 0);
+    ck_assert_int_eq(copy_out.num_collections, 7);
+    ck_assert_int_eq(copy_out.num_data_objects, 12);
+    ck_assert_int_eq(copy_out.num_errors, 0);
+
+    char obj_path[MAX_PATH_LEN];
+    snprintf(obj_path, MAX_PATH_LEN, "%s/x/m/f10.txt", copy_path_buf);
+
+    rodsPath_t rods_obj_path;
+    resolve_rods_path(conn, &env, &rods_obj_path, obj_path,
+                      flags, &resolve_error);
+    ck_assert_int_eq(resolve_error.code, 0);
+    ck_assert_int_eq(rods_obj_path.objType, DATA_OBJ_T); // Present
+
+    // The AVUs of data objects and collections are added to the copies
+    baton_error_t list_error;
+    json_t *avus = list_metadata(conn, &rods_obj_path, NULL, &list_error);
+    ck_assert_int_eq(list_error.code, 0);
+    ck_assert_int_eq(json_array_size(avus), 1);
+    ck_assert_str_eq(json_string_value(json_object_get
+                                       (json_array_get(avus, 0),
+                                        JSON_ATTRIBUTE_KEY)), "attr1");
+    json_decref(avus);
+
+    rodsPath_t rods_copy_path;
+    resolve_rods_path(conn, &env, &rods_copy_path, copy_path_buf,
+                      flags, &resolve_error);
+    ck_assert_int_eq(resolve_error.code, 0);
+
+    avus = list_metadata(conn, &rods_copy_path, NULL, &list_error);
+    ck_assert_int_eq(list_error.code, 0);
+    ck_assert_int_eq(json_array_size(avus), 1);
+    ck_assert_str_eq(json_string_value(json_object_get
+                                       (json_array_get(avus, 0),
+                                        JSON_ATTRIBUTE_KEY)), "attr2");
+    json_decref(avus);
+
+    // Copying again fails for each data object, unless forced
+    copy_path(conn, &rods_coll_path, copy_path_buf, &copy_in, flags,
+              &copy_out, &copy_error);
+    ck_assert_int_ne(copy_error.code, 0);
+    ck_assert_int_eq(copy_out.num_errors, 12);
+
+    // The AVUs the copies already have are not added again
+    ck_assert_int_eq(copy_path(conn, &rods_coll_path, copy_path_buf,
+                               &copy_in, flags | FORCE | PRINT_AVU,
+                               &copy_out, &copy_error), 0);
+    ck_assert_int_eq(copy_out.num_data_objects, 12);
+    ck_assert_int_eq(copy_out.num_errors, 0);
+
+    if (rods_coll_path.rodsObjStat) free(rods_coll_path.rodsObjStat);
+    if (rods_obj_path.rodsObjStat)  free(rods_obj_path.rodsObjStat);
+    if (rods_copy_path.rodsObjStat) free(rods_copy_path.rodsObjStat);
+    if (conn) rcDisconnect(conn);
+}
+END_TEST
+
+// Write a GNU long name header, which gives the name of the entry
+// whose header follows it
+static void write_gnu_long_name(FILE *out, const char *name) {
+    char header[TAR_MAX_HEADER_SIZE];
+    char content[TAR_MAX_NAME_LEN + TAR_BLOCK_SIZE] = { 0 };
+    size_t len = strlen(name) + 1;
+
+    baton_error_t error;
+    ck_assert_uint_eq(format_tar_header(header, "././@LongLink",
+                                        TAR_TYPE_FILE, len, 0, &error),
+                      TAR_BLOCK_SIZE);
+
+    // Retype the header and recalculate its checksum, which is
+    // calculated with its own field as spaces
+    header[156] = 'L';
+    memset(header + 148, ' ', 8);
+    unsigned int sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+        sum += (unsigned char) header[i];
+    }
+    snprintf(header + 148, 7, "%06o", sum);
+
+    memcpy(content, name, len);
+    ck_assert_uint_eq(fwrite(header, 1, TAR_BLOCK_SIZE, out),
+                      TAR_BLOCK_SIZE);
+    ck_assert_uint_eq(fwrite(content, 1, len + tar_padding(len), out),
+                      len + tar_padding(len));
+}
+
+// Can we archive a collection and extract it again, with names too
+// long for a ustar header?
+START_TEST(test_archive_round_trip) {
+    rodsEnv env;
+    rcComm_t *conn = rods_login(&env);
+
+    char file_path[MAX_PATH_LEN];
+    snprintf(file_path, MAX_PATH_LEN, "%s/%s/lorem_10k.txt",
+             TEST_ROOT, TEST_DATA_PATH);
+
+    char rods_root[MAX_PATH_LEN];
+    set_current_rods_root(TEST_COLL, rods_root);
+
+    char content[10240];
+    FILE *in = fopen(file_path, "r");
+    ck_assert_int_eq(fread(content, 1, sizeof content, in), 10240);
+    fclose(in);
+
+    char long_coll[121];
+    memset(long_coll, 'c', sizeof long_coll - 1);
+    long_coll[sizeof long_coll - 1] = '\0';
+    char long_obj[121];
+    memset(long_obj, 'o', sizeof long_obj - 1);
+    long_obj[sizeof long_obj - 1] = '\0';
+
+    char long_coll_name[TAR_MAX_NAME_LEN];
+    snprintf(long_coll_name, sizeof long_coll_name, "a/%s/", long_coll);
+    char long_obj_name[TAR_MAX_NAME_LEN];
+    snprintf(long_obj_name, sizeof long_obj_name, "a/%s/%s",
+             long_coll, long_obj);
+
+    // A GNU archive of a collection and a data object with long names
+    char header[TAR_MAX_HEADER_SIZE];
+    char zeros[TAR_END_SIZE] = { 0 };
+    baton_error_t error;
+
+    FILE *gnu = tmpfile();
+    write_gnu_long_name(gnu, long_coll_name);
+    size_t len = format_tar_header(header, "truncated/", TAR_TYPE_DIRECTORY,
+                                   0, 0, &error);
+    ck_assert_uint_eq(fwrite(header, 1, len, gnu), len);
+
+    write_gnu_long_name(gnu, long_obj_name);
+    len = format_tar_header(header, "truncated", TAR_TYPE_FILE,
+                            sizeof content, 0, &error);
+    ck_assert_uint_eq(fwrite(header, 1, len, gnu), len);
+    ck_assert_uint_eq(fwrite(content, 1, sizeof content, gnu),
+                      sizeof content);
+    fwrite(zeros, 1, tar_padding(sizeof content), gnu);
+    fwrite(zeros, 1, TAR_END_SIZE, gnu);
+    rewind(gnu);
+
+    rodsPath_t rods_root_path;
+    baton_error_t resolve_error;
+    resolve_rods_path(conn, &env, &rods_root_path, rods_root, 0,
+                      &resolve_error);
+    ck_assert_int_eq(resolve_error.code, 0);
+
+    // Small data objects are prefetched, or written, by the threads;
+    // the large one is streamed in turn
+    archive_in_t archive_in = { .num_threads = 2,
+                                .window      = 4096,
+                                .buffer_size = 1024 };
+    archive_out_t archive_out;
+
+    extract_archive(conn, &rods_root_path, gnu, &archive_in, &archive_out,
+                    &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_int_eq(archive_out.num_collections, 1);
+    ck_assert_int_eq(archive_out.num_data_objects, 1);
+    ck_assert_int_eq(archive_out.num_bytes, 10240);
+    fclose(gnu);
+
+    // Archiving 'a' now gives the long names in pax headers
+    char coll_path[MAX_PATH_LEN];
+    snprintf(coll_path, MAX_PATH_LEN, "%s/a", rods_root);
+
+    rodsPath_t rods_coll_path;
+    resolve_rods_path(conn, &env, &rods_coll_path, coll_path, 0,
+                      &resolve_error);
+    ck_assert_int_eq(resolve_error.code, 0);
+
+    FILE *archive = tmpfile();
+    archive_collection(conn, &rods_coll_path, archive, &archive_in,
+                       &archive_out, &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_int_eq(archive_out.num_collections, 8);
+    ck_assert_int_eq(archive_out.num_data_objects, 13);
+    ck_assert_int_eq(archive_out.num_concurrent, 12);
+    ck_assert_int_eq(archive_out.num_errors, 0);
+    ck_assert_int_eq(archive_out.num_bytes, 4 * 71 + 10240);
+
+    // The names, sizes and content of the entries are as expected
+    rewind(archive);
+
+    tar_entry_t entry;
+    size_t num_colls = 0;
+    size_t num_objs  = 0;
+    int found_long_coll = 0;
+    int found_long_obj  = 0;
+    int found_f10       = 0;
+    int status;
+    while ((status = read_tar_header(archive, &entry, &error)) == 0) {
+        ck_assert(str_starts_with(entry.name, "a/", TAR_MAX_NAME_LEN));
+
+        if (entry.type == TAR_TYPE_DIRECTORY) {
+            ck_assert_int_eq(entry.size, 0);
+            if (str_equals(entry.name, long_coll_name, TAR_MAX_NAME_LEN)) {
+                found_long_coll = 1;
+            }
+            num_colls++;
+            continue;
+        }
+
+        ck_assert_int_eq(entry.type, TAR_TYPE_FILE);
+        num_objs++;
+
+        char buffer[10240];
+        ck_assert_int_le(entry.size, sizeof buffer);
+        read_tar_content(archive, buffer, entry.size, &error);
+        ck_assert_int_eq(error.code, 0);
+        read_tar_content(archive, zeros, tar_padding(entry.size), &error);
+        ck_assert_int_eq(error.code, 0);
+
+        FILE *tmp = tmpfile();
+        fwrite(buffer, 1, entry.size, tmp);
+        rewind(tmp);
+
+        if (str_equals(entry.name, long_obj_name, TAR_MAX_NAME_LEN)) {
+            ck_assert_int_eq(entry.size, 10240);
+            confirm_checksum(tmp, "4efe0c1befd6f6ac4621cbdb13241246");
+            found_long_obj = 1;
+        }
+        else if (str_ends_with(entry.name, "/.gitignore", TAR_MAX_NAME_LEN)) {
+            ck_assert_int_eq(entry.size, 71);
+            confirm_checksum(tmp, "aab39e92ffe254319a73ebf43158c256");
+        }
+        else {
+            ck_assert_int_eq(entry.size, 0);
+            confirm_checksum(tmp, "d41d8cd98f00b204e9800998ecf8427e");
+            if (str_equals(entry.name, "a/x/m/f10.txt", TAR_MAX_NAME_LEN)) {
+                found_f10 = 1;
+            }
+        }
+        fclose(tmp);
+    }
+    ck_assert_int_eq(status, 1);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_int_eq(num_colls, 8);
+    ck_assert_int_eq(num_objs, 13);
+    ck_assert(found_long_coll);
+    ck_assert(found_long_obj);
+    ck_assert(found_f10);
+
+    // Extracting the archive elsewhere gives the same tree
+    rewind(archive);
+
+    char extract_path[MAX_PATH_LEN];
+    snprintf(extract_path, MAX_PATH_LEN, "%s/round_trip", rods_root);
+
+    rodsPath_t rods_extract_path;
+    resolve_rods_path(conn, &env, &rods_extract_path, extract_path, 0,
+                      &resolve_error);
+    ck_assert_int_eq(resolve_error.code, 0);
+
+    extract_archive(conn, &rods_extract_path, archive, &archive_in,
+                    &archive_out, &error);
+    ck_assert_int_eq(error.code, 0);
+    ck_assert_int_eq(archive_out.num_collections, 8);
+    ck_assert_int_eq(archive_out.num_data_objects, 13);
+    ck_assert_int_eq(archive_out.num_concurrent, 12);
+    ck_assert_int_eq(archive_out.num_errors, 0);
+    ck_assert_int_eq(archive_out.num_bytes, 4 * 71 + 10240);
+    fclose(archive);
+
+    // The digests cover the names, sizes and checksums of the trees
+    char copy_path[MAX_PATH_LEN];
+    snprintf(copy_path, MAX_PATH_LEN, "%s/a", extract_path);
+
+    json_t *original = digest_test_path(conn, &env, coll_path, 0);
+    json_t *copy     = digest_test_path(conn, &env, copy_path, 0);
+    ck_assert_str_eq(digest_value(original), digest_value(copy));
+
+    json_decref(original);
+    json_decref(copy);
+
+    if (rods_root_path.rodsObjStat)    free(rods_root_path.rodsObjStat);
+    if (rods_coll_path.rodsObjStat)    free(rods_coll_path.rodsObjStat);
+    if (rods_extract_path.rodsObjStat) free(rods_extract_path.rodsObjStat);
+    if (conn) rcDisconnect(conn);
+}
+END_TEST
+
 // Can we do a sequence of baton operations described by a JSON
 // stream?
 START_TEST(test_do_operation) {
@@ -2589,6 +4851,55 @@ START_TEST(test_search_specific_with_valid_setup) {
 }
 END_TEST
 
+// Tests that the `search_specific_concurrent` method runs a specific
+// query once for each of a batch of argument tuples, tagging each row
+// with the position of its tuple.
+START_TEST(test_search_specific_batch) {
+    if (!have_rodsadmin()) {
+        logmsg(WARN, "!!! Skipping specific query tests because we are "
+               "not rodsadmin !!!");
+        return;
+    }
+    rodsEnv env;
+    rcComm_t *conn = rods_login(&env);
+    baton_error_t search_error;
+
+    json_t *query_json = json_pack("{s: {s:[[s], [s], [s]], s:s}}",
+                                   JSON_SPECIFIC_KEY,
+                                   JSON_ARGS_KEY,
+                                   "metadataModifiedIdOnly",
+                                   "noSuchAlias",
+                                   "dataModifiedIdOnly",
+                                   JSON_SQL_KEY,  "findQueryByAlias");
+    ck_assert_ptr_ne(query_json, NULL);
+
+    for (size_t num_threads = 0; num_threads <= 2; num_threads++) {
+        json_t *search_results =
+            search_specific_concurrent(conn, query_json, NULL, num_threads,
+                                       &search_error);
+        ck_assert_int_eq(search_error.code, 0);
+        ck_assert_int_eq(json_array_size(search_results), 2);
+
+        json_t *first  = json_array_get(search_results, 0);
+        json_t *second = json_array_get(search_results, 1);
+        ck_assert_str_eq(json_string_value(json_object_get(first, "alias")),
+                         "metadataModifiedIdOnly");
+        ck_assert_int_eq(json_integer_value
+                         (json_object_get(first, JSON_ARGS_INDEX_KEY)), 0);
+        ck_assert_str_eq(json_string_value(json_object_get(second, "alias")),
+                         "dataModifiedIdOnly");
+        ck_assert_int_eq(json_integer_value
+                         (json_object_get(second, JSON_ARGS_INDEX_KEY)), 2);
+
+        json_decref(search_results);
+    }
+
+    json_decref(query_json);
+
+    if (conn) rcDisconnect(conn);
+}
+END_TEST
+
 START_TEST(test_exit_flag_on_sigint) {
     apply_signal_handler();
     raise(SIGINT);
@@ -2814,6 +5125,12 @@ START_TEST(test_regression_github_issue242) {
     ck_assert(json_object_get(result, JSON_CHECKSUM_KEY));
     ck_assert(json_equal(json_object_get(result, JSON_CHECKSUM_KEY),
                          json_string("d41d8cd98f00b204e9800998ecf8427e")));
+
+    // The target is left unchanged
+    ck_assert_ptr_eq(json_object_get(target, JSON_CHECKSUM_KEY), NULL);
+
+    json_decref(result);
+    json_decref(target);
 }
 END_TEST
 
@@ -2879,7 +5196,33 @@ Suite *baton_suite(void) {
     tcase_add_test(utilities, test_format_timestamp);
     tcase_add_test(utilities, test_parse_timestamp);
     tcase_add_test(utilities, test_parse_size);
+    tcase_add_test(utilities, test_parse_unsigned);
+    tcase_add_test(utilities, test_parse_mix);
+    tcase_add_test(utilities, test_percentile);
+    tcase_add_test(utilities, test_random_size);
+    tcase_add_test(utilities, test_tree_path);
     tcase_add_test(utilities, test_to_utf8);
+    tcase_add_test(utilities, test_cache_key);
+    tcase_add_test(utilities, test_cache_add_fetch_evict);
+    tcase_add_test(utilities, test_make_layout_path);
+    tcase_add_test(utilities, test_plan_items);
+    tcase_add_test(utilities, test_digest);
+    tcase_add_test(utilities, test_buffer_pool);
+    tcase_add_test(utilities, test_output_writer);
+    tcase_add_test(utilities, test_input_waiting);
+    tcase_add_test(utilities, test_count_json_nodes);
+    tcase_add_test(utilities, test_envelope_memory_threads);
+    tcase_add_test(utilities, test_decode_envelope);
+    tcase_add_test(utilities, test_format_tar_header);
+    tcase_add_test(utilities, test_read_tar_header);
+    tcase_add_test(utilities, test_get_fd_value);
+    tcase_add_test(utilities, test_digest_tree_entries);
+    tcase_add_test(utilities, test_select_resource);
+    tcase_add_test(utilities, test_trace);
+    tcase_add_test(utilities, test_write_behind_batch_add);
+    tcase_add_test(utilities, test_query_set);
+    tcase_add_test(utilities, test_deadline);
+    tcase_add_test(utilities, test_checkpoint_resume);
 
     TCase *basic = tcase_create("basic");
     tcase_add_unchecked_fixture(basic, setup, teardown);
@@ -2908,6 +5251,7 @@ Suite *baton_suite(void) {
     tcase_add_test(path, test_list_replicates_obj);
     tcase_add_test(path, test_list_timestamps_obj);
     tcase_add_test(path, test_list_timestamps_coll);
+    tcase_add_test(path, test_digest_collection);
 
     TCase *metadata = tcase_create("metadata");
     tcase_add_unchecked_fixture(metadata, setup, teardown);
@@ -2921,11 +5265,13 @@ Suite *baton_suite(void) {
     tcase_add_test(metadata, test_remove_metadata_obj);
     tcase_add_test(metadata, test_add_json_metadata_obj);
     tcase_add_test(metadata, test_remove_json_metadata_obj);
+    tcase_add_test(metadata, test_write_behind_metamod);
     tcase_add_test(metadata, test_search_metadata_obj);
     tcase_add_test(metadata, test_search_metadata_coll);
     tcase_add_test(metadata, test_search_metadata_path_obj);
     tcase_add_test(metadata, test_search_metadata_perm_obj);
     tcase_add_test(metadata, test_search_metadata_tps_obj);
+    tcase_add_test(metadata, test_add_json_array_batched);
 
     TCase *read_write = tcase_create("read_write");
     tcase_add_unchecked_fixture(read_write, setup, teardown);
@@ -2933,15 +5279,23 @@ Suite *baton_suite(void) {
 
     tcase_add_test(read_write, test_get_data_obj_stream);
     tcase_add_test(read_write, test_get_data_obj_file);
+    tcase_add_test(read_write, test_get_data_obj_file_parallel);
+    tcase_add_test(read_write, test_get_data_obj_file_cached);
+    tcase_add_test(read_write, test_fetch_metadata_results);
     tcase_add_test(read_write, test_slurp_data_obj);
     tcase_add_test(read_write, test_ingest_data_obj);
     tcase_add_test(read_write, test_write_data_obj);
+    tcase_add_test(read_write, test_write_json_fd);
     tcase_add_test(read_write, test_put_data_obj);
+    tcase_add_test(read_write, test_put_checksum_result);
+    tcase_add_test(read_write, test_acquire_resource_fallback);
     tcase_add_test(read_write, test_checksum_data_obj);
     tcase_add_test(read_write, test_checksum_ignore_stale);
     tcase_add_test(read_write, test_remove_data_obj);
     tcase_add_test(read_write, test_create_coll);
     tcase_add_test(read_write, test_remove_coll);
+    tcase_add_test(read_write, test_copy_coll);
+    tcase_add_test(read_write, test_archive_round_trip);
 
     TCase *json = tcase_create("json");
     tcase_add_unchecked_fixture(json, setup, teardown);
@@ -2971,6 +5325,8 @@ Suite *baton_suite(void) {
                    test_make_query_format_from_sql_with_invalid_query);
     tcase_add_test(specific_query,
                    test_search_specific_with_valid_setup);
+    tcase_add_test(specific_query,
+                   test_search_specific_batch);
 
     TCase *signal_handler = tcase_create("signal_handler");
     tcase_add_unchecked_fixture(signal_handler, setup, teardown);